@@ -14,6 +14,9 @@
 #include "libls/string_.h"
 #include "libls/vector.h"
 #include "libls/lua_utils.h"
+#include "libls/evloop_utils.h"
+
+#include "libxhub/xhub.h"
 
 typedef struct {
     size_t nwidgets;
@@ -28,9 +31,9 @@ typedef struct {
 
     char *sep;
 
-    xcb_connection_t *conn;
-
-    xcb_window_t root;
+    // The X connection is shared with the X plugins; we do not want any events.
+    XHubSub sub;
+    XHub *hub;
 } Priv;
 
 static
@@ -45,8 +48,8 @@ destroy(LuastatusBarlibData *bd)
     LS_VECTOR_FREE(p->tmpbuf);
     LS_VECTOR_FREE(p->joined);
     free(p->sep);
-    if (p->conn) {
-        xcb_disconnect(p->conn);
+    if (p->hub) {
+        xhub_unsubscribe(p->hub, &p->sub);
     }
     free(p);
 }
@@ -72,16 +75,23 @@ redraw(LuastatusBarlibData *bd)
         }
     }
 
+    xcb_connection_t *conn = p->hub->conn;
     xcb_generic_error_t *err = xcb_request_check(
-        p->conn,
+        conn,
         xcb_change_property_checked(
-            p->conn, XCB_PROP_MODE_REPLACE, p->root, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8,
+            conn, XCB_PROP_MODE_REPLACE, p->hub->root, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8,
             joined->size, joined->data));
     if (err) {
         LS_FATALF(bd, "XCB error %d occured", err->error_code);
         free(err);
         return false;
     }
+    // /xcb_request_check()/ reports no error if the connection has been lost.
+    const int r = xcb_connection_has_error(conn);
+    if (r != 0) {
+        LS_FATALF(bd, "connection to the X server has been lost: XCB error %d", r);
+        return false;
+    }
     return true;
 }
 
@@ -96,7 +106,14 @@ init(LuastatusBarlibData *bd, const char *const *opts, size_t nwidgets)
         .tmpbuf = LS_VECTOR_NEW(),
         .joined = LS_VECTOR_NEW_RESERVE(char, 1024),
         .sep = NULL,
-        .conn = NULL,
+        .sub = {
+            .userdata = bd->userdata,
+            .sayf = bd->sayf,
+            .wakeup = LS_WAKEUP_FD_NEW(),
+            .kinds = 0,
+            .ext = NULL,
+        },
+        .hub = NULL,
     };
     for (size_t i = 0; i < nwidgets; ++i) {
         LS_VECTOR_INIT_RESERVE(p->bufs[i], 512);
@@ -117,20 +134,11 @@ init(LuastatusBarlibData *bd, const char *const *opts, size_t nwidgets)
     }
     p->sep = ls_xstrdup(sep ? sep : " | ");
 
-    // Initialize /p->conn/ and /p->root/.
-    int screenp;
-    p->conn = xcb_connect(dpyname, &screenp);
-    int r = xcb_connection_has_error(p->conn);
-    if (r != 0) {
-        LS_FATALF(bd, "can't connect to display: XCB error %d", r);
+    // Connect to the display, or share the connection of the X plugins (they are initialized
+    // before the barlib).
+    if (!(p->hub = xhub_subscribe(&p->sub, bd->map_get, dpyname))) {
         goto error;
     }
-    const xcb_setup_t *setup = xcb_get_setup(p->conn);
-    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(setup);
-    for (int i = 0; i < screenp; ++i) {
-        xcb_screen_next(&iter);
-    }
-    p->root = iter.data->root;
 
     // Clear the current name.
     if (!redraw(bd)) {
@@ -2,6 +2,7 @@
 #define ls_algo_h_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "compdep.h"
 
@@ -17,4 +18,20 @@ ls_is_between_d(double x, double lbound, double ubound)
     return x >= lbound && x <= ubound;
 }
 
+// Returns /a - b/, or /0/ if /b/ is greater than /a/ (e.g. a counter has been reset).
+LS_INHEADER
+uint64_t
+ls_sat_sub_u64(uint64_t a, uint64_t b)
+{
+    return a > b ? a - b : 0;
+}
+
+// Clamps /x/ to /[0, 1]/.
+LS_INHEADER
+double
+ls_clamp01_d(double x)
+{
+    return x < 0 ? 0 : x > 1 ? 1 : x;
+}
+
 #endif
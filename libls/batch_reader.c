@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+#include "batch_reader.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "alloc_utils.h"
+#include "vector.h"
+#include "probes.generated.h"
+
+#if LS_HAVE_LINUX_IO_URING_H && LS_HAVE_NR_IO_URING_SETUP
+#   define USE_IO_URING 1
+#else
+#   define USE_IO_URING 0
+#endif
+
+#if USE_IO_URING
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <linux/io_uring.h>
+#endif
+
+enum {
+    INITIAL_CAPACITY = 1024,
+};
+
+// Reads the file /f/ from offset /0/ with /pread()/, growing the buffer if the data do not fit.
+static
+void
+pread_file(LSBatchReaderFile *f)
+{
+    while (1) {
+        ssize_t r = pread(f->fd, f->buf, f->capacity - 1, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            f->size = -1;
+            f->err = errno;
+            return;
+        }
+        if ((size_t) r < f->capacity - 1) {
+            f->size = r;
+            f->err = 0;
+            return;
+        }
+        f->buf = ls_x2realloc(f->buf, &f->capacity, 1);
+    }
+}
+
+#if USE_IO_URING
+
+// We talk to the kernel directly instead of using liburing: we only need a tiny subset of it.
+
+enum {
+    RING_ENTRIES = 32,
+};
+
+struct LSBatchReaderRing {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_map_size;
+
+    // Whether the file descriptors of the reader are registered in the ring.
+    bool registered;
+    // Whether the set of files has changed since the last registration attempt.
+    bool dirty;
+};
+
+// The head/tail indices are shared with the kernel.
+#define LOAD_ACQUIRE(P_)      __atomic_load_n(P_, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(P_, V_) __atomic_store_n(P_, V_, __ATOMIC_RELEASE)
+
+static
+void
+ring_destroy(LSBatchReaderRing *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_map_size);
+    }
+    if (ring->cq_map && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+static
+LSBatchReaderRing *
+ring_new(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // io_uring file descriptors are always close-on-exec.
+    const int fd = syscall(__NR_io_uring_setup, (unsigned) RING_ENTRIES, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    LSBatchReaderRing *ring = LS_XNEW0(LSBatchReaderRing, 1);
+    ring->fd = fd;
+    ring->sq_entries = params.sq_entries;
+    ring->dirty = true;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    void *p = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   IORING_OFF_SQ_RING);
+    if (p == MAP_FAILED) {
+        goto error;
+    }
+    ring->sq_map = p;
+
+    if (single_mmap) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        p = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 IORING_OFF_CQ_RING);
+        if (p == MAP_FAILED) {
+            goto error;
+        }
+        ring->cq_map = p;
+    }
+
+    ring->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    p = mmap(NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+             IORING_OFF_SQES);
+    if (p == MAP_FAILED) {
+        goto error;
+    }
+    ring->sqes = p;
+
+    char *sq = ring->sq_map;
+    ring->sq_head  = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return ring;
+
+error:
+    ring_destroy(ring);
+    return NULL;
+}
+
+// (Re-)registers the file descriptors of /r/ in the ring if the set of files has changed. If the
+// registration fails (e.g. because of /RLIMIT_MEMLOCK/ on older kernels), plain file descriptors
+// are used.
+static
+void
+ring_maybe_register(LSBatchReader *r)
+{
+    LSBatchReaderRing *ring = r->ring;
+    if (!ring->dirty) {
+        return;
+    }
+    ring->dirty = false;
+
+    if (ring->registered) {
+        syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_FILES, NULL, 0);
+        ring->registered = false;
+    }
+
+    const size_t n = r->files.size;
+    if (!n) {
+        return;
+    }
+    int *fds = LS_XNEW(int, n);
+    for (size_t i = 0; i < n; ++i) {
+        fds[i] = r->files.data[i].fd;
+    }
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, (unsigned) n) == 0) {
+        ring->registered = true;
+    }
+    free(fds);
+}
+
+static inline
+void
+ring_put_read(LSBatchReader *r, unsigned tail, size_t i)
+{
+    LSBatchReaderRing *ring = r->ring;
+    LSBatchReaderFile *f = &r->files.data[i];
+
+    const unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+
+    f->iov = (struct iovec) {.iov_base = f->buf, .iov_len = f->capacity - 1};
+
+    sqe->opcode = IORING_OP_READV;
+    if (ring->registered) {
+        sqe->fd = i;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = f->fd;
+    }
+    sqe->addr = (uintptr_t) &f->iov;
+    sqe->len = 1;
+    sqe->off = 0;
+    sqe->user_data = i;
+
+    ring->sq_array[slot] = slot;
+}
+
+// Handles the completions available in the completion queue of the ring; returns their number.
+static
+size_t
+ring_reap(LSBatchReader *r)
+{
+    LSBatchReaderRing *ring = r->ring;
+    unsigned cq_head = *ring->cq_head;
+    const unsigned cq_tail = LOAD_ACQUIRE(ring->cq_tail);
+    size_t nreaped = 0;
+    for (; cq_head != cq_tail; ++cq_head) {
+        const struct io_uring_cqe *cqe = &ring->cqes[cq_head & *ring->cq_mask];
+        // The completions come in no particular order.
+        LSBatchReaderFile *f = &r->files.data[cqe->user_data];
+        if (cqe->res < 0) {
+            f->size = -1;
+            f->err = -cqe->res;
+        } else {
+            f->size = cqe->res;
+            f->err = 0;
+            if ((size_t) f->size == f->capacity - 1) {
+                // The data may not fit; grow the buffer and re-read.
+                f->buf = ls_x2realloc(f->buf, &f->capacity, 1);
+                pread_file(f);
+            }
+        }
+        f->done = true;
+        ++nreaped;
+    }
+    STORE_RELEASE(ring->cq_head, cq_head);
+    return nreaped;
+}
+
+// Waits for the /ninflight/ submitted requests to complete, so that the ring can be destroyed.
+//
+// If that fails, the buffers of the files the requests of which might still be in flight are
+// abandoned (leaked): the kernel may still write into them.
+static
+void
+ring_drain(LSBatchReader *r, const size_t *indices, size_t nqueued, size_t ninflight)
+{
+    LSBatchReaderRing *ring = r->ring;
+    while (ninflight) {
+        if (syscall(__NR_io_uring_enter, ring->fd, 0U, (unsigned) ninflight,
+                    (unsigned) IORING_ENTER_GETEVENTS, NULL, (size_t) 0) < 0
+            && errno != EINTR)
+        {
+            break;
+        }
+        ninflight -= ring_reap(r);
+    }
+    if (!ninflight) {
+        return;
+    }
+    for (size_t k = 0; k < nqueued; ++k) {
+        LSBatchReaderFile *f = &r->files.data[indices ? indices[k] : k];
+        if (!f->done) {
+            f->buf = LS_XNEW(char, f->capacity);
+        }
+    }
+}
+
+// Reads the files with the given indices (or all, if /indices/ is /NULL/) via io_uring, setting
+// the /done/ flag of each file read.
+//
+// Returns /false/ if io_uring has failed; the caller should then destroy the ring and read the
+// files not marked as done with /pread()/.
+static
+bool
+ring_read(LSBatchReader *r, const size_t *indices, size_t n)
+{
+    LSBatchReaderRing *ring = r->ring;
+
+    ring_maybe_register(r);
+
+    for (size_t k = 0; k < n; ++k) {
+        r->files.data[indices ? indices[k] : k].done = false;
+    }
+
+    const unsigned sq_head0 = LOAD_ACQUIRE(ring->sq_head);
+    size_t nqueued = 0;
+    size_t ndone = 0;
+    while (ndone != n) {
+        unsigned tail = *ring->sq_tail;
+        const unsigned head = LOAD_ACQUIRE(ring->sq_head);
+        // We never have more than /sq_entries/ requests in flight, so that the completion queue
+        // (which is at least twice as large) can not overflow.
+        while (nqueued != n &&
+               nqueued - ndone < ring->sq_entries &&
+               tail - head < ring->sq_entries)
+        {
+            ring_put_read(r, tail, indices ? indices[nqueued] : nqueued);
+            ++tail;
+            ++nqueued;
+        }
+        STORE_RELEASE(ring->sq_tail, tail);
+
+        const unsigned to_submit = tail - LOAD_ACQUIRE(ring->sq_head);
+        const unsigned to_wait = nqueued - ndone;
+        bool failed = false;
+        if (syscall(__NR_io_uring_enter, ring->fd, to_submit, to_wait,
+                    (unsigned) IORING_ENTER_GETEVENTS, NULL, (size_t) 0) < 0)
+        {
+            failed = errno != EINTR && errno != EAGAIN && errno != EBUSY;
+        }
+
+        const size_t nreaped = ring_reap(r);
+        ndone += nreaped;
+        if (failed && !nreaped) {
+            // No progress; give up on io_uring. The requests the kernel has consumed from the
+            // submission queue (each of them produces a completion) may still be in flight; the
+            // rest will never be.
+            const size_t nsubmitted = (unsigned) (LOAD_ACQUIRE(ring->sq_head) - sq_head0);
+            ring_drain(r, indices, nqueued, nsubmitted - ndone);
+            return false;
+        }
+    }
+    return true;
+}
+
+#else
+
+struct LSBatchReaderRing {
+    char dummy;
+};
+
+static
+LSBatchReaderRing *
+ring_new(void)
+{
+    return NULL;
+}
+
+static
+void
+ring_destroy(LSBatchReaderRing *ring)
+{
+    (void) ring;
+}
+
+static
+bool
+ring_read(LSBatchReader *r, const size_t *indices, size_t n)
+{
+    (void) r;
+    (void) indices;
+    (void) n;
+    return false;
+}
+
+#endif
+
+static
+void
+mark_dirty(LSBatchReader *r)
+{
+#if USE_IO_URING
+    if (r->ring) {
+        r->ring->dirty = true;
+    }
+#else
+    (void) r;
+#endif
+}
+
+void
+ls_batch_reader_init(LSBatchReader *r)
+{
+    LS_VECTOR_INIT(r->files);
+    r->ring = NULL;
+    r->ring_tried = false;
+}
+
+int
+ls_batch_reader_add_fd(LSBatchReader *r, int fd)
+{
+    LS_VECTOR_PUSH(r->files, ((LSBatchReaderFile) {
+        .fd = fd,
+        .buf = LS_XNEW(char, INITIAL_CAPACITY),
+        .capacity = INITIAL_CAPACITY,
+        .size = -1,
+        .err = 0,
+        .done = false,
+    }));
+    mark_dirty(r);
+    return r->files.size - 1;
+}
+
+int
+ls_batch_reader_add(LSBatchReader *r, const char *path)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    return ls_batch_reader_add_fd(r, fd);
+}
+
+static
+void
+read_impl(LSBatchReader *r, const size_t *indices, size_t n)
+{
+    if (!r->ring_tried) {
+        r->ring_tried = true;
+        r->ring = ring_new();
+    }
+
+    if (r->ring) {
+        if (ring_read(r, indices, n)) {
+            return;
+        }
+        ring_destroy(r->ring);
+        r->ring = NULL;
+        for (size_t k = 0; k < n; ++k) {
+            LSBatchReaderFile *f = &r->files.data[indices ? indices[k] : k];
+            if (!f->done) {
+                pread_file(f);
+            }
+        }
+        return;
+    }
+    for (size_t k = 0; k < n; ++k) {
+        pread_file(&r->files.data[indices ? indices[k] : k]);
+    }
+}
+
+void
+ls_batch_reader_read(LSBatchReader *r)
+{
+    read_impl(r, NULL, r->files.size);
+}
+
+void
+ls_batch_reader_read_some(LSBatchReader *r, const size_t *indices, size_t nindices)
+{
+    read_impl(r, indices, nindices);
+}
+
+const char *
+ls_batch_reader_data(LSBatchReader *r, size_t i, size_t *n)
+{
+    LSBatchReaderFile *f = &r->files.data[i];
+    if (f->size < 0) {
+        errno = f->err ? f->err : EAGAIN;
+        return NULL;
+    }
+    f->buf[f->size] = '\0';
+    if (n) {
+        *n = f->size;
+    }
+    return f->buf;
+}
+
+void
+ls_batch_reader_clear(LSBatchReader *r)
+{
+    for (size_t i = 0; i < r->files.size; ++i) {
+        close(r->files.data[i].fd);
+        free(r->files.data[i].buf);
+    }
+    LS_VECTOR_CLEAR(r->files);
+    mark_dirty(r);
+}
+
+void
+ls_batch_reader_destroy(LSBatchReader *r)
+{
+    if (r->ring) {
+        ring_destroy(r->ring);
+        r->ring = NULL;
+    }
+    ls_batch_reader_clear(r);
+    LS_VECTOR_FREE(r->files);
+}
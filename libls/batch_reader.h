@@ -0,0 +1,147 @@
+#ifndef ls_batch_reader_h_
+#define ls_batch_reader_h_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "vector.h"
+#include "compdep.h"
+
+// Polling plugins typically re-read a bunch of small kernel-provided files (procfs and sysfs ones)
+// on each tick. Doing it the usual way costs an /open()/, a /read()/ and a /close()/ per file.
+//
+// /LSBatchReader/ keeps the files opened and re-reads all of them (from offset /0/) at once. If
+// io_uring is available, all the reads are submitted with a single /io_uring_enter()/ call, with
+// the file descriptors registered in the ring; otherwise, it falls back to a /pread()/ loop.
+//
+// The typical usage is following:
+//
+//      LSBatchReader r;
+//      ls_batch_reader_init(&r);
+//      int stat_idx = ls_batch_reader_add(&r, "/proc/stat");
+//      if (stat_idx < 0) {
+//          // ... (errno is set)
+//      }
+//
+//      // ...
+//
+//      while (1) {
+//          ls_batch_reader_read(&r);
+//          size_t n;
+//          const char *data = ls_batch_reader_data(&r, stat_idx, &n);
+//          if (!data) {
+//              // ... (errno is set)
+//          }
+//          // ...
+//      }
+//
+//      // ...
+//      ls_batch_reader_destroy(&r);
+//
+// This structure is not thread-safe.
+
+typedef struct {
+    int fd;
+
+    // The buffer; always has at least one byte more than the data read, so that the data can be
+    // zero-terminated.
+    char *buf;
+    size_t capacity;
+
+    // The size of the data read by the last read, or /-1/ if it failed (/err/ is then set to the
+    // /errno/ value), or if the file has not been read yet (/err/ is then /0/).
+    ssize_t size;
+    int err;
+
+    // Used by the io_uring code path; /done/ is set once the file has been read by the current
+    // batch.
+    struct iovec iov;
+    bool done;
+} LSBatchReaderFile;
+
+// Opaque; defined in "batch_reader.c".
+typedef struct LSBatchReaderRing LSBatchReaderRing;
+
+typedef struct {
+    LS_VECTOR_OF(LSBatchReaderFile) files;
+
+    // /NULL/ if io_uring has not been set up (yet), or is not available.
+    LSBatchReaderRing *ring;
+
+    // Whether we have already tried to set up io_uring.
+    bool ring_tried;
+} LSBatchReader;
+
+// Initializes /r/ with an empty set of files.
+//
+// The io_uring instance is not set up until the first read.
+void
+ls_batch_reader_init(LSBatchReader *r);
+
+// Opens the file /path/ for reading and adds it to /r/.
+//
+// On success, returns the (non-negative) index of the file, which is to be used with the other
+// functions below. On failure, /-1/ is returned and /errno/ is set.
+int
+ls_batch_reader_add(LSBatchReader *r, const char *path);
+
+// Adds an already opened file descriptor /fd/ to /r/; /r/ takes the ownership of /fd/. This is
+// useful when the file descriptor also needs to be /poll()/ed on.
+//
+// Returns the (non-negative) index of the file.
+int
+ls_batch_reader_add_fd(LSBatchReader *r, int fd);
+
+// Returns the number of files in /r/.
+LS_INHEADER
+size_t
+ls_batch_reader_size(LSBatchReader *r)
+{
+    return r->files.size;
+}
+
+// Returns the file descriptor of the file with index /i/.
+LS_INHEADER
+int
+ls_batch_reader_fd(LSBatchReader *r, size_t i)
+{
+    return r->files.data[i].fd;
+}
+
+// Re-reads all the files from offset /0/.
+void
+ls_batch_reader_read(LSBatchReader *r);
+
+// Re-reads (from offset /0/) only the files with the indices listed in /indices/.
+void
+ls_batch_reader_read_some(LSBatchReader *r, const size_t *indices, size_t nindices);
+
+// Returns a pointer to the zero-terminated content of the file with index /i/ as of the last read,
+// writing its length to /*n/ (unless /n/ is /NULL/).
+//
+// If the last read has failed, /NULL/ is returned and /errno/ is set. If the file has not been
+// read yet, /NULL/ is returned and /errno/ is set to /EAGAIN/.
+//
+// The pointer is only valid until the next read.
+const char *
+ls_batch_reader_data(LSBatchReader *r, size_t i, size_t *n);
+
+// Checks whether /r/ currently uses io_uring.
+LS_INHEADER
+bool
+ls_batch_reader_uses_uring(LSBatchReader *r)
+{
+    return r->ring != NULL;
+}
+
+// Closes all the files in /r/; the indices returned previously are invalidated.
+void
+ls_batch_reader_clear(LSBatchReader *r);
+
+// Destroys /r/. After this function is called, /r/ must not be used anymore.
+void
+ls_batch_reader_destroy(LSBatchReader *r);
+
+#endif
@@ -0,0 +1,165 @@
+#include "dir_watch.h"
+
+#include "probes.generated.h"
+
+#if LS_HAVE_INOTIFY_INIT1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/select.h>
+
+#include "alloc_utils.h"
+#include "sig_utils.h"
+
+// The events on the directory that may concern the file, or the directory itself.
+static const uint32_t DIR_MASK = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                 IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                 IN_DELETE_SELF | IN_MOVE_SELF;
+
+bool
+ls_dir_watch_init(LSDirWatch *w, const char *filename)
+{
+    *w = (LSDirWatch) LS_DIR_WATCH_NEW();
+
+    const size_t nfilename = strlen(filename);
+    if (!nfilename || filename[nfilename - 1] == '/') {
+        errno = EINVAL;
+        return false;
+    }
+    if ((w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        return false;
+    }
+
+    const char *slash = strrchr(filename, '/');
+    if (!slash) {
+        w->dirname = ls_xstrdup(".");
+        w->basename = ls_xstrdup(filename);
+    } else {
+        w->dirname = ls_xstrdup(filename);
+        // Keep the slash if it is the root directory.
+        w->dirname[slash == filename ? 1 : slash - filename] = '\0';
+        w->basename = ls_xstrdup(slash + 1);
+    }
+    return true;
+}
+
+bool
+ls_dir_watch_ensure(LSDirWatch *w, LSDirWatchCallback cb, void *ud)
+{
+    if (w->wd >= 0) {
+        return true;
+    }
+    w->wd = inotify_add_watch(w->inotify_fd, w->dirname, DIR_MASK);
+    if (w->wd < 0 && errno != ENOENT && errno != ENOTDIR && errno != EACCES) {
+        return false;
+    }
+    cb(ud, LS_DIR_WATCH_EV_REPLACED);
+    return true;
+}
+
+static
+void
+handle_events(LSDirWatch *w, const char *buf, size_t n, LSDirWatchCallback cb, void *ud)
+{
+    const struct inotify_event *event;
+    for (const char *ptr = buf;
+         ptr < buf + n;
+         ptr += sizeof(struct inotify_event) + event->len)
+    {
+        event = (const struct inotify_event *) ptr;
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Events have been lost; assume the worst.
+            cb(ud, LS_DIR_WATCH_EV_REPLACED);
+            continue;
+        }
+        if (event->wd != w->wd) {
+            continue;
+        }
+        if (event->mask & IN_IGNORED) {
+            // The directory has gone, and the watch with it.
+            w->wd = -1;
+            continue;
+        }
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            // The directory has been moved away; watch the new one at this path, if any.
+            inotify_rm_watch(w->inotify_fd, w->wd);
+            w->wd = -1;
+            continue;
+        }
+        if (!event->len || strcmp(event->name, w->basename) != 0) {
+            continue;
+        }
+        if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+            cb(ud, LS_DIR_WATCH_EV_REPLACED);
+        } else {
+            cb(ud, LS_DIR_WATCH_EV_MODIFIED);
+        }
+    }
+}
+
+bool
+ls_dir_watch_wait(
+        LSDirWatch *w,
+        struct timespec retry_period,
+        LSDirWatchCallback cb,
+        void *ud)
+{
+    // Room for quite a few events, so that a burst of them is handled with a single read.
+    char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(w->inotify_fd, &fds);
+
+    sigset_t allsigs;
+    ls_xsigfillset(&allsigs);
+
+    const int nfds = pselect(
+        w->inotify_fd + 1,
+        &fds, NULL, NULL,
+        w->wd < 0 ? &retry_period : NULL,
+        &allsigs);
+    if (nfds < 0) {
+        return false;
+    } else if (nfds == 0) {
+        return true;
+    }
+
+    while (1) {
+        const ssize_t r = read(w->inotify_fd, buf, sizeof(buf));
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            return false;
+        } else if (r == 0) {
+            // Should not happen with inotify.
+            errno = EIO;
+            return false;
+        }
+        handle_events(w, buf, r, cb, ud);
+    }
+}
+
+void
+ls_dir_watch_destroy(LSDirWatch *w)
+{
+    free(w->dirname);
+    free(w->basename);
+    if (w->inotify_fd >= 0) {
+        close(w->inotify_fd);
+    }
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef ls_dir_watch_h_
+#define ls_dir_watch_h_
+
+#include <stdbool.h>
+#include <time.h>
+
+// An inotify watch on a file itself does not survive the file being replaced (e.g. written to a
+// temporary file that is then renamed over it, or rotated), and can not be added while the file
+// does not exist. /LSDirWatch/ watches the parent directory of the file instead, and reports only
+// the events concerning the file. If the directory does not exist (or can not be watched), the
+// watch is retried periodically.
+//
+// The typical usage is following:
+//
+//      LSDirWatch w = LS_DIR_WATCH_NEW();
+//      if (!ls_dir_watch_init(&w, "/path/to/file")) {
+//          // ... (errno is set)
+//      }
+//
+//      // ...
+//
+//      while (1) {
+//          if (!ls_dir_watch_ensure(&w, on_event, ud)) {
+//              // ... (errno is set)
+//          }
+//          // ... (read the file if /on_event()/ has asked for it)
+//          if (!ls_dir_watch_wait(&w, retry_period, on_event, ud)) {
+//              // ... (errno is set)
+//          }
+//      }
+//
+//      // ...
+//      ls_dir_watch_destroy(&w);
+//
+// Only available where /inotify_init1()/ is.
+
+typedef enum {
+    // The file may have been written to.
+    LS_DIR_WATCH_EV_MODIFIED,
+    // The file may have been created, removed or replaced with another one. Also reported when
+    // events have been lost, and whenever the directory is (re)watched.
+    LS_DIR_WATCH_EV_REPLACED,
+} LSDirWatchEvent;
+
+typedef void (*LSDirWatchCallback)(void *ud, LSDirWatchEvent ev);
+
+typedef struct {
+    // The parent directory of the file, and the name of the file in it.
+    char *dirname;
+    char *basename;
+    int inotify_fd;
+    // The watch on /dirname/, or /-1/.
+    int wd;
+} LSDirWatch;
+
+// An initializer for a /LSDirWatch/ that may be passed to /ls_dir_watch_destroy()/ before (or
+// without) a successful /ls_dir_watch_init()/.
+#define LS_DIR_WATCH_NEW() {.dirname = NULL, .basename = NULL, .inotify_fd = -1, .wd = -1}
+
+// Prepares /w/ for watching the file /filename/; no watch is added until /ls_dir_watch_ensure()/.
+//
+// On failure, /false/ is returned and /errno/ is set; it is /EINVAL/ if /filename/ is empty or ends
+// with a slash.
+bool
+ls_dir_watch_init(LSDirWatch *w, const char *filename);
+
+// If the directory is not watched, tries to watch it, and then calls /cb(ud,
+// LS_DIR_WATCH_EV_REPLACED)/ whatever the outcome (the file might be another one by now).
+//
+// The directory being absent or inaccessible is not an error. On other errors, /false/ is returned
+// and /errno/ is set.
+bool
+ls_dir_watch_ensure(LSDirWatch *w, LSDirWatchCallback cb, void *ud);
+
+// Waits (with all signals blocked) for events; if the directory is not watched, waits for at most
+// /retry_period/ instead. Then reads all the pending events, without blocking, and calls /cb(ud,
+// ev)/ for each one concerning the file, so that a burst of events can be handled at once.
+//
+// On error, /false/ is returned and /errno/ is set.
+bool
+ls_dir_watch_wait(
+        LSDirWatch *w,
+        struct timespec retry_period,
+        LSDirWatchCallback cb,
+        void *ud);
+
+// Destroys /w/.
+void
+ls_dir_watch_destroy(LSDirWatch *w);
+
+#endif
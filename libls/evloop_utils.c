@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
 #include <lauxlib.h>
 #include <sys/stat.h>
 
@@ -12,28 +13,32 @@
 #include "io_utils.h"
 #include "sig_utils.h"
 
+// We store the pushed timeout as a number of nanoseconds so that it fits into a single integer that
+// can be accessed atomically.
+
+static const int64_t NO_VALUE = -1;
+
 void
 ls_pushed_timeout_init(LSPushedTimeout *p)
 {
-    p->value = ls_timespec_invalid;
-    LS_PTH_CHECK(pthread_spin_init(&p->lock, PTHREAD_PROCESS_PRIVATE));
+    __atomic_store_n(&p->value_ns, NO_VALUE, __ATOMIC_RELAXED);
 }
 
 struct timespec
 ls_pushed_timeout_fetch(LSPushedTimeout *p, struct timespec alt)
 {
-    pthread_spin_lock(&p->lock);
-
-    struct timespec r;
-    if (ls_timespec_is_invalid(p->value)) {
-        r = alt;
-    } else {
-        r = p->value;
-        p->value = ls_timespec_invalid;
+    // Fast path: nothing has been pushed, so do not dirty the cache line.
+    if (__atomic_load_n(&p->value_ns, __ATOMIC_RELAXED) == NO_VALUE) {
+        return alt;
     }
-
-    pthread_spin_unlock(&p->lock);
-    return r;
+    const int64_t ns = __atomic_exchange_n(&p->value_ns, NO_VALUE, __ATOMIC_ACQ_REL);
+    if (ns == NO_VALUE) {
+        return alt;
+    }
+    return (struct timespec) {
+        .tv_sec = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
 }
 
 static
@@ -42,15 +47,14 @@ l_push_timeout(lua_State *L)
 {
     const lua_Number arg = luaL_checknumber(L, 1);
     const struct timespec value = ls_timespec_from_seconds(arg);
-    if (ls_timespec_is_invalid(value)) {
+    if (ls_timespec_is_invalid(value) || value.tv_sec > INT64_MAX / 1000000000 - 1) {
         return luaL_error(L, "invalid timeout");
     }
 
     LSPushedTimeout *p = lua_touserdata(L, lua_upvalueindex(1));
 
-    pthread_spin_lock(&p->lock);
-    p->value = value;
-    pthread_spin_unlock(&p->lock);
+    const int64_t ns = (int64_t) value.tv_sec * 1000000000 + value.tv_nsec;
+    __atomic_store_n(&p->value_ns, ns, __ATOMIC_RELEASE);
 
     return 0;
 }
@@ -65,51 +69,99 @@ ls_pushed_timeout_push_luafunc(LSPushedTimeout *p, lua_State *L)
 void
 ls_pushed_timeout_destroy(LSPushedTimeout *p)
 {
-    pthread_spin_destroy(&p->lock);
+    (void) p;
 }
 
 int
-ls_self_pipe_open(LSSelfPipe *s)
+ls_wakeup_fd_open(LSWakeupFd *w)
 {
-    if (ls_cloexec_pipe(s->fds) < 0) {
-        s->fds[0] = -1;
-        s->fds[1] = -1;
-        return -1;
+    const int fd = ls_cloexec_nonblock_eventfd();
+    if (fd >= 0) {
+        w->rfd = fd;
+        w->wfd = fd;
+        return 0;
     }
-    ls_make_nonblock(s->fds[0]);
-    ls_make_nonblock(s->fds[1]);
+    if (errno != ENOSYS && errno != EINVAL) {
+        goto error;
+    }
+
+    int fds[2];
+    if (ls_cloexec_pipe(fds) < 0) {
+        goto error;
+    }
+    ls_make_nonblock(fds[0]);
+    ls_make_nonblock(fds[1]);
+    w->rfd = fds[0];
+    w->wfd = fds[1];
     return 0;
+
+error:
+    w->rfd = -1;
+    w->wfd = -1;
+    return -1;
+}
+
+void
+ls_wakeup_fd_wake(LSWakeupFd *w)
+{
+    const int fd = w->wfd;
+    if (fd < 0) {
+        return;
+    }
+    // If this fails with /EAGAIN/, there is already a pending wake-up that has not been drained,
+    // which is just as good.
+    if (w->rfd == fd) {
+        ssize_t unused = write(fd, &(uint64_t) {1}, sizeof(uint64_t));
+        (void) unused;
+    } else {
+        ssize_t unused = write(fd, "", 1); // write '\0'
+        (void) unused;
+    }
 }
 
 static
 int
-l_self_pipe_write(lua_State *L)
+l_wake_up(lua_State *L)
 {
-    LSSelfPipe *s = lua_touserdata(L, lua_upvalueindex(1));
+    LSWakeupFd *w = lua_touserdata(L, lua_upvalueindex(1));
 
-    const int fd = s->fds[1];
-    if (fd < 0) {
+    if (w->wfd < 0) {
         return luaL_error(L, "self-pipe has not been opened");
     }
-
-    ssize_t unused = write(fd, "", 1); // write '\0'
-    (void) unused;
+    ls_wakeup_fd_wake(w);
 
     return 0;
 }
 
 void
-ls_self_pipe_push_luafunc(LSSelfPipe *s, lua_State *L)
+ls_wakeup_fd_push_luafunc(LSWakeupFd *w, lua_State *L)
 {
-    lua_pushlightuserdata(L, s);
-    lua_pushcclosure(L, l_self_pipe_write, 1);
+    lua_pushlightuserdata(L, w);
+    lua_pushcclosure(L, l_wake_up, 1);
 }
 
 void
-ls_self_pipe_close(LSSelfPipe *s)
+ls_wakeup_fd_drain(LSWakeupFd *w)
 {
-    close(s->fds[0]);
-    close(s->fds[1]);
+    if (w->rfd == w->wfd) {
+        // A single read resets the /eventfd/ counter to zero.
+        uint64_t unused_counter;
+        ssize_t unused = read(w->rfd, &unused_counter, sizeof(unused_counter));
+        (void) unused;
+    } else {
+        char buf[256];
+        while (read(w->rfd, buf, sizeof(buf)) == (ssize_t) sizeof(buf)) {
+        }
+    }
+}
+
+void
+ls_wakeup_fd_close(LSWakeupFd *w)
+{
+    close(w->rfd);
+    if (w->wfd != w->rfd) {
+        close(w->wfd);
+    }
 }
 
 void
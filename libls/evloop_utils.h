@@ -2,8 +2,8 @@
 #define ls_evloop_utils_h_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
-#include <pthread.h>
 #include <lua.h>
 #include <signal.h>
 #include <errno.h>
@@ -15,23 +15,23 @@
 // Some plugins provide a "push_timeout"/"push_period" function that allows a widget to specify the
 // next timeout for an otherwise constant timeout-based plugin's event loop.
 //
-// The pushed timeout value has to be guarded with a lock as the "push_timeout"/"push_period"
+// The pushed timeout value has to be accessed atomically as the "push_timeout"/"push_period"
 // function may be called from the /event/ function of a widget (that is, asynchronously from the
 // plugin's viewpoint).
 //
-// /LSPushedTimeout/ is a structure containing the pushed timeout value (or an absence of such, as
-// indicated by the value being /ls_timespec_invalid/), and a lock.
+// /LSPushedTimeout/ is a structure containing the pushed timeout value in nanoseconds (or an
+// absence of such, as indicated by the value being /-1/). It is only accessed with atomic
+// operations, so neither the pushing nor the fetching side ever blocks or spins.
 //
 // <!!!>
 // This structure must reside at a constant address throughout its whole life; this is required for
 // the Lua closure created with /ls_pushed_timeout_push_luafunc()/.
 // </!!!>
 typedef struct {
-    struct timespec value;
-    pthread_spinlock_t lock;
+    int64_t value_ns;
 } LSPushedTimeout;
 
-// Initializes /p/ with an absence of pushed timeout value and a newly-created lock.
+// Initializes /p/ with an absence of pushed timeout value.
 void
 ls_pushed_timeout_init(LSPushedTimeout *p);
 
@@ -61,48 +61,62 @@ ls_pushed_timeout_destroy(LSPushedTimeout *p);
 // widget's event loop (and force a call to the widget's /cb()/ function) from within the widget's
 // /event()/ function via a special "wake_up" Lua function.
 //
-// /LSSelfPipe/ is a structure containing the file descriptors of the self-pipe.
-// The /fds[0]/ file descriptor is to be read from, and /fds[1]/ is to be written to.
+// /LSWakeupFd/ is a structure containing the file descriptor(s) of such a facility. Where
+// available, it is a single non-blocking /eventfd/ object with counter semantics: any number of
+// wake-ups that happen before the read side gets to it coalesce into a single readable event, and a
+// single /read()/ drains them all. Otherwise, it falls back to a non-blocking pipe; then /rfd/ and
+// /wfd/ are different.
+//
+// The /rfd/ file descriptor is to be polled for reading and drained with /ls_wakeup_fd_drain()/.
 //
 // <!!!>
 // This structure must reside at a constant address throughout its whole life; this is required for
-// the Lua closure created with /ls_self_pipe_push_luafunc()/.
+// the Lua closure created with /ls_wakeup_fd_push_luafunc()/.
 // </!!!>
 typedef struct {
-    int fds[2];
-} LSSelfPipe;
+    int rfd;
+    int wfd;
+} LSWakeupFd;
 
-// The initializer for an empty (not yet opened) /LSSelfPipe/ structure.
-#define LS_SELF_PIPE_NEW() {{-1, -1}}
+// The initializer for an empty (not yet opened) /LSWakeupFd/ structure.
+#define LS_WAKEUP_FD_NEW() {-1, -1}
 
-// Opens a self-pipe /s/.
+// Opens a wake-up file descriptor /w/.
 //
 // On success, /0/ is returned; on failure, /-1/ is returned and /errno/ is set.
 int
-ls_self_pipe_open(LSSelfPipe *s);
+ls_wakeup_fd_open(LSWakeupFd *w);
 
-// Creates a "wake_up" function (a "C closure" with /s/'s address, in Lua terminology) on /L/'s
+// Creates a "wake_up" function (a "C closure" with /w/'s address, in Lua terminology) on /L/'s
 // stack.
 //
 // The resulting Lua function takes no arguments and does not return anything. Once called, it will
-// write a single byte to /s->fds[1]/ (in a thread-safe manner), or throw an error if the self-pipe
-// has not been opened.
+// make /w->rfd/ readable (in a thread-safe manner), or throw an error if /w/ has not been opened.
 //
 // The caller must ensure that the /L/'s stack has at least 2 free slots.
 void
-ls_self_pipe_push_luafunc(LSSelfPipe *s, lua_State *L);
+ls_wakeup_fd_push_luafunc(LSWakeupFd *w, lua_State *L);
+
+// Wakes /w/ up from C code; does nothing if /w/ has not been opened.
+void
+ls_wakeup_fd_wake(LSWakeupFd *w);
+
+// Consumes all the pending wake-ups of /w/, so that /w->rfd/ is not readable anymore. Never
+// blocks.
+void
+ls_wakeup_fd_drain(LSWakeupFd *w);
 
-// Checks whether /s/ has been opened.
+// Checks whether /w/ has been opened.
 LS_INHEADER
 bool
-ls_self_pipe_is_opened(LSSelfPipe *s)
+ls_wakeup_fd_is_opened(LSWakeupFd *w)
 {
-    return s->fds[0] >= 0;
+    return w->rfd >= 0;
 }
 
-// If /s/ has been opened, closes it. After this function is called, /s/ must not be used anymore.
+// If /w/ has been opened, closes it. After this function is called, /w/ must not be used anymore.
 void
-ls_self_pipe_close(LSSelfPipe *s);
+ls_wakeup_fd_close(LSWakeupFd *w);
 
 // A device to perform a timed wait on a FIFO (although both the FIFO and timeout are optional).
 // The typical usage is following:
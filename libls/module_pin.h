@@ -0,0 +1,46 @@
+#ifndef ls_module_pin_h_
+#define ls_module_pin_h_
+
+// /dladdr()/ is a GNU extension: a file including this header must define /_GNU_SOURCE/ before
+// including anything else, and its target must be linked with /${CMAKE_DL_LIBS}/.
+
+#include <dlfcn.h>
+#include <stddef.h>
+
+#include "compdep.h"
+
+// A module (plugin or barlib) that starts a thread shared between several of its instances (e.g.
+// a hub) may be unloaded by luastatus while the thread still runs; the thread has to keep the
+// module loaded.
+
+// Loads the module containing the address /anchor/ (that of any static object of the module, so
+// that the module, not the luastatus binary, is found) once again, so that it stays loaded until
+// /ls_module_unpin()/ is called on the returned handle.
+//
+// Returns /NULL/ on failure.
+LS_INHEADER
+void *
+ls_module_pin(const void *anchor)
+{
+    Dl_info info;
+    if (!dladdr(anchor, &info) || !info.dli_fname) {
+        return NULL;
+    }
+    return dlopen(info.dli_fname, RTLD_NOW);
+}
+
+// Releases the handle returned by /ls_module_pin()/; /handle/ may be /NULL/.
+//
+// No other thread may run any code of the module after this (e.g. the hub's thread must have been
+// joined), and the caller itself must be sure the module has another reference (e.g. be called
+// from the module's /destroy()/ function).
+LS_INHEADER
+void
+ls_module_unpin(void *handle)
+{
+    if (handle) {
+        dlclose(handle);
+    }
+}
+
+#endif
@@ -9,6 +9,10 @@
 #include "io_utils.h"
 #include "probes.generated.h"
 
+#if LS_HAVE_EVENTFD
+#   include <sys/eventfd.h>
+#endif
+
 int
 ls_cloexec_pipe(int pipefd[2])
 {
@@ -50,3 +54,14 @@ ls_cloexec_socket(int domain, int type, int protocol)
     return fd;
 #endif
 }
+
+int
+ls_cloexec_nonblock_eventfd(void)
+{
+#if LS_HAVE_EVENTFD
+    return eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
@@ -17,4 +17,10 @@ ls_cloexec_pipe(int pipefd[2]);
 int
 ls_cloexec_socket(int domain, int type, int protocol);
 
+// Creates a non-blocking, close-on-exec /eventfd/ object with the initial value of zero, and
+// returns its file descriptor. On failure, /-1/ is returned and /errno/ is set; if /eventfd/ is not
+// supported by the platform, /errno/ is set to /ENOSYS/.
+int
+ls_cloexec_nonblock_eventfd(void);
+
 #endif
@@ -3,5 +3,9 @@
 
 #cmakedefine01 LS_HAVE_GNU_PIPE2
 #cmakedefine01 LS_HAVE_GNU_SOCK_CLOEXEC
+#cmakedefine01 LS_HAVE_EVENTFD
+#cmakedefine01 LS_HAVE_LINUX_IO_URING_H
+#cmakedefine01 LS_HAVE_NR_IO_URING_SETUP
+#cmakedefine01 LS_HAVE_INOTIFY_INIT1
 
 #endif
@@ -0,0 +1,116 @@
+#ifndef ls_scan_utils_h_
+#define ls_scan_utils_h_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "compdep.h"
+
+// Hand-written scanners for the (zero-terminated) contents of procfs, sysfs and cgroupfs files.
+// They are locale-independent and never fail: on malformed input, they just produce zeros.
+//
+// All of them take a pointer to the current position, and advance it.
+
+LS_INHEADER
+bool
+ls_scan_is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// Skips spaces and tabs (but not newlines).
+LS_INHEADER
+void
+ls_scan_skip_blanks(const char **pos)
+{
+    const char *s = *pos;
+    while (ls_scan_is_blank(*s)) {
+        ++s;
+    }
+    *pos = s;
+}
+
+// Advances the position to the beginning of the next line (or to the terminating zero).
+LS_INHEADER
+void
+ls_scan_next_line(const char **pos)
+{
+    const char *s = *pos;
+    while (*s && *s != '\n') {
+        ++s;
+    }
+    if (*s) {
+        ++s;
+    }
+    *pos = s;
+}
+
+// Skips blanks, then scans a decimal unsigned integer. Wraps around on overflow.
+LS_INHEADER
+uint64_t
+ls_scan_u64(const char **pos)
+{
+    ls_scan_skip_blanks(pos);
+    const char *s = *pos;
+    uint64_t r = 0;
+    while (*s >= '0' && *s <= '9') {
+        r = r * 10 + (*s - '0');
+        ++s;
+    }
+    *pos = s;
+    return r;
+}
+
+// Skips blanks, then scans a non-negative decimal number with an optional fractional part (as in
+// "0.15").
+LS_INHEADER
+double
+ls_scan_udouble(const char **pos)
+{
+    double r = ls_scan_u64(pos);
+    const char *s = *pos;
+    if (*s == '.') {
+        ++s;
+        double scale = 0.1;
+        while (*s >= '0' && *s <= '9') {
+            r += scale * (*s - '0');
+            scale /= 10;
+            ++s;
+        }
+    }
+    *pos = s;
+    return r;
+}
+
+// Skips blanks, then scans a word terminated by a blank, a newline, the terminating zero, or
+// /stop/ (which is not consumed). Writes the start of the word into /*word/ and returns its length.
+LS_INHEADER
+size_t
+ls_scan_word(const char **pos, const char **word, char stop)
+{
+    ls_scan_skip_blanks(pos);
+    const char *s = *pos;
+    *word = s;
+    while (*s && *s != '\n' && *s != stop && !ls_scan_is_blank(*s)) {
+        ++s;
+    }
+    *pos = s;
+    return s - *word;
+}
+
+// Checks if the word /word/ of length /nword/ is equal to the zero-terminated string /s/.
+LS_INHEADER
+bool
+ls_scan_word_eq(const char *word, size_t nword, const char *s)
+{
+    size_t i = 0;
+    for (; i < nword; ++i) {
+        if (s[i] != word[i]) {
+            return false;
+        }
+    }
+    return s[i] == '\0';
+}
+
+#endif
@@ -3,6 +3,8 @@
 #include <time.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include "algo.h"
 
@@ -21,6 +23,14 @@ ls_timespec_from_seconds(double seconds)
     };
 }
 
+int64_t
+ls_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 struct timeval
 ls_timeval_from_seconds(double seconds)
 {
@@ -32,3 +42,19 @@ ls_timeval_from_seconds(double seconds)
         .tv_usec = (seconds - (time_t) seconds) * 1e6,
     };
 }
+
+bool
+ls_period_ms_from_seconds(double seconds, int *out)
+{
+    if (seconds < 0) {
+        *out = -1;
+        return true;
+    }
+    const double millis = seconds * 1000;
+    // Note: this also checks that /seconds/ is not NaN.
+    if (!(seconds > 0 && millis <= INT_MAX)) {
+        return false;
+    }
+    *out = millis >= 1 ? millis : 1;
+    return true;
+}
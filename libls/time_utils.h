@@ -4,6 +4,7 @@
 #include <time.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "compdep.h"
 
@@ -24,6 +25,18 @@ ls_timeval_is_invalid(struct timeval tv)
     return tv.tv_usec == -1;
 }
 
+// Returns /a - b/ in seconds.
+LS_INHEADER
+double
+ls_timespec_diff(struct timespec a, struct timespec b)
+{
+    return (a.tv_sec - b.tv_sec) + (a.tv_nsec - b.tv_nsec) / 1e9;
+}
+
+// Returns the current value of the /CLOCK_MONOTONIC/ clock in milliseconds.
+int64_t
+ls_now_ms(void);
+
 // Converts the number of seconds specified by /seconds/ to a /struct timespec/.
 // Returns /ls_timespec_invalid/ if /seconds/ is negative, NaN, or too big.
 struct timespec
@@ -34,6 +47,14 @@ ls_timespec_from_seconds(double seconds);
 struct timeval
 ls_timeval_from_seconds(double seconds);
 
+// Converts a period of /seconds/ seconds to milliseconds suitable as a /poll()/ timeout, writing
+// the result to /*out/: /-1/ (no period) if /seconds/ is negative, and at least /1/ otherwise, so
+// that a tiny period does not turn into a zero timeout.
+//
+// Returns /false/ if /seconds/ is zero (which would make the caller spin), NaN, or too big.
+bool
+ls_period_ms_from_seconds(double seconds, int *out);
+
 // Converts the number of seconds specified by /seconds/ to a /struct timespec/, writing the result
 // or /ls_timespec_invalid/ to /*out/.
 //
@@ -0,0 +1,543 @@
+// for /dladdr()/
+#define _GNU_SOURCE
+
+#include "udevhub.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <libudev.h>
+
+#include "include/common.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+#include "libls/string_.h"
+#include "libls/strarr.h"
+#include "libls/evloop_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/panic.h"
+#include "libls/module_pin.h"
+
+static const char *MAP_KEY_PREFIX = "libudevhub:";
+
+// The receive buffer size requested for the monitor's socket. Setting it beyond
+// /net.core.rmem_max/ requires /CAP_NET_ADMIN/; without it, we get as much as we are allowed to.
+static const int RCVBUF_SIZE = 128 * 1024 * 1024;
+
+struct UdevHub {
+    pthread_mutex_t mtx;
+    bool thread_started;
+    pthread_t thread;
+    // Used to tell the thread to stop.
+    LSWakeupFd stop;
+    struct udev *udev;
+    struct udev_monitor *mon;
+    bool dead;
+    LS_VECTOR_OF(UdevHubSub *) subs;
+    // Incremented whenever a subscriber unsubscribes.
+    uint64_t unsub_gen;
+    void *pin;
+    void **slot;
+};
+
+// Its address identifies the module for /ls_module_pin()/.
+static char module_anchor;
+
+#define LOCK(H_)   LS_PTH_CHECK(pthread_mutex_lock(&(H_)->mtx))
+#define UNLOCK(H_) LS_PTH_CHECK(pthread_mutex_unlock(&(H_)->mtx))
+
+static
+void
+device_read(UdevHubDevice *d, struct udev_device *dev)
+{
+    const char *fields[UDEVHUB_NFIELDS] = {
+        [UDEVHUB_FIELD_ACTION]    = udev_device_get_action(dev),
+        [UDEVHUB_FIELD_SYSPATH]   = udev_device_get_syspath(dev),
+        [UDEVHUB_FIELD_SYSNAME]   = udev_device_get_sysname(dev),
+        [UDEVHUB_FIELD_SYSNUM]    = udev_device_get_sysnum(dev),
+        [UDEVHUB_FIELD_DEVPATH]   = udev_device_get_devpath(dev),
+        [UDEVHUB_FIELD_DEVNODE]   = udev_device_get_devnode(dev),
+        [UDEVHUB_FIELD_DEVTYPE]   = udev_device_get_devtype(dev),
+        [UDEVHUB_FIELD_SUBSYSTEM] = udev_device_get_subsystem(dev),
+        [UDEVHUB_FIELD_DRIVER]    = udev_device_get_driver(dev),
+    };
+    d->fields = ls_strarr_new_reserve(256, UDEVHUB_NFIELDS);
+    for (int i = 0; i < UDEVHUB_NFIELDS; ++i) {
+        ls_strarr_append_s(&d->fields, fields[i] ? fields[i] : "");
+    }
+
+    d->props = ls_strarr_new();
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_device_get_properties_list_entry(dev)) {
+        const char *value = udev_list_entry_get_value(entry);
+        ls_strarr_append_s(&d->props, udev_list_entry_get_name(entry));
+        ls_strarr_append_s(&d->props, value ? value : "");
+    }
+}
+
+static
+LSStringArray
+strarr_copy(LSStringArray sa)
+{
+    if (!sa.offsets.size) {
+        return ls_strarr_new();
+    }
+    LSStringArray r = ls_strarr_new_reserve(sa.buf.size, sa.offsets.size);
+    memcpy(r.buf.data, sa.buf.data, sa.buf.size);
+    r.buf.size = sa.buf.size;
+    memcpy(r.offsets.data, sa.offsets.data, sizeof(size_t) * sa.offsets.size);
+    r.offsets.size = sa.offsets.size;
+    return r;
+}
+
+static
+bool
+str_matches(const char *pattern, const char *value)
+{
+    return !pattern || (value && strcmp(pattern, value) == 0);
+}
+
+static
+bool
+matches(UdevHubSub *sub, struct udev_device *dev)
+{
+    if (!str_matches(sub->subsystem, udev_device_get_subsystem(dev)) ||
+        !str_matches(sub->devtype, udev_device_get_devtype(dev)))
+    {
+        return false;
+    }
+    if (sub->sysname) {
+        const char *sysname = udev_device_get_sysname(dev);
+        if (!sysname || fnmatch(sub->sysname, sysname, 0) != 0) {
+            return false;
+        }
+    }
+    if (sub->tag) {
+        struct udev_list_entry *entry;
+        udev_list_entry_foreach(entry, udev_device_get_tags_list_entry(dev)) {
+            if (strcmp(udev_list_entry_get_name(entry), sub->tag) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return true;
+}
+
+// Puts a copy of /*d/ (read from /dev/ first if /d->fields.buf.data/ is /NULL/) onto the queue of
+// /sub/. Must be called with the hub locked.
+static
+void
+deliver(UdevHubSub *sub, UdevHubDevice *d, struct udev_device *dev)
+{
+    if (!d->fields.buf.data) {
+        device_read(d, dev);
+    }
+    LS_VECTOR_PUSH(sub->events_, ((UdevHubEvent) {
+        .kind = UDEVHUB_EV_DEVICE,
+        .dev = {
+            .fields = strarr_copy(d->fields),
+            .props = strarr_copy(d->props),
+        },
+    }));
+    ls_wakeup_fd_wake(&sub->wakeup);
+}
+
+// Must be called with /h/ locked.
+static
+void
+dispatch(UdevHub *h, struct udev_device *dev)
+{
+    UdevHubDevice d = {.fields = ls_strarr_new(), .props = ls_strarr_new()};
+    for (size_t i = 0; i < h->subs.size; ++i) {
+        UdevHubSub *sub = h->subs.data[i];
+        if (matches(sub, dev)) {
+            deliver(sub, &d, dev);
+        }
+    }
+    udevhub_device_free(&d);
+}
+
+// Appends the devices matching the criteria of /sub/ to /*out/.
+static
+bool
+enumerate(struct udev *udev, UdevHubSub *sub, UdevHubEvents *out)
+{
+    struct udev_enumerate *e = udev_enumerate_new(udev);
+    if (!e) {
+        return false;
+    }
+    // The enumeration can only narrow it down; the exact criteria are checked by /matches()/.
+    if (sub->subsystem) {
+        udev_enumerate_add_match_subsystem(e, sub->subsystem);
+    }
+    if (sub->tag) {
+        udev_enumerate_add_match_tag(e, sub->tag);
+    }
+    if (sub->sysname) {
+        udev_enumerate_add_match_sysname(e, sub->sysname);
+    }
+    udev_enumerate_scan_devices(e);
+
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+        struct udev_device *dev = udev_device_new_from_syspath(
+            udev, udev_list_entry_get_name(entry));
+        if (!dev) {
+            // has gone in the meantime
+            continue;
+        }
+        if (matches(sub, dev)) {
+            UdevHubEvent ev = {.kind = UDEVHUB_EV_DEVICE};
+            device_read(&ev.dev, dev);
+            LS_VECTOR_PUSH(*out, ev);
+        }
+        udev_device_unref(dev);
+    }
+    udev_enumerate_unref(e);
+    return true;
+}
+
+static
+char *
+xstrdup_or_null(const char *s)
+{
+    return s ? ls_xstrdup(s) : NULL;
+}
+
+// A subscriber to be resynced, with copies of its criteria.
+typedef struct {
+    UdevHubSub *sub;
+    char *subsystem;
+    char *devtype;
+    char *tag;
+    char *sysname;
+    UdevHubEvents events;
+} Resync;
+
+// Puts a /UDEVHUB_EV_RESYNC/ marker and the currently existing matching devices onto the queue of
+// each subscriber.
+//
+// Enumerating the devices means walking sysfs, so it is done without holding the lock; the
+// subscribers' criteria are copied beforehand, as they may unsubscribe in the meantime.
+static
+void
+resync_all(UdevHub *h)
+{
+    LS_VECTOR_OF(Resync) rs = LS_VECTOR_NEW();
+    bool done = false;
+    while (!done) {
+        LOCK(h);
+        const uint64_t gen = h->unsub_gen;
+        for (size_t i = 0; i < h->subs.size; ++i) {
+            UdevHubSub *sub = h->subs.data[i];
+            LS_VECTOR_PUSH(rs, ((Resync) {
+                .sub = sub,
+                .subsystem = xstrdup_or_null(sub->subsystem),
+                .devtype = xstrdup_or_null(sub->devtype),
+                .tag = xstrdup_or_null(sub->tag),
+                .sysname = xstrdup_or_null(sub->sysname),
+                .events = LS_VECTOR_NEW(),
+            }));
+        }
+        UNLOCK(h);
+
+        for (size_t i = 0; i < rs.size; ++i) {
+            Resync *r = &rs.data[i];
+            UdevHubSub criteria = {
+                .subsystem = r->subsystem,
+                .devtype = r->devtype,
+                .tag = r->tag,
+                .sysname = r->sysname,
+            };
+            LS_VECTOR_PUSH(r->events, ((UdevHubEvent) {.kind = UDEVHUB_EV_RESYNC}));
+            enumerate(h->udev, &criteria, &r->events);
+        }
+
+        LOCK(h);
+        // If anyone has unsubscribed, some of /rs[i].sub/ may be dangling (or even reused by new
+        // subscribers); start over.
+        done = h->unsub_gen == gen;
+        if (done) {
+            for (size_t i = 0; i < rs.size; ++i) {
+                Resync *r = &rs.data[i];
+                for (size_t j = 0; j < r->events.size; ++j) {
+                    LS_VECTOR_PUSH(r->sub->events_, r->events.data[j]);
+                }
+                // The events have been moved.
+                LS_VECTOR_CLEAR(r->events);
+                ls_wakeup_fd_wake(&r->sub->wakeup);
+            }
+        }
+        UNLOCK(h);
+
+        for (size_t i = 0; i < rs.size; ++i) {
+            Resync *r = &rs.data[i];
+            free(r->subsystem);
+            free(r->devtype);
+            free(r->tag);
+            free(r->sysname);
+            udevhub_events_clear(&r->events);
+            LS_VECTOR_FREE(r->events);
+        }
+        LS_VECTOR_CLEAR(rs);
+    }
+    LS_VECTOR_FREE(rs);
+}
+
+// Receives all the pending events.
+static
+void
+receive_all(UdevHub *h)
+{
+    while (1) {
+        errno = 0;
+        struct udev_device *dev = udev_monitor_receive_device(h->mon);
+        if (dev) {
+            LOCK(h);
+            dispatch(h, dev);
+            UNLOCK(h);
+            udev_device_unref(dev);
+        } else if (errno == ENOBUFS) {
+            // The socket's receive buffer has overflowed, and the events have been lost.
+            resync_all(h);
+        } else {
+            // Either there are no more messages, or this one was malformed or came from an
+            // unexpected sender (older libudev versions do not even set /errno/ then).
+            return;
+        }
+    }
+}
+
+static
+void *
+monitor_thread(void *vh)
+{
+    UdevHub *h = vh;
+    struct pollfd pfds[2] = {
+        {.fd = udev_monitor_get_fd(h->mon), .events = POLLIN},
+        {.fd = h->stop.rfd, .events = POLLIN},
+    };
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfds[1].revents) {
+            // /udevhub_destroy()/ asks us to stop.
+            return NULL;
+        }
+        if (pfds[0].revents & POLLNVAL) {
+            break;
+        }
+        // An overflow of a netlink socket is reported as /POLLERR/; the following /recvmsg()/
+        // fails with /ENOBUFS/.
+        if (pfds[0].revents & (POLLIN | POLLERR)) {
+            receive_all(h);
+        }
+    }
+
+    // The monitor has failed.
+    LOCK(h);
+    h->dead = true;
+    for (size_t i = 0; i < h->subs.size; ++i) {
+        ls_wakeup_fd_wake(&h->subs.data[i]->wakeup);
+    }
+    UNLOCK(h);
+    return NULL;
+}
+
+static
+void
+udevhub_destroy(UdevHub *h)
+{
+    if (h->thread_started) {
+        ls_wakeup_fd_wake(&h->stop);
+        LS_PTH_CHECK(pthread_join(h->thread, NULL));
+    }
+    if (h->mon) {
+        udev_monitor_unref(h->mon);
+    }
+    if (h->udev) {
+        udev_unref(h->udev);
+    }
+    ls_wakeup_fd_close(&h->stop);
+    LS_PTH_CHECK(pthread_mutex_destroy(&h->mtx));
+    LS_VECTOR_FREE(h->subs);
+    *h->slot = NULL;
+    void *pin = h->pin;
+    free(h);
+    ls_module_unpin(pin);
+}
+
+static
+UdevHub *
+udevhub_create(UdevHubSub *sub, void **slot, bool kernel)
+{
+    UdevHub *h = LS_XNEW(UdevHub, 1);
+    *h = (UdevHub) {
+        .thread_started = false,
+        .stop = LS_WAKEUP_FD_NEW(),
+        .udev = NULL,
+        .mon = NULL,
+        .dead = false,
+        .subs = LS_VECTOR_NEW(),
+        .unsub_gen = 0,
+        .pin = NULL,
+        .slot = slot,
+    };
+    LS_PTH_CHECK(pthread_mutex_init(&h->mtx, NULL));
+    *slot = h;
+
+    // The hub's thread may outlive the widget that has created it.
+    if (!(h->pin = ls_module_pin(&module_anchor))) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "cannot pin the module: dladdr() or "
+                  "dlopen() failed");
+        goto error;
+    }
+
+    if (ls_wakeup_fd_open(&h->stop) < 0) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "ls_wakeup_fd_open: %s",
+                  ls_strerror_onstack(errno));
+        goto error;
+    }
+    if (!(h->udev = udev_new())) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "udev_new() failed");
+        goto error;
+    }
+    if (!(h->mon = udev_monitor_new_from_netlink(h->udev, kernel ? "kernel" : "udev"))) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "udev_monitor_new_from_netlink() failed");
+        goto error;
+    }
+    if (udev_monitor_set_receive_buffer_size(h->mon, RCVBUF_SIZE) < 0) {
+        // Requires /CAP_NET_ADMIN/; fall back to the limited version.
+        const int fd = udev_monitor_get_fd(h->mon);
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &RCVBUF_SIZE, sizeof(RCVBUF_SIZE));
+    }
+    if (udev_monitor_enable_receiving(h->mon) < 0) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "udev_monitor_enable_receiving() failed");
+        goto error;
+    }
+
+    if ((errno = pthread_create(&h->thread, NULL, monitor_thread, h))) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "pthread_create: %s",
+                  ls_strerror_onstack(errno));
+        goto error;
+    }
+    h->thread_started = true;
+    return h;
+
+error:
+    udevhub_destroy(h);
+    return NULL;
+}
+
+UdevHub *
+udevhub_subscribe(UdevHubSub *sub, UdevHubMapGet *map_get, bool kernel)
+{
+    LSString key = LS_VECTOR_NEW();
+    ls_string_assign_s(&key, MAP_KEY_PREFIX);
+    ls_string_append_s(&key, kernel ? "kernel" : "udev");
+    ls_string_append_c(&key, '\0');
+    void **slot = map_get(sub->userdata, key.data);
+    LS_VECTOR_FREE(key);
+
+    UdevHub *h = *slot;
+    if (!h && !(h = udevhub_create(sub, slot, kernel))) {
+        return NULL;
+    }
+
+    LS_VECTOR_INIT(sub->events_);
+    LOCK(h);
+    LS_VECTOR_PUSH(h->subs, sub);
+    if (h->dead) {
+        ls_wakeup_fd_wake(&sub->wakeup);
+    }
+    UNLOCK(h);
+    return h;
+}
+
+void
+udevhub_unsubscribe(UdevHub *h, UdevHubSub *sub)
+{
+    LOCK(h);
+    for (size_t i = 0; i < h->subs.size; ++i) {
+        if (h->subs.data[i] == sub) {
+            memmove(&h->subs.data[i], &h->subs.data[i + 1],
+                    sizeof(UdevHubSub *) * (h->subs.size - i - 1));
+            --h->subs.size;
+            break;
+        }
+    }
+    ++h->unsub_gen;
+    udevhub_events_clear(&sub->events_);
+    LS_VECTOR_FREE(sub->events_);
+    const bool last = h->subs.size == 0;
+    UNLOCK(h);
+
+    if (last) {
+        udevhub_destroy(h);
+    }
+}
+
+bool
+udevhub_take_events(UdevHub *h, UdevHubSub *sub, UdevHubEvents *out)
+{
+    udevhub_events_clear(out);
+    LOCK(h);
+    UdevHubEvents tmp = *out;
+    *out = sub->events_;
+    sub->events_ = tmp;
+    const bool alive = !h->dead;
+    UNLOCK(h);
+    return alive;
+}
+
+bool
+udevhub_enumerate(UdevHubSub *sub, UdevHubEvents *out)
+{
+    // The hub's context may not be used from another thread; a new one is cheap, as it opens
+    // nothing by itself.
+    struct udev *udev = udev_new();
+    if (!udev) {
+        return false;
+    }
+    const bool r = enumerate(udev, sub, out);
+    udev_unref(udev);
+    return r;
+}
+
+void
+udevhub_events_clear(UdevHubEvents *events)
+{
+    for (size_t i = 0; i < events->size; ++i) {
+        if (events->data[i].kind == UDEVHUB_EV_DEVICE) {
+            udevhub_device_free(&events->data[i].dev);
+        }
+    }
+    LS_VECTOR_CLEAR(*events);
+}
+
+void
+udevhub_device_free(UdevHubDevice *dev)
+{
+    ls_strarr_destroy(dev->fields);
+    ls_strarr_destroy(dev->props);
+}
+
+const char *
+udevhub_device_field(const UdevHubDevice *dev, UdevHubField f)
+{
+    const char *s = ls_strarr_at(dev->fields, f, NULL);
+    return *s ? s : NULL;
+}
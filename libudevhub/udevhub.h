@@ -0,0 +1,122 @@
+#ifndef udevhub_h_
+#define udevhub_h_
+
+#include <stdbool.h>
+
+#include "libls/vector.h"
+#include "libls/strarr.h"
+#include "libls/evloop_utils.h"
+
+// A udev monitor shared by all the udev widgets of the process, one per event source ("udev" or
+// "kernel"). A single thread of the hub receives the events from the monitor, matches them against
+// the criteria of each subscriber, and puts copies of the matching ones onto the subscriber's
+// queue, waking it up.
+//
+// The monitor's socket is given a large receive buffer; if it overflows nevertheless, the hub
+// enumerates the devices matching each subscriber's criteria anew, and delivers them after a
+// /UDEVHUB_EV_RESYNC/ marker.
+//
+// The hub is created when the first subscriber subscribes to it, and destroyed when the last one
+// unsubscribes. Since it may outlive the module that has created it, the hub keeps this module
+// loaded while it exists.
+
+typedef struct UdevHub UdevHub;
+
+// Device fields (see /UdevHubDevice::fields/).
+typedef enum {
+    UDEVHUB_FIELD_ACTION,
+    UDEVHUB_FIELD_SYSPATH,
+    UDEVHUB_FIELD_SYSNAME,
+    UDEVHUB_FIELD_SYSNUM,
+    UDEVHUB_FIELD_DEVPATH,
+    UDEVHUB_FIELD_DEVNODE,
+    UDEVHUB_FIELD_DEVTYPE,
+    UDEVHUB_FIELD_SUBSYSTEM,
+    UDEVHUB_FIELD_DRIVER,
+    UDEVHUB_NFIELDS,
+} UdevHubField;
+
+typedef struct {
+    // /UDEVHUB_NFIELDS/ NUL-terminated strings; an absent field is an empty string.
+    LSStringArray fields;
+    // The udev properties: NUL-terminated names and values, interleaved.
+    LSStringArray props;
+} UdevHubDevice;
+
+typedef enum {
+    // A device event.
+    UDEVHUB_EV_DEVICE,
+    // The events have been lost. This is followed by a /UDEVHUB_EV_DEVICE/ event (without the
+    // action) for each matching device that currently exists.
+    UDEVHUB_EV_RESYNC,
+} UdevHubEventKind;
+
+typedef struct {
+    UdevHubEventKind kind;
+    // Only valid if /kind/ is /UDEVHUB_EV_DEVICE/.
+    UdevHubDevice dev;
+} UdevHubEvent;
+
+typedef LS_VECTOR_OF(UdevHubEvent) UdevHubEvents;
+
+typedef void UdevHubSayf(void *userdata, int level, const char *fmt, ...);
+
+typedef void ** UdevHubMapGet(void *userdata, const char *key);
+
+typedef struct {
+    // Used for logging the hub's errors: the /userdata/ and /sayf/ of the plugin.
+    void *userdata;
+    UdevHubSayf *sayf;
+
+    // Woken up whenever an event is put onto the queue, or the monitor fails.
+    LSWakeupFd wakeup;
+
+    // Only the events of the devices matching all of these are delivered; /NULL/ matches
+    // anything. /sysname/ is a shell-style pattern. Must stay valid until unsubscribed.
+    const char *subsystem;
+    const char *devtype;
+    const char *tag;
+    const char *sysname;
+
+    // Private data; do not touch.
+    UdevHubEvents events_;
+} UdevHubSub;
+
+// Subscribes /sub/ to the hub for the "kernel" (if /kernel/ is true) or "udev" (otherwise) event
+// source, creating it if it does not exist yet; /sub->userdata/ and /sub->sayf/ must be set,
+// /sub->wakeup/ must be opened, and /sub/ must stay at a constant address until it is
+// unsubscribed. /map_get/ is that of the plugin; thus, this may only be called from its /init()/
+// function.
+//
+// On error, logs it and returns /NULL/.
+UdevHub *
+udevhub_subscribe(UdevHubSub *sub, UdevHubMapGet *map_get, bool kernel);
+
+// Unsubscribes /sub/ from /h/; destroys /h/ if it was the last subscriber.
+void
+udevhub_unsubscribe(UdevHub *h, UdevHubSub *sub);
+
+// Frees the events in /*out/ and replaces them with the events queued for /sub/, emptying the
+// queue. Returns /false/ if the monitor has failed (then there will never be any events anymore).
+bool
+udevhub_take_events(UdevHub *h, UdevHubSub *sub, UdevHubEvents *out);
+
+// Appends a /UDEVHUB_EV_DEVICE/ event (without the action) for each currently existing device
+// matching the criteria of /sub/ to /*out/. May be called from any thread; /sub/ does not have to
+// be subscribed. Returns /false/ on failure.
+bool
+udevhub_enumerate(UdevHubSub *sub, UdevHubEvents *out);
+
+// Frees the events in /*events/, leaving it empty.
+void
+udevhub_events_clear(UdevHubEvents *events);
+
+// Frees /*dev/.
+void
+udevhub_device_free(UdevHubDevice *dev);
+
+// Returns the field /f/ of /dev/, or /NULL/ if it is absent.
+const char *
+udevhub_device_field(const UdevHubDevice *dev, UdevHubField f);
+
+#endif
@@ -0,0 +1,92 @@
+#include "props.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+#include "libls/string_.h"
+
+#include "xhub.h"
+
+static
+void
+title_props(XHub *h, xcb_atom_t *atoms, xcb_atom_t *types)
+{
+    const xcb_atom_t utf8 = h->atoms[XHUB_ATOM_UTF8_STRING];
+
+    atoms[0] = h->atoms[XHUB_ATOM__NET_WM_VISIBLE_NAME];
+    types[0] = utf8;
+
+    atoms[1] = h->atoms[XHUB_ATOM__NET_WM_NAME];
+    types[1] = utf8;
+
+    atoms[2] = XCB_ATOM_WM_NAME;
+    types[2] = XCB_GET_PROPERTY_TYPE_ANY;
+}
+
+void
+xhub_title_request(XHub *h, xcb_window_t win, bool visible, XHubTitleCookies *c)
+{
+    xcb_atom_t atoms[XHUB_TITLE_NPROPS];
+    xcb_atom_t types[XHUB_TITLE_NPROPS];
+    title_props(h, atoms, types);
+
+    c->first = visible ? 0 : 1;
+    for (size_t i = c->first; i < XHUB_TITLE_NPROPS; ++i) {
+        c->cookies[i] = xhub_prop_request(h, win, atoms[i], types[i]);
+    }
+}
+
+bool
+xhub_title_reply(XHub *h, XHubTitleCookies *c, LSString *out)
+{
+    xcb_atom_t atoms[XHUB_TITLE_NPROPS];
+    xcb_atom_t types[XHUB_TITLE_NPROPS];
+    title_props(h, atoms, types);
+
+    bool found = false;
+    for (size_t i = c->first; i < XHUB_TITLE_NPROPS; ++i) {
+        if (found) {
+            // We do not need the less preferred ones anymore.
+            xcb_discard_reply(h->conn, c->cookies[i].sequence);
+            continue;
+        }
+        xcb_get_property_reply_t *reply = xhub_prop_reply(h, c->cookies[i], types[i], 8);
+        if (reply) {
+            ls_string_assign_b(out, xcb_get_property_value(reply),
+                               xcb_get_property_value_length(reply));
+            found = true;
+            free(reply);
+        }
+    }
+    return found;
+}
+
+bool
+xhub_is_title_atom(XHub *h, xcb_atom_t atom, bool visible)
+{
+    return (visible && atom == h->atoms[XHUB_ATOM__NET_WM_VISIBLE_NAME]) ||
+           atom == h->atoms[XHUB_ATOM__NET_WM_NAME] ||
+           atom == XCB_ATOM_WM_NAME;
+}
+
+xcb_get_property_cookie_t
+xhub_prop_request(XHub *h, xcb_window_t win, xcb_atom_t atom, xcb_atom_t type)
+{
+    return xcb_get_property(h->conn, 0, win, atom, type, 0, UINT32_MAX / 4);
+}
+
+xcb_get_property_reply_t *
+xhub_prop_reply(XHub *h, xcb_get_property_cookie_t cookie, xcb_atom_t type, uint8_t fmt)
+{
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(h->conn, cookie, NULL);
+    if (reply && (reply->format != fmt ||
+                  (type != XCB_GET_PROPERTY_TYPE_ANY && reply->type != type)))
+    {
+        free(reply);
+        return NULL;
+    }
+    return reply;
+}
@@ -0,0 +1,48 @@
+#ifndef xhub_props_h_
+#define xhub_props_h_
+
+#include <stdbool.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+#include "libls/string_.h"
+
+#include "xhub.h"
+
+// Helpers for fetching window properties through a hub's connection. The requests and the replies
+// are split, so that the caller can send requests for many windows first, and then collect all the
+// replies in a single round trip.
+
+// The window title requests, in the order of preference: /_NET_WM_VISIBLE_NAME/ (only if the title
+// request was made with /visible/ set), /_NET_WM_NAME/, and /WM_NAME/.
+enum { XHUB_TITLE_NPROPS = 3 };
+
+typedef struct {
+    size_t first;
+    xcb_get_property_cookie_t cookies[XHUB_TITLE_NPROPS];
+} XHubTitleCookies;
+
+// Sends the requests for the title of window /win/.
+void
+xhub_title_request(XHub *h, xcb_window_t win, bool visible, XHubTitleCookies *c);
+
+// Collects the replies to the requests sent by /xhub_title_request()/. On success, assigns the
+// title to /*out/ and returns /true/; if the window has no title, returns /false/.
+bool
+xhub_title_reply(XHub *h, XHubTitleCookies *c, LSString *out);
+
+// Checks if a change of property /atom/ may change the title, as fetched with /visible/.
+bool
+xhub_is_title_atom(XHub *h, xcb_atom_t atom, bool visible);
+
+// Sends a request for a whole property /atom/ of window /win/, of type /type/.
+xcb_get_property_cookie_t
+xhub_prop_request(XHub *h, xcb_window_t win, xcb_atom_t atom, xcb_atom_t type);
+
+// Collects the reply to a request sent by /xhub_prop_request()/. Returns /NULL/ if there is no such
+// property, or it is not of the requested type or of format /fmt/; otherwise, the reply has to be
+// /free()/d.
+xcb_get_property_reply_t *
+xhub_prop_reply(XHub *h, xcb_get_property_cookie_t cookie, xcb_atom_t type, uint8_t fmt);
+
+#endif
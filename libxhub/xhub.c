@@ -0,0 +1,342 @@
+// for /dladdr()/
+#define _GNU_SOURCE
+
+#include "xhub.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+#include "include/common.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+#include "libls/string_.h"
+#include "libls/evloop_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/panic.h"
+#include "libls/module_pin.h"
+
+static const char *MAP_KEY_PREFIX = "libxhub:";
+
+static const char *ATOM_NAMES[XHUB_NATOMS] = {
+    [XHUB_ATOM_UTF8_STRING]           = "UTF8_STRING",
+    [XHUB_ATOM__NET_ACTIVE_WINDOW]    = "_NET_ACTIVE_WINDOW",
+    [XHUB_ATOM__NET_CLIENT_LIST]      = "_NET_CLIENT_LIST",
+    [XHUB_ATOM__NET_CURRENT_DESKTOP]  = "_NET_CURRENT_DESKTOP",
+    [XHUB_ATOM__NET_WM_DESKTOP]       = "_NET_WM_DESKTOP",
+    [XHUB_ATOM__NET_WM_NAME]          = "_NET_WM_NAME",
+    [XHUB_ATOM__NET_WM_VISIBLE_NAME]  = "_NET_WM_VISIBLE_NAME",
+    [XHUB_ATOM__XKB_RULES_NAMES]      = "_XKB_RULES_NAMES",
+};
+
+// Its address identifies the module for /ls_module_pin()/.
+static char module_anchor;
+
+#define LOCK(H_)   LS_PTH_CHECK(pthread_mutex_lock(&(H_)->mtx_))
+#define UNLOCK(H_) LS_PTH_CHECK(pthread_mutex_unlock(&(H_)->mtx_))
+
+static
+bool
+has_xcb_error(XHubSub *sub, xcb_connection_t *conn, const char *what)
+{
+    const int err = xcb_connection_has_error(conn);
+    if (err) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "%s: XCB error %d", what, err);
+        return true;
+    }
+    return false;
+}
+
+static
+void
+select_events(XHub *h, xcb_window_t win, bool state)
+{
+    uint32_t value = XCB_EVENT_MASK_NO_EVENT;
+    if (state) {
+        value = XCB_EVENT_MASK_PROPERTY_CHANGE;
+        if (win != h->root) {
+            value |= XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+        }
+    }
+    xcb_change_window_attributes(h->conn, win, XCB_CW_EVENT_MASK, &value);
+    xcb_flush(h->conn);
+}
+
+// Must be called with /h/ locked.
+static
+void
+dispatch(XHub *h, const xcb_generic_event_t *ev)
+{
+    const uint8_t type = ev->response_type & ~0x80;
+    for (size_t i = 0; i < h->subs_.size; ++i) {
+        XHubSub *sub = h->subs_.data[i];
+        if ((type == XCB_PROPERTY_NOTIFY && (sub->kinds & XHUB_PROPERTY_NOTIFY)) ||
+            (type == XCB_DESTROY_NOTIFY && (sub->kinds & XHUB_DESTROY_NOTIFY)) ||
+            (sub->ext_event_ && type == sub->ext_event_))
+        {
+            LS_VECTOR_PUSH(sub->events_, *ev);
+            ls_wakeup_fd_wake(&sub->wakeup);
+        }
+    }
+}
+
+static
+void *
+event_thread(void *vh)
+{
+    XHub *h = vh;
+    xcb_generic_event_t *ev;
+    // /xcb_wait_for_event()/ (unlike polling the connection's file descriptor) also returns the
+    // events read by other threads while they were waiting for replies.
+    while ((ev = xcb_wait_for_event(h->conn))) {
+        const uint8_t type = ev->response_type & ~0x80;
+        if (type == XCB_CLIENT_MESSAGE &&
+            ((xcb_client_message_event_t *) ev)->window == h->own_window_)
+        {
+            // /xhub_destroy()/ asks us to stop.
+            free(ev);
+            return NULL;
+        }
+        // Errors (with /response_type/ of zero) are those of requests with no reply checked,
+        // e.g. selecting events of a window that has just been destroyed; ignore them.
+        if (type != 0) {
+            LOCK(h);
+            dispatch(h, ev);
+            UNLOCK(h);
+        }
+        free(ev);
+    }
+
+    // The connection has been lost.
+    LOCK(h);
+    h->dead_ = true;
+    for (size_t i = 0; i < h->subs_.size; ++i) {
+        ls_wakeup_fd_wake(&h->subs_.data[i]->wakeup);
+    }
+    UNLOCK(h);
+    return NULL;
+}
+
+static
+void
+xhub_destroy(XHub *h)
+{
+    if (h->thread_started_) {
+        // An empty event mask means the event is sent to the client that has created the window,
+        // that is, to us.
+        xcb_client_message_event_t msg = {
+            .response_type = XCB_CLIENT_MESSAGE,
+            .format = 32,
+            .window = h->own_window_,
+            .type = XCB_ATOM_NONE,
+        };
+        xcb_send_event(h->conn, false, h->own_window_, XCB_EVENT_MASK_NO_EVENT,
+                       (const char *) &msg);
+        xcb_flush(h->conn);
+        LS_PTH_CHECK(pthread_join(h->thread_, NULL));
+    }
+    if (h->conn) {
+        xcb_disconnect(h->conn);
+    }
+    LS_PTH_CHECK(pthread_mutex_destroy(&h->mtx_));
+    LS_VECTOR_FREE(h->subs_);
+    LS_VECTOR_FREE(h->watches_);
+    *h->slot_ = NULL;
+    void *pin = h->dlhandle_;
+    free(h);
+    ls_module_unpin(pin);
+}
+
+static
+XHub *
+xhub_create(XHubSub *sub, void **slot, const char *dpyname)
+{
+    XHub *h = LS_XNEW(XHub, 1);
+    *h = (XHub) {
+        .conn = NULL,
+        .thread_started_ = false,
+        .own_window_ = XCB_NONE,
+        .dead_ = false,
+        .subs_ = LS_VECTOR_NEW(),
+        .watches_ = LS_VECTOR_NEW(),
+        .dlhandle_ = NULL,
+        .slot_ = slot,
+    };
+    LS_PTH_CHECK(pthread_mutex_init(&h->mtx_, NULL));
+    *slot = h;
+
+    // The hub's thread may outlive the widget that has created it.
+    if (!(h->dlhandle_ = ls_module_pin(&module_anchor))) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "cannot pin the module: dladdr() or "
+                  "dlopen() failed");
+        goto error;
+    }
+
+    h->conn = xcb_connect(dpyname, &h->screenp);
+    if (has_xcb_error(sub, h->conn, "xcb_connect")) {
+        // /xcb_disconnect()/ should be called even if /xcb_connection_has_error()/ returned
+        // non-zero, so we should not set /h->conn/ to /NULL/ here.
+        goto error;
+    }
+
+    const xcb_setup_t *setup = xcb_get_setup(h->conn);
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(setup);
+    for (int i = 0; i < h->screenp; ++i) {
+        xcb_screen_next(&iter);
+    }
+    h->root = iter.data->root;
+
+    // Send all the requests first, then collect the replies.
+    xcb_intern_atom_cookie_t cookies[XHUB_NATOMS];
+    for (int i = 0; i < XHUB_NATOMS; ++i) {
+        cookies[i] = xcb_intern_atom(h->conn, 0, strlen(ATOM_NAMES[i]), ATOM_NAMES[i]);
+    }
+    bool atoms_ok = true;
+    for (int i = 0; i < XHUB_NATOMS; ++i) {
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(h->conn, cookies[i], NULL);
+        if (reply) {
+            h->atoms[i] = reply->atom;
+            free(reply);
+        } else {
+            atoms_ok = false;
+        }
+    }
+    if (!atoms_ok) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "xcb_intern_atom() failed");
+        goto error;
+    }
+
+    h->own_window_ = xcb_generate_id(h->conn);
+    xcb_create_window(h->conn, XCB_COPY_FROM_PARENT, h->own_window_, h->root, 0, 0, 1, 1, 0,
+                      XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, NULL);
+    select_events(h, h->root, true);
+    if (has_xcb_error(sub, h->conn, "xcb_create_window")) {
+        goto error;
+    }
+
+    if ((errno = pthread_create(&h->thread_, NULL, event_thread, h))) {
+        sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL, "pthread_create: %s",
+                  ls_strerror_onstack(errno));
+        goto error;
+    }
+    h->thread_started_ = true;
+    return h;
+
+error:
+    xhub_destroy(h);
+    return NULL;
+}
+
+XHub *
+xhub_subscribe(XHubSub *sub, XHubMapGet *map_get, const char *dpyname)
+{
+    LSString key = LS_VECTOR_NEW();
+    ls_string_assign_s(&key, MAP_KEY_PREFIX);
+    ls_string_append_s(&key, dpyname ? dpyname : "");
+    ls_string_append_c(&key, '\0');
+    void **slot = map_get(sub->userdata, key.data);
+    LS_VECTOR_FREE(key);
+
+    XHub *h = *slot;
+    if (!h && !(h = xhub_create(sub, slot, dpyname))) {
+        return NULL;
+    }
+
+    sub->ext_event_ = 0;
+    if (sub->ext) {
+        const xcb_query_extension_reply_t *ext = xcb_get_extension_data(h->conn, sub->ext);
+        if (!ext || !ext->present) {
+            sub->sayf(sub->userdata, LUASTATUS_LOG_FATAL,
+                      "the X server does not support the extension");
+            goto error;
+        }
+        sub->ext_event_ = ext->first_event;
+    }
+
+    LS_VECTOR_INIT(sub->events_);
+    LOCK(h);
+    LS_VECTOR_PUSH(h->subs_, sub);
+    if (h->dead_) {
+        ls_wakeup_fd_wake(&sub->wakeup);
+    }
+    UNLOCK(h);
+    return h;
+
+error:
+    LOCK(h);
+    const bool unused = h->subs_.size == 0;
+    UNLOCK(h);
+    if (unused) {
+        xhub_destroy(h);
+    }
+    return NULL;
+}
+
+void
+xhub_unsubscribe(XHub *h, XHubSub *sub)
+{
+    LOCK(h);
+    for (size_t i = 0; i < h->subs_.size; ++i) {
+        if (h->subs_.data[i] == sub) {
+            memmove(&h->subs_.data[i], &h->subs_.data[i + 1],
+                    sizeof(XHubSub *) * (h->subs_.size - i - 1));
+            --h->subs_.size;
+            break;
+        }
+    }
+    LS_VECTOR_FREE(sub->events_);
+    const bool last = h->subs_.size == 0;
+    UNLOCK(h);
+
+    if (last) {
+        xhub_destroy(h);
+    }
+}
+
+bool
+xhub_take_events(XHub *h, XHubSub *sub, XHubEvents *out)
+{
+    LS_VECTOR_CLEAR(*out);
+    LOCK(h);
+    XHubEvents tmp = *out;
+    *out = sub->events_;
+    sub->events_ = tmp;
+    const bool alive = !h->dead_;
+    UNLOCK(h);
+    return alive;
+}
+
+void
+xhub_watch(XHub *h, xcb_window_t win, bool state)
+{
+    if (win == XCB_NONE) {
+        return;
+    }
+    LOCK(h);
+    size_t i = 0;
+    while (i < h->watches_.size && h->watches_.data[i].window != win) {
+        ++i;
+    }
+    if (state) {
+        if (i == h->watches_.size) {
+            LS_VECTOR_PUSH(h->watches_, ((XHubWatch) {.window = win, .refcount = 0}));
+            if (win != h->root) {
+                select_events(h, win, true);
+            }
+        }
+        ++h->watches_.data[i].refcount;
+    } else if (i != h->watches_.size && --h->watches_.data[i].refcount == 0) {
+        if (win != h->root) {
+            select_events(h, win, false);
+        }
+        h->watches_.data[i] = h->watches_.data[h->watches_.size - 1];
+        --h->watches_.size;
+    }
+    UNLOCK(h);
+}
@@ -0,0 +1,126 @@
+#ifndef xhub_h_
+#define xhub_h_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+#include "libls/vector.h"
+#include "libls/evloop_utils.h"
+
+// An X connection shared by all the X widgets (and the barlib) of the process, one per display
+// name. A single thread of the hub reads the events from the connection and puts copies of the
+// ones a subscriber is interested in onto the subscriber's queue, waking it up.
+//
+// The connection itself is safe to use from any thread (as any XCB connection is); just do not
+// call /xcb_wait_for_event()/ or /xcb_poll_for_event()/ on it, and do not change the event mask of
+// any window with /xcb_change_window_attributes()/ directly (use /xhub_watch()/ instead).
+//
+// The hub is created when the first subscriber subscribes to it, and destroyed when the last one
+// unsubscribes. Since it may outlive the module (plugin or barlib) that has created it, the hub
+// keeps this module loaded while it exists.
+
+// Atoms interned by the hub once it is created.
+typedef enum {
+    XHUB_ATOM_UTF8_STRING,
+    XHUB_ATOM__NET_ACTIVE_WINDOW,
+    XHUB_ATOM__NET_CLIENT_LIST,
+    XHUB_ATOM__NET_CURRENT_DESKTOP,
+    XHUB_ATOM__NET_WM_DESKTOP,
+    XHUB_ATOM__NET_WM_NAME,
+    XHUB_ATOM__NET_WM_VISIBLE_NAME,
+    XHUB_ATOM__XKB_RULES_NAMES,
+    XHUB_NATOMS,
+} XHubAtom;
+
+// Subscriber interests (see /XHubSub::kinds/).
+enum {
+    // /XCB_PROPERTY_NOTIFY/ events, for the root window and all the watched windows.
+    XHUB_PROPERTY_NOTIFY = 1 << 0,
+    // /XCB_DESTROY_NOTIFY/ events, for all the watched windows.
+    XHUB_DESTROY_NOTIFY = 1 << 1,
+};
+
+typedef void XHubSayf(void *userdata, int level, const char *fmt, ...);
+
+typedef void ** XHubMapGet(void *userdata, const char *key);
+
+typedef LS_VECTOR_OF(xcb_generic_event_t) XHubEvents;
+
+typedef struct {
+    // Used for logging the hub's errors: the /userdata/ and /sayf/ of the plugin or barlib.
+    void *userdata;
+    XHubSayf *sayf;
+
+    // Woken up whenever an event is put onto the queue, or the connection is lost. May be left
+    // unopened if /kinds/ is zero and /ext/ is /NULL/.
+    LSWakeupFd wakeup;
+
+    // A bitmask of /XHUB_*/ values.
+    unsigned kinds;
+
+    // If not /NULL/, the extension (e.g. /&xcb_xkb_id/) whose events are to be delivered. All the
+    // events of an extension have the same response type, and are told apart by a field of their
+    // own.
+    xcb_extension_t *ext;
+
+    // Private data; do not touch.
+    uint8_t ext_event_;
+    XHubEvents events_;
+} XHubSub;
+
+typedef struct {
+    xcb_window_t window;
+    unsigned refcount;
+} XHubWatch;
+
+typedef struct {
+    xcb_connection_t *conn;
+    int screenp;
+    xcb_window_t root;
+    xcb_atom_t atoms[XHUB_NATOMS];
+
+    // Private data; do not touch.
+    pthread_mutex_t mtx_;
+    bool thread_started_;
+    pthread_t thread_;
+    // A window of our own, used to wake the thread up when the hub is destroyed.
+    xcb_window_t own_window_;
+    bool dead_;
+    LS_VECTOR_OF(XHubSub *) subs_;
+    LS_VECTOR_OF(XHubWatch) watches_;
+    void *dlhandle_;
+    void **slot_;
+} XHub;
+
+// Subscribes /sub/ to the hub for display /dpyname/ (/NULL/ means the one specified by the
+// /DISPLAY/ environment variable), creating it if it does not exist yet; /sub->userdata/ and
+// /sub->sayf/ must be set, /sub->wakeup/ must be opened unless no events are wanted, and /sub/ must
+// stay at a constant address until it is unsubscribed. /map_get/ is that of the plugin or barlib;
+// thus, this may only be called from its /init()/ function. If /sub->ext/ is not /NULL/, the
+// extension must be present on the server.
+//
+// On error, logs it and returns /NULL/.
+XHub *
+xhub_subscribe(XHubSub *sub, XHubMapGet *map_get, const char *dpyname);
+
+// Unsubscribes /sub/ from /h/; destroys /h/ if it was the last subscriber.
+void
+xhub_unsubscribe(XHub *h, XHubSub *sub);
+
+// Replaces the contents of /*out/ with the events queued for /sub/, emptying the queue. Returns
+// /false/ if the connection has been lost (then there will never be any events anymore).
+bool
+xhub_take_events(XHub *h, XHubSub *sub, XHubEvents *out);
+
+// Starts (if /state/ is true) or stops (otherwise) reporting /XCB_PROPERTY_NOTIFY/ and
+// /XCB_DESTROY_NOTIFY/ events for window /win/. The watches are reference-counted, so that
+// different subscribers can watch the same window; each call with /state/ set to true must be
+// paired with one with /state/ set to false. The root window is always watched. Does nothing if
+// /win/ is /XCB_NONE/.
+void
+xhub_watch(XHub *h, xcb_window_t win, bool state);
+
+#endif
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <lua.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,14 +17,50 @@
 #include "libls/alloc_utils.h"
 #include "libls/cstring_utils.h"
 #include "libls/evloop_utils.h"
+#include "libls/vector.h"
+#include "libls/time_utils.h"
+
+#include "probes.generated.h"
+
+#if HAVE_UDEV
+# include <libudev.h>
+#endif
+
+// Without udev, cards that can not be opened (or have gone) are retried this often.
+enum { RETRY_MS = 5000 };
+
+typedef struct {
+    // As specified by the user.
+    char *name;
+    // /NULL/ if the card has not been opened (yet, or anymore).
+    snd_mixer_t *mixer;
+    // The number of poll descriptors of /mixer/ in the poll set; -1 if not included.
+    int npollfds;
+} Card;
 
 typedef struct {
-    char *card;
-    char *channel;
+    // Index in /Priv::cards/.
+    size_t card;
+    char *name;
     bool capture;
     bool in_db;
+    // /NULL/ if the card has not been opened, or has no such element.
+    snd_mixer_elem_t *elem;
+    // Whether the element has changed since /cb/ was last called.
+    bool changed;
+} Channel;
+
+typedef struct {
+    LS_VECTOR_OF(Card) cards;
+    LS_VECTOR_OF(Channel) channels;
+    // Whether the legacy mode (a single channel, with the result not wrapped into an array) is
+    // used.
+    bool legacy;
     int timeout_ms;
-    LSSelfPipe self_pipe;
+    LSWakeupFd self_pipe;
+    // Whether a mixer has been closed since the poll set was last built (its descriptors are then
+    // still there).
+    bool pollfds_stale;
 } Priv;
 
 static
@@ -31,47 +68,104 @@ void
 destroy(LuastatusPluginData *pd)
 {
     Priv *p = pd->priv;
-    free(p->card);
-    free(p->channel);
-    ls_self_pipe_close(&p->self_pipe);
+    for (size_t i = 0; i < p->cards.size; ++i) {
+        free(p->cards.data[i].name);
+    }
+    LS_VECTOR_FREE(p->cards);
+    for (size_t i = 0; i < p->channels.size; ++i) {
+        free(p->channels.data[i].name);
+    }
+    LS_VECTOR_FREE(p->channels);
+    ls_wakeup_fd_close(&p->self_pipe);
     free(p);
 }
 
+static
+void
+add_channel(Priv *p, const char *card, const char *name, bool capture, bool in_db)
+{
+    size_t icard = 0;
+    while (icard < p->cards.size && strcmp(p->cards.data[icard].name, card) != 0) {
+        ++icard;
+    }
+    if (icard == p->cards.size) {
+        LS_VECTOR_PUSH(p->cards, ((Card) {
+            .name = ls_xstrdup(card),
+            .mixer = NULL,
+            .npollfds = -1,
+        }));
+    }
+    LS_VECTOR_PUSH(p->channels, ((Channel) {
+        .card = icard,
+        .name = ls_xstrdup(name),
+        .capture = capture,
+        .in_db = in_db,
+        .elem = NULL,
+        .changed = false,
+    }));
+}
+
 static
 int
 init(LuastatusPluginData *pd, lua_State *L)
 {
     Priv *p = pd->priv = LS_XNEW(Priv, 1);
     *p = (Priv) {
-        .card = NULL,
-        .channel = NULL,
-        .capture = false,
-        .in_db = false,
+        .cards = LS_VECTOR_NEW(),
+        .channels = LS_VECTOR_NEW(),
+        .legacy = true,
         .timeout_ms = -1,
-        .self_pipe = LS_SELF_PIPE_NEW(),
+        .self_pipe = LS_WAKEUP_FD_NEW(),
+        .pollfds_stale = false,
     };
+    // The top-level 'card', 'channel', 'capture' and 'in_db' options are the defaults for the
+    // entries of 'channels'.
+    char *card = NULL;
+    char *channel = NULL;
+    bool capture = false;
+    bool in_db = false;
 
     PU_MAYBE_VISIT_STR_FIELD(-1, "card", "'card'", s,
-        p->card = ls_xstrdup(s);
+        card = ls_xstrdup(s);
     );
-    if (!p->card) {
-        p->card = ls_xstrdup("default");
-    }
 
     PU_MAYBE_VISIT_STR_FIELD(-1, "channel", "'channel'", s,
-        p->channel = ls_xstrdup(s);
+        channel = ls_xstrdup(s);
     );
-    if (!p->channel) {
-        p->channel = ls_xstrdup("Master");
-    }
 
     PU_MAYBE_VISIT_BOOL_FIELD(-1, "capture", "'capture'", b,
-        p->capture = b;
+        capture = b;
     );
 
     PU_MAYBE_VISIT_BOOL_FIELD(-1, "in_db", "'in_db'", b,
-        p->in_db = b;
+        in_db = b;
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "channels", "'channels'",
+        p->legacy = false;
+        PU_CHECK_TYPE(LS_LUA_KEY, "'channels' key", LUA_TNUMBER);
+        PU_CHECK_TYPE(LS_LUA_VALUE, "'channels' element", LUA_TTABLE);
+        const char *e_card = card ? card : "default";
+        const char *e_channel = channel ? channel : "Master";
+        bool e_capture = capture;
+        bool e_in_db = in_db;
+        PU_MAYBE_VISIT_STR_FIELD(-1, "card", "'channels' element's 'card'", s,
+            e_card = s;
+        );
+        PU_MAYBE_VISIT_STR_FIELD(-1, "channel", "'channels' element's 'channel'", s,
+            e_channel = s;
+        );
+        PU_MAYBE_VISIT_BOOL_FIELD(-1, "capture", "'channels' element's 'capture'", b,
+            e_capture = b;
+        );
+        PU_MAYBE_VISIT_BOOL_FIELD(-1, "in_db", "'channels' element's 'in_db'", b,
+            e_in_db = b;
+        );
+        add_channel(p, e_card, e_channel, e_capture, e_in_db);
     );
+    if (p->legacy) {
+        add_channel(p, card ? card : "default", channel ? channel : "Master", capture, in_db);
+    }
 
     PU_MAYBE_VISIT_NUM_FIELD(-1, "timeout", "'timeout'", nsec,
         // Note: this also implicitly checks that /nsec/ is not NaN.
@@ -87,16 +181,20 @@ init(LuastatusPluginData *pd, lua_State *L)
 
     PU_MAYBE_VISIT_BOOL_FIELD(-1, "make_self_pipe", "'make_self_pipe'", b,
         if (b) {
-            if (ls_self_pipe_open(&p->self_pipe) < 0) {
-                LS_FATALF(pd, "ls_self_pipe_open: %s", ls_strerror_onstack(errno));
+            if (ls_wakeup_fd_open(&p->self_pipe) < 0) {
+                LS_FATALF(pd, "ls_wakeup_fd_open: %s", ls_strerror_onstack(errno));
                 goto error;
             }
         }
     );
 
+    free(card);
+    free(channel);
     return LUASTATUS_OK;
 
 error:
+    free(card);
+    free(channel);
     destroy(pd);
     return LUASTATUS_ERR;
 }
@@ -107,7 +205,7 @@ register_funcs(LuastatusPluginData *pd, lua_State *L)
 {
     Priv *p = pd->priv;
     // L: table
-    ls_self_pipe_push_luafunc(&p->self_pipe, L); // L: table func
+    ls_wakeup_fd_push_luafunc(&p->self_pipe, L); // L: table func
     lua_setfield(L, -2, "wake_up"); // L: table
 }
 
@@ -209,174 +307,394 @@ push_vol_info(lua_State *L, snd_mixer_elem_t *elem, GetVolFuncs gv_funcs)
     // L: table
 }
 
-typedef struct {
-    struct pollfd *data;
-    size_t size;
-    size_t nprefix;
-} PollFdSet;
-
-static inline
-PollFdSet
-pollfd_set_new(const struct pollfd *prefix, size_t nprefix)
-{
-    return (PollFdSet) {
-        .data = ls_xmemdup(prefix, nprefix * sizeof(struct pollfd)),
-        .size = nprefix,
-        .nprefix = nprefix,
-    };
-}
-
-static inline
-void
-pollfd_set_resize(PollFdSet *s, size_t n)
+static
+int
+elem_cb(snd_mixer_elem_t *elem, unsigned mask)
 {
-    if (s->size != n) {
-        s->data = ls_xrealloc(s->data, n, sizeof(struct pollfd));
-        s->size = n;
+    Channel *c = snd_mixer_elem_get_callback_private(elem);
+    if (mask == SND_CTL_EVENT_MASK_REMOVE) {
+        c->elem = NULL;
     }
+    c->changed = true;
+    return 0;
 }
 
-static inline
+static
 void
-pollfd_set_free(PollFdSet s)
+card_close(Priv *p, size_t icard)
 {
-    free(s.data);
+    Card *card = &p->cards.data[icard];
+    if (!card->mixer) {
+        return;
+    }
+    snd_mixer_close(card->mixer);
+    card->mixer = NULL;
+    card->npollfds = -1;
+    p->pollfds_stale = true;
+    for (size_t i = 0; i < p->channels.size; ++i) {
+        Channel *c = &p->channels.data[i];
+        if (c->card == icard) {
+            c->elem = NULL;
+            c->changed = true;
+        }
+    }
 }
 
+// Tries to open the mixer of the card /icard/ and find its channels. Returns /true/ on success.
 static
 bool
-iteration(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+card_open(LuastatusPluginData *pd, size_t icard)
 {
     Priv *p = pd->priv;
-    bool ret = false;
+    Card *card = &p->cards.data[icard];
 
-    snd_mixer_t *mixer = NULL;
     snd_mixer_selem_id_t *sid = NULL;
-    char *realname = NULL;
-    PollFdSet pollfds = ls_self_pipe_is_opened(&p->self_pipe)
-        ? pollfd_set_new((struct pollfd [1]) {{.fd = p->self_pipe.fds[0], .events = POLLIN}}, 1)
-        : pollfd_set_new(NULL, 0);
-
-    if (!(realname = xalloc_card_realname(p->card))) {
-        realname = ls_xstrdup(p->card);
-    }
-
-    // We do not check for /r_ == -EINTR/ as the only function that can
-    // return /-EINTR/ is /snd_mixer_wait/, because it uses one of the
-    // multiplexing interfaces mentioned below:
-    //
-    // http://man7.org/linux/man-pages/man7/signal.7.html
-    //
-    // > The following interfaces are never restarted after being interrupted
-    // > by a signal handler, regardless of the use of SA_RESTART; they always
-    // > fail with the error EINTR when interrupted by a signal handler:
-    // [...]
-    // >     * File descriptor multiplexing interfaces: epoll_wait(2),
-    // >       epoll_pwait(2), poll(2), ppoll(2), select(2), and pselect(2).
+    char *realname = xalloc_card_realname(card->name);
+    if (!realname) {
+        realname = ls_xstrdup(card->name);
+    }
+
 #define ALSA_CALL(Func_, ...) \
     do { \
         int r_ = Func_(__VA_ARGS__); \
         if (r_ < 0) { \
-            LS_FATALF(pd, "%s: %s", #Func_, snd_strerror(r_)); \
+            LS_WARNF(pd, "%s: %s: %s", card->name, #Func_, snd_strerror(r_)); \
             goto error; \
         } \
     } while (0)
 
-    ALSA_CALL(snd_mixer_open, &mixer, 0);
-    ALSA_CALL(snd_mixer_attach, mixer, realname);
-    ALSA_CALL(snd_mixer_selem_register, mixer, NULL, NULL);
-    ALSA_CALL(snd_mixer_load, mixer);
+    ALSA_CALL(snd_mixer_open, &card->mixer, 0);
+    ALSA_CALL(snd_mixer_attach, card->mixer, realname);
+    ALSA_CALL(snd_mixer_selem_register, card->mixer, NULL, NULL);
+    ALSA_CALL(snd_mixer_load, card->mixer);
     ALSA_CALL(snd_mixer_selem_id_malloc, &sid);
+#undef ALSA_CALL
 
-    snd_mixer_selem_id_set_name(sid, p->channel);
-    snd_mixer_elem_t *elem = snd_mixer_find_selem(mixer, sid);
-    if (!elem) {
-        LS_FATALF(pd, "can't find channel '%s'", p->channel);
-        goto error;
+    for (size_t i = 0; i < p->channels.size; ++i) {
+        Channel *c = &p->channels.data[i];
+        if (c->card != icard) {
+            continue;
+        }
+        snd_mixer_selem_id_set_name(sid, c->name);
+        c->elem = snd_mixer_find_selem(card->mixer, sid);
+        if (c->elem) {
+            // /p->channels/ is not resized after /init()/, so /c/ stays valid.
+            snd_mixer_elem_set_callback_private(c->elem, c);
+            snd_mixer_elem_set_callback(c->elem, elem_cb);
+        } else {
+            LS_WARNF(pd, "%s: can't find channel '%s'", card->name, c->name);
+        }
+        c->changed = true;
     }
 
-    ret = true;
+    snd_mixer_selem_id_free(sid);
+    free(realname);
+    return true;
 
-    GetVolFuncs gv_funcs = select_gv_funcs(p->capture, p->in_db);
-    bool is_timeout = false;
-    while (1) {
-        lua_State *L = funcs.call_begin(pd->userdata);
-        if (is_timeout) {
-            lua_pushnil(L); // L: nil
-        } else {
-            push_vol_info(L, elem, gv_funcs); // L: table
+error:
+    if (card->mixer) {
+        snd_mixer_close(card->mixer);
+        card->mixer = NULL;
+    }
+    free(realname);
+    return false;
+}
+
+// Tries to open all the cards that are not open. Returns /true/ if all of them are open now.
+static
+bool
+open_cards(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    bool all = true;
+    for (size_t i = 0; i < p->cards.size; ++i) {
+        if (!p->cards.data[i].mixer && !card_open(pd, i)) {
+            all = false;
         }
-        funcs.call_end(pd->userdata);
+    }
+    return all;
+}
 
-        pollfd_set_resize(&pollfds, pollfds.nprefix + snd_mixer_poll_descriptors_count(mixer));
-        ALSA_CALL(snd_mixer_poll_descriptors,
-            mixer,
-            pollfds.data + pollfds.nprefix,
-            pollfds.size - pollfds.nprefix);
+typedef LS_VECTOR_OF(struct pollfd) PollFds;
 
-        // TODO: call sigprocmask() before and after poll() to emulate ppoll() (if it worth the
-        // trouble).
-        const int r = poll(pollfds.data, pollfds.size, p->timeout_ms);
-        if (r < 0) {
-            if (errno == EINTR) {
-                if (p->timeout_ms == -1) {
-                    is_timeout = false;
-                    continue;
-                } else {
-                    LS_WARNF(pd, "poll: interrupted by signal, reporting as timeout");
-                    is_timeout = true;
-                    continue;
-                }
-            } else {
-                LS_FATALF(pd, "poll: %s", ls_strerror_onstack(errno));
-                goto error;
-            }
+// Rebuilds the mixers' part of /pfds/ (that after the first /nprefix/ entries) if the set of open
+// mixers, or the number of descriptors of any of them, has changed.
+static
+void
+update_pollfds(LuastatusPluginData *pd, PollFds *pfds, size_t nprefix)
+{
+    Priv *p = pd->priv;
 
-        } else if (r == 0) {
-            is_timeout = true;
+    bool rebuild = p->pollfds_stale;
+    for (size_t i = 0; i < p->cards.size; ++i) {
+        Card *card = &p->cards.data[i];
+        const int n = card->mixer ? snd_mixer_poll_descriptors_count(card->mixer) : -1;
+        if (n != card->npollfds) {
+            rebuild = true;
+        }
+    }
+    if (!rebuild) {
+        return;
+    }
+    p->pollfds_stale = false;
+
+    pfds->size = nprefix;
+    for (size_t i = 0; i < p->cards.size; ++i) {
+        Card *card = &p->cards.data[i];
+        if (!card->mixer) {
+            card->npollfds = -1;
+            continue;
+        }
+        const int n = snd_mixer_poll_descriptors_count(card->mixer);
+        LS_VECTOR_ENSURE(*pfds, pfds->size + n);
+        const int r = snd_mixer_poll_descriptors(card->mixer, pfds->data + pfds->size, n);
+        if (r < 0) {
+            LS_WARNF(pd, "%s: snd_mixer_poll_descriptors: %s", card->name, snd_strerror(r));
+            card_close(p, i);
+            continue;
+        }
+        card->npollfds = n;
+        pfds->size += n;
+    }
+}
 
-        } else {
-            is_timeout = false;
+// Processes the events of the mixers according to the /revents/ fields in /pfds/.
+static
+void
+handle_mixer_events(LuastatusPluginData *pd, PollFds *pfds, size_t nprefix)
+{
+    Priv *p = pd->priv;
 
-            if (pollfds.nprefix && (pollfds.data[0].revents & POLLIN)) {
-                ssize_t unused = read(p->self_pipe.fds[0], (char [1]) {'\0'}, 1);
-                (void) unused;
-            }
+    struct pollfd *cur = pfds->data + nprefix;
+    for (size_t i = 0; i < p->cards.size; ++i) {
+        Card *card = &p->cards.data[i];
+        if (card->npollfds < 0) {
+            continue;
         }
+        struct pollfd *mine = cur;
+        cur += card->npollfds;
 
         unsigned short revents;
-        ALSA_CALL(snd_mixer_poll_descriptors_revents, mixer,
-                  pollfds.data + pollfds.nprefix, pollfds.size - pollfds.nprefix, &revents);
-        if (revents & (POLLERR | POLLNVAL)) {
-            LS_ERRF(pd, "snd_mixer_poll_descriptors_revents() reported an error condition");
-            goto error;
+        int r = snd_mixer_poll_descriptors_revents(card->mixer, mine, card->npollfds, &revents);
+        if (r < 0) {
+            LS_WARNF(pd, "%s: snd_mixer_poll_descriptors_revents: %s", card->name, snd_strerror(r));
+            card_close(p, i);
+            continue;
+        }
+        if (revents & (POLLERR | POLLNVAL | POLLHUP)) {
+            // e.g. the card has been unplugged
+            LS_WARNF(pd, "%s: mixer reported an error condition, closing", card->name);
+            card_close(p, i);
+            continue;
         }
         if (revents & POLLIN) {
-            ALSA_CALL(snd_mixer_handle_events, mixer);
+            if ((r = snd_mixer_handle_events(card->mixer)) < 0) {
+                LS_WARNF(pd, "%s: snd_mixer_handle_events: %s", card->name, snd_strerror(r));
+                card_close(p, i);
+            }
         }
     }
-#undef ALSA_CALL
-error:
-    if (sid) {
-        snd_mixer_selem_id_free(sid);
+}
+
+static
+void
+push_channel(lua_State *L, Channel *c)
+{
+    if (c->elem) {
+        push_vol_info(L, c->elem, select_gv_funcs(c->capture, c->in_db)); // L: table
+    } else {
+        lua_pushboolean(L, false); // L: false
+    }
+}
+
+// Calls /cb/ if any channel has changed (or if /force/ is set). Returns /true/ if it has been
+// called.
+static
+bool
+report(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, bool force)
+{
+    Priv *p = pd->priv;
+
+    bool changed = force;
+    for (size_t i = 0; i < p->channels.size; ++i) {
+        if (p->channels.data[i].changed) {
+            changed = true;
+            p->channels.data[i].changed = false;
+        }
     }
-    if (mixer) {
-        snd_mixer_close(mixer);
+    if (!changed) {
+        return false;
     }
-    free(realname);
-    pollfd_set_free(pollfds);
-    return ret;
+
+    if (p->legacy) {
+        Channel *c = &p->channels.data[0];
+        // As before, nothing is reported while the channel is unavailable.
+        if (!c->elem) {
+            return false;
+        }
+        lua_State *L = funcs.call_begin(pd->userdata);
+        push_channel(L, c); // L: table
+        funcs.call_end(pd->userdata);
+        return true;
+    }
+
+    lua_State *L = funcs.call_begin(pd->userdata);
+    lua_createtable(L, p->channels.size, 0); // L: table
+    for (size_t i = 0; i < p->channels.size; ++i) {
+        push_channel(L, &p->channels.data[i]); // L: table value
+        lua_rawseti(L, -2, i + 1); // L: table
+    }
+    funcs.call_end(pd->userdata);
+    return true;
+}
+
+static
+void
+report_timeout(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    lua_State *L = funcs.call_begin(pd->userdata);
+    lua_pushnil(L); // L: nil
+    funcs.call_end(pd->userdata);
+}
+
+#if HAVE_UDEV
+// Reads all the pending events from /mon/; returns /true/ if a sound card may have been added.
+static
+bool
+drain_udev_events(struct udev_monitor *mon)
+{
+    bool added = false;
+    struct udev_device *dev;
+    while ((dev = udev_monitor_receive_device(mon))) {
+        const char *action = udev_device_get_action(dev);
+        if (action && (strcmp(action, "add") == 0 || strcmp(action, "change") == 0)) {
+            added = true;
+        }
+        udev_device_unref(dev);
+    }
+    return added;
 }
+#endif
 
 static
 void
 run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
 {
+    Priv *p = pd->priv;
+
+    PollFds pfds = LS_VECTOR_NEW();
+    // The first /nprefix/ entries of /pfds/ are the self-pipe and the udev monitor (if any); the
+    // descriptors of the mixers follow.
+    size_t nprefix = 0;
+
+    // If opened, the self-pipe is always the first one.
+    if (ls_wakeup_fd_is_opened(&p->self_pipe)) {
+        LS_VECTOR_PUSH(pfds, ((struct pollfd) {.fd = p->self_pipe.rfd, .events = POLLIN}));
+        ++nprefix;
+    }
+
+    bool hotplug = false;
+#if HAVE_UDEV
+    struct udev *udev = udev_new();
+    struct udev_monitor *mon = NULL;
+    const size_t udev_idx = nprefix;
+    if (udev) {
+        mon = udev_monitor_new_from_netlink(udev, "udev");
+    }
+    if (mon &&
+        udev_monitor_filter_add_match_subsystem_devtype(mon, "sound", NULL) >= 0 &&
+        udev_monitor_enable_receiving(mon) >= 0)
+    {
+        LS_VECTOR_PUSH(pfds, ((struct pollfd) {.fd = udev_monitor_get_fd(mon), .events = POLLIN}));
+        ++nprefix;
+        hotplug = true;
+    } else {
+        LS_WARNF(pd, "can't set up udev monitor, will poll for cards every %d ms", (int) RETRY_MS);
+    }
+#endif
+
+    bool all_open = open_cards(pd);
+    const int64_t none = -1;
+    int64_t retry_at = all_open || hotplug ? none : ls_now_ms() + RETRY_MS;
+    int64_t timeout_at = p->timeout_ms >= 0 ? ls_now_ms() + p->timeout_ms : none;
+
+    bool force = false;
     while (1) {
-        if (!iteration(pd, funcs)) {
-            nanosleep((struct timespec[1]) {{.tv_sec = 5}}, NULL);
+        if (report(pd, funcs, force) && p->timeout_ms >= 0) {
+            timeout_at = ls_now_ms() + p->timeout_ms;
+        }
+        force = false;
+
+        update_pollfds(pd, &pfds, nprefix);
+
+        int64_t deadline = timeout_at;
+        if (retry_at != none && (deadline == none || retry_at < deadline)) {
+            deadline = retry_at;
+        }
+        int poll_timeout = -1;
+        if (deadline != none) {
+            const int64_t left = deadline - ls_now_ms();
+            poll_timeout = left < 0 ? 0 : left > INT_MAX ? INT_MAX : left;
+        }
+
+        const int r = poll(pfds.data, pfds.size, poll_timeout);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LS_FATALF(pd, "poll: %s", ls_strerror_onstack(errno));
+            goto error;
         }
+
+        const int64_t now = ls_now_ms();
+        if (timeout_at != none && now >= timeout_at) {
+            report_timeout(pd, funcs);
+            timeout_at = p->timeout_ms >= 0 ? now + p->timeout_ms : none;
+        }
+
+        if (ls_wakeup_fd_is_opened(&p->self_pipe) && (pfds.data[0].revents & POLLIN)) {
+            ls_wakeup_fd_drain(&p->self_pipe);
+            force = true;
+        }
+
+        bool try_open = retry_at != none && now >= retry_at;
+#if HAVE_UDEV
+        if (hotplug && (pfds.data[udev_idx].revents & POLLIN) && drain_udev_events(mon)) {
+            try_open = true;
+        }
+#endif
+
+        handle_mixer_events(pd, &pfds, nprefix);
+
+        if (!try_open) {
+            // A card may have just gone; start retrying if there is no hotplug notification.
+            if (!hotplug && retry_at == none) {
+                for (size_t i = 0; i < p->cards.size; ++i) {
+                    if (!p->cards.data[i].mixer) {
+                        retry_at = now + RETRY_MS;
+                        break;
+                    }
+                }
+            }
+            continue;
+        }
+        all_open = open_cards(pd);
+        retry_at = all_open || hotplug ? none : now + RETRY_MS;
+    }
+
+error:
+    for (size_t i = 0; i < p->cards.size; ++i) {
+        card_close(p, i);
+    }
+#if HAVE_UDEV
+    if (mon) {
+        udev_monitor_unref(mon);
+    }
+    if (udev) {
+        udev_unref(udev);
     }
+#endif
+    LS_VECTOR_FREE(pfds);
 }
 
 LuastatusPluginIface luastatus_plugin_iface_v1 = {
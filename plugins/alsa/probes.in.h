@@ -0,0 +1,6 @@
+#ifndef probes_h_
+#define probes_h_
+
+#cmakedefine01 HAVE_UDEV
+
+#endif
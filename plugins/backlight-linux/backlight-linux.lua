@@ -1,18 +1,12 @@
 local P = {}
 
-local function read_num(path)
-    local f = assert(io.open(path, 'r'))
-    local r = f:read('*number')
-    f:close()
-    return r
-end
-
 function P.widget(tbl)
     local timeout = tbl.timeout or 2
     return {
         plugin = 'udev',
         opts = {
             subsystem = 'backlight',
+            sysattrs = {'brightness', 'max_brightness'},
         },
         cb = function(t)
             if t.what ~= 'event' then
@@ -25,8 +19,11 @@ function P.widget(tbl)
 
             luastatus.plugin.push_timeout(timeout)
 
-            local b = read_num(s .. '/brightness')
-            local mb = read_num(s .. '/max_brightness')
+            local b = tonumber(t.attrs and t.attrs.brightness)
+            local mb = tonumber(t.attrs and t.attrs.max_brightness)
+            if not b or not mb then
+                return tbl.cb(nil)
+            end
             return tbl.cb(b / mb)
         end,
         event = tbl.event,
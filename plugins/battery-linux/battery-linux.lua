@@ -1,38 +1,36 @@
 local P = {}
 
-local function read_uevent(dev)
-    local f = io.open('/sys/class/power_supply/' .. dev .. '/uevent', 'r')
-    if not f then
-        return nil
-    end
-    local r = {}
-    for line in f:lines() do
-        local key, value = line:match('POWER_SUPPLY_(.-)=(.*)')
-        r[key:lower()] = value
-    end
-    f:close()
-    return r
-end
+-- The udev plugin keeps these files open, and reads them anew on every call.
+local ATTRS = {
+    'status',
+    'energy_now', 'energy_full', 'power_now',
+    'charge_now', 'charge_full', 'current_now', 'voltage_now',
+}
 
-local function get_battery_info(dev)
-    local p = read_uevent(dev)
-    if not p then
+local function get_battery_info(attrs)
+    if not attrs then
         return {}
     end
+    local p = {}
+    for k, v in pairs(attrs) do
+        p[k] = tonumber(v) or v
+    end
 
     -- Convert amperes to watts.
-    if p.charge_full then
+    if p.charge_full and p.voltage_now then
         p.energy_full = p.charge_full * p.voltage_now / 1e6
-        p.energy_now = p.charge_now * p.voltage_now / 1e6
-        p.power_now = p.current_now * p.voltage_now / 1e6
+        p.energy_now = p.charge_now and p.charge_now * p.voltage_now / 1e6
+        p.power_now = p.current_now and p.current_now * p.voltage_now / 1e6
     end
 
     local r = {status = p.status}
-    -- A buggy driver can report energy_now as energy_full_design, which
-    -- will lead to an overshoot in capacity.
-    r.capacity = math.min(math.floor(p.energy_now / p.energy_full * 100 + 0.5), 100)
+    if p.energy_now and p.energy_full then
+        -- A buggy driver can report energy_now as energy_full_design, which
+        -- will lead to an overshoot in capacity.
+        r.capacity = math.min(math.floor(p.energy_now / p.energy_full * 100 + 0.5), 100)
+    end
 
-    if p.power_now ~= 0 then
+    if p.power_now and p.power_now ~= 0 and p.energy_now and p.energy_full then
         r.consumption = p.power_now / 1e6
         if p.status == 'Charging' then
             r.rem_time = (p.energy_full - p.energy_now) / p.power_now
@@ -51,11 +49,15 @@ function P.widget(tbl)
         plugin = 'udev',
         opts = {
             subsystem = 'power_supply',
+            sysattrs = ATTRS,
             timeout = period,
             greet = true
         },
-        cb = function()
-            return tbl.cb(get_battery_info(dev))
+        cb = function(t)
+            -- Events of other power supplies (e.g. AC) matter too, so any call is a reason to
+            -- look at the battery.
+            local d = t.devices[dev]
+            return tbl.cb(get_battery_info(d and d.attrs))
         end,
         event = tbl.event,
     }
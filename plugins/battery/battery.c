@@ -0,0 +1,587 @@
+#include <errno.h>
+#include <lua.h>
+#include <math.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/select.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+#include "libls/string_.h"
+#include "libls/strarr.h"
+#include "libls/time_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/evloop_utils.h"
+#include "libls/sig_utils.h"
+#include "libls/batch_reader.h"
+#include "libls/scan_utils.h"
+
+#include "libudevhub/udevhub.h"
+
+static const char *SYSFS_DIR = "/sys/class/power_supply";
+
+typedef enum {
+    ATTR_TYPE,
+    ATTR_ONLINE,
+    ATTR_STATUS,
+    ATTR_CAPACITY,
+    ATTR_ENERGY_NOW,
+    ATTR_ENERGY_FULL,
+    ATTR_POWER_NOW,
+    ATTR_CHARGE_NOW,
+    ATTR_CHARGE_FULL,
+    ATTR_CURRENT_NOW,
+    ATTR_VOLTAGE_NOW,
+
+    ATTR__LAST,
+} Attr;
+
+static const char *ATTR_NAMES[] = {
+    [ATTR_TYPE]        = "type",
+    [ATTR_ONLINE]      = "online",
+    [ATTR_STATUS]      = "status",
+    [ATTR_CAPACITY]    = "capacity",
+    [ATTR_ENERGY_NOW]  = "energy_now",
+    [ATTR_ENERGY_FULL] = "energy_full",
+    [ATTR_POWER_NOW]   = "power_now",
+    [ATTR_CHARGE_NOW]  = "charge_now",
+    [ATTR_CHARGE_FULL] = "charge_full",
+    [ATTR_CURRENT_NOW] = "current_now",
+    [ATTR_VOLTAGE_NOW] = "voltage_now",
+};
+
+typedef struct {
+    char *name;
+    bool is_battery;
+    // Index of each attribute's file in /Priv::reader/, or /-1/ if it does not exist.
+    int idx[ATTR__LAST];
+
+    // The last values read; /NAN/ if unknown.
+    LSString status;
+    double capacity;
+    // In watt-hours.
+    double energy_now;
+    double energy_full;
+    // In watts.
+    double power;
+
+    // The exponential moving average of /power/; /NAN/ if there is nothing to average yet. Reset
+    // whenever the status changes, as the power then flows the other way.
+    double power_avg;
+
+    // For mains and USB supplies.
+    bool online;
+} Supply;
+
+typedef LS_VECTOR_OF(Supply) SupplyVector;
+
+typedef struct {
+    // If not empty, only these supplies are monitored.
+    LSStringArray names;
+    struct timespec period;
+    struct timespec idle_period;
+    // The time constant of the moving average, in seconds.
+    double smoothing;
+
+    SupplyVector supplies;
+    LSBatchReader reader;
+    // Indices of the files in /reader/ that are read on each sample (that is, all but the
+    // /ATTR_TYPE/ ones).
+    LS_VECTOR_OF(size_t) sample_idx;
+    // Time of the previous sample (/CLOCK_MONOTONIC/), or /ls_timespec_invalid/.
+    struct timespec prev_time;
+
+    UdevHubSub sub;
+    UdevHub *hub;
+    // Events taken from the hub.
+    UdevHubEvents events;
+} Priv;
+
+static
+void
+supply_free(Supply *s)
+{
+    free(s->name);
+    LS_VECTOR_FREE(s->status);
+}
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    ls_strarr_destroy(p->names);
+    for (size_t i = 0; i < p->supplies.size; ++i) {
+        supply_free(&p->supplies.data[i]);
+    }
+    LS_VECTOR_FREE(p->supplies);
+    ls_batch_reader_destroy(&p->reader);
+    LS_VECTOR_FREE(p->sample_idx);
+    if (p->hub) {
+        udevhub_unsubscribe(p->hub, &p->sub);
+    }
+    ls_wakeup_fd_close(&p->sub.wakeup);
+    udevhub_events_clear(&p->events);
+    LS_VECTOR_FREE(p->events);
+    free(p);
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .names = ls_strarr_new(),
+        .period = {.tv_sec = 2},
+        .idle_period = {.tv_sec = 30},
+        .smoothing = 60,
+        .supplies = LS_VECTOR_NEW(),
+        .sample_idx = LS_VECTOR_NEW(),
+        .prev_time = ls_timespec_invalid,
+        .sub = {
+            .userdata = pd->userdata,
+            .sayf = pd->sayf,
+            .wakeup = LS_WAKEUP_FD_NEW(),
+            .subsystem = "power_supply",
+        },
+        .hub = NULL,
+        .events = LS_VECTOR_NEW(),
+    };
+    ls_batch_reader_init(&p->reader);
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "devices", "'devices'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'devices' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'devices' element", s,
+            if (!*s || strchr(s, '/')) {
+                LS_FATALF(pd, "'devices' element is not a valid device name");
+                goto error;
+            }
+            ls_strarr_append_s(&p->names, s);
+        );
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "period", "'period'", n,
+        if (ls_timespec_is_invalid(p->period = ls_timespec_from_seconds(n))) {
+            LS_FATALF(pd, "invalid 'period' value");
+            goto error;
+        }
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "idle_period", "'idle_period'", n,
+        if (ls_timespec_is_invalid(p->idle_period = ls_timespec_from_seconds(n))) {
+            LS_FATALF(pd, "invalid 'idle_period' value");
+            goto error;
+        }
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "smoothing", "'smoothing'", n,
+        if (!(n >= 0 && n <= 86400)) {
+            LS_FATALF(pd, "'smoothing' must be in range [0; 86400]");
+            goto error;
+        }
+        p->smoothing = n;
+    );
+
+    if (ls_wakeup_fd_open(&p->sub.wakeup) < 0) {
+        LS_FATALF(pd, "ls_wakeup_fd_open: %s", ls_strerror_onstack(errno));
+        goto error;
+    }
+    if (!(p->hub = udevhub_subscribe(&p->sub, pd->map_get, false))) {
+        goto error;
+    }
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+static
+bool
+is_wanted(Priv *p, const char *name)
+{
+    const size_t n = ls_strarr_size(p->names);
+    if (!n) {
+        return true;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (strcmp(ls_strarr_at(p->names, i, NULL), name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static
+const char *
+read_attr(Priv *p, const Supply *s, Attr a)
+{
+    return s->idx[a] < 0 ? NULL : ls_batch_reader_data(&p->reader, s->idx[a], NULL);
+}
+
+// Rebuilds the list of supplies (keeping the state of the ones that are still there), and
+// reopens their attribute files.
+static
+void
+rescan(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+
+    DIR *dir = opendir(SYSFS_DIR);
+    if (!dir) {
+        LS_WARNF(pd, "opendir: %s: %s", SYSFS_DIR, ls_strerror_onstack(errno));
+    }
+
+    SupplyVector old = p->supplies;
+    LS_VECTOR_INIT(p->supplies);
+    ls_batch_reader_clear(&p->reader);
+    LS_VECTOR_CLEAR(p->sample_idx);
+
+    LSString path = LS_VECTOR_NEW();
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' || !is_wanted(p, name)) {
+            continue;
+        }
+        Supply s = {
+            .name = NULL,
+            .status = LS_VECTOR_NEW(),
+            .capacity = NAN,
+            .energy_now = NAN,
+            .energy_full = NAN,
+            .power = NAN,
+            .power_avg = NAN,
+            .online = false,
+        };
+        for (size_t i = 0; i < old.size; ++i) {
+            if (old.data[i].name && strcmp(old.data[i].name, name) == 0) {
+                s = old.data[i];
+                old.data[i].name = NULL;
+                old.data[i].status = (LSString) LS_VECTOR_NEW();
+                break;
+            }
+        }
+        if (!s.name) {
+            s.name = ls_xstrdup(name);
+        }
+        for (int a = 0; a < ATTR__LAST; ++a) {
+            ls_string_assign_s(&path, SYSFS_DIR);
+            ls_string_append_c(&path, '/');
+            ls_string_append_s(&path, name);
+            ls_string_append_c(&path, '/');
+            ls_string_append_s(&path, ATTR_NAMES[a]);
+            ls_string_append_c(&path, '\0');
+            s.idx[a] = ls_batch_reader_add(&p->reader, path.data);
+            if (s.idx[a] >= 0 && a != ATTR_TYPE) {
+                LS_VECTOR_PUSH(p->sample_idx, s.idx[a]);
+            }
+        }
+        LS_VECTOR_PUSH(p->supplies, s);
+    }
+    LS_VECTOR_FREE(path);
+    if (dir) {
+        closedir(dir);
+    }
+
+    for (size_t i = 0; i < old.size; ++i) {
+        supply_free(&old.data[i]);
+    }
+    LS_VECTOR_FREE(old);
+
+    // The type never changes, so it is only read here.
+    ls_batch_reader_read(&p->reader);
+    for (size_t i = 0; i < p->supplies.size; ++i) {
+        Supply *s = &p->supplies.data[i];
+        const char *type = read_attr(p, s, ATTR_TYPE);
+        s->is_battery = type && strncmp(type, "Battery", 7) == 0;
+    }
+}
+
+// Returns the value of a numeric attribute, scaled by /scale/, or /NAN/. The sign is dropped, as
+// some drivers report the current (and the power) as negative while discharging.
+static
+double
+read_num(Priv *p, const Supply *s, Attr a, double scale)
+{
+    const char *data = read_attr(p, s, a);
+    if (!data) {
+        return NAN;
+    }
+    if (*data == '-') {
+        ++data;
+    }
+    return ls_scan_udouble(&data) * scale;
+}
+
+static
+double
+exp_smooth(double avg, double value, double dt, double tau)
+{
+    if (isnan(avg) || tau == 0) {
+        return value;
+    }
+    if (isnan(value)) {
+        return avg;
+    }
+    return avg + (1 - exp(-dt / tau)) * (value - avg);
+}
+
+static
+void
+sample_supply(Priv *p, Supply *s, double dt)
+{
+    if (!s->is_battery) {
+        const char *online = read_attr(p, s, ATTR_ONLINE);
+        s->online = online && online[0] == '1';
+        return;
+    }
+
+    const char *status = read_attr(p, s, ATTR_STATUS);
+    size_t nstatus = status ? strcspn(status, "\n") : 0;
+    if (nstatus != s->status.size || (nstatus && memcmp(status, s->status.data, nstatus) != 0)) {
+        ls_string_assign_b(&s->status, status, nstatus);
+        s->power_avg = NAN;
+    }
+
+    // Everything is reported in micro-units.
+    const double voltage = read_num(p, s, ATTR_VOLTAGE_NOW, 1e-6);
+    s->energy_now = read_num(p, s, ATTR_ENERGY_NOW, 1e-6);
+    if (isnan(s->energy_now)) {
+        s->energy_now = read_num(p, s, ATTR_CHARGE_NOW, 1e-6) * voltage;
+    }
+    s->energy_full = read_num(p, s, ATTR_ENERGY_FULL, 1e-6);
+    if (isnan(s->energy_full)) {
+        s->energy_full = read_num(p, s, ATTR_CHARGE_FULL, 1e-6) * voltage;
+    }
+    s->power = read_num(p, s, ATTR_POWER_NOW, 1e-6);
+    if (isnan(s->power)) {
+        s->power = read_num(p, s, ATTR_CURRENT_NOW, 1e-6) * voltage;
+    }
+
+    s->capacity = read_num(p, s, ATTR_CAPACITY, 1);
+    if (isnan(s->capacity) && s->energy_full > 0) {
+        // A buggy driver can report energy_now as energy_full_design, which will lead to an
+        // overshoot in capacity.
+        s->capacity = fmin(round(s->energy_now / s->energy_full * 100), 100);
+    }
+
+    s->power_avg = exp_smooth(s->power_avg, s->power, dt, p->smoothing);
+}
+
+static
+bool
+status_is(const Supply *s, const char *status)
+{
+    return s->status.size == strlen(status) && memcmp(s->status.data, status, s->status.size) == 0;
+}
+
+// Returns the time (in hours) remaining to full charge or discharge for the energy /energy/ and
+// the power /power/, or /NAN/.
+static
+double
+rem_time(double energy, double power)
+{
+    return power > 0 && energy >= 0 ? energy / power : NAN;
+}
+
+static
+void
+push_num(lua_State *L, const char *key, double value)
+{
+    // L: table
+    if (!isnan(value)) {
+        lua_pushnumber(L, value); // L: table number
+        lua_setfield(L, -2, key); // L: table
+    }
+}
+
+static
+void
+push_battery(lua_State *L, const Supply *s)
+{
+    lua_createtable(L, 0, 7); // L: table
+    if (s->status.size) {
+        lua_pushlstring(L, s->status.data, s->status.size); // L: table string
+        lua_setfield(L, -2, "status"); // L: table
+    }
+    push_num(L, "capacity", s->capacity);
+    push_num(L, "energy_now", s->energy_now);
+    push_num(L, "energy_full", s->energy_full);
+    push_num(L, "power", s->power);
+    push_num(L, "power_avg", s->power_avg);
+    if (status_is(s, "Charging")) {
+        push_num(L, "rem_time", rem_time(s->energy_full - s->energy_now, s->power_avg));
+    } else if (status_is(s, "Discharging")) {
+        push_num(L, "rem_time", rem_time(s->energy_now, s->power_avg));
+    }
+}
+
+// Makes a call; returns whether any battery is charging or discharging.
+static
+bool
+report(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    // Totals over all the batteries.
+    double energy_now = 0;
+    double energy_full = 0;
+    double charge_power = 0;
+    double discharge_power = 0;
+    bool charging = false;
+    bool discharging = false;
+    bool has_ac = false;
+    bool ac_online = false;
+    size_t nbatteries = 0;
+    const Supply *first = NULL;
+
+    lua_State *L = funcs.call_begin(pd->userdata);
+    lua_createtable(L, 0, 7); // L: table
+
+    lua_newtable(L); // L: table batteries
+    for (size_t i = 0; i < p->supplies.size; ++i) {
+        const Supply *s = &p->supplies.data[i];
+        if (!s->is_battery) {
+            has_ac = true;
+            ac_online = ac_online || s->online;
+            continue;
+        }
+        if (!nbatteries++) {
+            first = s;
+        }
+        push_battery(L, s); // L: table batteries battery
+        lua_setfield(L, -2, s->name); // L: table batteries
+
+        if (!isnan(s->energy_now) && !isnan(s->energy_full)) {
+            energy_now += s->energy_now;
+            energy_full += s->energy_full;
+        }
+        const double power = isnan(s->power_avg) ? 0 : s->power_avg;
+        if (status_is(s, "Charging")) {
+            charging = true;
+            charge_power += power;
+        } else if (status_is(s, "Discharging")) {
+            discharging = true;
+            discharge_power += power;
+        }
+    }
+    lua_setfield(L, -2, "batteries"); // L: table
+
+    if (has_ac) {
+        lua_pushboolean(L, ac_online); // L: table bool
+        lua_setfield(L, -2, "ac_online"); // L: table
+    }
+    if (first) {
+        const char *status = discharging ? "Discharging" :
+                             charging    ? "Charging" :
+                                           NULL;
+        if (status) {
+            lua_pushstring(L, status); // L: table string
+        } else {
+            lua_pushlstring(L, first->status.data, first->status.size); // L: table string
+        }
+        lua_setfield(L, -2, "status"); // L: table
+
+        if (nbatteries == 1 || !(energy_full > 0)) {
+            push_num(L, "capacity", first->capacity);
+        } else {
+            push_num(L, "capacity", fmin(round(energy_now / energy_full * 100), 100));
+        }
+        if (discharging) {
+            push_num(L, "power_avg", discharge_power);
+            push_num(L, "rem_time", rem_time(energy_now, discharge_power));
+        } else if (charging) {
+            push_num(L, "power_avg", charge_power);
+            push_num(L, "rem_time", rem_time(energy_full - energy_now, charge_power));
+        }
+    }
+
+    funcs.call_end(pd->userdata);
+    return charging || discharging;
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+    const int fd = p->sub.wakeup.rfd;
+
+    fd_set fds;
+    FD_ZERO(&fds);
+
+    sigset_t allsigs;
+    ls_xsigfillset(&allsigs);
+
+    rescan(pd);
+
+    while (1) {
+        // sample
+        ls_batch_reader_read_some(&p->reader, p->sample_idx.data, p->sample_idx.size);
+        struct timespec now;
+        if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+            LS_FATALF(pd, "clock_gettime: %s", ls_strerror_onstack(errno));
+            return;
+        }
+        const double dt = ls_timespec_is_invalid(p->prev_time)
+                          ? 0
+                          : ls_timespec_diff(now, p->prev_time);
+        p->prev_time = now;
+        for (size_t i = 0; i < p->supplies.size; ++i) {
+            sample_supply(p, &p->supplies.data[i], dt);
+        }
+
+        // make a call
+        const bool active = report(pd, funcs);
+
+        // wait; poll often only while the batteries are in use, otherwise rely on udev
+        // notifying us of the changes
+        const struct timespec timeout = active ? p->period : p->idle_period;
+        FD_SET(fd, &fds);
+        const int r = pselect(fd + 1, &fds, NULL, NULL, &timeout, &allsigs);
+        if (r < 0) {
+            LS_FATALF(pd, "pselect: %s", ls_strerror_onstack(errno));
+            return;
+        } else if (r > 0) {
+            ls_wakeup_fd_drain(&p->sub.wakeup);
+            const bool alive = udevhub_take_events(p->hub, &p->sub, &p->events);
+            bool need_rescan = false;
+            for (size_t i = 0; i < p->events.size; ++i) {
+                const UdevHubEvent *ev = &p->events.data[i];
+                if (ev->kind == UDEVHUB_EV_RESYNC) {
+                    need_rescan = true;
+                    continue;
+                }
+                const char *action = udevhub_device_field(&ev->dev, UDEVHUB_FIELD_ACTION);
+                if (!action || strcmp(action, "change") != 0) {
+                    // "add", "remove", or a device enumerated after a resync
+                    need_rescan = true;
+                }
+            }
+            if (need_rescan) {
+                rescan(pd);
+            }
+            if (!alive) {
+                LS_FATALF(pd, "udev monitor has failed");
+                return;
+            }
+        }
+    }
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
@@ -0,0 +1,474 @@
+#include <errno.h>
+#include <lua.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+#include "libls/string_.h"
+#include "libls/lua_utils.h"
+#include "libls/time_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/batch_reader.h"
+#include "libls/scan_utils.h"
+#include "libls/algo.h"
+
+typedef enum {
+    FILE_MEMORY_CURRENT,
+    FILE_MEMORY_MAX,
+    FILE_CPU_STAT,
+    FILE_IO_STAT,
+    // The files below are /poll()/ed for /POLLPRI/.
+    FILE_MEMORY_EVENTS,
+    FILE_CGROUP_EVENTS,
+
+    FILE__LAST,
+} File;
+
+static const char *FILE_NAMES[] = {
+    [FILE_MEMORY_CURRENT] = "memory.current",
+    [FILE_MEMORY_MAX]     = "memory.max",
+    [FILE_CPU_STAT]       = "cpu.stat",
+    [FILE_IO_STAT]        = "io.stat",
+    [FILE_MEMORY_EVENTS]  = "memory.events",
+    [FILE_CGROUP_EVENTS]  = "cgroup.events",
+};
+
+static inline
+bool
+is_event_file(File f)
+{
+    return f == FILE_MEMORY_EVENTS || f == FILE_CGROUP_EVENTS;
+}
+
+// Cumulative I/O counters of a device ("<major>:<minor>").
+typedef struct {
+    char dev[24];
+    uint64_t rbytes;
+    uint64_t wbytes;
+} IoCounters;
+
+typedef LS_VECTOR_OF(IoCounters) IoCountersVector;
+
+typedef struct {
+    // As specified by the user.
+    char *name;
+    // Index of each file in the reader, or /-1/ if it does not exist.
+    int idx[FILE__LAST];
+
+    // /cpu.stat/'s /usage_usec/ as of the previous sample, or /UINT64_MAX/.
+    uint64_t prev_usage_usec;
+    IoCountersVector io_prev;
+    IoCountersVector io_cur;
+
+    // Whether an event file of this cgroup has signalled since the previous call.
+    bool changed;
+} Cgroup;
+
+typedef struct {
+    LS_VECTOR_OF(Cgroup) cgroups;
+    int period_ms;
+
+    LSBatchReader reader;
+
+    // Time of the previous sample (/CLOCK_MONOTONIC/), or /ls_timespec_invalid/.
+    struct timespec prev_time;
+} Priv;
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    for (size_t i = 0; i < p->cgroups.size; ++i) {
+        Cgroup *c = &p->cgroups.data[i];
+        free(c->name);
+        LS_VECTOR_FREE(c->io_prev);
+        LS_VECTOR_FREE(c->io_cur);
+    }
+    LS_VECTOR_FREE(p->cgroups);
+    ls_batch_reader_destroy(&p->reader);
+    free(p);
+}
+
+static
+bool
+open_cgroup(LuastatusPluginData *pd, Cgroup *c)
+{
+    Priv *p = pd->priv;
+
+    LSString path = LS_VECTOR_NEW();
+    bool any = false;
+    for (int i = 0; i < FILE__LAST; ++i) {
+        LS_VECTOR_CLEAR(path);
+        if (c->name[0] != '/') {
+            ls_string_append_s(&path, "/sys/fs/cgroup/");
+        }
+        ls_string_append_f(&path, "%s/%s", c->name, FILE_NAMES[i]);
+        ls_string_append_c(&path, '\0');
+
+        c->idx[i] = ls_batch_reader_add(&p->reader, path.data);
+        if (c->idx[i] < 0) {
+            // The controller may be not enabled for this cgroup; /cgroup.events/ does not exist
+            // for the root cgroup.
+            if (errno != ENOENT) {
+                LS_WARNF(pd, "%s: %s", path.data, ls_strerror_onstack(errno));
+            }
+        } else {
+            any = true;
+        }
+    }
+    LS_VECTOR_FREE(path);
+
+    if (!any) {
+        LS_FATALF(pd, "%s: not a cgroup v2 directory, or no files can be opened", c->name);
+        return false;
+    }
+    return true;
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .cgroups = LS_VECTOR_NEW(),
+        .period_ms = 2 * 1000,
+        .prev_time = ls_timespec_invalid,
+    };
+    ls_batch_reader_init(&p->reader);
+
+    PU_VISIT_TABLE_FIELD(-1, "cgroups", "'cgroups'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'cgroups' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'cgroups' element", s,
+            LS_VECTOR_PUSH(p->cgroups, ((Cgroup) {
+                .name = ls_xstrdup(s),
+                .prev_usage_usec = UINT64_MAX,
+                .io_prev = LS_VECTOR_NEW(),
+                .io_cur = LS_VECTOR_NEW(),
+                .changed = false,
+            }));
+        );
+    );
+    if (!p->cgroups.size) {
+        LS_WARNF(pd, "'cgroups' is empty");
+    }
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "period", "'period'", n,
+        if (!ls_period_ms_from_seconds(n, &p->period_ms)) {
+            LS_FATALF(pd, "invalid 'period' value");
+            goto error;
+        }
+    );
+
+    for (size_t i = 0; i < p->cgroups.size; ++i) {
+        if (!open_cgroup(pd, &p->cgroups.data[i])) {
+            goto error;
+        }
+    }
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+// Pushes a table of "key value" lines of /data/; if /usage_usec/ is not /NULL/, the value of the
+// "usage_usec" key is also written into it.
+static
+void
+push_flat_keyed(lua_State *L, const char *data, uint64_t *usage_usec)
+{
+    lua_newtable(L); // L: table
+    for (const char *s = data; *s; ls_scan_next_line(&s)) {
+        const char *key;
+        const size_t nkey = ls_scan_word(&s, &key, '\0');
+        if (!nkey) {
+            continue;
+        }
+        const uint64_t v = ls_scan_u64(&s);
+        if (usage_usec && ls_scan_word_eq(key, nkey, "usage_usec")) {
+            *usage_usec = v;
+        }
+        lua_pushlstring(L, key, nkey); // L: table key
+        lua_pushnumber(L, v); // L: table key value
+        lua_rawset(L, -3); // L: table
+    }
+}
+
+static
+const IoCounters *
+io_find(const IoCountersVector *v, const char *dev, size_t hint)
+{
+    if (hint < v->size && strcmp(v->data[hint].dev, dev) == 0) {
+        return &v->data[hint];
+    }
+    for (size_t i = 0; i < v->size; ++i) {
+        if (strcmp(v->data[i].dev, dev) == 0) {
+            return &v->data[i];
+        }
+    }
+    return NULL;
+}
+
+// Pushes the parsed contents of /io.stat/, e.g.
+//
+//      8:0 rbytes=90430464 wbytes=299008000 rios=8950 wios=12252 dbytes=0 dios=0
+//
+// as /{["8:0"] = {rbytes = 90430464, ...}}/, adding /read_rate/ and /write_rate/ (bytes per second)
+// if there is a previous sample.
+static
+void
+push_io_stat(Cgroup *c, lua_State *L, const char *data, double dt)
+{
+    lua_newtable(L); // L: table
+    size_t n = 0;
+    for (const char *s = data; *s; ls_scan_next_line(&s)) {
+        const char *dev;
+        const size_t ndev = ls_scan_word(&s, &dev, '\0');
+        if (!ndev || ndev >= sizeof(((IoCounters *) NULL)->dev)) {
+            continue;
+        }
+        IoCounters cur = {.rbytes = 0, .wbytes = 0};
+        memcpy(cur.dev, dev, ndev);
+        cur.dev[ndev] = '\0';
+
+        lua_createtable(L, 0, 8); // L: table table
+        while (1) {
+            const char *key;
+            const size_t nkey = ls_scan_word(&s, &key, '=');
+            if (!nkey || *s != '=') {
+                break;
+            }
+            ++s;
+            const uint64_t v = ls_scan_u64(&s);
+            if (ls_scan_word_eq(key, nkey, "rbytes")) {
+                cur.rbytes = v;
+            } else if (ls_scan_word_eq(key, nkey, "wbytes")) {
+                cur.wbytes = v;
+            }
+            lua_pushlstring(L, key, nkey); // L: table table key
+            lua_pushnumber(L, v); // L: table table key value
+            lua_rawset(L, -3); // L: table table
+        }
+
+        const IoCounters *prev = io_find(&c->io_prev, cur.dev, n++);
+        if (prev && dt > 0) {
+            lua_pushnumber(L, ls_sat_sub_u64(cur.rbytes, prev->rbytes) / dt); // L: table table n
+            lua_setfield(L, -2, "read_rate"); // L: table table
+            lua_pushnumber(L, ls_sat_sub_u64(cur.wbytes, prev->wbytes) / dt); // L: table table n
+            lua_setfield(L, -2, "write_rate"); // L: table table
+        }
+        lua_setfield(L, -2, cur.dev); // L: table
+
+        LS_VECTOR_PUSH(c->io_cur, cur);
+    }
+
+    IoCountersVector tmp = c->io_prev;
+    c->io_prev = c->io_cur;
+    c->io_cur = tmp;
+    LS_VECTOR_CLEAR(c->io_cur);
+}
+
+static
+void
+push_cgroup(LuastatusPluginData *pd, Cgroup *c, lua_State *L, double dt)
+{
+    Priv *p = pd->priv;
+
+    const char *data[FILE__LAST];
+    bool removed = false;
+    for (int i = 0; i < FILE__LAST; ++i) {
+        data[i] = NULL;
+        if (c->idx[i] >= 0) {
+            data[i] = ls_batch_reader_data(&p->reader, c->idx[i], NULL);
+            if (!data[i]) {
+                if (errno == ENODEV) {
+                    removed = true;
+                } else {
+                    LS_WARNF(pd, "%s/%s: %s", c->name, FILE_NAMES[i], ls_strerror_onstack(errno));
+                }
+            }
+        }
+    }
+
+    lua_createtable(L, 0, 6); // L: table
+
+    if (removed) {
+        lua_pushboolean(L, true); // L: table true
+        lua_setfield(L, -2, "removed"); // L: table
+    }
+
+    if (data[FILE_MEMORY_CURRENT] || data[FILE_MEMORY_MAX] || data[FILE_MEMORY_EVENTS]) {
+        lua_createtable(L, 0, 3); // L: table memory
+        if (data[FILE_MEMORY_CURRENT]) {
+            const char *s = data[FILE_MEMORY_CURRENT];
+            lua_pushnumber(L, ls_scan_u64(&s)); // L: table memory n
+            lua_setfield(L, -2, "current"); // L: table memory
+        }
+        // "max" means no limit, in which case the entry is not set.
+        if (data[FILE_MEMORY_MAX] && strncmp(data[FILE_MEMORY_MAX], "max", 3) != 0) {
+            const char *s = data[FILE_MEMORY_MAX];
+            lua_pushnumber(L, ls_scan_u64(&s)); // L: table memory n
+            lua_setfield(L, -2, "max"); // L: table memory
+        }
+        if (data[FILE_MEMORY_EVENTS]) {
+            push_flat_keyed(L, data[FILE_MEMORY_EVENTS], NULL); // L: table memory events
+            lua_setfield(L, -2, "events"); // L: table memory
+        }
+        lua_setfield(L, -2, "memory"); // L: table
+    }
+
+    if (data[FILE_CPU_STAT]) {
+        uint64_t usage_usec = UINT64_MAX;
+        push_flat_keyed(L, data[FILE_CPU_STAT], &usage_usec); // L: table cpu
+        if (usage_usec != UINT64_MAX) {
+            if (c->prev_usage_usec != UINT64_MAX && dt > 0) {
+                // In CPUs, i.e. may be greater than 1 on a multi-core system.
+                const double usage = ls_sat_sub_u64(usage_usec, c->prev_usage_usec) / (dt * 1e6);
+                lua_pushnumber(L, usage); // L: table cpu n
+                lua_setfield(L, -2, "usage"); // L: table cpu
+            }
+            c->prev_usage_usec = usage_usec;
+        }
+        lua_setfield(L, -2, "cpu"); // L: table
+    }
+
+    if (data[FILE_IO_STAT]) {
+        push_io_stat(c, L, data[FILE_IO_STAT], dt); // L: table io
+        lua_setfield(L, -2, "io"); // L: table
+    }
+
+    if (data[FILE_CGROUP_EVENTS]) {
+        // "populated 1\nfrozen 0\n"
+        for (const char *s = data[FILE_CGROUP_EVENTS]; *s; ls_scan_next_line(&s)) {
+            const char *key;
+            const size_t nkey = ls_scan_word(&s, &key, '\0');
+            if (!nkey) {
+                continue;
+            }
+            lua_pushlstring(L, key, nkey); // L: table key
+            lua_pushboolean(L, ls_scan_u64(&s) != 0); // L: table key value
+            lua_rawset(L, -3); // L: table
+        }
+    }
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    // For each pollfd, the cgroup index and the reader index of the event file.
+    typedef struct {
+        size_t cgroup;
+        int idx;
+    } PollTarget;
+    LS_VECTOR_OF(struct pollfd) pfds = LS_VECTOR_NEW();
+    LS_VECTOR_OF(PollTarget) targets = LS_VECTOR_NEW();
+    for (size_t i = 0; i < p->cgroups.size; ++i) {
+        const Cgroup *c = &p->cgroups.data[i];
+        for (int j = 0; j < FILE__LAST; ++j) {
+            if (is_event_file(j) && c->idx[j] >= 0) {
+                const int fd = ls_batch_reader_fd(&p->reader, c->idx[j]);
+                LS_VECTOR_PUSH(pfds, ((struct pollfd) {.fd = fd, .events = POLLPRI}));
+                LS_VECTOR_PUSH(targets, ((PollTarget) {.cgroup = i, .idx = c->idx[j]}));
+            }
+        }
+    }
+
+    const char *what = "hello";
+
+    while (1) {
+        // Reading the event files also re-arms the notifications.
+        ls_batch_reader_read(&p->reader);
+        struct timespec now;
+        if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+            LS_FATALF(pd, "clock_gettime: %s", ls_strerror_onstack(errno));
+            goto error;
+        }
+        const double dt = ls_timespec_is_invalid(p->prev_time)
+                          ? -1
+                          : ls_timespec_diff(now, p->prev_time);
+        p->prev_time = now;
+
+        // Once a cgroup is removed, reading its files fails with /ENODEV/, and /poll()/ reports
+        // them as always ready; stop polling them. Other errors may be transient.
+        for (size_t i = 0; i < pfds.size; ++i) {
+            if (!ls_batch_reader_data(&p->reader, targets.data[i].idx, NULL) && errno == ENODEV) {
+                pfds.data[i].fd = -1;
+            }
+        }
+
+        lua_State *L = funcs.call_begin(pd->userdata);
+        lua_createtable(L, 0, 3); // L: table
+        lua_pushstring(L, what); // L: table what
+        lua_setfield(L, -2, "what"); // L: table
+        lua_newtable(L); // L: table changed
+        int nchanged = 0;
+        for (size_t i = 0; i < p->cgroups.size; ++i) {
+            Cgroup *c = &p->cgroups.data[i];
+            if (c->changed) {
+                lua_pushstring(L, c->name); // L: table changed name
+                lua_rawseti(L, -2, ++nchanged); // L: table changed
+                c->changed = false;
+            }
+        }
+        lua_setfield(L, -2, "changed"); // L: table
+        lua_createtable(L, 0, p->cgroups.size); // L: table cgroups
+        for (size_t i = 0; i < p->cgroups.size; ++i) {
+            Cgroup *c = &p->cgroups.data[i];
+            push_cgroup(pd, c, L, dt); // L: table cgroups value
+            lua_setfield(L, -2, c->name); // L: table cgroups
+        }
+        lua_setfield(L, -2, "cgroups"); // L: table
+        funcs.call_end(pd->userdata);
+
+        // On /EINTR/, only wait for the rest of the period: re-reading the files would call /cb/
+        // with a stale /what/.
+        const int64_t deadline = p->period_ms >= 0 ? ls_now_ms() + p->period_ms : -1;
+        int timeout = p->period_ms;
+        int r;
+        while ((r = poll(pfds.data, pfds.size, timeout)) < 0 && errno == EINTR) {
+            if (deadline >= 0) {
+                const int64_t left = deadline - ls_now_ms();
+                timeout = left > 0 ? left : 0;
+            }
+        }
+        if (r < 0) {
+            LS_FATALF(pd, "poll: %s", ls_strerror_onstack(errno));
+            goto error;
+        } else if (r == 0) {
+            what = "timeout";
+        } else {
+            what = "event";
+            for (size_t i = 0; i < pfds.size; ++i) {
+                // kernfs reports a change as /POLLPRI | POLLERR/.
+                if (pfds.data[i].revents & (POLLPRI | POLLERR)) {
+                    p->cgroups.data[targets.data[i].cgroup].changed = true;
+                }
+            }
+        }
+    }
+
+error:
+    LS_VECTOR_FREE(pfds);
+    LS_VECTOR_FREE(targets);
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
@@ -0,0 +1,267 @@
+#include <lua.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/string_.h"
+#include "libls/vector.h"
+#include "libls/time_utils.h"
+#include "libls/dir_watch.h"
+
+typedef struct {
+    char *filename;
+    size_t max_size;
+    struct timespec retry_period;
+
+    LSDirWatch watch;
+    // The cached file descriptor of /filename/, or /-1/.
+    int fd;
+    // Reused between the reads.
+    LSString buf;
+
+    // What has been passed to /cb/ last: either /errno/ value /last_err/ (if non-zero), or the
+    // content with hash /last_hash/ and size /last_size/, truncated if /last_truncated/.
+    bool has_last;
+    int last_err;
+    uint64_t last_hash;
+    size_t last_size;
+    bool last_truncated;
+} Priv;
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    free(p->filename);
+    if (p->fd >= 0) {
+        close(p->fd);
+    }
+    ls_dir_watch_destroy(&p->watch);
+    LS_VECTOR_FREE(p->buf);
+    free(p);
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .filename = NULL,
+        .max_size = 1024 * 1024,
+        .retry_period = {.tv_sec = 5},
+        .watch = LS_DIR_WATCH_NEW(),
+        .fd = -1,
+        .buf = LS_VECTOR_NEW(),
+        .has_last = false,
+    };
+
+    PU_VISIT_STR_FIELD(-1, "filename", "'filename'", s,
+        p->filename = ls_xstrdup(s);
+    );
+    if (!ls_dir_watch_init(&p->watch, p->filename)) {
+        if (errno == EINVAL) {
+            LS_FATALF(pd, "'filename' is empty or ends with a slash");
+        } else {
+            LS_FATALF(pd, "inotify_init1: %s", ls_strerror_onstack(errno));
+        }
+        goto error;
+    }
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "max_size", "'max_size'", n,
+        if (!(n >= 0 && n <= (double) (SIZE_MAX / 2))) {
+            LS_FATALF(pd, "invalid 'max_size' value");
+            goto error;
+        }
+        p->max_size = n;
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "retry_period", "'retry_period'", n,
+        if (ls_timespec_is_invalid(p->retry_period = ls_timespec_from_seconds(n))) {
+            LS_FATALF(pd, "invalid 'retry_period' value");
+            goto error;
+        }
+    );
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+// Drops the cached file descriptor, so that the file gets reopened by the next read.
+static
+void
+drop_fd(Priv *p)
+{
+    if (p->fd >= 0) {
+        close(p->fd);
+        p->fd = -1;
+    }
+}
+
+// 64-bit FNV-1a.
+static
+uint64_t
+hash_bytes(const char *data, size_t n)
+{
+    uint64_t h = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char) data[i];
+        h *= UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+// Reads (at most /p->max_size/ bytes of) the file into /p->buf/ from the cached file descriptor,
+// (re)opening it if needed. Sets /*truncated/ if the file is larger. On error, returns /false/ and
+// sets /errno/.
+static
+bool
+read_file(Priv *p, bool *truncated)
+{
+    if (p->fd < 0 && (p->fd = open(p->filename, O_RDONLY | O_CLOEXEC)) < 0) {
+        return false;
+    }
+    // The size is only a hint: it is zero for procfs and sysfs files, and the file may be growing.
+    struct stat st;
+    size_t hint = 4096;
+    if (fstat(p->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        hint = (size_t) st.st_size < p->max_size ? (size_t) st.st_size + 1 : p->max_size + 1;
+    }
+
+    LS_VECTOR_CLEAR(p->buf);
+    LS_VECTOR_RESERVE(p->buf, hint);
+    // Read one more byte than allowed to find out whether the file is larger.
+    const size_t limit = p->max_size + 1;
+    while (p->buf.size < limit) {
+        size_t want = p->buf.capacity - p->buf.size;
+        if (!want) {
+            LS_VECTOR_RESERVE(p->buf, p->buf.size * 2);
+            want = p->buf.capacity - p->buf.size;
+        }
+        if (want > limit - p->buf.size) {
+            want = limit - p->buf.size;
+        }
+        const ssize_t r = pread(p->fd, p->buf.data + p->buf.size, want, p->buf.size);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (r == 0) {
+            break;
+        }
+        p->buf.size += r;
+    }
+    *truncated = p->buf.size > p->max_size;
+    if (*truncated) {
+        p->buf.size = p->max_size;
+    }
+    return true;
+}
+
+// Reads the file and calls /cb/ if anything has changed since the last call.
+static
+void
+update(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    bool truncated = false;
+    int err = 0;
+    if (!read_file(p, &truncated)) {
+        err = errno;
+        drop_fd(p);
+    }
+
+    const uint64_t hash = err ? 0 : hash_bytes(p->buf.data, p->buf.size);
+    if (p->has_last && p->last_err == err &&
+        (err || (p->last_hash == hash && p->last_size == p->buf.size &&
+                 p->last_truncated == truncated)))
+    {
+        return;
+    }
+    p->has_last = true;
+    p->last_err = err;
+    p->last_hash = hash;
+    p->last_size = p->buf.size;
+    p->last_truncated = truncated;
+
+    lua_State *L = funcs.call_begin(pd->userdata);
+    lua_createtable(L, 0, 2); // L: table
+    if (err) {
+        lua_pushstring(L, ls_strerror_onstack(err)); // L: table string
+        lua_setfield(L, -2, "error"); // L: table
+    } else {
+        lua_pushlstring(L, p->buf.data ? p->buf.data : "", p->buf.size); // L: table string
+        lua_setfield(L, -2, "content"); // L: table
+        if (truncated) {
+            lua_pushboolean(L, true); // L: table true
+            lua_setfield(L, -2, "truncated"); // L: table
+        }
+    }
+    funcs.call_end(pd->userdata);
+}
+
+typedef struct {
+    Priv *p;
+    // Whether the file is to be read before waiting for events again.
+    bool need_read;
+} WatchCtx;
+
+static
+void
+on_watch_event(void *ud, LSDirWatchEvent ev)
+{
+    WatchCtx *ctx = ud;
+    if (ev == LS_DIR_WATCH_EV_REPLACED) {
+        // E.g. written to a temporary file and renamed; the cached descriptor is of the old one.
+        drop_fd(ctx->p);
+    }
+    ctx->need_read = true;
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    WatchCtx ctx = {.p = p, .need_read = true};
+    while (1) {
+        if (!ls_dir_watch_ensure(&p->watch, on_watch_event, &ctx)) {
+            LS_FATALF(pd, "inotify_add_watch: %s: %s", p->watch.dirname,
+                      ls_strerror_onstack(errno));
+            return;
+        }
+
+        if (ctx.need_read) {
+            update(pd, funcs);
+            ctx.need_read = false;
+        }
+
+        if (!ls_dir_watch_wait(&p->watch, p->retry_period, on_watch_event, &ctx)) {
+            LS_FATALF(pd, "waiting for inotify events: %s", ls_strerror_onstack(errno));
+            return;
+        }
+    }
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
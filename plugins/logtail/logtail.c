@@ -0,0 +1,582 @@
+#include <lua.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <regex.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/string_.h"
+#include "libls/vector.h"
+#include "libls/time_utils.h"
+#include "libls/dir_watch.h"
+
+// How much to read at once.
+enum { CHUNK = 64 * 1024 };
+
+typedef struct {
+    // The key in the /counts/ table of the /cb/ argument.
+    char *name;
+    // Either /fixed/ is non-NULL (and, if /icase/ is set, lower-cased), or /re/ is compiled.
+    char *fixed;
+    bool icase;
+    regex_t re;
+    // The number of the matching lines in the current batch.
+    uint64_t count;
+} Filter;
+
+typedef struct {
+    char *filename;
+    LS_VECTOR_OF(Filter) filters;
+    size_t max_matches;
+    size_t max_line_len;
+    bool from_start;
+    struct timespec retry_period;
+
+    LSDirWatch watch;
+    // The file descriptor of the file being followed, or /-1/.
+    int fd;
+    // Where to read the file from next.
+    off_t offset;
+    // Whether the file has not been opened yet since the start (only then /from_start/ matters).
+    bool at_start;
+
+    // The incomplete last line read so far, followed by the bytes just read. Reused between the
+    // reads.
+    LSString buf;
+    // Whether the rest of the current line is to be discarded, as it is longer than
+    // /max_line_len/.
+    bool skipping;
+
+    // The last (at most /max_matches/) matching lines of the current batch: a ring buffer of
+    // /max_matches/ strings, with /nmatches_kept/ of them starting from /matches_head/ in use.
+    LSString *matches;
+    size_t matches_head;
+    size_t nmatches_kept;
+
+    // The current batch.
+    uint64_t nlines;
+    uint64_t nmatched;
+    bool rotated;
+    bool truncated;
+
+    // The /errno/ value passed to /cb/ last, or /0/.
+    int last_err;
+} Priv;
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    free(p->filename);
+    for (size_t i = 0; i < p->filters.size; ++i) {
+        Filter *f = &p->filters.data[i];
+        free(f->name);
+        if (f->fixed) {
+            free(f->fixed);
+        } else {
+            regfree(&f->re);
+        }
+    }
+    LS_VECTOR_FREE(p->filters);
+    if (p->fd >= 0) {
+        close(p->fd);
+    }
+    ls_dir_watch_destroy(&p->watch);
+    LS_VECTOR_FREE(p->buf);
+    if (p->matches) {
+        for (size_t i = 0; i < p->max_matches; ++i) {
+            LS_VECTOR_FREE(p->matches[i]);
+        }
+        free(p->matches);
+    }
+    free(p);
+}
+
+static
+bool
+add_filter(LuastatusPluginData *pd, const char *name, const char *regex, const char *fixed,
+           bool icase)
+{
+    Priv *p = pd->priv;
+    Filter f = {
+        .name = ls_xstrdup(name ? name : regex ? regex : fixed),
+        .fixed = NULL,
+        .icase = icase,
+        .count = 0,
+    };
+    if (fixed) {
+        f.fixed = ls_xstrdup(fixed);
+        if (icase) {
+            for (char *s = f.fixed; *s; ++s) {
+                *s = tolower((unsigned char) *s);
+            }
+        }
+    } else {
+        const int r = regcomp(&f.re, regex, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0));
+        if (r != 0) {
+            char errbuf[256];
+            regerror(r, &f.re, errbuf, sizeof(errbuf));
+            LS_FATALF(pd, "regex '%s': %s", regex, errbuf);
+            free(f.name);
+            return false;
+        }
+    }
+    LS_VECTOR_PUSH(p->filters, f);
+    return true;
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .filename = NULL,
+        .filters = LS_VECTOR_NEW(),
+        .max_matches = 10,
+        .max_line_len = 4096,
+        .from_start = false,
+        .retry_period = {.tv_sec = 5},
+        .watch = LS_DIR_WATCH_NEW(),
+        .fd = -1,
+        .offset = 0,
+        .at_start = true,
+        .buf = LS_VECTOR_NEW(),
+        .skipping = false,
+        .matches = NULL,
+        .matches_head = 0,
+        .nmatches_kept = 0,
+        .nlines = 0,
+        .nmatched = 0,
+        .rotated = false,
+        .truncated = false,
+        .last_err = 0,
+    };
+
+    PU_VISIT_STR_FIELD(-1, "filename", "'filename'", s,
+        p->filename = ls_xstrdup(s);
+    );
+    if (!ls_dir_watch_init(&p->watch, p->filename)) {
+        if (errno == EINVAL) {
+            LS_FATALF(pd, "'filename' is empty or ends with a slash");
+        } else {
+            LS_FATALF(pd, "inotify_init1: %s", ls_strerror_onstack(errno));
+        }
+        goto error;
+    }
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "filters", "'filters'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'filters' key", LUA_TNUMBER);
+        if (lua_type(L, LS_LUA_VALUE) == LUA_TSTRING) {
+            if (!add_filter(pd, NULL, lua_tostring(L, LS_LUA_VALUE), NULL, false)) {
+                goto error;
+            }
+        } else {
+            PU_CHECK_TYPE(LS_LUA_VALUE, "'filters' element", LUA_TTABLE);
+
+            const char *regex = NULL;
+            PU_MAYBE_VISIT_STR_FIELD(-1, "regex", "filter's 'regex'", s,
+                regex = s;
+            );
+            const char *fixed = NULL;
+            PU_MAYBE_VISIT_STR_FIELD(-1, "fixed", "filter's 'fixed'", s,
+                fixed = s;
+            );
+            if (!regex == !fixed) {
+                LS_FATALF(pd, "a filter must have either 'regex' or 'fixed'");
+                goto error;
+            }
+            bool icase = false;
+            PU_MAYBE_VISIT_BOOL_FIELD(-1, "icase", "filter's 'icase'", b,
+                icase = b;
+            );
+            const char *name = NULL;
+            PU_MAYBE_VISIT_STR_FIELD(-1, "name", "filter's 'name'", s,
+                name = s;
+            );
+            if (!add_filter(pd, name, regex, fixed, icase)) {
+                goto error;
+            }
+        }
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "max_matches", "'max_matches'", n,
+        if (!(n >= 0 && n <= 1000000)) {
+            LS_FATALF(pd, "invalid 'max_matches' value");
+            goto error;
+        }
+        p->max_matches = n;
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "max_line_len", "'max_line_len'", n,
+        if (!(n >= 1 && n <= 1024 * 1024 * 1024)) {
+            LS_FATALF(pd, "invalid 'max_line_len' value");
+            goto error;
+        }
+        p->max_line_len = n;
+    );
+
+    PU_MAYBE_VISIT_BOOL_FIELD(-1, "from_start", "'from_start'", b,
+        p->from_start = b;
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "retry_period", "'retry_period'", n,
+        if (ls_timespec_is_invalid(p->retry_period = ls_timespec_from_seconds(n))) {
+            LS_FATALF(pd, "invalid 'retry_period' value");
+            goto error;
+        }
+    );
+
+    if (p->max_matches) {
+        p->matches = LS_XNEW(LSString, p->max_matches);
+        for (size_t i = 0; i < p->max_matches; ++i) {
+            p->matches[i] = (LSString) LS_VECTOR_NEW();
+        }
+    }
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+// Returns whether the zero-terminated /s/ contains the (lower-case) /needle/, ignoring case.
+static
+bool
+contains_icase(const char *s, const char *needle)
+{
+    for (; *s; ++s) {
+        size_t i = 0;
+        while (needle[i] && tolower((unsigned char) s[i]) == needle[i]) {
+            ++i;
+        }
+        if (!needle[i]) {
+            return true;
+        }
+    }
+    return !*needle;
+}
+
+static
+bool
+filter_matches(const Filter *f, const char *line)
+{
+    if (!f->fixed) {
+        return regexec(&f->re, line, 0, NULL, 0) == 0;
+    } else if (f->icase) {
+        return contains_icase(line, f->fixed);
+    } else {
+        return strstr(line, f->fixed) != NULL;
+    }
+}
+
+// Handles a complete line /line/ of /n/ bytes; /line[n]/ must be /'\0'/.
+static
+void
+handle_line(Priv *p, const char *line, size_t n)
+{
+    ++p->nlines;
+
+    bool matched = !p->filters.size;
+    for (size_t i = 0; i < p->filters.size; ++i) {
+        Filter *f = &p->filters.data[i];
+        if (filter_matches(f, line)) {
+            ++f->count;
+            matched = true;
+        }
+    }
+    if (!matched) {
+        return;
+    }
+    ++p->nmatched;
+
+    if (!p->max_matches) {
+        return;
+    }
+    LSString *slot;
+    if (p->nmatches_kept < p->max_matches) {
+        slot = &p->matches[(p->matches_head + p->nmatches_kept++) % p->max_matches];
+    } else {
+        // Overwrite the oldest one.
+        slot = &p->matches[p->matches_head];
+        p->matches_head = (p->matches_head + 1) % p->max_matches;
+    }
+    ls_string_assign_b(slot, line, n);
+}
+
+// Handles the complete lines in /p->buf/, leaving only the incomplete last one there. If /flush/ is
+// true, the incomplete last line is handled as well.
+static
+void
+handle_buf(Priv *p, bool flush)
+{
+    char *data = p->buf.data;
+    char *end = data + p->buf.size;
+    char *nl;
+    while ((nl = memchr(data, '\n', end - data))) {
+        if (p->skipping) {
+            p->skipping = false;
+        } else {
+            size_t n = nl - data;
+            if (n > p->max_line_len) {
+                n = p->max_line_len;
+            }
+            data[n] = '\0';
+            handle_line(p, data, n);
+        }
+        data = nl + 1;
+    }
+
+    size_t rest = end - data;
+    if (p->skipping) {
+        rest = 0;
+    } else if (rest > p->max_line_len || (flush && rest)) {
+        // There is room for the terminator: the buffer always has some spare capacity after a
+        // read (see /read_new()/), and cutting only makes the line shorter.
+        const size_t n = rest > p->max_line_len ? p->max_line_len : rest;
+        data[n] = '\0';
+        handle_line(p, data, n);
+        p->skipping = !flush;
+        rest = 0;
+    }
+    if (rest && data != p->buf.data) {
+        memmove(p->buf.data, data, rest);
+    }
+    p->buf.size = rest;
+}
+
+// Reads what has been appended to the file since the last read, handling the lines. On error,
+// returns /false/ and sets /errno/.
+static
+bool
+read_new(Priv *p)
+{
+    struct stat st;
+    if (fstat(p->fd, &st) < 0) {
+        return false;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size < p->offset) {
+        // Truncated (e.g. by "copytruncate" log rotation); start over.
+        p->offset = 0;
+        p->buf.size = 0;
+        p->skipping = false;
+        p->truncated = true;
+    }
+
+    while (1) {
+        // Reserve one more byte for the terminator of a line cut by /handle_buf()/.
+        LS_VECTOR_RESERVE(p->buf, p->buf.size + CHUNK + 1);
+        const ssize_t r = pread(p->fd, p->buf.data + p->buf.size, CHUNK, p->offset);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (r == 0) {
+            return true;
+        }
+        p->offset += r;
+        p->buf.size += r;
+        handle_buf(p, false);
+    }
+}
+
+static
+void
+close_file(Priv *p)
+{
+    if (p->fd >= 0) {
+        close(p->fd);
+        p->fd = -1;
+    }
+    p->buf.size = 0;
+    p->skipping = false;
+}
+
+static
+void
+push_batch(lua_State *L, Priv *p)
+{
+    lua_createtable(L, 0, 6); // L: table
+
+    lua_pushnumber(L, p->nlines); // L: table number
+    lua_setfield(L, -2, "lines"); // L: table
+
+    lua_pushnumber(L, p->nmatched); // L: table number
+    lua_setfield(L, -2, "matched"); // L: table
+
+    lua_createtable(L, 0, p->filters.size); // L: table table
+    for (size_t i = 0; i < p->filters.size; ++i) {
+        const Filter *f = &p->filters.data[i];
+        lua_pushnumber(L, f->count); // L: table table number
+        lua_setfield(L, -2, f->name); // L: table table
+    }
+    lua_setfield(L, -2, "counts"); // L: table
+
+    lua_createtable(L, p->nmatches_kept, 0); // L: table table
+    for (size_t i = 0; i < p->nmatches_kept; ++i) {
+        const LSString *s = &p->matches[(p->matches_head + i) % p->max_matches];
+        lua_pushlstring(L, s->data ? s->data : "", s->size); // L: table table string
+        lua_rawseti(L, -2, i + 1); // L: table table
+    }
+    lua_setfield(L, -2, "last_matches"); // L: table
+
+    if (p->rotated) {
+        lua_pushboolean(L, true); // L: table true
+        lua_setfield(L, -2, "rotated"); // L: table
+    }
+    if (p->truncated) {
+        lua_pushboolean(L, true); // L: table true
+        lua_setfield(L, -2, "truncated"); // L: table
+    }
+}
+
+static
+void
+reset_batch(Priv *p)
+{
+    p->nlines = 0;
+    p->nmatched = 0;
+    for (size_t i = 0; i < p->filters.size; ++i) {
+        p->filters.data[i].count = 0;
+    }
+    p->matches_head = 0;
+    p->nmatches_kept = 0;
+    p->rotated = false;
+    p->truncated = false;
+}
+
+// Checks whether /p->filename/ still refers to the file being followed (/p->fd/).
+static
+bool
+is_same_file(Priv *p)
+{
+    struct stat st_fd;
+    struct stat st_path;
+    if (fstat(p->fd, &st_fd) < 0 || stat(p->filename, &st_path) < 0) {
+        return false;
+    }
+    return st_fd.st_dev == st_path.st_dev && st_fd.st_ino == st_path.st_ino;
+}
+
+// Reads what is new in the file and calls /cb/ with the batch, if there is anything to report. If
+// /maybe_replaced/ is true and the file at /p->filename/ is indeed not the one being followed
+// anymore, the rest of the old one is read, and the new one is followed from its beginning.
+static
+void
+update(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, bool maybe_replaced)
+{
+    Priv *p = pd->priv;
+
+    // Overflows of the event queue and re-established watches do not mean the file has changed.
+    if (maybe_replaced && p->fd >= 0 && !is_same_file(p)) {
+        // The writer may have appended something before the rotation.
+        if (read_new(p)) {
+            handle_buf(p, true);
+        }
+        close_file(p);
+        p->offset = 0;
+        p->rotated = true;
+    }
+
+    int err = 0;
+    if (p->fd < 0) {
+        if ((p->fd = open(p->filename, O_RDONLY | O_CLOEXEC)) < 0) {
+            err = errno;
+        } else {
+            struct stat st;
+            p->offset = 0;
+            if (p->at_start && !p->from_start && fstat(p->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                p->offset = st.st_size;
+            }
+        }
+        p->at_start = false;
+    }
+    if (!err && !read_new(p)) {
+        err = errno;
+        close_file(p);
+    }
+
+    // Once the file is readable again, tell /cb/ that the error is gone, even with an empty batch.
+    if (p->nlines || p->rotated || p->truncated || (!err && p->last_err)) {
+        lua_State *L = funcs.call_begin(pd->userdata);
+        push_batch(L, p);
+        funcs.call_end(pd->userdata);
+        reset_batch(p);
+    }
+    if (err != p->last_err) {
+        p->last_err = err;
+        if (err) {
+            lua_State *L = funcs.call_begin(pd->userdata);
+            lua_createtable(L, 0, 1); // L: table
+            lua_pushstring(L, ls_strerror_onstack(err)); // L: table string
+            lua_setfield(L, -2, "error"); // L: table
+            funcs.call_end(pd->userdata);
+        }
+    }
+}
+
+typedef struct {
+    // Whether the file is to be read before waiting for events again.
+    bool need_read;
+    // Whether it might have been replaced (see /update()/).
+    bool replaced;
+} WatchCtx;
+
+static
+void
+on_watch_event(void *ud, LSDirWatchEvent ev)
+{
+    WatchCtx *ctx = ud;
+    if (ev == LS_DIR_WATCH_EV_REPLACED) {
+        // Rotated: renamed (or removed) and, possibly, created anew.
+        ctx->replaced = true;
+    }
+    ctx->need_read = true;
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    WatchCtx ctx = {.need_read = true, .replaced = false};
+    while (1) {
+        if (!ls_dir_watch_ensure(&p->watch, on_watch_event, &ctx)) {
+            LS_FATALF(pd, "inotify_add_watch: %s: %s", p->watch.dirname,
+                      ls_strerror_onstack(errno));
+            return;
+        }
+
+        if (ctx.need_read) {
+            update(pd, funcs, ctx.replaced);
+            ctx.need_read = ctx.replaced = false;
+        }
+
+        if (!ls_dir_watch_wait(&p->watch, p->retry_period, on_watch_event, &ctx)) {
+            LS_FATALF(pd, "waiting for inotify events: %s", ls_strerror_onstack(errno));
+            return;
+        }
+    }
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
@@ -0,0 +1,129 @@
+#include "line_buf.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libls/vector.h"
+#include "libls/time_utils.h"
+
+enum { READ_CHUNK = 4096 };
+
+void
+line_buf_init(LineBuf *b, int fd)
+{
+    b->fd = fd;
+    LS_VECTOR_INIT(b->buf);
+    b->pos = 0;
+}
+
+// Waits for /events/ on /fd/ until /deadline/ (a /ls_now_ms()/ value, or -1 for no deadline).
+// Returns 1 if ready, 0 on timeout, -1 on error.
+static
+int
+wait_for(int fd, short events, int64_t deadline)
+{
+    while (1) {
+        int timeout_ms = -1;
+        if (deadline >= 0) {
+            const int64_t left = deadline - ls_now_ms();
+            timeout_ms = left < 0 ? 0 : left > INT_MAX ? INT_MAX : left;
+        }
+        struct pollfd pfd = {.fd = fd, .events = events};
+        const int r = poll(&pfd, 1, timeout_ms);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        return r;
+    }
+}
+
+int
+line_buf_read_line(LineBuf *b, struct timespec timeout, const char **line, size_t *nline)
+{
+    const int64_t deadline = ls_timespec_is_invalid(timeout)
+        ? -1
+        : ls_now_ms() + (int64_t) timeout.tv_sec * 1000 + (timeout.tv_nsec + 999999) / 1000000;
+
+    // The part of /b->buf/ after /b->pos/ and before /scanned/ has been checked to have no '\n'.
+    size_t scanned = b->pos;
+    while (1) {
+        char *nl = scanned < b->buf.size
+            ? memchr(b->buf.data + scanned, '\n', b->buf.size - scanned)
+            : NULL;
+        if (nl) {
+            *nl = '\0';
+            *line = b->buf.data + b->pos;
+            if (nline) {
+                *nline = nl - *line;
+            }
+            b->pos = nl - b->buf.data + 1;
+            return 1;
+        }
+
+        // Move the incomplete line to the beginning of the buffer.
+        const size_t rest = b->buf.size - b->pos;
+        if (b->pos) {
+            memmove(b->buf.data, b->buf.data + b->pos, rest);
+            b->buf.size = rest;
+            b->pos = 0;
+        }
+        scanned = rest;
+
+        LS_VECTOR_ENSURE(b->buf, b->buf.size + READ_CHUNK);
+        const ssize_t r = read(b->fd, b->buf.data + b->buf.size, b->buf.capacity - b->buf.size);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            const int w = wait_for(b->fd, POLLIN, deadline);
+            if (w <= 0) {
+                return w;
+            }
+            continue;
+        }
+        if (r == 0) {
+            errno = 0;
+            return -1;
+        }
+        b->buf.size += r;
+    }
+}
+
+bool
+line_buf_write(LineBuf *b, const char *data, size_t n)
+{
+    while (n) {
+        const ssize_t w = write(b->fd, data, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            if (wait_for(b->fd, POLLOUT, -1) < 0) {
+                return false;
+            }
+            continue;
+        }
+        data += w;
+        n -= w;
+    }
+    return true;
+}
+
+void
+line_buf_destroy(LineBuf *b)
+{
+    LS_VECTOR_FREE(b->buf);
+}
@@ -0,0 +1,44 @@
+#ifndef line_buf_h_
+#define line_buf_h_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "libls/string_.h"
+
+// A line-oriented buffered reader and writer over a non-blocking file descriptor.
+typedef struct {
+    int fd;
+    // Data received but not consumed yet starts at /pos/.
+    LSString buf;
+    size_t pos;
+} LineBuf;
+
+// /fd/ must be in non-blocking mode.
+void
+line_buf_init(LineBuf *b, int fd);
+
+// Reads the next line; on success, sets /*line/ to it (without the trailing newline, but
+// terminated with '\0'), and /*nline/ (if not /NULL/) to its length. The line is valid until the
+// next call.
+//
+// If no complete line is available, waits for at most /timeout/ (or indefinitely, if it is
+// /ls_timespec_invalid/) for more data to come.
+//
+// Returns 1 on success, 0 on timeout, or -1 on error (in which case /errno/ is set; on end of
+// file, it is set to 0).
+int
+line_buf_read_line(LineBuf *b, struct timespec timeout, const char **line, size_t *nline);
+
+// Writes all /n/ bytes of /data/, waiting for the descriptor to become writable as needed.
+//
+// Returns /true/ on success, or /false/ on error (in which case /errno/ is set).
+bool
+line_buf_write(LineBuf *b, const char *data, size_t n);
+
+// Does not close the file descriptor.
+void
+line_buf_destroy(LineBuf *b);
+
+#endif
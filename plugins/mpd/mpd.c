@@ -1,14 +1,13 @@
 #include <lua.h>
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <time.h>
-#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
-#include <sys/select.h>
 
 #include "include/plugin_v1.h"
 #include "include/sayf_macros.h"
@@ -23,16 +22,18 @@
 #include "libls/time_utils.h"
 #include "libls/evloop_utils.h"
 #include "libls/strarr.h"
-#include "libls/sig_utils.h"
+#include "libls/io_utils.h"
 
 #include "connect.h"
 #include "proto.h"
+#include "line_buf.h"
 
 typedef struct {
     char *hostname;
     int port;
     char *password;
     struct timespec timeout;
+    struct timespec tick;
     struct timespec retry_in;
     char *retry_fifo;
     char *idle_str;
@@ -60,6 +61,7 @@ init(LuastatusPluginData *pd, lua_State *L)
         .port = 6600,
         .password = NULL,
         .timeout = ls_timespec_invalid,
+        .tick = ls_timespec_invalid,
         .retry_in = {.tv_sec = 10},
         .retry_fifo = NULL,
         .idle_str = NULL,
@@ -93,6 +95,17 @@ init(LuastatusPluginData *pd, lua_State *L)
         }
     );
 
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "tick", "'tick'", n,
+        if (!ls_opt_timespec_from_seconds(n, &p->tick)) {
+            LS_FATALF(pd, "'tick' is invalid");
+            goto error;
+        }
+        if (!ls_timespec_is_invalid(p->tick) && !p->tick.tv_sec && !p->tick.tv_nsec) {
+            LS_FATALF(pd, "'tick' is zero");
+            goto error;
+        }
+    );
+
     PU_MAYBE_VISIT_NUM_FIELD(-1, "retry_in", "'retry_in'", n,
         if (!ls_opt_timespec_from_seconds(n, &p->retry_in)) {
             LS_FATALF(pd, "'retry_in' is invalid");
@@ -127,30 +140,138 @@ error:
     return LUASTATUS_ERR;
 }
 
-// Returns the length of /s/ without trailing newlines.
-static inline
-size_t
-rstrip_nl_strlen(const char *s)
+// If /line/ is of form "key: value", appends /key/ and /value/ to /sa/.
+static
+void
+kv_strarr_line_append(LSStringArray *sa, const char *line, size_t nline)
+{
+    const char *colon_pos = memchr(line, ':', nline);
+    if (!colon_pos || colon_pos + 1 == line + nline || colon_pos[1] != ' ') {
+        return;
+    }
+    const char *value_pos = colon_pos + 2;
+    ls_strarr_append(sa, line, colon_pos - line);
+    ls_strarr_append(sa, value_pos, line + nline - value_pos);
+}
+
+// Finds the value for /key/ in /sa/; returns /NULL/ if there is no such key.
+static
+const char *
+kv_strarr_find(LSStringArray sa, const char *key, size_t *nvalue)
 {
-    size_t len = strlen(s);
-    while (len && s[len - 1] == '\n') {
-        --len;
+    const size_t n = ls_strarr_size(sa);
+    const size_t nkey = strlen(key);
+    for (size_t i = 0; i < n; i += 2) {
+        size_t ncur;
+        const char *cur = ls_strarr_at(sa, i, &ncur);
+        if (ncur == nkey && memcmp(cur, key, nkey) == 0) {
+            return ls_strarr_at(sa, i + 1, nvalue);
+        }
     }
-    return len;
+    return NULL;
 }
 
-// If /line/ is of form "key: value\n", appends /key/ and /value/ to /sa/.
+// Appends the value for /key/ in /sa/ (or nothing, if there is no such key) to /s/.
 static
 void
-kv_strarr_line_append(LSStringArray *sa, const char *line)
+kv_strarr_value_append(LSStringArray sa, const char *key, LSString *s)
 {
-    const char *colon_pos = strchr(line, ':');
-    if (!colon_pos || colon_pos[1] != ' ') {
-        return;
+    size_t nvalue;
+    const char *value = kv_strarr_find(sa, key, &nvalue);
+    if (value) {
+        ls_string_append_b(s, value, nvalue);
     }
-    const char *value_pos = colon_pos + 2;
-    ls_strarr_append(sa, line, colon_pos - line);
-    ls_strarr_append(sa, value_pos, rstrip_nl_strlen(value_pos));
+}
+
+// Parses the number at the beginning of the value for /key/ in /sa/. Returns /NAN/ if there is no
+// such key, or the value does not start with a number.
+static
+double
+kv_strarr_find_num(LSStringArray sa, const char *key)
+{
+    size_t nvalue;
+    const char *value = kv_strarr_find(sa, key, &nvalue);
+    char buf[64];
+    if (!value || nvalue >= sizeof(buf)) {
+        return NAN;
+    }
+    memcpy(buf, value, nvalue);
+    buf[nvalue] = '\0';
+    char *endptr;
+    const double r = strtod(buf, &endptr);
+    return endptr == buf ? NAN : r;
+}
+
+// The playback position, as of the last status query, used to interpolate the elapsed time.
+typedef struct {
+    bool playing;
+    // /NAN/ if unknown.
+    double elapsed;
+    // /NAN/ if unknown.
+    double duration;
+    // /ls_now_ms()/ (in seconds) at the moment of the status query.
+    double at;
+} Playback;
+
+static
+Playback
+playback_from_status(LSStringArray kv_status, double at)
+{
+    size_t nstate;
+    const char *state = kv_strarr_find(kv_status, "state", &nstate);
+
+    Playback pb = {
+        .playing = state && nstate == 4 && memcmp(state, "play", 4) == 0,
+        .elapsed = kv_strarr_find_num(kv_status, "elapsed"),
+        .duration = kv_strarr_find_num(kv_status, "duration"),
+        .at = at,
+    };
+
+    // Older servers only report "time: <elapsed>:<duration>", with the precision of a second.
+    size_t ntime;
+    const char *time_ = kv_strarr_find(kv_status, "time", &ntime);
+    const char *colon_pos = time_ ? memchr(time_, ':', ntime) : NULL;
+    if (isnan(pb.elapsed) && time_) {
+        pb.elapsed = strtod(time_, NULL);
+    }
+    if (isnan(pb.duration) && colon_pos) {
+        pb.duration = strtod(colon_pos + 1, NULL);
+    }
+    return pb;
+}
+
+// Returns the interpolated elapsed time at /now/.
+static
+double
+playback_elapsed(const Playback *pb, double now)
+{
+    double r = pb->elapsed;
+    if (pb->playing) {
+        r += now - pb->at;
+    }
+    if (!isnan(pb->duration) && pb->duration > 0 && r > pb->duration) {
+        r = pb->duration;
+    }
+    return r;
+}
+
+// Returns the time (in terms of /ls_now_ms()/, in seconds) of the next tick after /now/, that is,
+// the moment the interpolated elapsed time reaches the next multiple of /tick/; or /NAN/ if there
+// are to be no more ticks.
+static
+double
+playback_next_tick(const Playback *pb, double tick, double now)
+{
+    if (!pb->playing || isnan(pb->elapsed)) {
+        return NAN;
+    }
+    // Allow for the wake-up being slightly early.
+    const double elapsed = pb->elapsed + (now - pb->at) + 1e-3;
+    const double next = (floor(elapsed / tick) + 1) * tick;
+    if (!isnan(pb->duration) && pb->duration > 0 && next > pb->duration) {
+        return NAN;
+    }
+    return pb->at + (next - pb->elapsed);
 }
 
 static
@@ -182,49 +303,124 @@ report_status(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, const char
     funcs.call_end(pd->userdata);
 }
 
+static
+void
+report_tick(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, const Playback *pb, double now)
+{
+    lua_State *L = funcs.call_begin(pd->userdata);
+    lua_createtable(L, 0, 3); // L: table
+    lua_pushstring(L, "tick"); // L: table "tick"
+    lua_setfield(L, -2, "what"); // L: table
+    lua_pushnumber(L, playback_elapsed(pb, now)); // L: table elapsed
+    lua_setfield(L, -2, "elapsed"); // L: table
+    if (!isnan(pb->duration)) {
+        lua_pushnumber(L, pb->duration); // L: table duration
+        lua_setfield(L, -2, "duration"); // L: table
+    }
+    funcs.call_end(pd->userdata);
+}
+
+// Waits for the first line of the response to "idle", calling /cb/ with /what="tick"/ and
+// /what="timeout"/ meanwhile, as configured.
+//
+// Returns the same as /line_buf_read_line()/, except that it never returns 0.
+static
+int
+wait_idle(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, LineBuf *lb, const Playback *pb,
+          const char **line, size_t *nline)
+{
+    Priv *p = pd->priv;
+
+    const bool has_timeout = !ls_timespec_is_invalid(p->timeout);
+    const bool has_tick = !ls_timespec_is_invalid(p->tick);
+    const struct timespec zero = {0};
+    // In seconds.
+    const double tick = has_tick ? ls_timespec_diff(p->tick, zero) : 0;
+    const double timeout = has_timeout ? ls_timespec_diff(p->timeout, zero) : 0;
+
+    double now = ls_now_ms() / 1000.0;
+    double timeout_at = has_timeout ? now + timeout : NAN;
+    double tick_at = has_tick ? playback_next_tick(pb, tick, now) : NAN;
+
+    while (1) {
+        double wake_at = timeout_at;
+        if (isnan(wake_at) || tick_at < wake_at) {
+            wake_at = tick_at;
+        }
+        const struct timespec wait = isnan(wake_at)
+            ? ls_timespec_invalid
+            : ls_timespec_from_seconds(wake_at > now ? wake_at - now : 0);
+
+        const int r = line_buf_read_line(lb, wait, line, nline);
+        if (r != 0) {
+            return r;
+        }
+
+        now = ls_now_ms() / 1000.0;
+        if (now >= tick_at - 1e-3) {
+            report_tick(pd, funcs, pb, now);
+            tick_at = playback_next_tick(pb, tick, now);
+        }
+        if (now >= timeout_at) {
+            report_status(pd, funcs, "timeout");
+            timeout_at = now + timeout;
+        }
+    }
+}
+
 static
 void
 interact(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, int fd)
 {
     Priv *p = pd->priv;
 
-    FILE *f = fdopen(fd, "r+");
-    if (!f) {
-        LS_ERRF(pd, "can't fdopen connection file descriptor %d: %s",
+    if (ls_make_nonblock(fd) < 0) {
+        LS_ERRF(pd, "can't make connection file descriptor %d non-blocking: %s",
                 fd, ls_strerror_onstack(errno));
         close(fd);
         return;
     }
 
-    char *buf = NULL;
-    size_t nbuf = 1024;
+    LineBuf lb;
+    line_buf_init(&lb, fd);
+    const char *line;
+    size_t nline;
+
+    LSString cmd = LS_VECTOR_NEW_RESERVE(char, 1024);
     LSStringArray kv_song   = ls_strarr_new();
     LSStringArray kv_status = ls_strarr_new();
 
+    // The song is only requeried when /songid/ or /playlist/ (the playlist version) in the status
+    // change; these two, joined with a '\n', are kept in /song_key/.
+    LSString song_key = LS_VECTOR_NEW();
+    LSString new_song_key = LS_VECTOR_NEW();
+    bool has_song = false;
+
 #define GETLINE() \
     do { \
-        if (getline(&buf, &nbuf, f) < 0) { \
+        if (line_buf_read_line(&lb, ls_timespec_invalid, &line, &nline) < 0) { \
             goto io_error; \
         } \
     } while (0)
 
-#define WRITE(What_) \
+#define WRITE_B(Buf_, NBuf_) \
     do { \
-        fputs(What_, f); \
-        fflush(f); \
-        if (ferror(f)) { \
+        if (!line_buf_write(&lb, Buf_, NBuf_)) { \
             goto io_error; \
         } \
     } while (0)
 
+#define WRITE(What_) WRITE_B(What_, strlen(What_))
+
+// Reads lines until a line terminating a response ("OK", or "list_OK" for a command list element).
 #define UNTIL_OK(...) \
     do { \
         GETLINE(); \
-        const ResponseType rt_ = response_type(buf); \
-        if (rt_ == RESP_OK) { \
+        const ResponseType rt_ = response_type(line); \
+        if (rt_ == RESP_OK || rt_ == RESP_LIST_OK) { \
             break; \
         } else if (rt_ == RESP_ACK) { \
-            LS_ERRF(pd, "server said: %.*s", (int) rstrip_nl_strlen(buf), buf); \
+            LS_ERRF(pd, "server said: %s", line); \
             goto error; \
         } else { \
             __VA_ARGS__ \
@@ -233,47 +429,72 @@ interact(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, int fd)
 
     // read and check the greeting
     GETLINE();
-    if (strncmp(buf, "OK MPD ", 7) != 0) {
-        LS_ERRF(pd, "bad greeting: %.*s", (int) rstrip_nl_strlen(buf), buf);
+    if (strncmp(line, "OK MPD ", 7) != 0) {
+        LS_ERRF(pd, "bad greeting: %s", line);
         goto error;
     }
 
     // send the password, if specified
     if (p->password) {
-        fputs("password ", f);
-        write_quoted(f, p->password);
-        putc_unlocked('\n', f);
-        fflush(f);
-        if (ferror(f)) {
-            goto io_error;
-        }
+        ls_string_assign_s(&cmd, "password ");
+        append_quoted(&cmd, p->password);
+        ls_string_append_c(&cmd, '\n');
+        WRITE_B(cmd.data, cmd.size);
         GETLINE();
-        if (response_type(buf) != RESP_OK) {
-            LS_ERRF(pd, "(password) server said: %.*s", (int) rstrip_nl_strlen(buf), buf);
+        if (response_type(line) != RESP_OK) {
+            LS_ERRF(pd, "(password) server said: %s", line);
             goto error;
         }
     }
 
-    sigset_t allsigs;
-    ls_xsigfillset(&allsigs);
-
-    if (fd >= FD_SETSIZE && !ls_timespec_is_invalid(p->timeout)) {
-        LS_WARNF(pd, "connection file descriptor is too large, will not report time outs");
-    }
-
-    fd_set fds;
-    FD_ZERO(&fds);
+    // Whether the last idle response suggests the song might have changed.
+    bool song_maybe_changed = true;
 
     while (1) {
-        WRITE("currentsong\n");
-        UNTIL_OK(
-            kv_strarr_line_append(&kv_song, buf);
-        );
+        // If the song is likely to have changed, request both the status and the song in one
+        // round trip; the song part is discarded if it turns out to be unchanged.
+        const bool pipelined = song_maybe_changed;
+        if (pipelined) {
+            WRITE("command_list_ok_begin\nstatus\ncurrentsong\ncommand_list_end\n");
+        } else {
+            WRITE("status\n");
+        }
 
-        WRITE("status\n");
+        ls_strarr_clear(&kv_status);
         UNTIL_OK(
-            kv_strarr_line_append(&kv_status, buf);
+            kv_strarr_line_append(&kv_status, line, nline);
         );
+        const Playback pb = playback_from_status(kv_status, ls_now_ms() / 1000.0);
+
+        LS_VECTOR_CLEAR(new_song_key);
+        kv_strarr_value_append(kv_status, "songid", &new_song_key);
+        ls_string_append_c(&new_song_key, '\n');
+        kv_strarr_value_append(kv_status, "playlist", &new_song_key);
+        const bool song_changed = !has_song || !ls_string_eq(song_key, new_song_key);
+
+        if (!pipelined && song_changed) {
+            WRITE("currentsong\n");
+        }
+        if (song_changed) {
+            ls_strarr_clear(&kv_song);
+            UNTIL_OK(
+                kv_strarr_line_append(&kv_song, line, nline);
+            );
+            ls_string_swap(&song_key, &new_song_key);
+            has_song = true;
+        } else if (pipelined) {
+            UNTIL_OK(
+                // do nothing
+            );
+        }
+        if (pipelined) {
+            // the final "OK" of the command list
+            GETLINE();
+            if (response_type(line) != RESP_OK) {
+                LS_ERRF(pd, "(command list) server said: %s", line);
+                goto error;
+            }
+        }
 
         lua_State *L = funcs.call_begin(pd->userdata);
         lua_createtable(L, 0, 3); // L: table
@@ -282,51 +503,51 @@ interact(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, int fd)
         lua_setfield(L, -2, "what"); // L: table
 
         kv_strarr_table_push(kv_song, L); // L: table table
-        ls_strarr_clear(&kv_song);
         lua_setfield(L, -2, "song"); // L: table
 
         kv_strarr_table_push(kv_status, L); // L: table table
-        ls_strarr_clear(&kv_status);
         lua_setfield(L, -2, "status"); // L: table
 
         funcs.call_end(pd->userdata);
 
         WRITE(p->idle_str);
 
-        if (fd < FD_SETSIZE && !ls_timespec_is_invalid(p->timeout)) {
-            while (1) {
-                FD_SET(fd, &fds);
-                int r = pselect(fd + 1, &fds, NULL, NULL, &p->timeout, &allsigs);
-                if (r < 0) {
-                    LS_ERRF(pd, "pselect (on connection file descriptor): %s",
-                            ls_strerror_onstack(errno));
-                    goto error;
-                } else if (r == 0) {
-                    report_status(pd, funcs, "timeout");
-                } else {
-                    break;
-                }
+        if (wait_idle(pd, funcs, &lb, &pb, &line, &nline) < 0) {
+            goto io_error;
+        }
+        song_maybe_changed = false;
+        while (1) {
+            const ResponseType rt = response_type(line);
+            if (rt == RESP_OK) {
+                break;
+            } else if (rt == RESP_ACK) {
+                LS_ERRF(pd, "(idle) server said: %s", line);
+                goto error;
+            }
+            if (strcmp(line, "changed: player") == 0 || strcmp(line, "changed: playlist") == 0) {
+                song_maybe_changed = true;
             }
+            GETLINE();
         }
-
-        UNTIL_OK(
-            // do nothing
-        );
     }
 #undef GETLINE
+#undef WRITE_B
 #undef WRITE
 #undef UNTIL_OK
 
 io_error:
-    if (feof(f)) {
+    if (errno == 0) {
         LS_ERRF(pd, "connection closed");
     } else {
         LS_ERRF(pd, "I/O error: %s", ls_strerror_onstack(errno));
     }
 
 error:
-    fclose(f);
-    free(buf);
+    close(fd);
+    line_buf_destroy(&lb);
+    LS_VECTOR_FREE(cmd);
+    LS_VECTOR_FREE(song_key);
+    LS_VECTOR_FREE(new_song_key);
     ls_strarr_destroy(kv_song);
     ls_strarr_destroy(kv_status);
 }
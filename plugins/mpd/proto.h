@@ -2,24 +2,29 @@
 #define proto_h_
 
 #include <string.h>
-#include <stdio.h>
 
 #include "libls/compdep.h"
+#include "libls/string_.h"
 
 typedef enum {
     RESP_OK,
+    RESP_LIST_OK,
     RESP_ACK,
     RESP_OTHER,
 } ResponseType;
 
+// /line/ is a response line without the trailing newline.
 LS_INHEADER
 ResponseType
-response_type(const char *s)
+response_type(const char *line)
 {
-    if (strcmp(s, "OK\n") == 0) {
+    if (strcmp(line, "OK") == 0) {
         return RESP_OK;
     }
-    if (strncmp(s, "ACK ", 4) == 0) {
+    if (strcmp(line, "list_OK") == 0) {
+        return RESP_LIST_OK;
+    }
+    if (strncmp(line, "ACK ", 4) == 0) {
         return RESP_ACK;
     }
     return RESP_OTHER;
@@ -27,16 +32,16 @@ response_type(const char *s)
 
 LS_INHEADER
 void
-write_quoted(FILE *f, const char *s)
+append_quoted(LSString *buf, const char *s)
 {
-    fputc('"', f);
+    ls_string_append_c(buf, '"');
     for (const char *t; (t = strchr(s, '"'));) {
-        fwrite(s, 1, t - s, f);
-        fputs("\\\"", f);
+        ls_string_append_b(buf, s, t - s);
+        ls_string_append_s(buf, "\\\"");
         s = t + 1;
     }
-    fputs(s, f);
-    fputc('"', f);
+    ls_string_append_s(buf, s);
+    ls_string_append_c(buf, '"');
 }
 
 #endif
@@ -0,0 +1,53 @@
+#include "iface_filter.h"
+
+#include <fnmatch.h>
+
+IfaceFilter
+iface_filter_new(void)
+{
+    return (IfaceFilter) {
+        .include = ls_strarr_new(),
+        .exclude = ls_strarr_new(),
+        .include_kinds = ls_strarr_new(),
+        .exclude_kinds = ls_strarr_new(),
+    };
+}
+
+static
+bool
+any_matches(LSStringArray patterns, const char *s)
+{
+    for (size_t i = 0; i < ls_strarr_size(patterns); ++i) {
+        if (fnmatch(ls_strarr_at(patterns, i, NULL), s, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+iface_filter_passes(const IfaceFilter *f, const char *name, const char *kind)
+{
+    if (ls_strarr_size(f->include) && !any_matches(f->include, name)) {
+        return false;
+    }
+    if (any_matches(f->exclude, name)) {
+        return false;
+    }
+    if (ls_strarr_size(f->include_kinds) && !any_matches(f->include_kinds, kind)) {
+        return false;
+    }
+    if (any_matches(f->exclude_kinds, kind)) {
+        return false;
+    }
+    return true;
+}
+
+void
+iface_filter_destroy(IfaceFilter *f)
+{
+    ls_strarr_destroy(f->include);
+    ls_strarr_destroy(f->exclude);
+    ls_strarr_destroy(f->include_kinds);
+    ls_strarr_destroy(f->exclude_kinds);
+}
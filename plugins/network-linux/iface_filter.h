@@ -0,0 +1,29 @@
+#ifndef iface_filter_h_
+#define iface_filter_h_
+
+#include <stdbool.h>
+
+#include "libls/strarr.h"
+
+// Include/exclude lists of /fnmatch()/ patterns on interface names and kinds (as in
+// /IFLA_INFO_KIND/, e.g. "veth" or "bridge"; empty for physical devices).
+typedef struct {
+    LSStringArray include;
+    LSStringArray exclude;
+    LSStringArray include_kinds;
+    LSStringArray exclude_kinds;
+} IfaceFilter;
+
+IfaceFilter
+iface_filter_new(void);
+
+// Returns /true/ if an interface with name /name/ and kind /kind/ passes the filter, that is, if
+// each of the non-empty include lists has a matching pattern and neither of the exclude lists
+// does.
+bool
+iface_filter_passes(const IfaceFilter *f, const char *name, const char *kind);
+
+void
+iface_filter_destroy(IfaceFilter *f);
+
+#endif
@@ -0,0 +1,388 @@
+#include "iface_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/if_addr.h>
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+
+#include "iface_type.h"
+
+void
+iface_table_init(IfaceTable *t, const IfaceFilter *filter)
+{
+    LS_VECTOR_INIT(t->ifaces);
+    LS_VECTOR_INIT(t->removed);
+    t->filter = filter;
+    t->detect_wlan = false;
+}
+
+static
+void
+iface_destroy(Iface *iface)
+{
+    LS_VECTOR_FREE(iface->addrs);
+}
+
+static
+void
+record_removed(IfaceTable *t, const Iface *iface)
+{
+    if (iface->name[0] && !iface->ignored) {
+        LS_VECTOR_PUSH(t->removed, ls_xstrdup(iface->name));
+    }
+}
+
+void
+iface_table_reset(IfaceTable *t)
+{
+    for (size_t i = 0; i < t->ifaces.size; ++i) {
+        record_removed(t, &t->ifaces.data[i]);
+        iface_destroy(&t->ifaces.data[i]);
+    }
+    LS_VECTOR_CLEAR(t->ifaces);
+}
+
+// Returns the index of the first interface with index not less than /ifindex/.
+static
+size_t
+lower_bound(IfaceTable *t, int ifindex)
+{
+    size_t lo = 0;
+    size_t hi = t->ifaces.size;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (t->ifaces.data[mid].ifindex < ifindex) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+Iface *
+iface_table_find(IfaceTable *t, int ifindex)
+{
+    const size_t i = lower_bound(t, ifindex);
+    if (i == t->ifaces.size || t->ifaces.data[i].ifindex != ifindex) {
+        return NULL;
+    }
+    return &t->ifaces.data[i];
+}
+
+static
+Iface *
+find_or_insert(IfaceTable *t, int ifindex)
+{
+    const size_t i = lower_bound(t, ifindex);
+    if (i != t->ifaces.size && t->ifaces.data[i].ifindex == ifindex) {
+        return &t->ifaces.data[i];
+    }
+    LS_VECTOR_ENSURE(t->ifaces, t->ifaces.size + 1);
+    memmove(&t->ifaces.data[i + 1], &t->ifaces.data[i], sizeof(Iface) * (t->ifaces.size - i));
+    ++t->ifaces.size;
+
+    Iface *iface = &t->ifaces.data[i];
+    *iface = (Iface) {.ifindex = ifindex, .wireless_stale = true, .dirty = true};
+    LS_VECTOR_INIT(iface->addrs);
+    return iface;
+}
+
+static
+void
+remove_at(IfaceTable *t, size_t i)
+{
+    record_removed(t, &t->ifaces.data[i]);
+    iface_destroy(&t->ifaces.data[i]);
+    memmove(&t->ifaces.data[i], &t->ifaces.data[i + 1], sizeof(Iface) * (t->ifaces.size - i - 1));
+    --t->ifaces.size;
+}
+
+static
+bool
+is_ipv6_link_local(const IfaceAddr *a)
+{
+    return a->family == AF_INET6 && a->raw[0] == 0xfe && (a->raw[1] & 0xc0) == 0x80;
+}
+
+static
+void
+format_addr(const Iface *iface, IfaceAddr *a)
+{
+    if (!inet_ntop(a->family, a->raw, a->str, sizeof(a->str))) {
+        a->str[0] = '\0';
+        return;
+    }
+    // Link-local addresses are ambiguous without the zone index; this mimics what
+    // /getnameinfo()/ does.
+    if (is_ipv6_link_local(a) && iface->name[0]) {
+        const size_t n = strlen(a->str);
+        snprintf(a->str + n, sizeof(a->str) - n, "%%%s", iface->name);
+    }
+}
+
+static
+bool
+handle_link_msg(IfaceTable *t, const struct nlmsghdr *nh)
+{
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg))) {
+        return false;
+    }
+    const struct ifinfomsg *ifi = NLMSG_DATA(nh);
+
+    if (nh->nlmsg_type == RTM_DELLINK) {
+        const size_t i = lower_bound(t, ifi->ifi_index);
+        if (i == t->ifaces.size || t->ifaces.data[i].ifindex != ifi->ifi_index) {
+            return false;
+        }
+        const bool was_ignored = t->ifaces.data[i].ignored;
+        remove_at(t, i);
+        return !was_ignored;
+    }
+
+    const char *name = NULL;
+    const char *kind = "";
+    int operstate = -1;
+    const void *stats64 = NULL;
+    size_t nstats64 = 0;
+    // Wireless extensions events (e.g. association or disassociation) come as /RTM_NEWLINK/
+    // messages with /IFLA_WIRELESS/ attribute; they change nothing we store, but the wireless
+    // info has to be requeried.
+    bool wireless_event = false;
+
+    int attrlen = IFLA_PAYLOAD(nh);
+    for (const struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen);
+         rta = RTA_NEXT(rta, attrlen))
+    {
+        switch (rta->rta_type) {
+        case IFLA_IFNAME:
+            if (RTA_PAYLOAD(rta) && memchr(RTA_DATA(rta), '\0', RTA_PAYLOAD(rta))) {
+                name = RTA_DATA(rta);
+            }
+            break;
+        case IFLA_OPERSTATE:
+            if (RTA_PAYLOAD(rta) >= 1) {
+                operstate = *(const unsigned char *) RTA_DATA(rta);
+            }
+            break;
+        case IFLA_WIRELESS:
+            wireless_event = true;
+            break;
+        case IFLA_STATS64:
+            stats64 = RTA_DATA(rta);
+            nstats64 = RTA_PAYLOAD(rta);
+            break;
+        case IFLA_LINKINFO:
+            {
+                int infolen = RTA_PAYLOAD(rta);
+                for (const struct rtattr *info = RTA_DATA(rta); RTA_OK(info, infolen);
+                     info = RTA_NEXT(info, infolen))
+                {
+                    if (info->rta_type == IFLA_INFO_KIND &&
+                        RTA_PAYLOAD(info) &&
+                        memchr(RTA_DATA(info), '\0', RTA_PAYLOAD(info)))
+                    {
+                        kind = RTA_DATA(info);
+                    }
+                }
+            }
+            break;
+        }
+    }
+
+    Iface *iface = find_or_insert(t, ifi->ifi_index);
+    bool changed = iface->dirty || wireless_event;
+
+    if (nstats64 >= sizeof(iface->counters)) {
+        // The attribute payload is not necessarily aligned.
+        memcpy(iface->counters, stats64, sizeof(iface->counters));
+        iface->has_counters = true;
+    }
+
+    bool renamed = false;
+    if (name && strcmp(name, iface->name) != 0 && strlen(name) < sizeof(iface->name)) {
+        record_removed(t, iface);
+        renamed = true;
+        strcpy(iface->name, name);
+        iface->is_wlan = t->detect_wlan && is_wlan_iface(name);
+        for (size_t i = 0; i < iface->addrs.size; ++i) {
+            format_addr(iface, &iface->addrs.data[i]);
+        }
+        changed = true;
+    }
+    if (iface->flags != ifi->ifi_flags) {
+        iface->flags = ifi->ifi_flags;
+        changed = true;
+    }
+    if (operstate >= 0 && iface->operstate != operstate) {
+        iface->operstate = operstate;
+        changed = true;
+    }
+
+    const bool ignored = t->filter && iface->name[0] &&
+                         !iface_filter_passes(t->filter, iface->name, kind);
+    bool became_ignored = false;
+    if (ignored != iface->ignored) {
+        if (ignored) {
+            // Report it as removed (unless it has just been reported so under the old name).
+            if (!renamed) {
+                record_removed(t, iface);
+            }
+            became_ignored = true;
+        }
+        iface->ignored = ignored;
+        changed = true;
+    }
+
+    if (changed) {
+        iface->wireless_stale = true;
+    }
+    iface->dirty = changed && !ignored;
+    return iface->dirty || became_ignored;
+}
+
+static
+IfaceAddr *
+find_addr(Iface *iface, const IfaceAddr *a)
+{
+    const size_t n = a->family == AF_INET ? 4 : 16;
+    for (size_t i = 0; i < iface->addrs.size; ++i) {
+        IfaceAddr *b = &iface->addrs.data[i];
+        if (b->family == a->family &&
+            b->prefixlen == a->prefixlen &&
+            memcmp(b->raw, a->raw, n) == 0)
+        {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static
+bool
+handle_addr_msg(IfaceTable *t, const struct nlmsghdr *nh)
+{
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg))) {
+        return false;
+    }
+    const struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6) {
+        return false;
+    }
+    const size_t addrlen = ifa->ifa_family == AF_INET ? 4 : 16;
+
+    const void *addr = NULL;
+    const void *local = NULL;
+
+    int attrlen = IFA_PAYLOAD(nh);
+    for (const struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, attrlen);
+         rta = RTA_NEXT(rta, attrlen))
+    {
+        if (RTA_PAYLOAD(rta) < addrlen) {
+            continue;
+        }
+        switch (rta->rta_type) {
+        case IFA_ADDRESS:
+            addr = RTA_DATA(rta);
+            break;
+        case IFA_LOCAL:
+            local = RTA_DATA(rta);
+            break;
+        }
+    }
+    // For point-to-point interfaces, /IFA_ADDRESS/ is the address of the peer, and /IFA_LOCAL/
+    // is the local one; otherwise, they are the same (or /IFA_LOCAL/ is absent).
+    if (local) {
+        addr = local;
+    }
+    if (!addr) {
+        return false;
+    }
+
+    IfaceAddr a = {
+        .family = ifa->ifa_family,
+        .prefixlen = ifa->ifa_prefixlen,
+        .scope = ifa->ifa_scope,
+    };
+    memcpy(a.raw, addr, addrlen);
+
+    if (nh->nlmsg_type == RTM_DELADDR) {
+        Iface *iface = iface_table_find(t, ifa->ifa_index);
+        if (!iface) {
+            return false;
+        }
+        IfaceAddr *b = find_addr(iface, &a);
+        if (!b) {
+            return false;
+        }
+        const size_t i = b - iface->addrs.data;
+        memmove(b, b + 1, sizeof(IfaceAddr) * (iface->addrs.size - i - 1));
+        --iface->addrs.size;
+        iface->dirty = !iface->ignored;
+        return iface->dirty;
+    }
+
+    // An address notification may come before the link one (e.g. if the latter has been lost
+    // due to buffer overrun); in that case, the interface is created with an empty name and
+    // is not reported until the link notification comes.
+    Iface *iface = find_or_insert(t, ifa->ifa_index);
+    IfaceAddr *b = find_addr(iface, &a);
+    if (b) {
+        if (b->scope == a.scope) {
+            return false;
+        }
+        b->scope = a.scope;
+    } else {
+        format_addr(iface, &a);
+        LS_VECTOR_PUSH(iface->addrs, a);
+    }
+    iface->dirty = !iface->ignored;
+    return iface->dirty;
+}
+
+bool
+iface_table_handle_msg(IfaceTable *t, const struct nlmsghdr *nh)
+{
+    switch (nh->nlmsg_type) {
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        return handle_link_msg(t, nh);
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        return handle_addr_msg(t, nh);
+    default:
+        return false;
+    }
+}
+
+void
+iface_table_clear_changes(IfaceTable *t)
+{
+    for (size_t i = 0; i < t->ifaces.size; ++i) {
+        t->ifaces.data[i].dirty = false;
+    }
+    for (size_t i = 0; i < t->removed.size; ++i) {
+        free(t->removed.data[i]);
+    }
+    LS_VECTOR_CLEAR(t->removed);
+}
+
+void
+iface_table_destroy(IfaceTable *t)
+{
+    for (size_t i = 0; i < t->ifaces.size; ++i) {
+        iface_destroy(&t->ifaces.data[i]);
+    }
+    LS_VECTOR_FREE(t->ifaces);
+
+    for (size_t i = 0; i < t->removed.size; ++i) {
+        free(t->removed.data[i]);
+    }
+    LS_VECTOR_FREE(t->removed);
+}
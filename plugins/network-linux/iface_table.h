@@ -0,0 +1,121 @@
+#ifndef iface_table_h_
+#define iface_table_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+
+#include "libls/vector.h"
+
+#include "wireless_info.h"
+#include "iface_filter.h"
+
+// An in-memory table of network interfaces and their addresses, keyed by interface index, that is
+// kept up to date by feeding it rtnetlink messages (both dump replies and notifications).
+
+typedef struct {
+    int family;
+    unsigned char prefixlen;
+    unsigned char scope;
+    // Raw address (/IFA_LOCAL/ if present, /IFA_ADDRESS/ otherwise); 4 or 16 bytes.
+    unsigned char raw[16];
+    // Formatted with /inet_ntop()/; IPv6 link-local addresses have "%<interface name>" appended.
+    char str[INET6_ADDRSTRLEN + IF_NAMESIZE + 1];
+} IfaceAddr;
+
+// Traffic counters, in the order they come in /struct rtnl_link_stats64/.
+enum {
+    IFACE_RX_PACKETS,
+    IFACE_TX_PACKETS,
+    IFACE_RX_BYTES,
+    IFACE_TX_BYTES,
+    IFACE_RX_ERRORS,
+    IFACE_TX_ERRORS,
+    IFACE_RX_DROPPED,
+    IFACE_TX_DROPPED,
+    IFACE_NCOUNTERS,
+};
+
+typedef struct {
+    int ifindex;
+    // Empty if the interface is not known yet (an address notification may come before the link
+    // one).
+    char name[IF_NAMESIZE];
+    unsigned flags;
+    unsigned char operstate;
+    // Whether this is a wireless interface; determined once per name, if the table's /detect_wlan/
+    // is set.
+    bool is_wlan;
+    // Whether the interface does not pass the table's filter. Such interfaces are still tracked,
+    // but are never marked dirty or recorded as removed.
+    bool ignored;
+    LS_VECTOR_OF(IfaceAddr) addrs;
+
+    // Cached wireless info, maintained by the user of the table (the table only sets
+    // /wireless_stale/ on link changes).
+    WirelessInfo wireless;
+    bool has_wireless;
+    bool wireless_stale;
+
+    // Traffic counters from the latest /IFLA_STATS64/ attribute seen, if /has_counters/. Changes
+    // in them do not mark the interface dirty.
+    bool has_counters;
+    uint64_t counters[IFACE_NCOUNTERS];
+
+    // The counters at the previous sample, and the rates computed then (if /has_rates/);
+    // maintained by the user of the table.
+    bool has_sampled;
+    uint64_t sampled[IFACE_NCOUNTERS];
+    bool has_rates;
+    double rates[IFACE_NCOUNTERS];
+
+    // Whether the interface has changed since the flag was last cleared.
+    bool dirty;
+} Iface;
+
+typedef struct {
+    // Sorted by /ifindex/.
+    LS_VECTOR_OF(Iface) ifaces;
+
+    // Names of interfaces that have been removed since the list was last cleared.
+    LS_VECTOR_OF(char *) removed;
+
+    // May be /NULL/.
+    const IfaceFilter *filter;
+
+    // Whether to find out /Iface::is_wlan/ (which means reading a sysfs file for each new name).
+    // /false/ after /iface_table_init()/; may be set before any message is handled.
+    bool detect_wlan;
+} IfaceTable;
+
+// /filter/ may be /NULL/; otherwise, it must outlive the table.
+void
+iface_table_init(IfaceTable *t, const IfaceFilter *filter);
+
+// Removes all the interfaces, recording them as removed. Used before re-dumping the whole state.
+void
+iface_table_reset(IfaceTable *t);
+
+// Finds an interface by its index; returns /NULL/ if not found.
+Iface *
+iface_table_find(IfaceTable *t, int ifindex);
+
+// Updates /t/ according to an /RTM_NEWLINK/, /RTM_DELLINK/, /RTM_NEWADDR/ or /RTM_DELADDR/
+// message; other messages are ignored.
+//
+// Returns /true/ if anything has changed (the affected interface is then marked dirty, or, if it
+// has been removed, its name is appended to /t->removed/).
+bool
+iface_table_handle_msg(IfaceTable *t, const struct nlmsghdr *nh);
+
+// Clears the dirty flags and the removed list.
+void
+iface_table_clear_changes(IfaceTable *t);
+
+void
+iface_table_destroy(IfaceTable *t);
+
+#endif
@@ -2,8 +2,8 @@
 #include <asm/types.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <ifaddrs.h>
-#include <netdb.h>
+#include <asm/socket.h>
+#include <poll.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <time.h>
@@ -11,8 +11,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 
+#if EAGAIN == EWOULDBLOCK
+#   define IS_EAGAIN(E_) ((E_) == EAGAIN)
+#else
+#   define IS_EAGAIN(E_) ((E_) == EAGAIN || (E_) == EWOULDBLOCK)
+#endif
+
 #include "include/plugin_v1.h"
 #include "include/plugin_utils.h"
 #include "include/sayf_macros.h"
@@ -20,19 +28,14 @@
 #include "libls/alloc_utils.h"
 #include "libls/osdep.h"
 #include "libls/cstring_utils.h"
-#include "libls/time_utils.h"
 #include "libls/strarr.h"
+#include "libls/algo.h"
+#include "libls/time_utils.h"
 
-#include "string_set.h"
+#include "iface_table.h"
+#include "iface_filter.h"
 #include "wireless_info.h"
 #include "ethernet_info.h"
-#include "iface_type.h"
-
-#if EAGAIN == EWOULDBLOCK
-#   define IS_EAGAIN(E_) ((E_) == EAGAIN)
-#else
-#   define IS_EAGAIN(E_) ((E_) == EAGAIN || (E_) == EWOULDBLOCK)
-#endif
 
 enum {
     REPORT_IP       = 1 << 0,
@@ -42,9 +45,20 @@ enum {
 
 typedef struct {
     int flags;
-    struct timeval timeout;
-    StringSet wlan_ifaces;
+    int timeout_ms;
+    int wireless_period_ms;
+    int debounce_ms;
+    int stats_period_ms;
+    double stats_smoothing;
+    int rcvbuf;
+    bool changes_only;
+    IfaceFilter filter;
     int eth_sockfd;
+    WirelessConn wconn;
+    // Whether the last attempt to (re)establish /wconn/ has failed and has been logged.
+    bool wconn_failed;
+    IfaceTable table;
+    uint32_t seq;
 } Priv;
 
 static
@@ -52,8 +66,10 @@ void
 destroy(LuastatusPluginData *pd)
 {
     Priv *p = pd->priv;
-    string_set_destroy(p->wlan_ifaces);
     close(p->eth_sockfd);
+    wireless_conn_close(&p->wconn);
+    iface_table_destroy(&p->table);
+    iface_filter_destroy(&p->filter);
     free(p);
 }
 
@@ -68,6 +84,25 @@ modify_bit(int *mask, int bit, bool value)
     }
 }
 
+// Converts a number of seconds /n/ to milliseconds; a negative /n/ is converted to -1.
+// Returns /false/ if /n/ is NaN or too large.
+static
+bool
+millis_from_seconds(double n, int *out)
+{
+    if (n < 0) {
+        *out = -1;
+        return true;
+    }
+    const double nmillis = n * 1000;
+    // Note: this also checks that /n/ is not NaN.
+    if (!(nmillis <= INT_MAX)) {
+        return false;
+    }
+    *out = nmillis;
+    return true;
+}
+
 static
 int
 init(LuastatusPluginData *pd, lua_State *L)
@@ -75,10 +110,20 @@ init(LuastatusPluginData *pd, lua_State *L)
     Priv *p = pd->priv = LS_XNEW(Priv, 1);
     *p = (Priv) {
         .flags = REPORT_IP,
-        .timeout = ls_timeval_invalid,
-        .wlan_ifaces = string_set_new(),
+        .timeout_ms = -1,
+        .wireless_period_ms = -1,
+        .debounce_ms = 0,
+        .stats_period_ms = -1,
+        .stats_smoothing = 0,
+        .rcvbuf = 1024 * 1024,
+        .changes_only = false,
+        .filter = iface_filter_new(),
         .eth_sockfd = -1,
+        .wconn = WIRELESS_CONN_NEW(),
+        .wconn_failed = false,
+        .seq = 0,
     };
+    iface_table_init(&p->table, &p->filter);
 
     PU_MAYBE_VISIT_BOOL_FIELD(-1, "ip", "'ip'", b,
         modify_bit(&p->flags, REPORT_IP, b);
@@ -93,12 +138,86 @@ init(LuastatusPluginData *pd, lua_State *L)
     );
 
     PU_MAYBE_VISIT_NUM_FIELD(-1, "timeout", "'timeout'", n,
-        if (!ls_opt_timeval_from_seconds(n, &p->timeout)) {
+        if (!millis_from_seconds(n, &p->timeout_ms)) {
             LS_FATALF(pd, "'timeout' is invalid");
             goto error;
         }
     );
 
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "wireless_period", "'wireless_period'", n,
+        if (!millis_from_seconds(n, &p->wireless_period_ms)) {
+            LS_FATALF(pd, "'wireless_period' is invalid");
+            goto error;
+        }
+    );
+
+    PU_MAYBE_VISIT_BOOL_FIELD(-1, "changes_only", "'changes_only'", b,
+        p->changes_only = b;
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "debounce", "'debounce'", n,
+        if (!millis_from_seconds(n, &p->debounce_ms)) {
+            LS_FATALF(pd, "'debounce' is invalid");
+            goto error;
+        }
+        if (p->debounce_ms < 0) {
+            p->debounce_ms = 0;
+        }
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "stats_period", "'stats_period'", n,
+        if (!millis_from_seconds(n, &p->stats_period_ms) || p->stats_period_ms == 0) {
+            LS_FATALF(pd, "'stats_period' is invalid");
+            goto error;
+        }
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "stats_smoothing", "'stats_smoothing'", n,
+        // Note: this also checks that /n/ is not NaN.
+        if (!(n >= 0 && n < 1)) {
+            LS_FATALF(pd, "'stats_smoothing' must be within [0; 1)");
+            goto error;
+        }
+        p->stats_smoothing = n;
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "rcvbuf", "'rcvbuf'", n,
+        // Note: this also checks that /n/ is not NaN.
+        if (!(n >= 0 && n <= INT_MAX)) {
+            LS_FATALF(pd, "'rcvbuf' is invalid");
+            goto error;
+        }
+        p->rcvbuf = n;
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "include", "'include'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'include' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'include' element", s,
+            ls_strarr_append_s(&p->filter.include, s);
+        );
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "exclude", "'exclude'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'exclude' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'exclude' element", s,
+            ls_strarr_append_s(&p->filter.exclude, s);
+        );
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "include_kinds", "'include_kinds'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'include_kinds' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'include_kinds' element", s,
+            ls_strarr_append_s(&p->filter.include_kinds, s);
+        );
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "exclude_kinds", "'exclude_kinds'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'exclude_kinds' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'exclude_kinds' element", s,
+            ls_strarr_append_s(&p->filter.exclude_kinds, s);
+        );
+    );
+
     if (p->flags & REPORT_ETHERNET) {
         p->eth_sockfd = ls_cloexec_socket(AF_INET, SOCK_DGRAM, 0);
         if (p->eth_sockfd < 0) {
@@ -106,6 +225,10 @@ init(LuastatusPluginData *pd, lua_State *L)
         }
     }
 
+    if (p->flags & REPORT_WIRELESS) {
+        p->table.detect_wlan = true;
+    }
+
     return LUASTATUS_OK;
 
 error:
@@ -125,54 +248,53 @@ report_error(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
 
 static
 void
-inject_ip_info(lua_State *L, struct ifaddrs *addr)
+inject_ip_info(lua_State *L, const Iface *iface)
 {
-    // L: ? ifacetbl
-    if (!addr->ifa_addr) {
-        return;
+    // For each family, report the first address with the global ("universe") scope, or, if there
+    // are none, the first address at all.
+    const IfaceAddr *best4 = NULL;
+    const IfaceAddr *best6 = NULL;
+    for (size_t i = 0; i < iface->addrs.size; ++i) {
+        const IfaceAddr *a = &iface->addrs.data[i];
+        if (!a->str[0]) {
+            continue;
+        }
+        const IfaceAddr **best = a->family == AF_INET ? &best4 : &best6;
+        if (!*best || ((*best)->scope != RT_SCOPE_UNIVERSE && a->scope == RT_SCOPE_UNIVERSE)) {
+            *best = a;
+        }
     }
-    int family = addr->ifa_addr->sa_family;
-    if (family != AF_INET && family != AF_INET6) {
-        return;
+    // L: ? ifacetbl
+    if (best4) {
+        lua_pushstring(L, best4->str); // L: ? ifacetbl ip
+        lua_setfield(L, -2, "ipv4"); // L: ? ifacetbl
     }
-    char host[1025];
-    int r = getnameinfo(
-        addr->ifa_addr,
-        family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
-        host, sizeof(host),
-        NULL, 0, NI_NUMERICHOST);
-    if (r) {
-        return;
+    if (best6) {
+        lua_pushstring(L, best6->str); // L: ? ifacetbl ip
+        lua_setfield(L, -2, "ipv6"); // L: ? ifacetbl
     }
-    lua_pushstring(L, host); // L: ? ifacetbl ip
-    lua_setfield(L, -2, family == AF_INET ? "ipv4" : "ipv6"); // L: ? ifacetbl
 }
 
 static
 void
-inject_wireless_info(lua_State *L, struct ifaddrs *addr)
+inject_wireless_info(lua_State *L, const WirelessInfo *info)
 {
-    WirelessInfo info;
-    if (!get_wireless_info(addr->ifa_name, &info)) {
-        return;
-    }
-
     // L: ? ifacetbl
     lua_createtable(L, 0, 4); // L: ? ifacetbl table
-    if (info.flags & HAS_ESSID) {
-        lua_pushstring(L, info.essid); // L: ? ifacetbl table str
+    if (info->flags & HAS_ESSID) {
+        lua_pushstring(L, info->essid); // L: ? ifacetbl table str
         lua_setfield(L, -2, "ssid"); // L: ? ifacetbl table
     }
-    if (info.flags & HAS_SIGNAL_DBM) {
-        lua_pushnumber(L, info.signal_dbm); // L: ? ifacetbl table number
+    if (info->flags & HAS_SIGNAL_DBM) {
+        lua_pushnumber(L, info->signal_dbm); // L: ? ifacetbl table number
         lua_setfield(L, -2, "signal_dbm"); // L: ? ifacetbl table
     }
-    if (info.flags & HAS_FREQUENCY) {
-        lua_pushnumber(L, info.frequency); // L: ? ifacetbl table number
+    if (info->flags & HAS_FREQUENCY) {
+        lua_pushnumber(L, info->frequency); // L: ? ifacetbl table number
         lua_setfield(L, -2, "frequency"); // L: ? ifacetbl table
     }
-    if (info.flags & HAS_BITRATE) {
-        lua_pushnumber(L, info.bitrate); // L: ? ifacetbl table number
+    if (info->flags & HAS_BITRATE) {
+        lua_pushnumber(L, info->bitrate); // L: ? ifacetbl table number
         lua_setfield(L, -2, "bitrate"); // L: ? ifacetbl table
     }
     lua_setfield(L, -2, "wireless"); // L: ? ifacetbl
@@ -180,9 +302,9 @@ inject_wireless_info(lua_State *L, struct ifaddrs *addr)
 
 static
 void
-inject_ethernet_info(lua_State *L, struct ifaddrs *addr, int sockfd)
+inject_ethernet_info(lua_State *L, const Iface *iface, int sockfd)
 {
-    const int speed = get_ethernet_speed(sockfd, addr->ifa_name);
+    const int speed = get_ethernet_speed(sockfd, iface->name);
     if (!speed) {
         return;
     }
@@ -195,85 +317,479 @@ inject_ethernet_info(lua_State *L, struct ifaddrs *addr, int sockfd)
     lua_setfield(L, -2, "ethernet"); // L: ? ifacetbl
 }
 
+// Re-queries the wireless info of /iface/ and updates the cache. Returns /true/ if the info has
+// changed.
+static
+bool
+update_wireless_info(Priv *p, Iface *iface)
+{
+    WirelessInfo info;
+    const bool ok = get_wireless_info(&p->wconn, iface->ifindex, &info);
+    iface->wireless_stale = false;
+    if (ok == iface->has_wireless && (!ok || memcmp(&info, &iface->wireless, sizeof(info)) == 0)) {
+        return false;
+    }
+    iface->has_wireless = ok;
+    iface->wireless = info;
+    return true;
+}
+
 static
 void
-make_call(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, bool timeout)
+inject_stats(lua_State *L, const Iface *iface)
 {
-    struct ifaddrs *ifaddr;
-    if (getifaddrs(&ifaddr) < 0) {
-        LS_ERRF(pd, "getifaddrs: %s", ls_strerror_onstack(errno));
-        report_error(pd, funcs);
-        return;
+    static const char *const COUNTER_NAMES[IFACE_NCOUNTERS] = {
+        [IFACE_RX_PACKETS] = "rx_packets",
+        [IFACE_TX_PACKETS] = "tx_packets",
+        [IFACE_RX_BYTES] = "rx_bytes",
+        [IFACE_TX_BYTES] = "tx_bytes",
+        [IFACE_RX_ERRORS] = "rx_errors",
+        [IFACE_TX_ERRORS] = "tx_errors",
+        [IFACE_RX_DROPPED] = "rx_dropped",
+        [IFACE_TX_DROPPED] = "tx_dropped",
+    };
+    static const char *const RATE_NAMES[IFACE_NCOUNTERS] = {
+        [IFACE_RX_PACKETS] = "rx_packets_rate",
+        [IFACE_TX_PACKETS] = "tx_packets_rate",
+        [IFACE_RX_BYTES] = "rx_rate",
+        [IFACE_TX_BYTES] = "tx_rate",
+    };
+
+    // L: ? ifacetbl
+    lua_createtable(L, 0, IFACE_NCOUNTERS + 4); // L: ? ifacetbl table
+    for (int i = 0; i < IFACE_NCOUNTERS; ++i) {
+        lua_pushnumber(L, iface->sampled[i]); // L: ? ifacetbl table number
+        lua_setfield(L, -2, COUNTER_NAMES[i]); // L: ? ifacetbl table
+    }
+    if (iface->has_rates) {
+        for (int i = 0; i < IFACE_NCOUNTERS; ++i) {
+            if (RATE_NAMES[i]) {
+                lua_pushnumber(L, iface->rates[i]); // L: ? ifacetbl table number
+                lua_setfield(L, -2, RATE_NAMES[i]); // L: ? ifacetbl table
+            }
+        }
     }
+    lua_setfield(L, -2, "stats"); // L: ? ifacetbl
+}
 
-    lua_State *L = funcs.call_begin(pd->userdata); // L: ?
-    lua_newtable(L); // L: ? table
+static
+void
+push_iface(lua_State *L, Priv *p, Iface *iface)
+{
+    // L: ?
+    lua_newtable(L); // L: ? ifacetbl
+    if (p->flags & REPORT_IP) {
+        inject_ip_info(L, iface); // L: ? ifacetbl
+    }
+    if ((p->flags & REPORT_WIRELESS) && iface->is_wlan) {
+        if (iface->wireless_stale) {
+            update_wireless_info(p, iface);
+        }
+        if (iface->has_wireless) {
+            inject_wireless_info(L, &iface->wireless); // L: ? ifacetbl
+        }
+    }
+    if (p->flags & REPORT_ETHERNET) {
+        inject_ethernet_info(L, iface, p->eth_sockfd); // L: ? ifacetbl
+    }
+    if (p->stats_period_ms > 0 && iface->has_sampled) {
+        inject_stats(L, iface); // L: ? ifacetbl
+    }
+}
 
+// If /p->changes_only/ is set, only the interfaces that have changed since the last call (or, on
+// timeout, the wireless ones) are reported, and the removed ones are reported as /false/.
+static
+void
+make_call(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, bool timeout)
+{
     Priv *p = pd->priv;
-    if (!timeout) {
-        string_set_reset(&p->wlan_ifaces);
-    }
-
-    for (struct ifaddrs *cur = ifaddr; cur; cur = cur->ifa_next) {
-        lua_getfield(L, -1, cur->ifa_name); // L: ? table ifacetbl
-        if (lua_isnil(L, -1)) {
-            lua_pop(L, 1); // L: ? table
-            lua_newtable(L); // L: ? table ifacetbl
-            lua_pushvalue(L, -1); // L: ? table ifacetbl ifacetbl
-            lua_setfield(L, -3, cur->ifa_name); // L: ? table ifacetbl
-
-            if (p->flags & REPORT_WIRELESS) {
-                bool is_wlan;
-                if (timeout) {
-                    is_wlan = string_set_contains(p->wlan_ifaces, cur->ifa_name);
-                } else {
-                    is_wlan = is_wlan_iface(cur->ifa_name);
-                    if (is_wlan) {
-                        string_set_add(&p->wlan_ifaces, cur->ifa_name);
-                    }
-                }
-                if (is_wlan) {
-                    inject_wireless_info(L, cur); // L: ? table ifacetbl
-                }
+    IfaceTable *t = &p->table;
+
+    lua_State *L = funcs.call_begin(pd->userdata); // L: ?
+    lua_createtable(L, 0, t->ifaces.size); // L: ? table
+
+    if (p->changes_only) {
+        for (size_t i = 0; i < t->removed.size; ++i) {
+            lua_pushboolean(L, 0); // L: ? table false
+            lua_setfield(L, -2, t->removed.data[i]); // L: ? table
+        }
+    }
+
+    for (size_t i = 0; i < t->ifaces.size; ++i) {
+        Iface *iface = &t->ifaces.data[i];
+        if (!iface->name[0] || iface->ignored) {
+            continue;
+        }
+        if (p->changes_only) {
+            const bool volatile_info = timeout && iface->is_wlan && (p->flags & REPORT_WIRELESS);
+            if (!iface->dirty && !volatile_info) {
+                continue;
             }
+        }
+        push_iface(L, p, iface); // L: ? table ifacetbl
+        lua_setfield(L, -2, iface->name); // L: ? table
+    }
+
+    iface_table_clear_changes(t);
+    funcs.call_end(pd->userdata);
+}
 
-            if (p->flags & REPORT_ETHERNET) {
-                inject_ethernet_info(L, cur, p->eth_sockfd); // L: ? table ifacetbl
+// Handles a batch of netlink messages read from the socket.
+//
+// If /dump_seq/ is not zero, sets /*dump_done/ when the end of the dump with this sequence number
+// is seen, and /*dump_intr/ if the kernel reports the dump was interrupted by a change.
+//
+// On error, logs it and returns /false/.
+static
+bool
+handle_msgs(
+        LuastatusPluginData *pd,
+        char *buf,
+        ssize_t len,
+        uint32_t dump_seq,
+        bool *changed,
+        bool *dump_done,
+        bool *dump_intr)
+{
+    Priv *p = pd->priv;
+    for (struct nlmsghdr *nh = (struct nlmsghdr *) buf;
+         NLMSG_OK(nh, len);
+         nh = NLMSG_NEXT(nh, len))
+    {
+        const bool is_dump_reply = dump_seq && nh->nlmsg_seq == dump_seq;
+        if (is_dump_reply && (nh->nlmsg_flags & NLM_F_DUMP_INTR)) {
+            *dump_intr = true;
+        }
+        if (nh->nlmsg_type == NLMSG_DONE) {
+            // end of multipart message
+            if (is_dump_reply) {
+                *dump_done = true;
+            }
+            continue;
+        }
+        if (nh->nlmsg_type == NLMSG_ERROR) {
+            if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+                LS_ERRF(pd, "netlink error message truncated");
+                return false;
+            }
+            struct nlmsgerr *e = NLMSG_DATA(nh);
+            const int errnum = e->error;
+            if (errnum) {
+                LS_ERRF(pd, "netlink error: %s", ls_strerror_onstack(-errnum));
+                return false;
+            } else {
+                LS_WARNF(pd, "unexpected ACK - what's going on?");
+                continue;
             }
         }
+        if (iface_table_handle_msg(&p->table, nh)) {
+            *changed = true;
+        }
+    }
+    return true;
+}
+
+// Reads from /fd/ into /buf/ of size /nbuf/, retrying on /EINTR/.
+static
+ssize_t
+recv_msgs(int fd, char *buf, size_t nbuf, int flags)
+{
+    struct iovec iov = {buf, nbuf};
+    struct msghdr msg = {NULL, 0, &iov, 1, NULL, 0, 0};
+    ssize_t len;
+    while ((len = recvmsg(fd, &msg, flags)) < 0 && errno == EINTR) {}
+    return len;
+}
 
-        if (p->flags & REPORT_IP) {
-            inject_ip_info(L, cur); // L: ? table ifacetbl
+// Requests a dump of type /type/ (/RTM_GETLINK/ or /RTM_GETADDR/) and feeds the replies (and any
+// notifications that arrive meanwhile) to the table; sets /*changed/ if anything has changed.
+//
+// Returns 1 on success, 0 if the dump has been interrupted and should be retried, or -1 on error
+// (which is logged).
+static
+int
+dump(LuastatusPluginData *pd, int fd, int type, char *buf, size_t nbuf, bool *changed)
+{
+    Priv *p = pd->priv;
+    if (!++p->seq) {
+        ++p->seq;
+    }
+    const uint32_t seq = p->seq;
+
+    struct {
+        struct nlmsghdr nh;
+        struct rtgenmsg g;
+    } req = {
+        .nh = {
+            .nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg)),
+            .nlmsg_type = type,
+            .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+            .nlmsg_seq = seq,
+        },
+        .g = {.rtgen_family = AF_UNSPEC},
+    };
+    if (send(fd, &req, req.nh.nlmsg_len, 0) < 0) {
+        LS_ERRF(pd, "send: %s", ls_strerror_onstack(errno));
+        return -1;
+    }
+
+    bool done = false;
+    bool intr = false;
+    while (!done) {
+        ssize_t len = recv_msgs(fd, buf, nbuf, 0);
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                // Some notifications have been lost; the dump itself goes on, but the whole
+                // resync has to be redone afterwards.
+                intr = true;
+                continue;
+            }
+            LS_ERRF(pd, "recvmsg: %s", ls_strerror_onstack(errno));
+            return -1;
+        }
+        if (!handle_msgs(pd, buf, len, seq, changed, &done, &intr)) {
+            return -1;
         }
+    }
+    return intr ? 0 : 1;
+}
 
-        lua_pop(L, 1); // L: ? table
+// Re-reads the whole state into the table.
+static
+bool
+resync(LuastatusPluginData *pd, int fd, char *buf, size_t nbuf)
+{
+    Priv *p = pd->priv;
+    // Interfaces must be known before their addresses are, so the links are dumped first.
+    const int types[] = {RTM_GETLINK, RTM_GETADDR};
+    for (int attempt = 0; ; ++attempt) {
+        iface_table_reset(&p->table);
+        int r = 1;
+        bool changed = false;
+        for (size_t i = 0; i < LS_ARRAY_SIZE(types) && r == 1; ++i) {
+            r = dump(pd, fd, types[i], buf, nbuf, &changed);
+        }
+        if (r < 0) {
+            return false;
+        }
+        if (r == 1) {
+            return true;
+        }
+        if (attempt == 10) {
+            LS_WARNF(pd, "dump keeps being interrupted; the state may be inconsistent");
+            return true;
+        }
     }
+}
 
-    if (!timeout) {
-        string_set_freeze(&p->wlan_ifaces);
+// Reads and handles all the pending messages without blocking; sets /*changed/ if anything has
+// changed. If the kernel reports that the socket buffer has overrun, resynchronizes right away.
+//
+// On error, logs it and returns /false/.
+static
+bool
+drain(LuastatusPluginData *pd, int fd, char *buf, size_t nbuf, bool *changed)
+{
+    while (1) {
+        ssize_t len = recv_msgs(fd, buf, nbuf, MSG_DONTWAIT);
+        if (len < 0) {
+            if (IS_EAGAIN(errno)) {
+                return true;
+            } else if (errno == ENOBUFS) {
+                LS_WARNF(pd, "ENOBUFS - kernel's socket buffer is full, resynchronizing");
+                if (!resync(pd, fd, buf, nbuf)) {
+                    return false;
+                }
+                *changed = true;
+                continue;
+            } else {
+                LS_ERRF(pd, "recvmsg: %s", ls_strerror_onstack(errno));
+                return false;
+            }
+        }
+        bool dump_done = false;
+        bool dump_intr = false;
+        if (!handle_msgs(pd, buf, len, 0, changed, &dump_done, &dump_intr)) {
+            return false;
+        }
     }
+}
 
-    freeifaddrs(ifaddr);
-    funcs.call_end(pd->userdata);
+static
+void
+setup_rcvbuf(LuastatusPluginData *pd, int fd)
+{
+    Priv *p = pd->priv;
+    if (!p->rcvbuf) {
+        return;
+    }
+    // /SO_RCVBUFFORCE/ can exceed /net.core.rmem_max/, but requires /CAP_NET_ADMIN/.
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &p->rcvbuf, sizeof(p->rcvbuf)) < 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &p->rcvbuf, sizeof(p->rcvbuf)) < 0)
+    {
+        LS_WARNF(pd, "setsockopt: %s", ls_strerror_onstack(errno));
+    }
 }
 
 static
 void
-setup_sock_timeout(LuastatusPluginData *pd, int fd)
+mark_wlan_ifaces(IfaceTable *t, bool dirty)
+{
+    for (size_t i = 0; i < t->ifaces.size; ++i) {
+        Iface *iface = &t->ifaces.data[i];
+        if (iface->is_wlan && !iface->ignored) {
+            iface->wireless_stale = true;
+            if (dirty) {
+                iface->dirty = true;
+            }
+        }
+    }
+}
+
+// Establishes whatever part of the nl80211 connection is missing: it may have failed to open (e.g.
+// cfg80211 had not been loaded yet), and the event socket is closed on a receive error. Called
+// whenever the wireless info is about to be queried, so the connection is retried lazily. Only the
+// first of consecutive failures is logged.
+//
+// If the event socket has just been (re)subscribed, events may have been missed: the wireless
+// interfaces are then marked stale and dirty, and /true/ is returned.
+static
+bool
+wconn_ensure(LuastatusPluginData *pd)
 {
     Priv *p = pd->priv;
-    const struct timeval timeout = p->timeout;
-    if (!ls_timeval_is_invalid(timeout)) {
-        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-            LS_WARNF(pd, "setsockopt: %s", ls_strerror_onstack(errno));
+    if (!(p->flags & REPORT_WIRELESS)) {
+        return false;
+    }
+    const char *err;
+    if (!p->wconn.sk && (err = wireless_conn_open(&p->wconn))) {
+        if (!p->wconn_failed) {
+            LS_WARNF(pd, "cannot connect to nl80211: %s", err);
+        }
+        p->wconn_failed = true;
+        return false;
+    }
+    if (p->wconn.ev_sk) {
+        return false;
+    }
+    if ((err = wireless_conn_subscribe(&p->wconn))) {
+        if (!p->wconn_failed) {
+            LS_WARNF(pd, "cannot subscribe to nl80211 events: %s", err);
+        }
+        p->wconn_failed = true;
+        return false;
+    }
+    p->wconn_failed = false;
+    mark_wlan_ifaces(&p->table, true);
+    return true;
+}
+
+typedef struct {
+    IfaceTable *table;
+    bool changed;
+} WirelessEventCtx;
+
+static
+void
+on_wireless_event(void *ud, int ifindex)
+{
+    WirelessEventCtx *ctx = ud;
+    Iface *iface = iface_table_find(ctx->table, ifindex);
+    if (iface && iface->is_wlan && !iface->ignored) {
+        iface->wireless_stale = true;
+        iface->dirty = true;
+        ctx->changed = true;
+    }
+}
+
+// Re-queries the wireless info of all wireless interfaces; returns /true/ if any has changed.
+static
+bool
+poll_wireless_info(Priv *p)
+{
+    bool changed = false;
+    for (size_t i = 0; i < p->table.ifaces.size; ++i) {
+        Iface *iface = &p->table.ifaces.data[i];
+        if (iface->is_wlan && !iface->ignored && update_wireless_info(p, iface)) {
+            iface->dirty = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Takes a sample of the traffic counters of all interfaces (which must have just been dumped)
+// and updates the rates; /dt/ is the time since the previous sample, in seconds, or negative if
+// there was none. Marks the sampled interfaces dirty.
+static
+void
+sample_stats(Priv *p, double dt)
+{
+    const double alpha = p->stats_smoothing;
+    for (size_t i = 0; i < p->table.ifaces.size; ++i) {
+        Iface *iface = &p->table.ifaces.data[i];
+        if (!iface->has_counters || iface->ignored) {
+            continue;
+        }
+        if (iface->has_sampled && dt > 0) {
+            bool ok = true;
+            double rates[IFACE_NCOUNTERS];
+            for (int j = 0; j < IFACE_NCOUNTERS; ++j) {
+                if (iface->counters[j] < iface->sampled[j]) {
+                    // The counters have been reset.
+                    ok = false;
+                    break;
+                }
+                rates[j] = (iface->counters[j] - iface->sampled[j]) / dt;
+            }
+            if (ok) {
+                for (int j = 0; j < IFACE_NCOUNTERS; ++j) {
+                    iface->rates[j] = iface->has_rates
+                        ? alpha * iface->rates[j] + (1 - alpha) * rates[j]
+                        : rates[j];
+                }
+                iface->has_rates = true;
+            } else {
+                iface->has_rates = false;
+            }
         }
+        memcpy(iface->sampled, iface->counters, sizeof(iface->sampled));
+        iface->has_sampled = true;
+        iface->dirty = true;
     }
 }
 
+// Returns the deadline /period_ms/ milliseconds after /now/, or -1 if /period_ms/ is negative.
+static
+int64_t
+next_deadline(int64_t now, int period_ms)
+{
+    return period_ms >= 0 ? now + period_ms : -1;
+}
+
+static
+int
+poll_timeout(int64_t now, const int64_t *deadlines, size_t ndeadlines)
+{
+    int64_t r = -1;
+    for (size_t i = 0; i < ndeadlines; ++i) {
+        if (deadlines[i] < 0) {
+            continue;
+        }
+        const int64_t left = deadlines[i] > now ? deadlines[i] - now : 0;
+        if (r < 0 || left < r) {
+            r = left;
+        }
+    }
+    return r > INT_MAX ? INT_MAX : r;
+}
+
 static
 bool
 interact(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
 {
+    Priv *p = pd->priv;
     bool ret = false;
     int fd = ls_cloexec_socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
     if (fd < 0) {
@@ -289,59 +805,133 @@ interact(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
         goto error;
     }
 
-    setup_sock_timeout(pd, fd);
+    setup_rcvbuf(pd, fd);
 
     // netlink(7) says "8192 to avoid message truncation on platforms with page size > 4096"
     char buf[8192];
-    while (1) {
-        make_call(pd, funcs, false);
 
-        struct iovec iov = {buf, sizeof(buf)};
-        struct msghdr msg = {NULL, 0, &iov, 1, NULL, 0, 0};
-        ssize_t len = recvmsg(fd, &msg, 0);
-        if (len < 0) {
+    // We are subscribed to the notifications before dumping, so no update can be lost in
+    // between.
+    if (!resync(pd, fd, buf, sizeof(buf))) {
+        ret = true;
+        goto error;
+    }
+    int64_t now = ls_now_ms();
+    // The time of the previous traffic counters sample.
+    int64_t stats_sampled_at = -1;
+    if (p->stats_period_ms > 0) {
+        // The counters have just been dumped with the links.
+        sample_stats(p, -1);
+        stats_sampled_at = now;
+    }
+
+    wconn_ensure(pd);
+    make_call(pd, funcs, false);
+
+    enum {
+        // The next call on timeout.
+        DL_TIMEOUT,
+        // The next wireless info poll.
+        DL_WIRELESS,
+        // The end of the debounce window: a call has been postponed until then.
+        DL_DEBOUNCE,
+        // The next traffic counters sample.
+        DL_STATS,
+        DL__LAST,
+    };
+    int64_t deadlines[DL__LAST] = {
+        [DL_TIMEOUT] = next_deadline(now, p->timeout_ms),
+        [DL_WIRELESS] = next_deadline(now, p->wireless_period_ms),
+        [DL_DEBOUNCE] = -1,
+        [DL_STATS] = next_deadline(now, p->stats_period_ms),
+    };
+
+    while (1) {
+        struct pollfd pfds[2] = {
+            {.fd = fd, .events = POLLIN},
+            // /poll()/ ignores negative fds.
+            {.fd = wireless_conn_event_fd(&p->wconn), .events = POLLIN},
+        };
+        const int r = poll(pfds, 2, poll_timeout(now, deadlines, DL__LAST));
+        if (r < 0) {
             if (errno == EINTR) {
                 continue;
-            } else if (IS_EAGAIN(errno)) {
-                make_call(pd, funcs, true);
-                continue;
-            } else if (errno == ENOBUFS) {
+            }
+            LS_FATALF(pd, "poll: %s", ls_strerror_onstack(errno));
+            goto error;
+        }
+
+        bool changed = false;
+
+        if (pfds[0].revents) {
+            if (!drain(pd, fd, buf, sizeof(buf), &changed)) {
                 ret = true;
-                LS_WARNF(pd, "ENOBUFS - kernel's socket buffer is full");
-                goto error;
-            } else {
-                LS_FATALF(pd, "recvmsg: %s", ls_strerror_onstack(errno));
                 goto error;
             }
         }
 
-        for (struct nlmsghdr *nh = (struct nlmsghdr *) buf;
-             NLMSG_OK(nh, len);
-             nh = NLMSG_NEXT(nh, len))
-        {
-            if (nh->nlmsg_type == NLMSG_DONE) {
-                // end of multipart message
-                break;
+        if (pfds[1].revents) {
+            WirelessEventCtx ctx = {.table = &p->table, .changed = false};
+            if (!wireless_conn_read_events(&p->wconn, on_wireless_event, &ctx)) {
+                // Some events may have been lost.
+                mark_wlan_ifaces(&p->table, true);
+                ctx.changed = true;
             }
-            if (nh->nlmsg_type == NLMSG_ERROR) {
-                if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
-                    LS_ERRF(pd, "netlink error message truncated");
-                    ret = true;
-                    goto error;
-                }
-                struct nlmsgerr *e = NLMSG_DATA(nh);
-                const int errnum = e->error;
-                if (errnum) {
-                    LS_ERRF(pd, "netlink error: %s", ls_strerror_onstack(-errnum));
+            if (ctx.changed) {
+                changed = true;
+            }
+        }
+
+        now = ls_now_ms();
+        if (deadlines[DL_WIRELESS] >= 0 && now >= deadlines[DL_WIRELESS]) {
+            if (wconn_ensure(pd)) {
+                changed = true;
+            }
+            if (poll_wireless_info(p)) {
+                changed = true;
+            }
+            deadlines[DL_WIRELESS] = next_deadline(now, p->wireless_period_ms);
+        }
+
+        if (deadlines[DL_STATS] >= 0 && now >= deadlines[DL_STATS]) {
+            const int dr = dump(pd, fd, RTM_GETLINK, buf, sizeof(buf), &changed);
+            if (dr < 0) {
+                ret = true;
+                goto error;
+            }
+            if (dr == 0) {
+                // Some notifications have been lost.
+                if (!resync(pd, fd, buf, sizeof(buf))) {
                     ret = true;
                     goto error;
-                } else {
-                    LS_WARNF(pd, "unexpected ACK - what's going on?");
-                    continue;
                 }
+                stats_sampled_at = -1;
             }
-            // we don't care about the message
+            now = ls_now_ms();
+            sample_stats(p, stats_sampled_at >= 0 ? (now - stats_sampled_at) / 1000.0 : -1);
+            stats_sampled_at = now;
+            changed = true;
+            deadlines[DL_STATS] = next_deadline(now, p->stats_period_ms);
+        }
+
+        // All the changes within the debounce window (counted from the first one) are reported
+        // with a single call.
+        if (changed && deadlines[DL_DEBOUNCE] < 0) {
+            deadlines[DL_DEBOUNCE] = now + p->debounce_ms;
+        }
+
+        if (deadlines[DL_TIMEOUT] >= 0 && now >= deadlines[DL_TIMEOUT]) {
+            wconn_ensure(pd);
+            mark_wlan_ifaces(&p->table, false);
+            make_call(pd, funcs, true);
+        } else if (deadlines[DL_DEBOUNCE] >= 0 && now >= deadlines[DL_DEBOUNCE]) {
+            wconn_ensure(pd);
+            make_call(pd, funcs, false);
+        } else {
+            continue;
         }
+        deadlines[DL_TIMEOUT] = next_deadline(now, p->timeout_ms);
+        deadlines[DL_DEBOUNCE] = -1;
     }
 
 error:
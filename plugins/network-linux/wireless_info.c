@@ -2,10 +2,10 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 
-#include <net/if.h>
 #include <netlink/netlink.h>
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
@@ -160,41 +160,161 @@ gwi_scan_cb(struct nl_msg *msg, void *vud)
     return NL_SKIP;
 }
 
+typedef struct {
+    void (*on_event)(void *ud, int ifindex);
+    void *ud;
+} EventHandler;
+
+static
+int
+event_cb(struct nl_msg *msg, void *vud)
+{
+    EventHandler *h = vud;
+    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+
+    switch (gnlh->cmd) {
+    case NL80211_CMD_CONNECT:
+    case NL80211_CMD_ROAM:
+    case NL80211_CMD_DISCONNECT:
+    case NL80211_CMD_ASSOCIATE:
+    case NL80211_CMD_DISASSOCIATE:
+    case NL80211_CMD_DEAUTHENTICATE:
+    case NL80211_CMD_NEW_SCAN_RESULTS:
+    case NL80211_CMD_CH_SWITCH_NOTIFY:
+        break;
+    default:
+        return NL_SKIP;
+    }
+
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    if (nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0),
+                  NULL) < 0)
+    {
+        return NL_SKIP;
+    }
+    if (!tb[NL80211_ATTR_IFINDEX]) {
+        return NL_SKIP;
+    }
+    h->on_event(h->ud, nla_get_u32(tb[NL80211_ATTR_IFINDEX]));
+    return NL_SKIP;
+}
+
+const char *
+wireless_conn_open(WirelessConn *c)
+{
+    if (!(c->sk = nl_socket_alloc())) {
+        return "nl_socket_alloc() failed";
+    }
+    int r;
+    if ((r = genl_connect(c->sk)) < 0) {
+        goto error;
+    }
+    if ((r = genl_ctrl_resolve(c->sk, "nl80211")) < 0) {
+        goto error;
+    }
+    c->family_id = r;
+    return NULL;
+
+error:
+    nl_socket_free(c->sk);
+    c->sk = NULL;
+    return nl_geterror(r);
+}
+
+const char *
+wireless_conn_subscribe(WirelessConn *c)
+{
+    if (!(c->ev_sk = nl_socket_alloc())) {
+        return "nl_socket_alloc() failed";
+    }
+    // Notifications are not replies to our requests.
+    nl_socket_disable_seq_check(c->ev_sk);
+
+    int r;
+    if ((r = genl_connect(c->ev_sk)) < 0) {
+        goto error;
+    }
+    static const char *const GROUPS[] = {"mlme", "scan"};
+    for (size_t i = 0; i < sizeof(GROUPS) / sizeof(GROUPS[0]); ++i) {
+        // The ids are resolved over the request socket, so that no replies arrive on /ev_sk/.
+        if ((r = genl_ctrl_resolve_grp(c->sk, "nl80211", GROUPS[i])) < 0) {
+            goto error;
+        }
+        if ((r = nl_socket_add_membership(c->ev_sk, r)) < 0) {
+            goto error;
+        }
+    }
+    if ((r = nl_socket_set_nonblocking(c->ev_sk)) < 0) {
+        goto error;
+    }
+    return NULL;
+
+error:
+    nl_socket_free(c->ev_sk);
+    c->ev_sk = NULL;
+    return nl_geterror(r);
+}
+
+int
+wireless_conn_event_fd(WirelessConn *c)
+{
+    return c->ev_sk ? nl_socket_get_fd(c->ev_sk) : -1;
+}
+
+bool
+wireless_conn_read_events(WirelessConn *c, void (*on_event)(void *ud, int ifindex), void *ud)
+{
+    if (!c->ev_sk) {
+        return true;
+    }
+    EventHandler h = {.on_event = on_event, .ud = ud};
+    if (nl_socket_modify_cb(c->ev_sk, NL_CB_VALID, NL_CB_CUSTOM, event_cb, &h) < 0) {
+        return false;
+    }
+    // The socket is non-blocking, so this reads at most one buffer; if there is more, /poll()/
+    // will report the socket readable again.
+    const int r = nl_recvmsgs_default(c->ev_sk);
+    if (r >= 0 || r == -NLE_AGAIN) {
+        return true;
+    }
+    // Do not count on the socket anymore; it is to be subscribed anew.
+    nl_socket_free(c->ev_sk);
+    c->ev_sk = NULL;
+    return false;
+}
+
+void
+wireless_conn_close(WirelessConn *c)
+{
+    if (c->ev_sk) {
+        nl_socket_free(c->ev_sk);
+    }
+    if (c->sk) {
+        nl_socket_free(c->sk);
+    }
+}
+
 bool
-get_wireless_info(const char *iface, WirelessInfo *info)
+get_wireless_info(WirelessConn *c, int ifindex, WirelessInfo *info)
 {
     memset(info, 0, sizeof(WirelessInfo));
     bool ok = false;
-    struct nl_sock *sk = NULL;
     struct nl_msg *msg = NULL;
 
 #define SEND() \
     do { \
-        const int r_ = nl_send_sync(sk, msg); \
+        const int r_ = nl_send_sync(c->sk, msg); \
         msg = NULL; /* nl_send_sync() calls nlmsg_free(), even on error */ \
         if (r_ < 0) { \
             goto done; \
         } \
     } while (0)
 
-    if (!(sk = nl_socket_alloc())) {
-        goto done;
-    }
-    if (genl_connect(sk) != 0) {
+    if (!c->sk) {
         goto done;
     }
 
-    if (nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM, gwi_scan_cb, info) < 0) {
-        goto done;
-    }
-
-    const int nl80211_id = genl_ctrl_resolve(sk, "nl80211");
-    if (nl80211_id < 0) {
-        goto done;
-    }
-
-    const unsigned ifidx = if_nametoindex(iface);
-    if (ifidx == 0) {
+    if (nl_socket_modify_cb(c->sk, NL_CB_VALID, NL_CB_CUSTOM, gwi_scan_cb, info) < 0) {
         goto done;
     }
 
@@ -202,18 +322,18 @@ get_wireless_info(const char *iface, WirelessInfo *info)
         goto done;
     }
 
-    if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, nl80211_id, 0, NLM_F_DUMP,
+    if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, c->family_id, 0, NLM_F_DUMP,
                      NL80211_CMD_GET_SCAN, 0))
     {
         goto done;
     }
-    if (nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifidx) < 0) {
+    if (nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifindex) < 0) {
         goto done;
     }
 
     SEND();
 
-    if (nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM, gwi_sta_cb, info) < 0) {
+    if (nl_socket_modify_cb(c->sk, NL_CB_VALID, NL_CB_CUSTOM, gwi_sta_cb, info) < 0) {
         goto done;
     }
 
@@ -221,12 +341,12 @@ get_wireless_info(const char *iface, WirelessInfo *info)
         goto done;
     }
 
-    if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, nl80211_id, 0, NLM_F_DUMP,
+    if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, c->family_id, 0, NLM_F_DUMP,
                      NL80211_CMD_GET_STATION, 0))
     {
         goto done;
     }
-    if (nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifidx) < 0) {
+    if (nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifindex) < 0) {
         goto done;
     }
     if (nla_put(msg, NL80211_ATTR_MAC, 6, info->bssid) < 0) {
@@ -240,9 +360,6 @@ done:
     if (msg) {
         nlmsg_free(msg);
     }
-    if (sk) {
-        nl_socket_free(sk);
-    }
     return ok;
 #undef SEND
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <linux/if_ether.h>
+#include <netlink/netlink.h>
 
 #define ESSID_MAX 32
 
@@ -23,7 +24,47 @@ typedef struct {
     double   frequency;
 } WirelessInfo;
 
+// A persistent connection to nl80211, the kernel's wireless configuration interface.
+typedef struct {
+    // Socket for requests; /NULL/ if not opened.
+    struct nl_sock *sk;
+    // Cached id of the "nl80211" generic netlink family.
+    int family_id;
+    // Socket subscribed to the "mlme" and "scan" multicast groups; /NULL/ if not subscribed.
+    struct nl_sock *ev_sk;
+} WirelessConn;
+
+#define WIRELESS_CONN_NEW() {.sk = NULL, .family_id = -1, .ev_sk = NULL}
+
+// Opens the request socket and resolves the family id. /c/ must not be opened.
+//
+// Returns /NULL/ on success, or an error description on failure.
+const char *
+wireless_conn_open(WirelessConn *c);
+
+// Subscribes to association, roaming and scan events. /c/ must be opened, but not subscribed.
+//
+// Returns /NULL/ on success, or an error description on failure.
+const char *
+wireless_conn_subscribe(WirelessConn *c);
+
+// Returns the file descriptor to /poll()/ for events, or -1 if not subscribed.
+int
+wireless_conn_event_fd(WirelessConn *c);
+
+// Reads pending events (without blocking) and calls /on_event(ud, ifindex)/ for each event of
+// interest.
+//
+// Returns /false/ if some events may have been lost (e.g. the socket buffer has overrun); the event
+// socket is then closed, so that /wireless_conn_subscribe()/ may be called again.
+bool
+wireless_conn_read_events(WirelessConn *c, void (*on_event)(void *ud, int ifindex), void *ud);
+
+void
+wireless_conn_close(WirelessConn *c);
+
+// Queries the info on the interface with index /ifindex/ over /c/.
 bool
-get_wireless_info(const char *iface, WirelessInfo *info);
+get_wireless_info(WirelessConn *c, int ifindex, WirelessInfo *info);
 
 #endif
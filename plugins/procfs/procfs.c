@@ -0,0 +1,527 @@
+#include <errno.h>
+#include <lua.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+#include "libls/lua_utils.h"
+#include "libls/time_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/evloop_utils.h"
+#include "libls/batch_reader.h"
+#include "libls/scan_utils.h"
+#include "libls/algo.h"
+
+typedef enum {
+    SRC_STAT,
+    SRC_MEMINFO,
+    SRC_LOADAVG,
+    SRC_DISKSTATS,
+    SRC_NET_DEV,
+    SRC_VMSTAT,
+
+    SRC__LAST,
+} Source;
+
+static const struct {
+    const char *name;
+    const char *path;
+} SOURCES[] = {
+    [SRC_STAT]      = {"stat",      "/proc/stat"},
+    [SRC_MEMINFO]   = {"meminfo",   "/proc/meminfo"},
+    [SRC_LOADAVG]   = {"loadavg",   "/proc/loadavg"},
+    [SRC_DISKSTATS] = {"diskstats", "/proc/diskstats"},
+    [SRC_NET_DEV]   = {"net_dev",   "/proc/net/dev"},
+    [SRC_VMSTAT]    = {"vmstat",    "/proc/vmstat"},
+};
+
+enum {
+    MAX_CPUS = 1 << 16,
+};
+
+// Cumulative CPU times, as per the formula used in htop (and in the "cpu-usage-linux" plugin).
+typedef struct {
+    uint64_t busy;
+    uint64_t total;
+    bool valid;
+} CpuTimes;
+
+// Cumulative counters of a named entity (a disk or a network interface).
+typedef struct {
+    // Both disk names and network interface names are shorter than that.
+    char name[32];
+    uint64_t c[4];
+} Counters;
+
+typedef LS_VECTOR_OF(Counters) CountersVector;
+
+typedef struct {
+    struct timespec period;
+    char *fifo;
+
+    LSBatchReader reader;
+    // Index of each source in /reader/, or /-1/ if the source is not enabled.
+    int idx[SRC__LAST];
+
+    // Index /0/ is for the aggregate "cpu" line, index /i + 1/ is for "cpu<i>".
+    LS_VECTOR_OF(CpuTimes) cpu_prev;
+
+    CountersVector disks_prev;
+    CountersVector disks_cur;
+    CountersVector ifaces_prev;
+    CountersVector ifaces_cur;
+
+    // Time of the previous sample (/CLOCK_MONOTONIC/), or /ls_timespec_invalid/.
+    struct timespec prev_time;
+} Priv;
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    free(p->fifo);
+    ls_batch_reader_destroy(&p->reader);
+    LS_VECTOR_FREE(p->cpu_prev);
+    LS_VECTOR_FREE(p->disks_prev);
+    LS_VECTOR_FREE(p->disks_cur);
+    LS_VECTOR_FREE(p->ifaces_prev);
+    LS_VECTOR_FREE(p->ifaces_cur);
+    free(p);
+}
+
+static
+int
+source_by_name(const char *name)
+{
+    for (int i = 0; i < SRC__LAST; ++i) {
+        if (strcmp(SOURCES[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .period = {.tv_sec = 1},
+        .fifo = NULL,
+        .cpu_prev = LS_VECTOR_NEW(),
+        .disks_prev = LS_VECTOR_NEW(),
+        .disks_cur = LS_VECTOR_NEW(),
+        .ifaces_prev = LS_VECTOR_NEW(),
+        .ifaces_cur = LS_VECTOR_NEW(),
+        .prev_time = ls_timespec_invalid,
+    };
+    ls_batch_reader_init(&p->reader);
+
+    bool enabled[SRC__LAST] = {false};
+    bool any_enabled = false;
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "sources", "'sources'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'sources' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'sources' element", s,
+            const int src = source_by_name(s);
+            if (src < 0) {
+                LS_FATALF(pd, "unknown source '%s'", s);
+                goto error;
+            }
+            enabled[src] = true;
+            any_enabled = true;
+        );
+    );
+    if (!any_enabled) {
+        enabled[SRC_STAT] = true;
+        enabled[SRC_MEMINFO] = true;
+        enabled[SRC_LOADAVG] = true;
+    }
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "period", "'period'", n,
+        if (ls_timespec_is_invalid(p->period = ls_timespec_from_seconds(n))) {
+            LS_FATALF(pd, "invalid 'period' value");
+            goto error;
+        }
+    );
+
+    PU_MAYBE_VISIT_STR_FIELD(-1, "fifo", "'fifo'", s,
+        p->fifo = ls_xstrdup(s);
+    );
+
+    for (int i = 0; i < SRC__LAST; ++i) {
+        p->idx[i] = -1;
+        if (enabled[i]) {
+            if ((p->idx[i] = ls_batch_reader_add(&p->reader, SOURCES[i].path)) < 0) {
+                LS_FATALF(pd, "%s: %s", SOURCES[i].path, ls_strerror_onstack(errno));
+                goto error;
+            }
+        }
+    }
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+// Finds the counters named /name/ (of length /nname/) in /v/. Entities usually come in the same
+// order each time, so /hint/ is checked first.
+static
+Counters *
+counters_find(CountersVector *v, const char *name, size_t nname, size_t hint)
+{
+    if (hint < v->size && ls_scan_word_eq(name, nname, v->data[hint].name)) {
+        return &v->data[hint];
+    }
+    for (size_t i = 0; i < v->size; ++i) {
+        if (ls_scan_word_eq(name, nname, v->data[i].name)) {
+            return &v->data[i];
+        }
+    }
+    return NULL;
+}
+
+// Appends a new entry named /name/ (of length /nname/) to /v/; returns /NULL/ if the name is too
+// long.
+static
+Counters *
+counters_append(CountersVector *v, const char *name, size_t nname)
+{
+    if (nname >= sizeof(((Counters *) NULL)->name)) {
+        return NULL;
+    }
+    Counters c = {.c = {0}};
+    memcpy(c.name, name, nname);
+    c.name[nname] = '\0';
+    LS_VECTOR_PUSH(*v, c);
+    return &v->data[v->size - 1];
+}
+
+static
+void
+swap_counters(CountersVector *a, CountersVector *b)
+{
+    CountersVector tmp = *a;
+    *a = *b;
+    *b = tmp;
+    LS_VECTOR_CLEAR(*b);
+}
+
+// Sets field /key/ of the table on top of /L/'s stack to the per-second rate of the /i/-th counter,
+// if there is a previous sample.
+static
+void
+maybe_set_rate(lua_State *L, const char *key, const Counters *prev, const Counters *cur, int i,
+               double dt)
+{
+    if (!prev || dt <= 0) {
+        return;
+    }
+    lua_pushnumber(L, ls_sat_sub_u64(cur->c[i], prev->c[i]) / dt); // L: ? table n
+    lua_setfield(L, -2, key); // L: ? table
+}
+
+static
+void
+push_stat(Priv *p, lua_State *L, const char *data)
+{
+    lua_createtable(L, 0, 4); // L: table
+    lua_newtable(L); // L: table cores
+
+    for (const char *s = data; *s; ls_scan_next_line(&s)) {
+        const char *word;
+        const size_t nword = ls_scan_word(&s, &word, '\0');
+
+        if (nword >= 3 && strncmp(word, "cpu", 3) == 0) {
+            size_t i = 0;
+            if (nword > 3) {
+                const char *t = word + 3;
+                i = ls_scan_u64(&t) + 1;
+                if (t != word + nword || i > MAX_CPUS) {
+                    continue;
+                }
+            }
+
+            uint64_t v[10];
+            for (int j = 0; j < 10; ++j) {
+                v[j] = ls_scan_u64(&s);
+            }
+            const uint64_t user = ls_sat_sub_u64(v[0], v[8]);
+            const uint64_t nice = ls_sat_sub_u64(v[1], v[9]);
+            const uint64_t idle_all = v[3] + v[4];
+            const uint64_t sys_all = v[2] + v[5] + v[6];
+            const uint64_t virt_all = v[8] + v[9];
+            const CpuTimes cur = {
+                .busy = user + nice + sys_all + v[7] + v[8],
+                .total = user + nice + sys_all + idle_all + v[7] + virt_all,
+                .valid = true,
+            };
+
+            if (i >= p->cpu_prev.size) {
+                LS_VECTOR_ENSURE(p->cpu_prev, i + 1);
+                while (p->cpu_prev.size <= i) {
+                    p->cpu_prev.data[p->cpu_prev.size++] = (CpuTimes) {.valid = false};
+                }
+            }
+            const CpuTimes prev = p->cpu_prev.data[i];
+            p->cpu_prev.data[i] = cur;
+
+            if (!prev.valid || cur.total <= prev.total) {
+                continue;
+            }
+            const double usage = ls_clamp01_d(
+                (double) ls_sat_sub_u64(cur.busy, prev.busy) / (cur.total - prev.total));
+            lua_pushnumber(L, usage); // L: table cores n
+            if (i == 0) {
+                lua_setfield(L, -3, "usage"); // L: table cores
+            } else {
+                lua_rawseti(L, -2, i); // L: table cores
+            }
+
+        } else if (ls_scan_word_eq(word, nword, "procs_running") ||
+                   ls_scan_word_eq(word, nword, "procs_blocked") ||
+                   ls_scan_word_eq(word, nword, "ctxt") ||
+                   ls_scan_word_eq(word, nword, "processes"))
+        {
+            lua_pushlstring(L, word, nword); // L: table cores key
+            lua_pushnumber(L, ls_scan_u64(&s)); // L: table cores key n
+            lua_rawset(L, -4); // L: table cores
+        }
+    }
+
+    lua_setfield(L, -2, "cores"); // L: table
+}
+
+// Pushes a table of "key value" or "key: value [unit]" lines of /data/.
+static
+void
+push_kv(lua_State *L, const char *data, char sep)
+{
+    lua_newtable(L); // L: table
+    for (const char *s = data; *s; ls_scan_next_line(&s)) {
+        const char *word;
+        const size_t nword = ls_scan_word(&s, &word, sep);
+        if (!nword) {
+            continue;
+        }
+        if (*s == sep) {
+            ++s;
+        }
+        lua_pushlstring(L, word, nword); // L: table key
+        lua_pushnumber(L, ls_scan_u64(&s)); // L: table key n
+        lua_rawset(L, -3); // L: table
+    }
+}
+
+static
+void
+push_loadavg(lua_State *L, const char *data)
+{
+    const char *s = data;
+    lua_createtable(L, 3, 2); // L: table
+    for (int i = 1; i <= 3; ++i) {
+        lua_pushnumber(L, ls_scan_udouble(&s)); // L: table n
+        lua_rawseti(L, -2, i); // L: table
+    }
+    lua_pushnumber(L, ls_scan_u64(&s)); // L: table n
+    lua_setfield(L, -2, "running"); // L: table
+    if (*s == '/') {
+        ++s;
+    }
+    lua_pushnumber(L, ls_scan_u64(&s)); // L: table n
+    lua_setfield(L, -2, "total"); // L: table
+}
+
+static
+void
+push_diskstats(Priv *p, lua_State *L, const char *data, double dt)
+{
+    lua_newtable(L); // L: table
+    size_t n = 0;
+    for (const char *s = data; *s; ls_scan_next_line(&s)) {
+        (void) ls_scan_u64(&s); // major
+        (void) ls_scan_u64(&s); // minor
+        const char *name;
+        const size_t nname = ls_scan_word(&s, &name, '\0');
+        if (!nname) {
+            continue;
+        }
+        uint64_t v[10];
+        for (int j = 0; j < 10; ++j) {
+            v[j] = ls_scan_u64(&s);
+        }
+        Counters *cur = counters_append(&p->disks_cur, name, nname);
+        if (!cur) {
+            continue;
+        }
+        // Sectors are always 512 bytes here, regardless of the actual sector size of the device.
+        cur->c[0] = v[2] * 512; // read bytes
+        cur->c[1] = v[6] * 512; // written bytes
+        cur->c[2] = v[9];       // milliseconds spent doing I/O
+        const Counters *prev = counters_find(&p->disks_prev, name, nname, n++);
+
+        lua_createtable(L, 0, 5); // L: table table
+        lua_pushnumber(L, cur->c[0]); // L: table table n
+        lua_setfield(L, -2, "read_bytes"); // L: table table
+        lua_pushnumber(L, cur->c[1]); // L: table table n
+        lua_setfield(L, -2, "written_bytes"); // L: table table
+        maybe_set_rate(L, "read_rate", prev, cur, 0, dt);
+        maybe_set_rate(L, "write_rate", prev, cur, 1, dt);
+        if (prev && dt > 0) {
+            const double busy = ls_sat_sub_u64(cur->c[2], prev->c[2]) / (dt * 1000);
+            lua_pushnumber(L, ls_clamp01_d(busy)); // L: table table n
+            lua_setfield(L, -2, "busy"); // L: table table
+        }
+        lua_setfield(L, -2, cur->name); // L: table
+    }
+    swap_counters(&p->disks_prev, &p->disks_cur);
+}
+
+static
+void
+push_net_dev(Priv *p, lua_State *L, const char *data, double dt)
+{
+    lua_newtable(L); // L: table
+    const char *s = data;
+    // skip the two header lines
+    ls_scan_next_line(&s);
+    ls_scan_next_line(&s);
+    size_t n = 0;
+    for (; *s; ls_scan_next_line(&s)) {
+        const char *name;
+        const size_t nname = ls_scan_word(&s, &name, ':');
+        if (!nname || *s != ':') {
+            continue;
+        }
+        ++s;
+        uint64_t v[16];
+        for (int j = 0; j < 16; ++j) {
+            v[j] = ls_scan_u64(&s);
+        }
+        Counters *cur = counters_append(&p->ifaces_cur, name, nname);
+        if (!cur) {
+            continue;
+        }
+        cur->c[0] = v[0]; // received bytes
+        cur->c[1] = v[8]; // transmitted bytes
+        cur->c[2] = v[1]; // received packets
+        cur->c[3] = v[9]; // transmitted packets
+        const Counters *prev = counters_find(&p->ifaces_prev, name, nname, n++);
+
+        lua_createtable(L, 0, 6); // L: table table
+        lua_pushnumber(L, cur->c[0]); // L: table table n
+        lua_setfield(L, -2, "rx_bytes"); // L: table table
+        lua_pushnumber(L, cur->c[1]); // L: table table n
+        lua_setfield(L, -2, "tx_bytes"); // L: table table
+        lua_pushnumber(L, cur->c[2]); // L: table table n
+        lua_setfield(L, -2, "rx_packets"); // L: table table
+        lua_pushnumber(L, cur->c[3]); // L: table table n
+        lua_setfield(L, -2, "tx_packets"); // L: table table
+        maybe_set_rate(L, "rx_rate", prev, cur, 0, dt);
+        maybe_set_rate(L, "tx_rate", prev, cur, 1, dt);
+        lua_setfield(L, -2, cur->name); // L: table
+    }
+    swap_counters(&p->ifaces_prev, &p->ifaces_cur);
+}
+
+static
+void
+push_sample(LuastatusPluginData *pd, lua_State *L, double dt)
+{
+    Priv *p = pd->priv;
+
+    lua_newtable(L); // L: table
+    for (int i = 0; i < SRC__LAST; ++i) {
+        if (p->idx[i] < 0) {
+            continue;
+        }
+        const char *data = ls_batch_reader_data(&p->reader, p->idx[i], NULL);
+        if (!data) {
+            LS_WARNF(pd, "%s: %s", SOURCES[i].path, ls_strerror_onstack(errno));
+            continue;
+        }
+        switch ((Source) i) {
+        case SRC_STAT:
+            push_stat(p, L, data);
+            break;
+        case SRC_MEMINFO:
+            push_kv(L, data, ':');
+            break;
+        case SRC_LOADAVG:
+            push_loadavg(L, data);
+            break;
+        case SRC_DISKSTATS:
+            push_diskstats(p, L, data, dt);
+            break;
+        case SRC_NET_DEV:
+            push_net_dev(p, L, data, dt);
+            break;
+        case SRC_VMSTAT:
+            push_kv(L, data, '\0');
+            break;
+        case SRC__LAST:
+            LS_UNREACHABLE();
+        }
+        // L: table value
+        lua_setfield(L, -2, SOURCES[i].name); // L: table
+    }
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    LSWakeupFifo w;
+    ls_wakeup_fifo_init(&w, p->fifo, NULL);
+
+    while (1) {
+        // sample
+        ls_batch_reader_read(&p->reader);
+        struct timespec now;
+        if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+            LS_FATALF(pd, "clock_gettime: %s", ls_strerror_onstack(errno));
+            goto error;
+        }
+        const double dt = ls_timespec_is_invalid(p->prev_time)
+                          ? -1
+                          : ls_timespec_diff(now, p->prev_time);
+        p->prev_time = now;
+
+        // make a call
+        lua_State *L = funcs.call_begin(pd->userdata);
+        push_sample(pd, L, dt);
+        funcs.call_end(pd->userdata);
+
+        // wait
+        if (ls_wakeup_fifo_open(&w) < 0) {
+            LS_WARNF(pd, "ls_wakeup_fifo_open: %s: %s", p->fifo,
+                     LS_WAKEUP_FIFO_STRERROR_ONSTACK(errno));
+        }
+        if (ls_wakeup_fifo_wait(&w, p->period) < 0) {
+            LS_FATALF(pd, "ls_wakeup_fifo_wait: %s: %s", p->fifo, ls_strerror_onstack(errno));
+            goto error;
+        }
+    }
+
+error:
+    ls_wakeup_fifo_destroy(&w);
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
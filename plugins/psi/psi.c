@@ -0,0 +1,395 @@
+#include <errno.h>
+#include <lua.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+#include "libls/string_.h"
+#include "libls/lua_utils.h"
+#include "libls/time_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/batch_reader.h"
+#include "libls/scan_utils.h"
+
+typedef enum {
+    RES_CPU,
+    RES_MEMORY,
+    RES_IO,
+    RES_IRQ,
+
+    RES__LAST,
+} Resource;
+
+static const char *RESOURCE_NAMES[] = {
+    [RES_CPU]    = "cpu",
+    [RES_MEMORY] = "memory",
+    [RES_IO]     = "io",
+    [RES_IRQ]    = "irq",
+};
+
+typedef struct {
+    Resource res;
+    // The string written to the pressure file, e.g. "some 150000 1000000".
+    char *spec;
+    int fd;
+} Trigger;
+
+typedef struct {
+    char *cgroup;
+    LS_VECTOR_OF(Trigger) triggers;
+    bool report[RES__LAST];
+    int period_ms;
+
+    LSBatchReader reader;
+    // Index of each reported resource's pressure file in /reader/, or /-1/.
+    int idx[RES__LAST];
+} Priv;
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    free(p->cgroup);
+    for (size_t i = 0; i < p->triggers.size; ++i) {
+        free(p->triggers.data[i].spec);
+        close(p->triggers.data[i].fd);
+    }
+    LS_VECTOR_FREE(p->triggers);
+    ls_batch_reader_destroy(&p->reader);
+    free(p);
+}
+
+static
+int
+resource_by_name(const char *name)
+{
+    for (int i = 0; i < RES__LAST; ++i) {
+        if (strcmp(RESOURCE_NAMES[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the path to the pressure file of /res/; the result should be freed.
+static
+char *
+pressure_path(Priv *p, Resource res)
+{
+    LSString s = LS_VECTOR_NEW();
+    if (p->cgroup) {
+        ls_string_append_f(&s, "%s/%s.pressure", p->cgroup, RESOURCE_NAMES[res]);
+    } else {
+        ls_string_append_f(&s, "/proc/pressure/%s", RESOURCE_NAMES[res]);
+    }
+    ls_string_append_c(&s, '\0');
+    return s.data;
+}
+
+// Converts /sec/ seconds to microseconds; returns /-1/ if /sec/ is not positive or is too large.
+static
+long
+to_usec(double sec)
+{
+    if (!(sec > 0) || sec > LONG_MAX / 1e6 || sec > 1e6) {
+        return -1;
+    }
+    return sec * 1e6;
+}
+
+static
+bool
+register_trigger(LuastatusPluginData *pd, Trigger *t)
+{
+    Priv *p = pd->priv;
+    char *path = pressure_path(p, t->res);
+    bool ret = false;
+
+    // The kernel only accepts triggers on file descriptors opened for writing.
+    t->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (t->fd < 0) {
+        LS_FATALF(pd, "%s: %s", path, ls_strerror_onstack(errno));
+        goto done;
+    }
+    // The terminating zero is to be written, too.
+    if (write(t->fd, t->spec, strlen(t->spec) + 1) < 0) {
+        LS_FATALF(pd, "%s: cannot register trigger '%s': %s", path, t->spec,
+                  ls_strerror_onstack(errno));
+        goto done;
+    }
+    ret = true;
+
+done:
+    free(path);
+    return ret;
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .cgroup = NULL,
+        .triggers = LS_VECTOR_NEW(),
+        .period_ms = 60 * 1000,
+    };
+    ls_batch_reader_init(&p->reader);
+
+    PU_MAYBE_VISIT_STR_FIELD(-1, "cgroup", "'cgroup'", s,
+        p->cgroup = ls_xstrdup(s);
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "triggers", "'triggers'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'triggers' key", LUA_TNUMBER);
+        PU_CHECK_TYPE(LS_LUA_VALUE, "'triggers' element", LUA_TTABLE);
+
+        int res = -1;
+        PU_VISIT_STR_FIELD(-1, "resource", "trigger's 'resource'", s,
+            if ((res = resource_by_name(s)) < 0) {
+                LS_FATALF(pd, "unknown resource '%s'", s);
+                goto error;
+            }
+        );
+
+        const char *kind = "some";
+        PU_MAYBE_VISIT_STR_FIELD(-1, "kind", "trigger's 'kind'", s,
+            if (strcmp(s, "some") == 0) {
+                kind = "some";
+            } else if (strcmp(s, "full") == 0) {
+                kind = "full";
+            } else {
+                LS_FATALF(pd, "trigger's 'kind' is neither 'some' nor 'full'");
+                goto error;
+            }
+        );
+
+        long stall_us = -1;
+        PU_VISIT_NUM_FIELD(-1, "stall", "trigger's 'stall'", n,
+            if ((stall_us = to_usec(n)) < 0) {
+                LS_FATALF(pd, "invalid trigger's 'stall' value");
+                goto error;
+            }
+        );
+
+        long window_us = 1000 * 1000;
+        PU_MAYBE_VISIT_NUM_FIELD(-1, "window", "trigger's 'window'", n,
+            if ((window_us = to_usec(n)) < 0) {
+                LS_FATALF(pd, "invalid trigger's 'window' value");
+                goto error;
+            }
+        );
+
+        if (stall_us > window_us) {
+            LS_FATALF(pd, "trigger's 'stall' is greater than its 'window'");
+            goto error;
+        }
+
+        LSString spec = LS_VECTOR_NEW();
+        ls_string_append_f(&spec, "%s %ld %ld", kind, stall_us, window_us);
+        ls_string_append_c(&spec, '\0');
+        LS_VECTOR_PUSH(p->triggers, ((Trigger) {.res = res, .spec = spec.data, .fd = -1}));
+
+        p->report[res] = true;
+    );
+
+    bool any_reported = false;
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "resources", "'resources'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'resources' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'resources' element", s,
+            const int res = resource_by_name(s);
+            if (res < 0) {
+                LS_FATALF(pd, "unknown resource '%s'", s);
+                goto error;
+            }
+            p->report[res] = true;
+            any_reported = true;
+        );
+    );
+    if (!any_reported && !p->triggers.size) {
+        p->report[RES_CPU] = true;
+        p->report[RES_MEMORY] = true;
+        p->report[RES_IO] = true;
+    }
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "period", "'period'", n,
+        if (!ls_period_ms_from_seconds(n, &p->period_ms)) {
+            LS_FATALF(pd, "invalid 'period' value");
+            goto error;
+        }
+    );
+
+    if (!p->triggers.size && p->period_ms < 0) {
+        LS_WARNF(pd, "neither triggers nor period are specified");
+    }
+
+    for (size_t i = 0; i < p->triggers.size; ++i) {
+        if (!register_trigger(pd, &p->triggers.data[i])) {
+            goto error;
+        }
+    }
+
+    for (int i = 0; i < RES__LAST; ++i) {
+        p->idx[i] = -1;
+        if (p->report[i]) {
+            char *path = pressure_path(p, i);
+            p->idx[i] = ls_batch_reader_add(&p->reader, path);
+            if (p->idx[i] < 0) {
+                LS_FATALF(pd, "%s: %s", path, ls_strerror_onstack(errno));
+                free(path);
+                goto error;
+            }
+            free(path);
+        }
+    }
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+// Pushes the parsed contents of a pressure file, e.g.
+//
+//      some avg10=0.12 avg60=0.08 avg300=0.02 total=1234567
+//      full avg10=0.00 avg60=0.00 avg300=0.00 total=2345
+//
+// as /{some = {avg10 = 0.12, ...}, full = {...}}/.
+static
+void
+push_pressure(lua_State *L, const char *data)
+{
+    lua_createtable(L, 0, 2); // L: table
+    for (const char *s = data; *s; ls_scan_next_line(&s)) {
+        const char *kind;
+        const size_t nkind = ls_scan_word(&s, &kind, '\0');
+        if (!nkind) {
+            continue;
+        }
+        lua_pushlstring(L, kind, nkind); // L: table kind
+        lua_createtable(L, 0, 4); // L: table kind table
+        while (1) {
+            const char *key;
+            const size_t nkey = ls_scan_word(&s, &key, '=');
+            if (!nkey || *s != '=') {
+                break;
+            }
+            ++s;
+            lua_pushlstring(L, key, nkey); // L: table kind table key
+            lua_pushnumber(L, ls_scan_udouble(&s)); // L: table kind table key value
+            lua_rawset(L, -3); // L: table kind table
+        }
+        lua_rawset(L, -3); // L: table
+    }
+}
+
+static
+void
+push_sample(LuastatusPluginData *pd, lua_State *L, const char *what, const bool *fired)
+{
+    Priv *p = pd->priv;
+
+    lua_createtable(L, 0, 2 + RES__LAST); // L: table
+    lua_pushstring(L, what); // L: table what
+    lua_setfield(L, -2, "what"); // L: table
+
+    lua_newtable(L); // L: table triggered
+    int n = 0;
+    for (int i = 0; i < RES__LAST; ++i) {
+        if (fired[i]) {
+            lua_pushstring(L, RESOURCE_NAMES[i]); // L: table triggered name
+            lua_rawseti(L, -2, ++n); // L: table triggered
+        }
+    }
+    lua_setfield(L, -2, "triggered"); // L: table
+
+    for (int i = 0; i < RES__LAST; ++i) {
+        if (p->idx[i] < 0) {
+            continue;
+        }
+        const char *data = ls_batch_reader_data(&p->reader, p->idx[i], NULL);
+        if (!data) {
+            LS_WARNF(pd, "cannot read %s pressure: %s", RESOURCE_NAMES[i],
+                     ls_strerror_onstack(errno));
+            continue;
+        }
+        push_pressure(L, data); // L: table value
+        lua_setfield(L, -2, RESOURCE_NAMES[i]); // L: table
+    }
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    const size_t npfds = p->triggers.size;
+    struct pollfd *pfds = LS_XNEW(struct pollfd, npfds);
+    for (size_t i = 0; i < npfds; ++i) {
+        pfds[i] = (struct pollfd) {.fd = p->triggers.data[i].fd, .events = POLLPRI};
+    }
+
+    const char *what = "hello";
+    bool fired[RES__LAST] = {false};
+
+    while (1) {
+        ls_batch_reader_read(&p->reader);
+
+        lua_State *L = funcs.call_begin(pd->userdata);
+        push_sample(pd, L, what, fired);
+        funcs.call_end(pd->userdata);
+
+        // Do not make a call with a stale /what/ if interrupted.
+        int r;
+        while ((r = poll(pfds, npfds, p->period_ms)) < 0 && errno == EINTR) {
+        }
+        if (r < 0) {
+            LS_FATALF(pd, "poll: %s", ls_strerror_onstack(errno));
+            goto error;
+        }
+
+        for (int i = 0; i < RES__LAST; ++i) {
+            fired[i] = false;
+        }
+        if (r == 0) {
+            what = "timeout";
+            continue;
+        }
+        what = "trigger";
+        for (size_t i = 0; i < npfds; ++i) {
+            const Trigger *t = &p->triggers.data[i];
+            if (pfds[i].revents & (POLLERR | POLLNVAL)) {
+                // E.g. the cgroup has been removed.
+                LS_FATALF(pd, "trigger '%s' on %s has been destroyed", t->spec,
+                          RESOURCE_NAMES[t->res]);
+                goto error;
+            }
+            if (pfds[i].revents & POLLPRI) {
+                fired[t->res] = true;
+            }
+        }
+    }
+
+error:
+    free(pfds);
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
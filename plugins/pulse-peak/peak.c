@@ -0,0 +1,364 @@
+#include <lua.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <pulse/pulseaudio.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+
+typedef struct {
+    char *device;
+    double fps;
+    // Full scale per second.
+    double decay;
+    // Seconds.
+    double hold;
+} Priv;
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    free(p->device);
+    free(p);
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .device = NULL,
+        .fps = 20,
+        .decay = 2,
+        .hold = 1,
+    };
+
+    PU_MAYBE_VISIT_STR_FIELD(-1, "device", "'device'", s,
+        p->device = ls_xstrdup(s);
+    );
+    if (!p->device) {
+        p->device = ls_xstrdup("@DEFAULT_MONITOR@");
+    }
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "fps", "'fps'", n,
+        if (!(n > 0 && n <= 1000)) {
+            LS_FATALF(pd, "'fps' must be in range (0; 1000]");
+            goto error;
+        }
+        p->fps = n;
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "decay", "'decay'", n,
+        if (!(n > 0)) {
+            LS_FATALF(pd, "'decay' must be positive");
+            goto error;
+        }
+        p->decay = n;
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "hold", "'hold'", n,
+        if (!(n >= 0 && n <= 3600)) {
+            LS_FATALF(pd, "'hold' must be in range [0; 3600]");
+            goto error;
+        }
+        p->hold = n;
+    );
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+typedef struct {
+    LuastatusPluginData *pd;
+    LuastatusPluginRunFuncs funcs;
+    pa_mainloop *ml;
+    pa_mainloop_api *api;
+    pa_stream *stream;
+    pa_time_event *frame_ev;
+    pa_usec_t frame_usec;
+
+    // The maximum of the samples received since the last frame.
+    float frame_peak;
+    // The level, decaying since the last maximum.
+    double level;
+    // The held peak, and the number of frames left to hold it for.
+    double peak;
+    uint64_t peak_frames_left;
+
+    // The values last passed to /cb/; /NAN/ if nothing has been passed yet.
+    double last_level;
+    double last_peak;
+} UserData;
+
+static
+void
+stream_read_cb(pa_stream *s, size_t nbytes, void *vud)
+{
+    (void) nbytes;
+    UserData *ud = vud;
+
+    const void *data;
+    size_t n;
+    while (pa_stream_peek(s, &data, &n) == 0 && n) {
+        // /data/ is /NULL/ if there is a hole in the stream.
+        if (data) {
+            const float *samples = data;
+            for (size_t i = 0; i < n / sizeof(float); ++i) {
+                const float v = fabsf(samples[i]);
+                if (v > ud->frame_peak) {
+                    ud->frame_peak = v;
+                }
+            }
+        }
+        pa_stream_drop(s);
+    }
+}
+
+static
+void
+frame_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *vud)
+{
+    UserData *ud = vud;
+    Priv *p = ud->pd->priv;
+
+    struct timeval next = *tv;
+    pa_timeval_add(&next, ud->frame_usec);
+    api->time_restart(e, &next);
+
+    const double frame_peak = ud->frame_peak > 1 ? 1 : ud->frame_peak;
+    ud->frame_peak = 0;
+
+    ud->level -= p->decay / p->fps;
+    if (ud->level < frame_peak) {
+        ud->level = frame_peak;
+    }
+
+    if (ud->peak_frames_left) {
+        --ud->peak_frames_left;
+    } else if (ud->peak > ud->level) {
+        ud->peak -= p->decay / p->fps;
+    }
+    if (ud->peak <= ud->level) {
+        ud->peak = ud->level;
+        ud->peak_frames_left = p->hold * p->fps;
+    }
+
+    // Do not bother /cb/ with the same values over and over (e.g. while nothing is playing).
+    if (ud->level == ud->last_level && ud->peak == ud->last_peak) {
+        return;
+    }
+    ud->last_level = ud->level;
+    ud->last_peak = ud->peak;
+
+    lua_State *L = ud->funcs.call_begin(ud->pd->userdata);
+    lua_createtable(L, 0, 2); // L: table
+    lua_pushnumber(L, ud->level); // L: table number
+    lua_setfield(L, -2, "level"); // L: table
+    lua_pushnumber(L, ud->peak); // L: table number
+    lua_setfield(L, -2, "peak"); // L: table
+    ud->funcs.call_end(ud->pd->userdata);
+}
+
+static
+void
+stream_state_cb(pa_stream *s, void *vud)
+{
+    UserData *ud = vud;
+    switch (pa_stream_get_state(s)) {
+    case PA_STREAM_UNCONNECTED:
+    case PA_STREAM_CREATING:
+    case PA_STREAM_READY:
+    default:
+        break;
+
+    case PA_STREAM_FAILED:
+    case PA_STREAM_TERMINATED:
+        // e.g. the device has gone
+        LS_ERRF(ud->pd, "record stream failed or terminated");
+        pa_mainloop_quit(ud->ml, 1);
+        break;
+    }
+}
+
+static
+bool
+open_stream(UserData *ud, pa_context *c)
+{
+    Priv *p = ud->pd->priv;
+
+    // With /PA_STREAM_PEAK_DETECT/, the server resamples the stream to /rate/ by taking the peaks,
+    // so this is the number of values per second the plugin has to handle. A few of them per frame
+    // are enough not to miss short peaks.
+    double rate = ceil(p->fps) * 4;
+    if (rate < 25) {
+        rate = 25;
+    }
+    const pa_sample_spec ss = {
+        .format = PA_SAMPLE_FLOAT32NE,
+        .rate = rate,
+        .channels = 1,
+    };
+    const pa_buffer_attr attr = {
+        .maxlength = (uint32_t) -1,
+        .tlength = (uint32_t) -1,
+        .prebuf = (uint32_t) -1,
+        .minreq = (uint32_t) -1,
+        // deliver every value as soon as it is available
+        .fragsize = sizeof(float),
+    };
+
+    if (!(ud->stream = pa_stream_new(c, "luastatus-plugin-pulse-peak", &ss, NULL))) {
+        LS_ERRF(ud->pd, "pa_stream_new: %s", pa_strerror(pa_context_errno(c)));
+        return false;
+    }
+    pa_stream_set_state_callback(ud->stream, stream_state_cb, ud);
+    pa_stream_set_read_callback(ud->stream, stream_read_cb, ud);
+
+    const pa_stream_flags_t flags = PA_STREAM_PEAK_DETECT |
+                                    PA_STREAM_ADJUST_LATENCY |
+                                    PA_STREAM_DONT_INHIBIT_AUTO_SUSPEND;
+    if (pa_stream_connect_record(ud->stream, p->device, &attr, flags) < 0) {
+        LS_ERRF(ud->pd, "pa_stream_connect_record: %s", pa_strerror(pa_context_errno(c)));
+        return false;
+    }
+
+    struct timeval tv;
+    pa_timeval_add(pa_gettimeofday(&tv), ud->frame_usec);
+    if (!(ud->frame_ev = ud->api->time_new(ud->api, &tv, frame_cb, ud))) {
+        LS_ERRF(ud->pd, "time_new() failed");
+        return false;
+    }
+    return true;
+}
+
+static
+void
+context_state_cb(pa_context *c, void *vud)
+{
+    UserData *ud = vud;
+    switch (pa_context_get_state(c)) {
+    case PA_CONTEXT_UNCONNECTED:
+    case PA_CONTEXT_CONNECTING:
+    case PA_CONTEXT_AUTHORIZING:
+    case PA_CONTEXT_SETTING_NAME:
+    case PA_CONTEXT_TERMINATED:
+    default:
+        break;
+
+    case PA_CONTEXT_READY:
+        if (!open_stream(ud, c)) {
+            pa_mainloop_quit(ud->ml, 1);
+        }
+        break;
+
+    case PA_CONTEXT_FAILED:
+        // server disconnected us
+        pa_mainloop_quit(ud->ml, 1);
+        break;
+    }
+}
+
+static
+bool
+iteration(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    bool ret = false;
+    Priv *p = pd->priv;
+    UserData ud = {
+        .pd = pd,
+        .funcs = funcs,
+        .ml = NULL,
+        .api = NULL,
+        .stream = NULL,
+        .frame_ev = NULL,
+        .frame_usec = PA_USEC_PER_SEC / p->fps,
+        .frame_peak = 0,
+        .level = 0,
+        .peak = 0,
+        .peak_frames_left = 0,
+        .last_level = NAN,
+        .last_peak = NAN,
+    };
+    pa_context *ctx = NULL;
+
+    if (!(ud.ml = pa_mainloop_new())) {
+        LS_FATALF(pd, "pa_mainloop_new() failed");
+        goto error;
+    }
+    if (!(ud.api = pa_mainloop_get_api(ud.ml))) {
+        LS_FATALF(pd, "pa_mainloop_get_api() failed");
+        goto error;
+    }
+    pa_proplist *proplist = pa_proplist_new();
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, "luastatus-plugin-pulse-peak");
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_ID, "io.github.shdown.luastatus");
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_VERSION, "0.0.1");
+    ctx = pa_context_new_with_proplist(ud.api, "luastatus-plugin-pulse-peak", proplist);
+    pa_proplist_free(proplist);
+    if (!ctx) {
+        LS_FATALF(pd, "pa_context_new_with_proplist() failed");
+        goto error;
+    }
+
+    pa_context_set_state_callback(ctx, context_state_cb, &ud);
+    if (pa_context_connect(ctx, NULL, PA_CONTEXT_NOFAIL | PA_CONTEXT_NOAUTOSPAWN, NULL) < 0) {
+        LS_FATALF(pd, "pa_context_connect: %s", pa_strerror(pa_context_errno(ctx)));
+        goto error;
+    }
+
+    ret = true;
+
+    int ignored;
+    if (pa_mainloop_run(ud.ml, &ignored) < 0) {
+        LS_FATALF(pd, "pa_mainloop_run: %s", pa_strerror(pa_context_errno(ctx)));
+        goto error;
+    }
+
+error:
+    if (ud.frame_ev) {
+        ud.api->time_free(ud.frame_ev);
+    }
+    if (ud.stream) {
+        pa_stream_set_state_callback(ud.stream, NULL, NULL);
+        pa_stream_set_read_callback(ud.stream, NULL, NULL);
+        pa_stream_disconnect(ud.stream);
+        pa_stream_unref(ud.stream);
+    }
+    if (ctx) {
+        pa_context_unref(ctx);
+    }
+    if (ud.ml) {
+        pa_mainloop_free(ud.ml);
+    }
+    return ret;
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    while (1) {
+        // If the stream has failed (e.g. the device has gone), give it a second to come back.
+        const time_t sleep_for = iteration(pd, funcs) ? 1 : 5;
+        nanosleep((struct timespec[1]) {{.tv_sec = sleep_for}}, NULL);
+    }
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
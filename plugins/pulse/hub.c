@@ -0,0 +1,635 @@
+#include "hub.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "include/sayf_macros.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+
+// Note: some parts of this file are stolen from i3status' src/pulse.c.
+// This is fine since the BSD 3-Clause licence, under which it is licenced, is compatible with
+// LGPL-3.0.
+
+static const char *MAP_KEY = "plugin-pulse:hub";
+
+enum { RECONNECT_IN_SECONDS = 5 };
+
+// An info request; /index/ is /PA_INVALID_INDEX/ for list requests.
+//
+// Requests for a single object are merged: if a change event comes while a request for the same
+// object is in flight, the /again/ flag is set instead of sending another one, and the request is
+// re-sent once the reply comes. Thus, a storm of events for one object (e.g. when scrolling the
+// volume) results in at most two requests in flight at any time.
+typedef struct HubRequest {
+    Hub *h;
+    HubKind kind;
+    uint32_t index;
+    bool again;
+} HubRequest;
+
+static
+void
+log_error(Hub *h, const char *what)
+{
+    // There is always at least one subscriber while the mainloop runs.
+    LuastatusPluginData *pd = h->subs.data[0]->pd;
+    LS_ERRF(pd, "%s: %s", what, pa_strerror(pa_context_errno(h->ctx)));
+}
+
+static
+void
+wake_subs(Hub *h, unsigned kinds)
+{
+    for (size_t i = 0; i < h->subs.size; ++i) {
+        HubSub *sub = h->subs.data[i];
+        if (sub->kinds & kinds) {
+            ls_wakeup_fd_wake(&sub->wakeup);
+        }
+    }
+}
+
+static
+HubObject *
+find_object(Hub *h, HubKind kind, uint32_t index)
+{
+    for (size_t i = 0; i < h->objects[kind].size; ++i) {
+        HubObject *o = &h->objects[kind].data[i];
+        if (o->index == index) {
+            return o;
+        }
+    }
+    return NULL;
+}
+
+static
+void
+object_destroy(HubObject *o)
+{
+    free(o->name);
+    free(o->description);
+}
+
+static inline
+bool
+str_eq_nullable(const char *a, const char *b)
+{
+    if (!a || !b) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+static inline
+char *
+xstrdup_nullable(const char *s)
+{
+    return s ? ls_xstrdup(s) : NULL;
+}
+
+static
+void
+update_object(Hub *h, HubKind kind, uint32_t index, const char *name, const char *description,
+              uint32_t sink, const pa_cvolume *volume, int mute)
+{
+    const pa_volume_t avg = pa_cvolume_avg(volume);
+
+    HubObject *o = find_object(h, kind, index);
+    if (o) {
+        if (str_eq_nullable(o->name, name) &&
+            str_eq_nullable(o->description, description) &&
+            o->sink == sink &&
+            o->volume == avg &&
+            o->mute == !!mute)
+        {
+            return;
+        }
+        object_destroy(o);
+    } else {
+        LS_VECTOR_PUSH(h->objects[kind], (HubObject) {.index = index});
+        o = &h->objects[kind].data[h->objects[kind].size - 1];
+    }
+    *o = (HubObject) {
+        .index = index,
+        .name = xstrdup_nullable(name),
+        .description = xstrdup_nullable(description),
+        .sink = sink,
+        .volume = avg,
+        .mute = mute,
+        .gen = ++h->last_gen,
+    };
+    wake_subs(h, 1u << kind);
+}
+
+static
+void
+remove_object(Hub *h, HubKind kind, uint32_t index)
+{
+    HubObject *o = find_object(h, kind, index);
+    if (!o) {
+        return;
+    }
+    object_destroy(o);
+    *o = h->objects[kind].data[--h->objects[kind].size];
+    wake_subs(h, 1u << kind);
+}
+
+static
+void
+forget_request(Hub *h, HubRequest *req)
+{
+    for (size_t i = 0; i < h->requests.size; ++i) {
+        if (h->requests.data[i] == req) {
+            h->requests.data[i] = h->requests.data[--h->requests.size];
+            break;
+        }
+    }
+    free(req);
+}
+
+static void send_request(HubRequest *req);
+
+// Called when the reply to /req/ has been fully received; /ok/ tells if it was successful.
+static
+void
+request_done(HubRequest *req, bool ok)
+{
+    Hub *h = req->h;
+    if (!ok) {
+        if (pa_context_errno(h->ctx) == PA_ERR_NOENTITY) {
+            // The object has gone; the removal event is either already processed or on its way.
+            if (req->index != PA_INVALID_INDEX) {
+                remove_object(h, req->kind, req->index);
+            }
+        } else {
+            log_error(h, "info request");
+        }
+    }
+    if (req->again) {
+        req->again = false;
+        send_request(req);
+    } else {
+        forget_request(h, req);
+    }
+}
+
+static
+void
+sink_info_cb(pa_context *c, const pa_sink_info *info, int eol, void *vreq)
+{
+    (void) c;
+    HubRequest *req = vreq;
+    if (eol) {
+        request_done(req, eol > 0);
+        return;
+    }
+    update_object(req->h, HUB_SINK, info->index, info->name, info->description,
+                  PA_INVALID_INDEX, &info->volume, info->mute);
+}
+
+static
+void
+source_info_cb(pa_context *c, const pa_source_info *info, int eol, void *vreq)
+{
+    (void) c;
+    HubRequest *req = vreq;
+    if (eol) {
+        request_done(req, eol > 0);
+        return;
+    }
+    update_object(req->h, HUB_SOURCE, info->index, info->name, info->description,
+                  PA_INVALID_INDEX, &info->volume, info->mute);
+}
+
+static
+void
+sink_input_info_cb(pa_context *c, const pa_sink_input_info *info, int eol, void *vreq)
+{
+    (void) c;
+    HubRequest *req = vreq;
+    if (eol) {
+        request_done(req, eol > 0);
+        return;
+    }
+    const char *app_name = info->proplist
+        ? pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME)
+        : NULL;
+    update_object(req->h, HUB_SINK_INPUT, info->index, app_name ? app_name : info->name, NULL,
+                  info->sink, &info->volume, info->mute);
+}
+
+static
+void
+send_request(HubRequest *req)
+{
+    Hub *h = req->h;
+    pa_context *c = h->ctx;
+    const bool list = req->index == PA_INVALID_INDEX;
+    pa_operation *o = NULL;
+    switch (req->kind) {
+    case HUB_SINK:
+        o = list
+            ? pa_context_get_sink_info_list(c, sink_info_cb, req)
+            : pa_context_get_sink_info_by_index(c, req->index, sink_info_cb, req);
+        break;
+    case HUB_SOURCE:
+        o = list
+            ? pa_context_get_source_info_list(c, source_info_cb, req)
+            : pa_context_get_source_info_by_index(c, req->index, source_info_cb, req);
+        break;
+    case HUB_SINK_INPUT:
+        o = list
+            ? pa_context_get_sink_input_info_list(c, sink_input_info_cb, req)
+            : pa_context_get_sink_input_info(c, req->index, sink_input_info_cb, req);
+        break;
+    case HUB_NKINDS:
+        break;
+    }
+    if (o) {
+        pa_operation_unref(o);
+    } else {
+        log_error(h, "pa_context_get_*_info");
+        forget_request(h, req);
+    }
+}
+
+static
+void
+request(Hub *h, HubKind kind, uint32_t index)
+{
+    if (index != PA_INVALID_INDEX) {
+        for (size_t i = 0; i < h->requests.size; ++i) {
+            HubRequest *req = h->requests.data[i];
+            if (req->kind == kind && req->index == index) {
+                req->again = true;
+                return;
+            }
+        }
+    }
+    HubRequest *req = LS_XNEW(HubRequest, 1);
+    *req = (HubRequest) {.h = h, .kind = kind, .index = index, .again = false};
+    LS_VECTOR_PUSH(h->requests, req);
+    send_request(req);
+}
+
+static void request_server_info(Hub *h);
+
+static
+void
+server_info_cb(pa_context *c, const pa_server_info *info, void *vh)
+{
+    (void) c;
+    Hub *h = vh;
+    h->server_info_pending = false;
+
+    if (info) {
+        bool changed = false;
+        if (!str_eq_nullable(h->default_sink, info->default_sink_name)) {
+            free(h->default_sink);
+            h->default_sink = xstrdup_nullable(info->default_sink_name);
+            changed = true;
+        }
+        if (!str_eq_nullable(h->default_source, info->default_source_name)) {
+            free(h->default_source);
+            h->default_source = xstrdup_nullable(info->default_source_name);
+            changed = true;
+        }
+        if (changed) {
+            wake_subs(h, (1u << HUB_SINK) | (1u << HUB_SOURCE));
+        }
+    } else {
+        log_error(h, "pa_context_get_server_info");
+    }
+
+    if (h->server_info_again) {
+        h->server_info_again = false;
+        request_server_info(h);
+    }
+}
+
+static
+void
+request_server_info(Hub *h)
+{
+    if (h->server_info_pending) {
+        h->server_info_again = true;
+        return;
+    }
+    pa_operation *o = pa_context_get_server_info(h->ctx, server_info_cb, h);
+    if (o) {
+        pa_operation_unref(o);
+        h->server_info_pending = true;
+    } else {
+        log_error(h, "pa_context_get_server_info");
+    }
+}
+
+static
+void
+subscribe_cb(pa_context *c, pa_subscription_event_type_t t, uint32_t idx, void *vh)
+{
+    (void) c;
+    Hub *h = vh;
+
+    HubKind kind;
+    switch (t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
+    case PA_SUBSCRIPTION_EVENT_SERVER:
+        // the default sink or source may have changed
+        request_server_info(h);
+        return;
+    case PA_SUBSCRIPTION_EVENT_SINK:
+        kind = HUB_SINK;
+        break;
+    case PA_SUBSCRIPTION_EVENT_SOURCE:
+        kind = HUB_SOURCE;
+        break;
+    case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+        kind = HUB_SINK_INPUT;
+        break;
+    default:
+        return;
+    }
+
+    if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
+        remove_object(h, kind, idx);
+    } else {
+        request(h, kind, idx);
+    }
+}
+
+// Forgets everything known about the server's state and any requests in flight.
+static
+void
+reset_state(Hub *h)
+{
+    for (int kind = 0; kind < HUB_NKINDS; ++kind) {
+        for (size_t i = 0; i < h->objects[kind].size; ++i) {
+            object_destroy(&h->objects[kind].data[i]);
+        }
+        LS_VECTOR_CLEAR(h->objects[kind]);
+    }
+    free(h->default_sink);
+    h->default_sink = NULL;
+    free(h->default_source);
+    h->default_source = NULL;
+
+    for (size_t i = 0; i < h->requests.size; ++i) {
+        free(h->requests.data[i]);
+    }
+    LS_VECTOR_CLEAR(h->requests);
+    h->server_info_pending = false;
+    h->server_info_again = false;
+
+    wake_subs(h, ~0u);
+}
+
+static void drop_ctx(Hub *h);
+static bool connect_ctx(Hub *h);
+
+static
+void
+reconnect_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *vh)
+{
+    (void) e;
+    (void) tv;
+    Hub *h = vh;
+    api->time_free(h->reconnect_ev);
+    h->reconnect_ev = NULL;
+    if (!connect_ctx(h)) {
+        drop_ctx(h);
+    }
+}
+
+// Drops the context (if any) and schedules a reconnect.
+static
+void
+drop_ctx(Hub *h)
+{
+    if (h->ctx) {
+        pa_context_set_state_callback(h->ctx, NULL, NULL);
+        pa_context_set_subscribe_callback(h->ctx, NULL, NULL);
+        pa_context_disconnect(h->ctx);
+        pa_context_unref(h->ctx);
+        h->ctx = NULL;
+    }
+    // The callbacks of pending operations are not going to be called anymore.
+    reset_state(h);
+
+    if (!h->reconnect_ev) {
+        struct timeval tv;
+        pa_timeval_add(pa_gettimeofday(&tv), RECONNECT_IN_SECONDS * PA_USEC_PER_SEC);
+        h->reconnect_ev = h->api->time_new(h->api, &tv, reconnect_cb, h);
+    }
+}
+
+static
+void
+context_state_cb(pa_context *c, void *vh)
+{
+    Hub *h = vh;
+    switch (pa_context_get_state(c)) {
+    case PA_CONTEXT_UNCONNECTED:
+    case PA_CONTEXT_CONNECTING:
+    case PA_CONTEXT_AUTHORIZING:
+    case PA_CONTEXT_SETTING_NAME:
+    default:
+        break;
+
+    case PA_CONTEXT_READY:
+        {
+            pa_context_set_subscribe_callback(c, subscribe_cb, h);
+            pa_operation *o = pa_context_subscribe(
+                c,
+                PA_SUBSCRIPTION_MASK_SINK |
+                PA_SUBSCRIPTION_MASK_SOURCE |
+                PA_SUBSCRIPTION_MASK_SINK_INPUT |
+                PA_SUBSCRIPTION_MASK_SERVER,
+                NULL, NULL);
+            if (o) {
+                pa_operation_unref(o);
+            } else {
+                log_error(h, "pa_context_subscribe");
+            }
+            request_server_info(h);
+            for (int kind = 0; kind < HUB_NKINDS; ++kind) {
+                request(h, kind, PA_INVALID_INDEX);
+            }
+        }
+        break;
+
+    case PA_CONTEXT_FAILED:
+    case PA_CONTEXT_TERMINATED:
+        // server disconnected us
+        log_error(h, "PulseAudio connection lost");
+        drop_ctx(h);
+        break;
+    }
+}
+
+static
+bool
+connect_ctx(Hub *h)
+{
+    pa_proplist *proplist = pa_proplist_new();
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, "luastatus-plugin-pulse");
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_ID, "io.github.shdown.luastatus");
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_VERSION, "0.0.1");
+    h->ctx = pa_context_new_with_proplist(h->api, "luastatus-plugin-pulse", proplist);
+    pa_proplist_free(proplist);
+    if (!h->ctx) {
+        LS_ERRF(h->subs.data[0]->pd, "pa_context_new_with_proplist() failed");
+        return false;
+    }
+
+    pa_context_set_state_callback(h->ctx, context_state_cb, h);
+    if (pa_context_connect(h->ctx, NULL, PA_CONTEXT_NOFAIL | PA_CONTEXT_NOAUTOSPAWN, NULL) < 0) {
+        log_error(h, "pa_context_connect");
+        return false;
+    }
+    return true;
+}
+
+static
+void
+hub_destroy(Hub *h)
+{
+    if (h->ml) {
+        pa_threaded_mainloop_stop(h->ml);
+    }
+    // The mainloop thread is not running anymore, so there is no need to lock.
+    if (h->ctx) {
+        pa_context_set_state_callback(h->ctx, NULL, NULL);
+        pa_context_disconnect(h->ctx);
+        pa_context_unref(h->ctx);
+        h->ctx = NULL;
+    }
+    if (h->reconnect_ev) {
+        h->api->time_free(h->reconnect_ev);
+    }
+    // /reset_state()/ wakes the subscribers up.
+    LS_VECTOR_CLEAR(h->subs);
+    reset_state(h);
+    if (h->ml) {
+        pa_threaded_mainloop_free(h->ml);
+    }
+
+    for (int kind = 0; kind < HUB_NKINDS; ++kind) {
+        LS_VECTOR_FREE(h->objects[kind]);
+    }
+    LS_VECTOR_FREE(h->requests);
+    LS_VECTOR_FREE(h->subs);
+    *h->slot = NULL;
+    free(h);
+}
+
+Hub *
+hub_subscribe(HubSub *sub)
+{
+    LuastatusPluginData *pd = sub->pd;
+    void **slot = pd->map_get(pd->userdata, MAP_KEY);
+    Hub *h = *slot;
+    if (h) {
+        hub_lock(h);
+        LS_VECTOR_PUSH(h->subs, sub);
+        // Let the new subscriber pick up the current state.
+        ls_wakeup_fd_wake(&sub->wakeup);
+        hub_unlock(h);
+        return h;
+    }
+
+    h = LS_XNEW(Hub, 1);
+    *h = (Hub) {
+        .ml = NULL,
+        .api = NULL,
+        .ctx = NULL,
+        .reconnect_ev = NULL,
+        .default_sink = NULL,
+        .default_source = NULL,
+        .requests = LS_VECTOR_NEW(),
+        .server_info_pending = false,
+        .server_info_again = false,
+        .last_gen = 0,
+        .subs = LS_VECTOR_NEW(),
+        .slot = slot,
+    };
+    for (int kind = 0; kind < HUB_NKINDS; ++kind) {
+        LS_VECTOR_INIT(h->objects[kind]);
+    }
+    *slot = h;
+    LS_VECTOR_PUSH(h->subs, sub);
+
+    if (!(h->ml = pa_threaded_mainloop_new())) {
+        LS_FATALF(pd, "pa_threaded_mainloop_new() failed");
+        goto error;
+    }
+    if (!(h->api = pa_threaded_mainloop_get_api(h->ml))) {
+        LS_FATALF(pd, "pa_threaded_mainloop_get_api() failed");
+        goto error;
+    }
+    if (!connect_ctx(h)) {
+        goto error;
+    }
+    if (pa_threaded_mainloop_start(h->ml) < 0) {
+        LS_FATALF(pd, "pa_threaded_mainloop_start() failed");
+        goto error;
+    }
+    return h;
+
+error:
+    hub_destroy(h);
+    return NULL;
+}
+
+void
+hub_unsubscribe(Hub *h, HubSub *sub)
+{
+    hub_lock(h);
+    for (size_t i = 0; i < h->subs.size; ++i) {
+        if (h->subs.data[i] == sub) {
+            memmove(&h->subs.data[i], &h->subs.data[i + 1],
+                    sizeof(HubSub *) * (h->subs.size - i - 1));
+            --h->subs.size;
+            break;
+        }
+    }
+    const bool last = h->subs.size == 0;
+    hub_unlock(h);
+
+    if (last) {
+        hub_destroy(h);
+    }
+}
+
+void
+hub_lock(Hub *h)
+{
+    pa_threaded_mainloop_lock(h->ml);
+}
+
+void
+hub_unlock(Hub *h)
+{
+    pa_threaded_mainloop_unlock(h->ml);
+}
+
+const HubObject *
+hub_find_by_name(Hub *h, HubKind kind, const char *name)
+{
+    if (kind == HUB_SINK && strcmp(name, "@DEFAULT_SINK@") == 0) {
+        name = h->default_sink;
+    } else if (kind == HUB_SOURCE && strcmp(name, "@DEFAULT_SOURCE@") == 0) {
+        name = h->default_source;
+    }
+    if (!name) {
+        return NULL;
+    }
+    for (size_t i = 0; i < h->objects[kind].size; ++i) {
+        const HubObject *o = &h->objects[kind].data[i];
+        if (o->name && strcmp(o->name, name) == 0) {
+            return o;
+        }
+    }
+    return NULL;
+}
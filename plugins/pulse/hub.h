@@ -0,0 +1,108 @@
+#ifndef hub_h_
+#define hub_h_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pulse/pulseaudio.h>
+
+#include "include/plugin_v1.h"
+
+#include "libls/vector.h"
+#include "libls/evloop_utils.h"
+
+// A PulseAudio connection shared by all the pulse widgets of the process. It runs in the thread of
+// its own /pa_threaded_mainloop/ and keeps the state of all the sinks, sources and sink inputs (and
+// the server's defaults) up to date; widgets subscribe to it to be woken up on changes, and then
+// inspect the state with the hub locked.
+//
+// The hub is created when the first widget subscribes to it, and destroyed when the last one
+// unsubscribes.
+
+typedef enum {
+    HUB_SINK,
+    HUB_SOURCE,
+    HUB_SINK_INPUT,
+    HUB_NKINDS,
+} HubKind;
+
+typedef struct {
+    uint32_t index;
+    // For sinks and sources, the name; for sink inputs, the application name (or the stream name,
+    // if the former is not known).
+    char *name;
+    // May be /NULL/.
+    char *description;
+    // For sink inputs, the index of the sink they are connected to; /PA_INVALID_INDEX/ otherwise.
+    uint32_t sink;
+    pa_volume_t volume;
+    bool mute;
+    // Changes (to a value never used before by the hub) whenever the object changes.
+    uint64_t gen;
+} HubObject;
+
+typedef struct {
+    // Used for logging the hub's errors.
+    LuastatusPluginData *pd;
+    // Woken up whenever an object of a kind in /kinds/ is added, changed or removed, the
+    // server's defaults change, or the connection is lost.
+    LSWakeupFd wakeup;
+    // A bitmask of /(1 << kind)/ values.
+    unsigned kinds;
+} HubSub;
+
+struct HubRequest;
+
+typedef struct {
+    pa_threaded_mainloop *ml;
+    pa_mainloop_api *api;
+    // /NULL/ while waiting to reconnect.
+    pa_context *ctx;
+    pa_time_event *reconnect_ev;
+
+    // Unordered.
+    LS_VECTOR_OF(HubObject) objects[HUB_NKINDS];
+
+    // Names of the default sink and source; /NULL/ if not known.
+    char *default_sink;
+    char *default_source;
+
+    // Info requests that have been sent, but not completed yet.
+    LS_VECTOR_OF(struct HubRequest *) requests;
+    bool server_info_pending;
+    bool server_info_again;
+
+    uint64_t last_gen;
+
+    LS_VECTOR_OF(HubSub *) subs;
+
+    // The /map_get()/ slot the hub is stored in.
+    void **slot;
+} Hub;
+
+// Subscribes /sub/ to the hub of the process, creating and starting the hub if it does not exist
+// yet; /sub->pd/ must be set, and /sub->wakeup/ must be opened. /sub/ must stay at a constant
+// address until it is unsubscribed. May only be called from the /init()/ function of a plugin.
+//
+// On error, logs it and returns /NULL/.
+Hub *
+hub_subscribe(HubSub *sub);
+
+// Unsubscribes /sub/ from /h/; destroys /h/ if it was the last subscriber. The hub must not be
+// locked.
+void
+hub_unsubscribe(Hub *h, HubSub *sub);
+
+// While the hub is locked, its state does not change, and its callbacks are not run. Must not be
+// held for long.
+void
+hub_lock(Hub *h);
+
+void
+hub_unlock(Hub *h);
+
+// Finds a sink or source by its name; "@DEFAULT_SINK@" and "@DEFAULT_SOURCE@" refer to the
+// current defaults. Returns /NULL/ if there is no such object. The hub must be locked.
+const HubObject *
+hub_find_by_name(Hub *h, HubKind kind, const char *name);
+
+#endif
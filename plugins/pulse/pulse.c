@@ -1,12 +1,10 @@
 #include <lua.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 #include <errno.h>
 #include <stdint.h>
-#include <unistd.h>
-#include <assert.h>
-#include <limits.h>
 #include <stdbool.h>
+#include <poll.h>
 #include <pulse/pulseaudio.h>
 
 #include "include/plugin_v1.h"
@@ -16,14 +14,36 @@
 #include "libls/alloc_utils.h"
 #include "libls/cstring_utils.h"
 #include "libls/evloop_utils.h"
+#include "libls/vector.h"
 
-// Note: some parts of this file are stolen from i3status' src/pulse.c.
-// This is fine since the BSD 3-Clause licence, under which it is licenced, is compatible with
-// LGPL-3.0.
+#include "hub.h"
 
+// A sink or source the widget is interested in.
 typedef struct {
-    char *sink_name;
-    LSSelfPipe self_pipe;
+    // As specified by the user; may be "@DEFAULT_SINK@" or "@DEFAULT_SOURCE@".
+    char *name;
+    // The index and generation of the object last reported; /index/ is /PA_INVALID_INDEX/ if the
+    // object has not been reported, or has been reported missing.
+    uint32_t index;
+    uint64_t gen;
+} Watched;
+
+// A sink input last reported to the widget.
+typedef struct {
+    uint32_t index;
+    uint64_t gen;
+} Seen;
+
+typedef struct {
+    // Whether the legacy mode (a single sink, specified with the 'sink' option) is used.
+    bool legacy;
+    // Indexed by /HUB_SINK/ and /HUB_SOURCE/.
+    LS_VECTOR_OF(Watched) watched[2];
+    bool sink_inputs;
+    LS_VECTOR_OF(Seen) seen_inputs;
+    HubSub sub;
+    Hub *hub;
+    LSWakeupFd self_pipe;
 } Priv;
 
 static
@@ -31,40 +51,107 @@ void
 destroy(LuastatusPluginData *pd)
 {
     Priv *p = pd->priv;
-    free(p->sink_name);
-    ls_self_pipe_close(&p->self_pipe);
+    if (p->hub) {
+        hub_unsubscribe(p->hub, &p->sub);
+    }
+    for (int kind = 0; kind < 2; ++kind) {
+        for (size_t i = 0; i < p->watched[kind].size; ++i) {
+            free(p->watched[kind].data[i].name);
+        }
+        LS_VECTOR_FREE(p->watched[kind]);
+    }
+    LS_VECTOR_FREE(p->seen_inputs);
+    ls_wakeup_fd_close(&p->sub.wakeup);
+    ls_wakeup_fd_close(&p->self_pipe);
     free(p);
 }
 
+static
+void
+watch(Priv *p, HubKind kind, const char *name)
+{
+    LS_VECTOR_PUSH(p->watched[kind], ((Watched) {
+        .name = ls_xstrdup(name),
+        .index = PA_INVALID_INDEX,
+        .gen = 0,
+    }));
+    p->sub.kinds |= 1u << kind;
+}
+
 static
 int
 init(LuastatusPluginData *pd, lua_State *L)
 {
     Priv *p = pd->priv = LS_XNEW(Priv, 1);
     *p = (Priv) {
-        .sink_name = NULL,
-        .self_pipe = LS_SELF_PIPE_NEW(),
+        .legacy = true,
+        .sink_inputs = false,
+        .seen_inputs = LS_VECTOR_NEW(),
+        .sub = {.pd = pd, .wakeup = LS_WAKEUP_FD_NEW(), .kinds = 0},
+        .hub = NULL,
+        .self_pipe = LS_WAKEUP_FD_NEW(),
     };
+    LS_VECTOR_INIT(p->watched[HUB_SINK]);
+    LS_VECTOR_INIT(p->watched[HUB_SOURCE]);
 
+    char *sink_name = NULL;
     PU_MAYBE_VISIT_STR_FIELD(-1, "sink", "'sink'", s,
-        p->sink_name = ls_xstrdup(s);
+        sink_name = ls_xstrdup(s);
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "sinks", "'sinks'",
+        p->legacy = false;
+        PU_CHECK_TYPE(LS_LUA_KEY, "'sinks' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'sinks' element", s,
+            watch(p, HUB_SINK, s);
+        );
     );
-    if (!p->sink_name) {
-        p->sink_name = ls_xstrdup("@DEFAULT_SINK@");
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "sources", "'sources'",
+        p->legacy = false;
+        PU_CHECK_TYPE(LS_LUA_KEY, "'sources' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'sources' element", s,
+            watch(p, HUB_SOURCE, s);
+        );
+    );
+
+    PU_MAYBE_VISIT_BOOL_FIELD(-1, "sink_inputs", "'sink_inputs'", b,
+        p->legacy = false;
+        if (b) {
+            p->sink_inputs = true;
+            p->sub.kinds |= 1u << HUB_SINK_INPUT;
+        }
+    );
+
+    if (p->legacy) {
+        watch(p, HUB_SINK, sink_name ? sink_name : "@DEFAULT_SINK@");
+    } else if (sink_name) {
+        LS_FATALF(pd, "'sink' can not be used together with 'sinks', 'sources' or 'sink_inputs'");
+        goto error;
     }
 
     PU_MAYBE_VISIT_BOOL_FIELD(-1, "make_self_pipe", "'make_self_pipe'", b,
         if (b) {
-            if (ls_self_pipe_open(&p->self_pipe) < 0) {
-                LS_FATALF(pd, "ls_self_pipe_open: %s", ls_strerror_onstack(errno));
+            if (ls_wakeup_fd_open(&p->self_pipe) < 0) {
+                LS_FATALF(pd, "ls_wakeup_fd_open: %s", ls_strerror_onstack(errno));
                 goto error;
             }
         }
     );
 
+    if (ls_wakeup_fd_open(&p->sub.wakeup) < 0) {
+        LS_FATALF(pd, "ls_wakeup_fd_open: %s", ls_strerror_onstack(errno));
+        goto error;
+    }
+    if (!(p->hub = hub_subscribe(&p->sub))) {
+        goto error;
+    }
+
+    free(sink_name);
     return LUASTATUS_OK;
 
 error:
+    free(sink_name);
     destroy(pd);
     return LUASTATUS_ERR;
 }
@@ -75,233 +162,252 @@ register_funcs(LuastatusPluginData *pd, lua_State *L)
 {
     Priv *p = pd->priv;
     // L: table
-    ls_self_pipe_push_luafunc(&p->self_pipe, L); // L: table func
+    ls_wakeup_fd_push_luafunc(&p->self_pipe, L); // L: table func
     lua_setfield(L, -2, "wake_up"); // L: table
 }
 
+// A change to report to /cb/; /obj/ is a copy of the hub's object, made while the hub was locked.
 typedef struct {
-    LuastatusPluginData *pd;
-    LuastatusPluginRunFuncs funcs;
-    pa_mainloop *ml;
-    uint32_t sink_idx;
-} UserData;
+    HubKind kind;
+    // For sinks and sources, the name the widget has requested them by; /NULL/ for sink inputs.
+    const char *key;
+    // If /false/, the object is missing (or has gone), and only /obj.index/ is valid.
+    bool present;
+    HubObject obj;
+} Change;
+
+typedef LS_VECTOR_OF(Change) Changes;
 
 static
 void
-self_pipe_cb(pa_mainloop_api *api, pa_io_event *e, int fd, pa_io_event_flags_t events, void *vud)
+push_change(Changes *changes, HubKind kind, const char *key, const HubObject *o, uint32_t index)
 {
-    (void) api;
-    (void) e;
-    (void) events;
-
-    ssize_t unused = read(fd, (char[1]) {'\0'}, 1);
-    (void) unused;
-
-    UserData *ud = vud;
-    lua_State *L = ud->funcs.call_begin(ud->pd->userdata);
-    lua_pushnil(L);
-    ud->funcs.call_end(ud->pd->userdata);
+    Change c = {.kind = kind, .key = key, .present = !!o, .obj = {.index = index}};
+    if (o) {
+        c.obj = *o;
+        c.obj.name = o->name ? ls_xstrdup(o->name) : NULL;
+        c.obj.description = o->description ? ls_xstrdup(o->description) : NULL;
+    }
+    LS_VECTOR_PUSH(*changes, c);
 }
 
 static
 void
-store_volume_from_sink_cb(pa_context *c, const pa_sink_info *info, int eol, void *vud)
+changes_clear(Changes *changes)
 {
-    UserData *ud = vud;
-    if (eol < 0) {
-        if (pa_context_errno(c) == PA_ERR_NOENTITY) {
-            return;
-        }
-        LS_ERRF(ud->pd, "PulseAudio error: %s", pa_strerror(pa_context_errno(c)));
-    } else if (eol == 0) {
-        if (info->index == ud->sink_idx) {
-            lua_State *L = ud->funcs.call_begin(ud->pd->userdata);
-            // L: ?
-            lua_createtable(L, 0, 3); // L: ? table
-            lua_pushinteger(L, pa_cvolume_avg(&info->volume)); // L: ? table integer
-            lua_setfield(L, -2, "cur"); // L: ? table
-            lua_pushinteger(L, PA_VOLUME_NORM); // L: ? table integer
-            lua_setfield(L, -2, "norm"); // L: ? table
-            lua_pushboolean(L, info->mute); // L: ? table boolean
-            lua_setfield(L, -2, "mute"); // L: ? table
-            ud->funcs.call_end(ud->pd->userdata);
-        }
+    for (size_t i = 0; i < changes->size; ++i) {
+        free(changes->data[i].obj.name);
+        free(changes->data[i].obj.description);
     }
+    LS_VECTOR_CLEAR(*changes);
 }
 
+// Compares the hub's state with what has been reported to the widget, and appends the differences
+// to /changes/. The hub must be locked.
 static
 void
-store_sink_cb(pa_context *c, const pa_sink_info *info, int eol, void *vud)
+collect_changes(Priv *p, Changes *changes)
 {
-    UserData *ud = vud;
-    if (info) {
-        if (ud->sink_idx != info->index) {
-            // sink has changed?
-            ud->sink_idx = info->index;
-            store_volume_from_sink_cb(c, info, eol, vud);
+    for (int kind = 0; kind < 2; ++kind) {
+        for (size_t i = 0; i < p->watched[kind].size; ++i) {
+            Watched *w = &p->watched[kind].data[i];
+            const HubObject *o = hub_find_by_name(p->hub, kind, w->name);
+            const uint32_t index = o ? o->index : PA_INVALID_INDEX;
+            const uint64_t gen = o ? o->gen : 0;
+            if (index != w->index || gen != w->gen) {
+                push_change(changes, kind, w->name, o, index);
+                w->index = index;
+                w->gen = gen;
+            }
         }
     }
+
+    if (!p->sink_inputs) {
+        return;
+    }
+    const size_t nobjects = p->hub->objects[HUB_SINK_INPUT].size;
+    const HubObject *objects = p->hub->objects[HUB_SINK_INPUT].data;
+
+    // Report the ones that have gone...
+    for (size_t i = 0; i < p->seen_inputs.size; ++i) {
+        const Seen *s = &p->seen_inputs.data[i];
+        bool found = false;
+        for (size_t j = 0; j < nobjects; ++j) {
+            if (objects[j].index == s->index) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            push_change(changes, HUB_SINK_INPUT, NULL, NULL, s->index);
+        }
+    }
+    // ...and the ones that are new or have changed.
+    for (size_t j = 0; j < nobjects; ++j) {
+        const HubObject *o = &objects[j];
+        bool same = false;
+        for (size_t i = 0; i < p->seen_inputs.size; ++i) {
+            const Seen *s = &p->seen_inputs.data[i];
+            if (s->index == o->index) {
+                same = s->gen == o->gen;
+                break;
+            }
+        }
+        if (!same) {
+            push_change(changes, HUB_SINK_INPUT, NULL, o, o->index);
+        }
+    }
+
+    LS_VECTOR_CLEAR(p->seen_inputs);
+    for (size_t j = 0; j < nobjects; ++j) {
+        LS_VECTOR_PUSH(p->seen_inputs, ((Seen) {.index = objects[j].index, .gen = objects[j].gen}));
+    }
 }
 
 static
 void
-update_sink(pa_context *c, void *vud)
+push_volume(lua_State *L, const HubObject *o)
 {
-    UserData *ud = vud;
-    Priv *p = ud->pd->priv;
-
-    pa_operation *o = pa_context_get_sink_info_by_name(c, p->sink_name, store_sink_cb, vud);
-    if (o) {
-        pa_operation_unref(o);
-    } else {
-        LS_ERRF(ud->pd, "pa_context_get_sink_info_by_name: %s", pa_strerror(pa_context_errno(c)));
-    }
+    // L: table
+    lua_pushinteger(L, o->volume); // L: table integer
+    lua_setfield(L, -2, "cur"); // L: table
+    lua_pushinteger(L, PA_VOLUME_NORM); // L: table integer
+    lua_setfield(L, -2, "norm"); // L: table
+    lua_pushboolean(L, o->mute); // L: table boolean
+    lua_setfield(L, -2, "mute"); // L: table
 }
 
 static
 void
-subscribe_cb(pa_context *c, pa_subscription_event_type_t t, uint32_t idx, void *vud)
+push_object(lua_State *L, const Change *c)
 {
-    UserData *ud = vud;
-
-    if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) != PA_SUBSCRIPTION_EVENT_CHANGE) {
+    if (!c->present) {
+        lua_pushboolean(L, false); // L: false
         return;
     }
-    pa_subscription_event_type_t facility = t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
-    switch (facility) {
-    case PA_SUBSCRIPTION_EVENT_SERVER:
-        // server change event, see if the sink has changed
-        update_sink(c, vud);
-        break;
-    case PA_SUBSCRIPTION_EVENT_SINK:
-        {
-            pa_operation *o = pa_context_get_sink_info_by_index(
-                c, idx, store_volume_from_sink_cb, vud);
-
-            if (o) {
-                pa_operation_unref(o);
-            } else {
-                LS_ERRF(ud->pd, "pa_context_get_sink_info_by_index: %s",
-                        pa_strerror(pa_context_errno(c)));
-            }
-        }
-        break;
-    default:
-        break;
+    const HubObject *o = &c->obj;
+    lua_createtable(L, 0, 7); // L: table
+    push_volume(L, o); // L: table
+    lua_pushinteger(L, o->index); // L: table integer
+    lua_setfield(L, -2, "index"); // L: table
+    if (o->name) {
+        lua_pushstring(L, o->name); // L: table string
+        lua_setfield(L, -2, "name"); // L: table
+    }
+    if (o->description) {
+        lua_pushstring(L, o->description); // L: table string
+        lua_setfield(L, -2, "description"); // L: table
+    }
+    if (o->sink != PA_INVALID_INDEX) {
+        lua_pushinteger(L, o->sink); // L: table integer
+        lua_setfield(L, -2, "sink"); // L: table
     }
 }
 
 static
 void
-context_state_cb(pa_context *c, void *vud)
+report_changes(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, const Changes *changes)
 {
-    UserData *ud = vud;
-    switch (pa_context_get_state(c)) {
-    case PA_CONTEXT_UNCONNECTED:
-    case PA_CONTEXT_CONNECTING:
-    case PA_CONTEXT_AUTHORIZING:
-    case PA_CONTEXT_SETTING_NAME:
-    case PA_CONTEXT_TERMINATED:
-    default:
-        break;
-
-    case PA_CONTEXT_READY:
-        {
-            pa_context_set_subscribe_callback(c, subscribe_cb, vud);
-            update_sink(c, vud);
-            pa_operation *o = pa_context_subscribe(
-                c, PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SERVER, NULL, NULL);
-
-            if (o) {
-                pa_operation_unref(o);
-            } else {
-                LS_ERRF(ud->pd, "pa_context_subscribe: %s", pa_strerror(pa_context_errno(c)));
+    Priv *p = pd->priv;
+
+    if (p->legacy) {
+        // There is only one watched object; keep the old behaviour of not reporting its absence.
+        for (size_t i = 0; i < changes->size; ++i) {
+            const Change *c = &changes->data[i];
+            if (c->present) {
+                lua_State *L = funcs.call_begin(pd->userdata);
+                // L: ?
+                lua_createtable(L, 0, 3); // L: ? table
+                push_volume(L, &c->obj); // L: ? table
+                funcs.call_end(pd->userdata);
             }
         }
-        break;
+        return;
+    }
 
-    case PA_CONTEXT_FAILED:
-        // server disconnected us
-        pa_mainloop_quit(ud->ml, 1);
-        break;
+    if (!changes->size) {
+        return;
     }
+
+    static const char *FIELDS[] = {
+        [HUB_SINK] = "sinks",
+        [HUB_SOURCE] = "sources",
+        [HUB_SINK_INPUT] = "sink_inputs",
+    };
+
+    lua_State *L = funcs.call_begin(pd->userdata);
+    // L: ?
+    lua_createtable(L, 0, 3); // L: ? table
+    for (int kind = 0; kind < HUB_NKINDS; ++kind) {
+        if (!(p->sub.kinds & (1u << kind))) {
+            continue;
+        }
+        lua_newtable(L); // L: ? table table
+        for (size_t i = 0; i < changes->size; ++i) {
+            const Change *c = &changes->data[i];
+            if (c->kind != (HubKind) kind) {
+                continue;
+            }
+            if (c->key) {
+                lua_pushstring(L, c->key); // L: ? table table key
+            } else {
+                lua_pushinteger(L, c->obj.index); // L: ? table table key
+            }
+            push_object(L, c); // L: ? table table key value
+            lua_settable(L, -3); // L: ? table table
+        }
+        lua_setfield(L, -2, FIELDS[kind]); // L: ? table
+    }
+    funcs.call_end(pd->userdata);
 }
 
 static
-bool
-iteration(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
 {
-    bool ret = false;
     Priv *p = pd->priv;
-    UserData ud = {.pd = pd, .funcs = funcs, .sink_idx = UINT32_MAX};
-    pa_mainloop_api *api = NULL;
-    pa_context *ctx = NULL;
-    pa_io_event *pipe_ev = NULL;
 
-    if (!(ud.ml = pa_mainloop_new())) {
-        LS_FATALF(pd, "pa_mainloop_new() failed");
-        goto error;
-    }
-    if (!(api = pa_mainloop_get_api(ud.ml))) {
-        LS_FATALF(pd, "pa_mainloop_get_api() failed");
-        goto error;
-    }
-    pa_proplist *proplist = pa_proplist_new();
-    pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, "luastatus-plugin-pulse");
-    pa_proplist_sets(proplist, PA_PROP_APPLICATION_ID, "io.github.shdown.luastatus");
-    pa_proplist_sets(proplist, PA_PROP_APPLICATION_VERSION, "0.0.1");
-    ctx = pa_context_new_with_proplist(api, "luastatus-plugin-pulse", proplist);
-    pa_proplist_free(proplist);
-    if (!ctx) {
-        LS_FATALF(pd, "pa_context_new_with_proplist() failed");
-        goto error;
-    }
+    Changes changes = LS_VECTOR_NEW();
 
-    pa_context_set_state_callback(ctx, context_state_cb, &ud);
-    if (pa_context_connect(ctx, NULL, PA_CONTEXT_NOFAIL | PA_CONTEXT_NOAUTOSPAWN, NULL) < 0) {
-        LS_FATALF(pd, "pa_context_connect: %s", pa_strerror(pa_context_errno(ctx)));
-        goto error;
-    }
+    struct pollfd pfds[2] = {
+        {.fd = p->sub.wakeup.rfd, .events = POLLIN},
+        // if the self-pipe has not been opened, this is -1, and poll() ignores it
+        {.fd = p->self_pipe.rfd, .events = POLLIN},
+    };
 
-    if (ls_self_pipe_is_opened(&p->self_pipe)) {
-        pipe_ev = api->io_new(api, p->self_pipe.fds[0], PA_IO_EVENT_INPUT, self_pipe_cb, &ud);
-        if (!pipe_ev) {
-            LS_FATALF(pd, "io_new() failed");
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LS_FATALF(pd, "poll: %s", ls_strerror_onstack(errno));
             goto error;
         }
-    }
 
-    ret = true;
+        if (pfds[1].revents & POLLIN) {
+            ls_wakeup_fd_drain(&p->self_pipe);
+            lua_State *L = funcs.call_begin(pd->userdata);
+            lua_pushnil(L);
+            funcs.call_end(pd->userdata);
+        }
 
-    int ignored;
-    if (pa_mainloop_run(ud.ml, &ignored) < 0) {
-        LS_FATALF(pd, "pa_mainloop_run: %s", pa_strerror(pa_context_errno(ctx)));
-        goto error;
-    }
+        if (pfds[0].revents & POLLIN) {
+            ls_wakeup_fd_drain(&p->sub.wakeup);
 
-error:
-    if (pipe_ev) {
-        assert(api);
-        api->io_free(pipe_ev);
-    }
-    if (ctx) {
-        pa_context_unref(ctx);
-    }
-    if (ud.ml) {
-        pa_mainloop_free(ud.ml);
-    }
-    return ret;
-}
+            // Any number of changes that happen before we get here are coalesced into one call
+            // with the latest state.
+            hub_lock(p->hub);
+            collect_changes(p, &changes);
+            hub_unlock(p->hub);
 
-static
-void
-run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
-{
-    while (1) {
-        if (!iteration(pd, funcs)) {
-            nanosleep((struct timespec[1]) {{.tv_sec = 5}}, NULL);
+            report_changes(pd, funcs, &changes);
+            changes_clear(&changes);
         }
     }
+
+error:
+    changes_clear(&changes);
+    LS_VECTOR_FREE(changes);
 }
 
 LuastatusPluginIface luastatus_plugin_iface_v1 = {
@@ -0,0 +1,484 @@
+#include <errno.h>
+#include <lua.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+#include "libls/lua_utils.h"
+#include "libls/time_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/evloop_utils.h"
+#include "libls/osdep.h"
+
+typedef enum {
+    PROTO_TCP,
+    PROTO_UDP,
+
+    PROTO__LAST,
+} Proto;
+
+static const struct {
+    const char *name;
+    int ipproto;
+} PROTOS[] = {
+    [PROTO_TCP] = {"tcp", IPPROTO_TCP},
+    [PROTO_UDP] = {"udp", IPPROTO_UDP},
+};
+
+// Socket states, as in /include/net/tcp_states.h/ in the kernel. UDP sockets are either
+// "established" (connected) or "close" (not connected).
+enum {
+    // The kernel reports request sockets (those in the process of a three-way handshake) in this
+    // state; we count them as "syn_recv", as /ss(8)/ does.
+    STATE_NEW_SYN_RECV = 12,
+
+    NSTATES,
+};
+
+static const char *const STATE_NAMES[NSTATES] = {
+    [1]  = "established",
+    [2]  = "syn_sent",
+    [3]  = "syn_recv",
+    [4]  = "fin_wait1",
+    [5]  = "fin_wait2",
+    [6]  = "time_wait",
+    [7]  = "close",
+    [8]  = "close_wait",
+    [9]  = "last_ack",
+    [10] = "listen",
+    [11] = "closing",
+};
+
+enum {
+    STATE_SYN_RECV = 3,
+};
+
+typedef struct {
+    unsigned total;
+    unsigned by_state[NSTATES];
+} Counts;
+
+typedef struct {
+    uint16_t port;
+    Counts counts;
+} PortCounts;
+
+typedef struct {
+    bool protos[PROTO__LAST];
+    bool ipv4;
+    bool ipv6;
+    // Bitmask of states to dump, as in /inet_diag_req_v2::idiag_states/.
+    uint32_t states;
+    // Local ports to count (all if empty).
+    LS_VECTOR_OF(PortCounts) ports[PROTO__LAST];
+    // Bitmap of /ports/ (the same for all protocols).
+    uint8_t *port_bitmap;
+    // Only count sockets of this user, if not negative.
+    int64_t uid;
+
+    struct timespec period;
+    char *fifo;
+
+    int fd;
+    uint32_t seq;
+    Counts totals[PROTO__LAST];
+} Priv;
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    for (int i = 0; i < PROTO__LAST; ++i) {
+        LS_VECTOR_FREE(p->ports[i]);
+    }
+    free(p->port_bitmap);
+    free(p->fifo);
+    close(p->fd);
+    free(p);
+}
+
+static
+int
+proto_by_name(const char *name)
+{
+    for (int i = 0; i < PROTO__LAST; ++i) {
+        if (strcmp(PROTOS[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static
+int
+state_by_name(const char *name)
+{
+    for (int i = 0; i < NSTATES; ++i) {
+        if (STATE_NAMES[i] && strcmp(STATE_NAMES[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static
+bool
+port_bitmap_has(const uint8_t *bitmap, uint16_t port)
+{
+    return bitmap[port / 8] & (1 << (port % 8));
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .protos = {false},
+        .ipv4 = true,
+        .ipv6 = true,
+        .states = 0,
+        .port_bitmap = NULL,
+        .uid = -1,
+        .period = {.tv_sec = 5},
+        .fifo = NULL,
+        .fd = -1,
+        .seq = 0,
+    };
+    for (int i = 0; i < PROTO__LAST; ++i) {
+        LS_VECTOR_INIT(p->ports[i]);
+    }
+
+    bool any_proto = false;
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "protocols", "'protocols'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'protocols' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'protocols' element", s,
+            const int proto = proto_by_name(s);
+            if (proto < 0) {
+                LS_FATALF(pd, "unknown protocol '%s'", s);
+                goto error;
+            }
+            p->protos[proto] = true;
+            any_proto = true;
+        );
+    );
+    if (!any_proto) {
+        p->protos[PROTO_TCP] = true;
+    }
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "families", "'families'",
+        p->ipv4 = false;
+        p->ipv6 = false;
+        PU_CHECK_TYPE(LS_LUA_KEY, "'families' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'families' element", s,
+            if (strcmp(s, "ipv4") == 0) {
+                p->ipv4 = true;
+            } else if (strcmp(s, "ipv6") == 0) {
+                p->ipv6 = true;
+            } else {
+                LS_FATALF(pd, "unknown family '%s'", s);
+                goto error;
+            }
+        );
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "states", "'states'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'states' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'states' element", s,
+            const int state = state_by_name(s);
+            if (state < 0) {
+                LS_FATALF(pd, "unknown state '%s'", s);
+                goto error;
+            }
+            p->states |= 1u << state;
+        );
+    );
+    if (!p->states) {
+        for (int i = 0; i < NSTATES; ++i) {
+            if (STATE_NAMES[i]) {
+                p->states |= 1u << i;
+            }
+        }
+    }
+    if (p->states & (1u << STATE_SYN_RECV)) {
+        p->states |= 1u << STATE_NEW_SYN_RECV;
+    }
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "ports", "'ports'",
+        if (!p->port_bitmap) {
+            p->port_bitmap = LS_XNEW0(uint8_t, 65536 / 8);
+        }
+        PU_CHECK_TYPE(LS_LUA_KEY, "'ports' key", LUA_TNUMBER);
+        PU_VISIT_NUM(LS_LUA_VALUE, "'ports' element", n,
+            if (!(n >= 1 && n <= 65535) || n != (uint16_t) n) {
+                LS_FATALF(pd, "invalid port in 'ports'");
+                goto error;
+            }
+            const uint16_t port = n;
+            if (!port_bitmap_has(p->port_bitmap, port)) {
+                p->port_bitmap[port / 8] |= 1 << (port % 8);
+                for (int i = 0; i < PROTO__LAST; ++i) {
+                    LS_VECTOR_PUSH(p->ports[i], ((PortCounts) {.port = port}));
+                }
+            }
+        );
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "uid", "'uid'", n,
+        // Note: this also checks that /n/ is not NaN.
+        if (!(n >= 0 && n <= UINT32_MAX)) {
+            LS_FATALF(pd, "invalid 'uid' value");
+            goto error;
+        }
+        p->uid = n;
+    );
+
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "period", "'period'", n,
+        if (ls_timespec_is_invalid(p->period = ls_timespec_from_seconds(n))) {
+            LS_FATALF(pd, "invalid 'period' value");
+            goto error;
+        }
+    );
+
+    PU_MAYBE_VISIT_STR_FIELD(-1, "fifo", "'fifo'", s,
+        p->fifo = ls_xstrdup(s);
+    );
+
+    if ((p->fd = ls_cloexec_socket(AF_NETLINK, SOCK_DGRAM, NETLINK_SOCK_DIAG)) < 0) {
+        LS_FATALF(pd, "socket: %s", ls_strerror_onstack(errno));
+        goto error;
+    }
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+static
+PortCounts *
+find_port(Priv *p, Proto proto, uint16_t port)
+{
+    for (size_t i = 0; i < p->ports[proto].size; ++i) {
+        if (p->ports[proto].data[i].port == port) {
+            return &p->ports[proto].data[i];
+        }
+    }
+    return NULL;
+}
+
+static
+void
+count(Counts *c, int state)
+{
+    if (state == STATE_NEW_SYN_RECV) {
+        state = STATE_SYN_RECV;
+    }
+    ++c->total;
+    if (state >= 0 && state < NSTATES) {
+        ++c->by_state[state];
+    }
+}
+
+static
+void
+handle_sock(Priv *p, Proto proto, const struct inet_diag_msg *m)
+{
+    if (p->uid >= 0 && m->idiag_uid != p->uid) {
+        return;
+    }
+    if (p->port_bitmap) {
+        const uint16_t port = ntohs(m->id.idiag_sport);
+        if (!port_bitmap_has(p->port_bitmap, port)) {
+            return;
+        }
+        count(&find_port(p, proto, port)->counts, m->idiag_state);
+    }
+    count(&p->totals[proto], m->idiag_state);
+}
+
+// Dumps the sockets of protocol /proto/ and family /family/, filtered by state in the kernel,
+// and counts them.
+static
+bool
+dump(LuastatusPluginData *pd, Proto proto, int family)
+{
+    Priv *p = pd->priv;
+    if (!++p->seq) {
+        ++p->seq;
+    }
+    const uint32_t seq = p->seq;
+
+    struct {
+        struct nlmsghdr nh;
+        struct inet_diag_req_v2 r;
+    } req = {
+        .nh = {
+            .nlmsg_len = sizeof(req),
+            .nlmsg_type = SOCK_DIAG_BY_FAMILY,
+            .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+            .nlmsg_seq = seq,
+        },
+        .r = {
+            .sdiag_family = family,
+            .sdiag_protocol = PROTOS[proto].ipproto,
+            .idiag_states = p->states,
+        },
+    };
+    struct sockaddr_nl sa = {.nl_family = AF_NETLINK};
+    if (sendto(p->fd, &req, sizeof(req), 0, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+        LS_ERRF(pd, "sendto: %s", ls_strerror_onstack(errno));
+        return false;
+    }
+
+    // Dumps are large, so the buffer is larger than the 8 KiB recommended by netlink(7).
+    char buf[32768];
+    while (1) {
+        ssize_t len = recv(p->fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LS_ERRF(pd, "recv: %s", ls_strerror_onstack(errno));
+            return false;
+        }
+        for (struct nlmsghdr *nh = (struct nlmsghdr *) buf;
+             NLMSG_OK(nh, len);
+             nh = NLMSG_NEXT(nh, len))
+        {
+            if (nh->nlmsg_seq != seq) {
+                // A leftover of a previous, failed, dump.
+                continue;
+            }
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                return true;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+                    LS_ERRF(pd, "netlink error message truncated");
+                    return false;
+                }
+                const struct nlmsgerr *e = NLMSG_DATA(nh);
+                LS_ERRF(pd, "netlink error: %s", ls_strerror_onstack(-e->error));
+                return false;
+            }
+            if (nh->nlmsg_type != SOCK_DIAG_BY_FAMILY ||
+                nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct inet_diag_msg)))
+            {
+                continue;
+            }
+            handle_sock(p, proto, NLMSG_DATA(nh));
+        }
+    }
+}
+
+static
+void
+push_counts(lua_State *L, Priv *p, const Counts *c)
+{
+    // L: ?
+    lua_newtable(L); // L: ? table
+
+    lua_pushnumber(L, c->total); // L: ? table number
+    lua_setfield(L, -2, "total"); // L: ? table
+
+    for (int i = 0; i < NSTATES; ++i) {
+        if (STATE_NAMES[i] && (p->states & (1u << i))) {
+            lua_pushnumber(L, c->by_state[i]); // L: ? table number
+            lua_setfield(L, -2, STATE_NAMES[i]); // L: ? table
+        }
+    }
+}
+
+static
+void
+make_call(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    bool ok[PROTO__LAST];
+    for (int proto = 0; proto < PROTO__LAST; ++proto) {
+        ok[proto] = false;
+        if (!p->protos[proto]) {
+            continue;
+        }
+        p->totals[proto] = (Counts) {0};
+        for (size_t i = 0; i < p->ports[proto].size; ++i) {
+            p->ports[proto].data[i].counts = (Counts) {0};
+        }
+        ok[proto] = (!p->ipv4 || dump(pd, proto, AF_INET)) &&
+                    (!p->ipv6 || dump(pd, proto, AF_INET6));
+    }
+
+    lua_State *L = funcs.call_begin(pd->userdata);
+    // L: ?
+    lua_createtable(L, 0, PROTO__LAST); // L: ? table
+    for (int proto = 0; proto < PROTO__LAST; ++proto) {
+        if (!ok[proto]) {
+            continue;
+        }
+        push_counts(L, p, &p->totals[proto]); // L: ? table counts
+
+        if (p->port_bitmap) {
+            lua_createtable(L, 0, p->ports[proto].size); // L: ? table counts ports
+            for (size_t i = 0; i < p->ports[proto].size; ++i) {
+                const PortCounts *pc = &p->ports[proto].data[i];
+                push_counts(L, p, &pc->counts); // L: ? table counts ports portcounts
+                lua_rawseti(L, -2, pc->port); // L: ? table counts ports
+            }
+            lua_setfield(L, -2, "ports"); // L: ? table counts
+        }
+
+        lua_setfield(L, -2, PROTOS[proto].name); // L: ? table
+    }
+    funcs.call_end(pd->userdata);
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    LSWakeupFifo w;
+    ls_wakeup_fifo_init(&w, p->fifo, NULL);
+
+    while (1) {
+        make_call(pd, funcs);
+
+        if (ls_wakeup_fifo_open(&w) < 0) {
+            LS_WARNF(pd, "ls_wakeup_fifo_open: %s: %s", p->fifo,
+                     LS_WAKEUP_FIFO_STRERROR_ONSTACK(errno));
+        }
+        if (ls_wakeup_fifo_wait(&w, p->period) < 0) {
+            LS_FATALF(pd, "ls_wakeup_fifo_wait: %s: %s", p->fifo, ls_strerror_onstack(errno));
+            goto error;
+        }
+    }
+
+error:
+    ls_wakeup_fifo_destroy(&w);
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
@@ -0,0 +1,383 @@
+#include <errno.h>
+#include <lua.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/vector.h"
+#include "libls/string_.h"
+#include "libls/cstring_utils.h"
+#include "libls/batch_reader.h"
+#include "libls/scan_utils.h"
+#include "libls/time_utils.h"
+
+typedef struct {
+    // The key in the /cb/ argument table.
+    char *name;
+    // Index of the file in /Priv::reader/.
+    size_t idx;
+    // Whether the attribute supports /sysfs_notify()/, and thus is to be waited on.
+    bool notify;
+    // In milliseconds; /-1/ if the attribute is not to be polled.
+    int64_t period_ms;
+    // When the attribute is to be polled next (a /ls_now_ms()/ value), or /-1/.
+    int64_t due;
+    // Whether the attribute is to be re-read in the current iteration.
+    bool pending;
+    // Whether the attribute has changed since the last call.
+    bool changed;
+
+    // The value last passed to /cb/ (zero-terminated), and whether there is one (a failed read is
+    // a value, too).
+    bool has_last;
+    bool last_ok;
+    LSString last;
+} Attr;
+
+typedef struct {
+    LS_VECTOR_OF(Attr) attrs;
+    LSBatchReader reader;
+    // Indices of the files to be re-read in the current iteration.
+    LS_VECTOR_OF(size_t) to_read;
+} Priv;
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    for (size_t i = 0; i < p->attrs.size; ++i) {
+        free(p->attrs.data[i].name);
+        LS_VECTOR_FREE(p->attrs.data[i].last);
+    }
+    LS_VECTOR_FREE(p->attrs);
+    ls_batch_reader_destroy(&p->reader);
+    LS_VECTOR_FREE(p->to_read);
+    free(p);
+}
+
+// Converts /sec/ seconds to milliseconds; returns /-1/ if /sec/ is not positive or is too large.
+static
+int64_t
+to_ms(double sec)
+{
+    if (!(sec > 0) || sec > 1e6) {
+        return -1;
+    }
+    const int64_t r = sec * 1000;
+    return r ? r : 1;
+}
+
+static
+bool
+add_attr(LuastatusPluginData *pd, const char *path, const char *name, bool notify,
+         int64_t period_ms)
+{
+    Priv *p = pd->priv;
+    const int idx = ls_batch_reader_add(&p->reader, path);
+    if (idx < 0) {
+        LS_FATALF(pd, "%s: %s", path, ls_strerror_onstack(errno));
+        return false;
+    }
+    LS_VECTOR_PUSH(p->attrs, ((Attr) {
+        .name = ls_xstrdup(name ? name : path),
+        .idx = idx,
+        .notify = notify,
+        .period_ms = period_ms,
+        .due = -1,
+        .pending = false,
+        .changed = false,
+        .has_last = false,
+        .last_ok = false,
+        .last = LS_VECTOR_NEW(),
+    }));
+    return true;
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .attrs = LS_VECTOR_NEW(),
+        .to_read = LS_VECTOR_NEW(),
+    };
+    ls_batch_reader_init(&p->reader);
+
+    int64_t default_period_ms = 1000;
+    PU_MAYBE_VISIT_NUM_FIELD(-1, "period", "'period'", n,
+        if ((default_period_ms = to_ms(n)) < 0) {
+            LS_FATALF(pd, "invalid 'period' value");
+            goto error;
+        }
+    );
+
+    PU_VISIT_TABLE_FIELD(-1, "attrs", "'attrs'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'attrs' key", LUA_TNUMBER);
+        if (lua_type(L, LS_LUA_VALUE) == LUA_TSTRING) {
+            if (!add_attr(pd, lua_tostring(L, LS_LUA_VALUE), NULL, false, default_period_ms)) {
+                goto error;
+            }
+        } else {
+            PU_CHECK_TYPE(LS_LUA_VALUE, "'attrs' element", LUA_TTABLE);
+
+            bool notify = false;
+            PU_MAYBE_VISIT_BOOL_FIELD(-1, "notify", "attribute's 'notify'", b,
+                notify = b;
+            );
+
+            // Attributes that notify are only polled if asked to.
+            int64_t period_ms = notify ? -1 : default_period_ms;
+            PU_MAYBE_VISIT_NUM_FIELD(-1, "period", "attribute's 'period'", n,
+                if ((period_ms = to_ms(n)) < 0) {
+                    LS_FATALF(pd, "invalid attribute's 'period' value");
+                    goto error;
+                }
+            );
+
+            const char *name = NULL;
+            PU_MAYBE_VISIT_STR_FIELD(-1, "name", "attribute's 'name'", s,
+                name = s;
+            );
+
+            PU_VISIT_STR_FIELD(-1, "path", "attribute's 'path'", s,
+                if (!add_attr(pd, s, name, notify, period_ms)) {
+                    goto error;
+                }
+            );
+        }
+    );
+
+    if (!p->attrs.size) {
+        LS_FATALF(pd, "'attrs' is empty");
+        goto error;
+    }
+
+    return LUASTATUS_OK;
+
+error:
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+// If the (zero-terminated) /s/ of length /ns/ is a decimal number (as in "-12", "0.15"), writes
+// it into /*out/ and returns /true/.
+static
+bool
+parse_num(const char *s, size_t ns, double *out)
+{
+    if (!ns) {
+        return false;
+    }
+    const char *end = s + ns;
+    const bool neg = *s == '-';
+    const char *pos = neg ? s + 1 : s;
+    if (pos == end || *pos < '0' || *pos > '9') {
+        return false;
+    }
+    const double r = ls_scan_udouble(&pos);
+    if (pos != end) {
+        return false;
+    }
+    *out = neg ? -r : r;
+    return true;
+}
+
+// Updates the value of /a/ from what has just been read; sets /a->changed/ if it differs from the
+// last one.
+static
+void
+update_value(Priv *p, Attr *a)
+{
+    size_t n;
+    const char *data = ls_batch_reader_data(&p->reader, a->idx, &n);
+    const bool ok = data != NULL;
+    if (ok) {
+        while (n && (data[n - 1] == '\n' || ls_scan_is_blank(data[n - 1]))) {
+            --n;
+        }
+    }
+    if (a->has_last && a->last_ok == ok &&
+        (!ok || (a->last.size == n + 1 && memcmp(a->last.data, data, n) == 0)))
+    {
+        return;
+    }
+    a->has_last = true;
+    a->last_ok = ok;
+    ls_string_assign_b(&a->last, ok ? data : "", ok ? n : 0);
+    ls_string_append_c(&a->last, '\0');
+    a->changed = true;
+}
+
+// Pushes a table with the values of the changed attributes; clears their /changed/ flags.
+static
+void
+push_changed(lua_State *L, Priv *p)
+{
+    lua_newtable(L); // L: table
+    for (size_t i = 0; i < p->attrs.size; ++i) {
+        Attr *a = &p->attrs.data[i];
+        if (!a->changed) {
+            continue;
+        }
+        a->changed = false;
+        double num;
+        if (!a->last_ok) {
+            lua_pushboolean(L, false); // L: table false
+        } else if (parse_num(a->last.data, a->last.size - 1, &num)) {
+            lua_pushnumber(L, num); // L: table number
+        } else {
+            lua_pushlstring(L, a->last.data, a->last.size - 1); // L: table string
+        }
+        lua_setfield(L, -2, a->name); // L: table
+    }
+}
+
+// Re-reads the pending attributes in a batch; returns whether any of them has changed.
+static
+bool
+read_pending(Priv *p)
+{
+    LS_VECTOR_CLEAR(p->to_read);
+    for (size_t i = 0; i < p->attrs.size; ++i) {
+        if (p->attrs.data[i].pending) {
+            LS_VECTOR_PUSH(p->to_read, p->attrs.data[i].idx);
+        }
+    }
+    ls_batch_reader_read_some(&p->reader, p->to_read.data, p->to_read.size);
+
+    bool changed = false;
+    for (size_t i = 0; i < p->attrs.size; ++i) {
+        Attr *a = &p->attrs.data[i];
+        if (a->pending) {
+            a->pending = false;
+            update_value(p, a);
+            changed = changed || a->changed;
+        }
+    }
+    return changed;
+}
+
+// Once a device is removed, /poll()/ reports its attributes as always ready, and reading them
+// fails; so an attribute that has failed to read is not waited on (its /false/ value is reported
+// once), until a periodic read of it (if any) succeeds again.
+static
+void
+update_pfds(Priv *p, struct pollfd *pfds, const size_t *pfd_attr, size_t npfds)
+{
+    for (size_t i = 0; i < npfds; ++i) {
+        const Attr *a = &p->attrs.data[pfd_attr[i]];
+        pfds[i].fd = a->last_ok ? ls_batch_reader_fd(&p->reader, a->idx) : -1;
+    }
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    // /pfd_attr[i]/ is the index of the attribute of /pfds[i]/.
+    struct pollfd *pfds = LS_XNEW(struct pollfd, p->attrs.size);
+    size_t *pfd_attr = LS_XNEW(size_t, p->attrs.size);
+    size_t npfds = 0;
+    for (size_t i = 0; i < p->attrs.size; ++i) {
+        const Attr *a = &p->attrs.data[i];
+        if (a->notify) {
+            pfds[npfds] = (struct pollfd) {
+                .fd = ls_batch_reader_fd(&p->reader, a->idx),
+                .events = POLLPRI,
+            };
+            pfd_attr[npfds] = i;
+            ++npfds;
+        }
+    }
+
+    // Read everything first; for the attributes that notify, this also arms the notification.
+    const int64_t start = ls_now_ms();
+    for (size_t i = 0; i < p->attrs.size; ++i) {
+        Attr *a = &p->attrs.data[i];
+        a->pending = true;
+        a->due = a->period_ms < 0 ? -1 : start + a->period_ms;
+    }
+    bool changed = read_pending(p);
+    update_pfds(p, pfds, pfd_attr, npfds);
+
+    while (1) {
+        // make a call if anything has changed
+        if (changed) {
+            lua_State *L = funcs.call_begin(pd->userdata);
+            push_changed(L, p);
+            funcs.call_end(pd->userdata);
+        }
+
+        // wait until an attribute notifies, or the earliest one is due
+        int64_t deadline = -1;
+        for (size_t i = 0; i < p->attrs.size; ++i) {
+            const int64_t due = p->attrs.data[i].due;
+            if (due >= 0 && (deadline < 0 || due < deadline)) {
+                deadline = due;
+            }
+        }
+        int64_t now = ls_now_ms();
+        int timeout = -1;
+        if (deadline >= 0) {
+            timeout = deadline > now ? deadline - now : 0;
+        }
+        const int r = poll(pfds, npfds, timeout);
+        if (r < 0) {
+            if (errno == EINTR) {
+                changed = false;
+                continue;
+            }
+            LS_FATALF(pd, "poll: %s", ls_strerror_onstack(errno));
+            goto error;
+        }
+
+        // collect the attributes to re-read
+        for (size_t i = 0; i < npfds; ++i) {
+            if (pfds[i].revents & POLLNVAL) {
+                LS_FATALF(pd, "poll: invalid file descriptor");
+                goto error;
+            }
+            // After a notification, the value has to be re-read from the beginning to re-arm it.
+            if (pfds[i].revents & (POLLPRI | POLLERR)) {
+                p->attrs.data[pfd_attr[i]].pending = true;
+            }
+        }
+        now = ls_now_ms();
+        for (size_t i = 0; i < p->attrs.size; ++i) {
+            Attr *a = &p->attrs.data[i];
+            if (a->due < 0 || a->due > now) {
+                continue;
+            }
+            a->pending = true;
+            // Do not try to catch up if we have fallen behind (e.g. after a suspend).
+            a->due += a->period_ms;
+            if (a->due <= now) {
+                a->due = now + a->period_ms;
+            }
+        }
+        changed = read_pending(p);
+        update_pfds(p, pfds, pfd_attr, npfds);
+    }
+
+error:
+    free(pfds);
+    free(pfd_attr);
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};
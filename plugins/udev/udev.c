@@ -1,31 +1,77 @@
 #include <sys/select.h>
+#include <sys/types.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <lua.h>
 #include <stdlib.h>
-#include <libudev.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "include/plugin_v1.h"
 #include "include/sayf_macros.h"
 #include "include/plugin_utils.h"
 
 #include "libls/alloc_utils.h"
+#include "libls/algo.h"
+#include "libls/vector.h"
+#include "libls/string_.h"
+#include "libls/strarr.h"
 #include "libls/time_utils.h"
 #include "libls/cstring_utils.h"
 #include "libls/evloop_utils.h"
 #include "libls/sig_utils.h"
 
+#include "libudevhub/udevhub.h"
+
+// A device seen in an event, with the sysattrs files kept open.
+typedef struct {
+    UdevHubDevice dev;
+    // One for each of /Priv::sysattrs/; -1 if it could not be opened.
+    int *fds;
+} CachedDevice;
+
 typedef struct {
     char *subsystem;
     char *devtype;
     char *tag;
-    bool kernel_ev;
+    char *sysname;
     bool greet;
     struct timespec timeout;
     LSPushedTimeout pushed_timeout;
+    UdevHubSub sub;
+    UdevHub *hub;
+    // Events taken from the hub.
+    UdevHubEvents events;
+    // If not empty, the devices are cached.
+    LSStringArray sysattrs;
+    LS_VECTOR_OF(CachedDevice) cache;
 } Priv;
 
+static
+void
+cached_device_free(Priv *p, CachedDevice *cd)
+{
+    for (size_t i = 0; i < ls_strarr_size(p->sysattrs); ++i) {
+        if (cd->fds[i] >= 0) {
+            close(cd->fds[i]);
+        }
+    }
+    free(cd->fds);
+    udevhub_device_free(&cd->dev);
+}
+
+static
+void
+cache_clear(Priv *p)
+{
+    for (size_t i = 0; i < p->cache.size; ++i) {
+        cached_device_free(p, &p->cache.data[i]);
+    }
+    LS_VECTOR_CLEAR(p->cache);
+}
+
 static
 void
 destroy(LuastatusPluginData *pd)
@@ -34,7 +80,17 @@ destroy(LuastatusPluginData *pd)
     free(p->subsystem);
     free(p->devtype);
     free(p->tag);
+    free(p->sysname);
     ls_pushed_timeout_destroy(&p->pushed_timeout);
+    if (p->hub) {
+        udevhub_unsubscribe(p->hub, &p->sub);
+    }
+    ls_wakeup_fd_close(&p->sub.wakeup);
+    udevhub_events_clear(&p->events);
+    LS_VECTOR_FREE(p->events);
+    cache_clear(p);
+    LS_VECTOR_FREE(p->cache);
+    ls_strarr_destroy(p->sysattrs);
     free(p);
 }
 
@@ -47,10 +103,20 @@ init(LuastatusPluginData *pd, lua_State *L)
         .subsystem = NULL,
         .devtype = NULL,
         .tag = NULL,
-        .kernel_ev = false,
+        .sysname = NULL,
         .greet = false,
         .timeout = ls_timespec_invalid,
+        .sub = {
+            .userdata = pd->userdata,
+            .sayf = pd->sayf,
+            .wakeup = LS_WAKEUP_FD_NEW(),
+        },
+        .hub = NULL,
+        .events = LS_VECTOR_NEW(),
+        .sysattrs = ls_strarr_new(),
+        .cache = LS_VECTOR_NEW(),
     };
+    bool kernel_ev = false;
     ls_pushed_timeout_init(&p->pushed_timeout);
 
     PU_MAYBE_VISIT_STR_FIELD(-1, "subsystem", "'subsystem'", s,
@@ -65,8 +131,12 @@ init(LuastatusPluginData *pd, lua_State *L)
         p->tag = ls_xstrdup(s);
     );
 
+    PU_MAYBE_VISIT_STR_FIELD(-1, "sysname", "'sysname'", s,
+        p->sysname = ls_xstrdup(s);
+    );
+
     PU_MAYBE_VISIT_BOOL_FIELD(-1, "kernel_events", "'kernel_events'", b,
-        p->kernel_ev = b;
+        kernel_ev = b;
     );
 
     PU_MAYBE_VISIT_NUM_FIELD(-1, "timeout", "'timeout'", n,
@@ -80,6 +150,29 @@ init(LuastatusPluginData *pd, lua_State *L)
         p->greet = b;
     );
 
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "sysattrs", "'sysattrs'",
+        PU_CHECK_TYPE(LS_LUA_KEY, "'sysattrs' key", LUA_TNUMBER);
+        PU_VISIT_STR(LS_LUA_VALUE, "'sysattrs' element", s,
+            if (!*s || *s == '/') {
+                LS_FATALF(pd, "'sysattrs' element is empty or an absolute path");
+                goto error;
+            }
+            ls_strarr_append_s(&p->sysattrs, s);
+        );
+    );
+
+    p->sub.subsystem = p->subsystem;
+    p->sub.devtype = p->devtype;
+    p->sub.tag = p->tag;
+    p->sub.sysname = p->sysname;
+    if (ls_wakeup_fd_open(&p->sub.wakeup) < 0) {
+        LS_FATALF(pd, "ls_wakeup_fd_open: %s", ls_strerror_onstack(errno));
+        goto error;
+    }
+    if (!(p->hub = udevhub_subscribe(&p->sub, pd->map_get, kernel_ev))) {
+        goto error;
+    }
+
     return LUASTATUS_OK;
 
 error:
@@ -97,70 +190,229 @@ register_funcs(LuastatusPluginData *pd, lua_State *L)
     lua_setfield(L, -2, "push_timeout"); // L: table
 }
 
+static
+CachedDevice *
+cache_find(Priv *p, const char *syspath)
+{
+    for (size_t i = 0; i < p->cache.size; ++i) {
+        CachedDevice *cd = &p->cache.data[i];
+        if (strcmp(udevhub_device_field(&cd->dev, UDEVHUB_FIELD_SYSPATH), syspath) == 0) {
+            return cd;
+        }
+    }
+    return NULL;
+}
+
+// Takes /*dev/ over (leaving it empty) and stores it in the cache, opening the sysattrs files if
+// the device is new. Returns the cache entry.
+static
+CachedDevice *
+cache_update(Priv *p, UdevHubDevice *dev)
+{
+    const char *syspath = udevhub_device_field(dev, UDEVHUB_FIELD_SYSPATH);
+    CachedDevice *cd = cache_find(p, syspath);
+    if (cd) {
+        udevhub_device_free(&cd->dev);
+    } else {
+        const size_t nattrs = ls_strarr_size(p->sysattrs);
+        LS_VECTOR_PUSH(p->cache, ((CachedDevice) {.fds = LS_XNEW(int, nattrs)}));
+        cd = &p->cache.data[p->cache.size - 1];
+        LSString path = LS_VECTOR_NEW();
+        for (size_t i = 0; i < nattrs; ++i) {
+            ls_string_assign_s(&path, syspath);
+            ls_string_append_c(&path, '/');
+            ls_string_append_s(&path, ls_strarr_at(p->sysattrs, i, NULL));
+            ls_string_append_c(&path, '\0');
+            cd->fds[i] = open(path.data, O_RDONLY | O_CLOEXEC);
+        }
+        LS_VECTOR_FREE(path);
+    }
+    cd->dev = *dev;
+    *dev = (UdevHubDevice) {.fields = ls_strarr_new(), .props = ls_strarr_new()};
+    return cd;
+}
+
+static
+void
+cache_remove(Priv *p, const char *syspath)
+{
+    CachedDevice *cd = cache_find(p, syspath);
+    if (cd) {
+        cached_device_free(p, cd);
+        *cd = p->cache.data[p->cache.size - 1];
+        --p->cache.size;
+    }
+}
+
 static inline
 void
-report_status(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, const char *status)
+push_status(lua_State *L, const char *status)
 {
-    lua_State *L = funcs.call_begin(pd->userdata);
-    lua_createtable(L, 0, 1); // L: table
+    lua_createtable(L, 0, 16); // L: table
     lua_pushstring(L, status); // L: table string
     lua_setfield(L, -2, "what"); // L: table
-    funcs.call_end(pd->userdata);
 }
 
 static
 void
-report_event(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, struct udev_device *dev)
+push_props(lua_State *L, const UdevHubDevice *dev)
 {
-    lua_State *L = funcs.call_begin(pd->userdata);
-    lua_createtable(L, 0, 4); // L: table
+    const size_t n = ls_strarr_size(dev->props);
+    lua_createtable(L, 0, n / 2); // L: table
+    for (size_t i = 0; i + 1 < n; i += 2) {
+        lua_pushstring(L, ls_strarr_at(dev->props, i + 1, NULL)); // L: table value
+        lua_setfield(L, -2, ls_strarr_at(dev->props, i, NULL)); // L: table
+    }
+}
 
-    lua_pushstring(L, "event"); // L: table string
-    lua_setfield(L, -2, "what"); // L: table
+// Reads the sysattrs of /cd/ anew; the ones that can not be read are omitted.
+static
+void
+push_attrs(lua_State *L, Priv *p, const CachedDevice *cd)
+{
+    const size_t n = ls_strarr_size(p->sysattrs);
+    lua_createtable(L, 0, n); // L: table
+    for (size_t i = 0; i < n; ++i) {
+        if (cd->fds[i] < 0) {
+            continue;
+        }
+        // sysfs attributes are at most a page long; reading from the offset of zero makes sysfs
+        // regenerate the value.
+        char buf[4096];
+        ssize_t r = pread(cd->fds[i], buf, sizeof(buf), 0);
+        if (r < 0) {
+            continue;
+        }
+        while (r && (buf[r - 1] == '\n')) {
+            --r;
+        }
+        lua_pushlstring(L, buf, r); // L: table value
+        lua_setfield(L, -2, ls_strarr_at(p->sysattrs, i, NULL)); // L: table
+    }
+}
+
+// Pushes the fields of /dev/ (except for the action, which only makes sense for an event) into the
+// table on the top of the stack, along with its properties, and also the sysattrs if /cd/ is not
+// /NULL/.
+static
+void
+fill_device(lua_State *L, Priv *p, const UdevHubDevice *dev, const CachedDevice *cd)
+{
+    static const struct {
+        const char *key;
+        UdevHubField field;
+    } FIELDS[] = {
+        {"syspath",   UDEVHUB_FIELD_SYSPATH},
+        {"sysname",   UDEVHUB_FIELD_SYSNAME},
+        {"sysnum",    UDEVHUB_FIELD_SYSNUM},
+        {"devpath",   UDEVHUB_FIELD_DEVPATH},
+        {"devnode",   UDEVHUB_FIELD_DEVNODE},
+        {"devtype",   UDEVHUB_FIELD_DEVTYPE},
+        {"subsystem", UDEVHUB_FIELD_SUBSYSTEM},
+        {"driver",    UDEVHUB_FIELD_DRIVER},
+    };
 
-#define PROP(Key_, Func_) \
-    do { \
-        /* L: table */ \
-        const char *r_ = Func_(dev); \
-        if (r_) { \
-            lua_pushstring(L, r_);     /* L: table string */ \
-            lua_setfield(L, -2, Key_); /* L: table */ \
-        } \
-    } while (0)
-
-    PROP("syspath", udev_device_get_syspath);
-    PROP("sysname", udev_device_get_sysname);
-    PROP("sysnum", udev_device_get_sysnum);
-    PROP("devpath", udev_device_get_devpath);
-    PROP("devnode", udev_device_get_devnode);
-    PROP("devtype", udev_device_get_devtype);
-    PROP("subsystem", udev_device_get_subsystem);
-    PROP("driver", udev_device_get_driver);
-    PROP("action", udev_device_get_action);
-
-#undef PROP
+    // L: table
+    for (size_t i = 0; i < LS_ARRAY_SIZE(FIELDS); ++i) {
+        const char *r = udevhub_device_field(dev, FIELDS[i].field);
+        if (r) {
+            lua_pushstring(L, r); // L: table string
+            lua_setfield(L, -2, FIELDS[i].key); // L: table
+        }
+    }
+    push_props(L, dev); // L: table props
+    lua_setfield(L, -2, "props"); // L: table
+    if (cd) {
+        push_attrs(L, p, cd); // L: table attrs
+        lua_setfield(L, -2, "attrs"); // L: table
+    }
+}
+
+// If the devices are cached, pushes them into the table on the top of the stack.
+static
+void
+fill_devices(lua_State *L, Priv *p)
+{
+    if (!ls_strarr_size(p->sysattrs)) {
+        return;
+    }
+    // L: table
+    lua_createtable(L, 0, p->cache.size); // L: table devices
+    for (size_t i = 0; i < p->cache.size; ++i) {
+        const CachedDevice *cd = &p->cache.data[i];
+        lua_createtable(L, 0, 11); // L: table devices device
+        fill_device(L, p, &cd->dev, cd); // L: table devices device
+        lua_setfield(L, -2, udevhub_device_field(&cd->dev, UDEVHUB_FIELD_SYSNAME));
+        // L: table devices
+    }
+    lua_setfield(L, -2, "devices"); // L: table
+}
+
+static
+void
+report_status(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, const char *status)
+{
+    Priv *p = pd->priv;
+    lua_State *L = funcs.call_begin(pd->userdata);
+    push_status(L, status); // L: table
+    fill_devices(L, p); // L: table
+    funcs.call_end(pd->userdata);
+}
 
+static
+void
+report_event(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, const UdevHubDevice *dev,
+             const CachedDevice *cd)
+{
+    Priv *p = pd->priv;
+    lua_State *L = funcs.call_begin(pd->userdata);
+    push_status(L, "event"); // L: table
+    const char *action = udevhub_device_field(dev, UDEVHUB_FIELD_ACTION);
+    if (action) {
+        lua_pushstring(L, action); // L: table string
+        lua_setfield(L, -2, "action"); // L: table
+    }
+    fill_device(L, p, dev, cd); // L: table
+    fill_devices(L, p); // L: table
     funcs.call_end(pd->userdata);
 }
 
 static
 void
-run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+handle_event(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, UdevHubEvent *ev)
 {
     Priv *p = pd->priv;
+    const bool caching = ls_strarr_size(p->sysattrs);
 
-    struct udev *udev = udev_new();
-    if (!udev) {
-        LS_FATALF(pd, "udev_new() failed");
-        return;
+    switch (ev->kind) {
+    case UDEVHUB_EV_DEVICE:
+        {
+            const char *action = udevhub_device_field(&ev->dev, UDEVHUB_FIELD_ACTION);
+            if (!caching) {
+                report_event(pd, funcs, &ev->dev, NULL);
+            } else if (action && strcmp(action, "remove") == 0) {
+                cache_remove(p, udevhub_device_field(&ev->dev, UDEVHUB_FIELD_SYSPATH));
+                report_event(pd, funcs, &ev->dev, NULL);
+            } else {
+                const CachedDevice *cd = cache_update(p, &ev->dev);
+                report_event(pd, funcs, &cd->dev, cd);
+            }
+        }
+        break;
+    case UDEVHUB_EV_RESYNC:
+        // The devices that still exist follow.
+        cache_clear(p);
+        report_status(pd, funcs, "resync");
+        break;
     }
+}
 
-    struct udev_monitor *mon = udev_monitor_new_from_netlink(
-        udev, p->kernel_ev ? "kernel" : "udev");
-    udev_monitor_filter_add_match_subsystem_devtype(mon, p->subsystem, p->devtype);
-    udev_monitor_filter_add_match_tag(mon, p->tag);
-    udev_monitor_enable_receiving(mon);
-    const int fd = udev_monitor_get_fd(mon);
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+    const int fd = p->sub.wakeup.rfd;
 
     fd_set fds;
     FD_ZERO(&fds);
@@ -168,6 +420,17 @@ run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
     sigset_t allsigs;
     ls_xsigfillset(&allsigs);
 
+    if (ls_strarr_size(p->sysattrs)) {
+        // Fill the cache with the devices that already exist.
+        if (!udevhub_enumerate(&p->sub, &p->events)) {
+            LS_FATALF(pd, "cannot enumerate the devices");
+            return;
+        }
+        for (size_t i = 0; i < p->events.size; ++i) {
+            cache_update(p, &p->events.data[i].dev);
+        }
+    }
+
     if (p->greet) {
         report_status(pd, funcs, "hello");
     }
@@ -183,21 +446,21 @@ run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
 
         if (r < 0) {
             LS_FATALF(pd, "pselect: %s", ls_strerror_onstack(errno));
-            break;
+            return;
         } else if (r == 0) {
             report_status(pd, funcs, "timeout");
         } else {
-            struct udev_device *dev = udev_monitor_receive_device(mon);
-            if (!dev) {
-                // what the...?
-                continue;
+            ls_wakeup_fd_drain(&p->sub.wakeup);
+            const bool alive = udevhub_take_events(p->hub, &p->sub, &p->events);
+            for (size_t i = 0; i < p->events.size; ++i) {
+                handle_event(pd, funcs, &p->events.data[i]);
+            }
+            if (!alive) {
+                LS_FATALF(pd, "udev monitor has failed");
+                return;
             }
-            report_event(pd, funcs, dev);
-            udev_device_unref(dev);
         }
     }
-
-    udev_unref(udev);
 }
 
 LuastatusPluginIface luastatus_plugin_iface_v1 = {
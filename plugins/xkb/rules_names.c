@@ -3,37 +3,40 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
-#include <X11/X.h>
-#include <X11/Xatom.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
 
+#include "libls/alloc_utils.h"
 #include "libls/algo.h"
 
-static const char *NAMES_PROP_ATOM = "_XKB_RULES_NAMES";
-static const long NAMES_PROP_MAXLEN = 1024;
+// In 4-byte units.
+static const uint32_t NAMES_PROP_MAXLEN = 1024;
 
 bool
-rules_names_load(Display *dpy, RulesNames *out)
+rules_names_load(xcb_connection_t *conn, xcb_window_t root, xcb_atom_t atom, RulesNames *out)
 {
     *out = (RulesNames) {.data_ = NULL};
 
-    Atom rules_atom = XInternAtom(dpy, NAMES_PROP_ATOM, True);
-    if (rules_atom == None) {
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(
+        conn,
+        xcb_get_property(conn, 0, root, atom, XCB_ATOM_STRING, 0, NAMES_PROP_MAXLEN),
+        NULL);
+    if (!reply) {
         goto error;
     }
-    Atom actual_type;
-    int fmt;
-    unsigned long ndata, bytes_after;
-    if (XGetWindowProperty(dpy, DefaultRootWindow(dpy), rules_atom, 0L, NAMES_PROP_MAXLEN,
-                           False, XA_STRING, &actual_type, &fmt, &ndata, &bytes_after, &out->data_)
-        != Success)
-    {
-        goto error;
-    }
-    if (bytes_after || actual_type != XA_STRING || fmt != 8) {
+    if (reply->bytes_after || reply->type != XCB_ATOM_STRING || reply->format != 8) {
+        free(reply);
         goto error;
     }
 
-    const char *ptr = (const char *) out->data_;
+    // Unlike Xlib, XCB does not terminate the value with a nul byte, so make a copy that is.
+    const size_t ndata = xcb_get_property_value_length(reply);
+    out->data_ = ls_xmalloc(ndata + 1, 1);
+    memcpy(out->data_, xcb_get_property_value(reply), ndata);
+    out->data_[ndata] = '\0';
+    free(reply);
+
+    const char *ptr = out->data_;
     const char *const end = ptr + ndata;
 
     const char **table[] = {
@@ -43,7 +46,7 @@ rules_names_load(Display *dpy, RulesNames *out)
         &out->options,
     };
     for (size_t i = 0;
-         i < LS_ARRAY_SIZE(table) && ptr != end;
+         i < LS_ARRAY_SIZE(table) && ptr < end;
          ++i, ptr += strlen(ptr) + 1)
     {
         *table[i] = ptr;
@@ -59,7 +62,5 @@ error:
 void
 rules_names_destroy(RulesNames *rn)
 {
-    if (rn->data_) {
-        XFree(rn->data_);
-    }
+    free(rn->data_);
 }
@@ -1,7 +1,8 @@
 #ifndef rules_names_h_
 #define rules_names_h_
 
-#include <X11/Xlib.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
 #include <stdbool.h>
 
 typedef struct {
@@ -12,11 +13,12 @@ typedef struct {
     const char *options;
 
     // Private data; do not touch.
-    unsigned char *data_;
+    char *data_;
 } RulesNames;
 
+// /atom/ is the (interned) /_XKB_RULES_NAMES/ atom.
 bool
-rules_names_load(Display *dpy, RulesNames *out);
+rules_names_load(xcb_connection_t *conn, xcb_window_t root, xcb_atom_t atom, RulesNames *out);
 
 void
 rules_names_destroy(RulesNames *rn);
@@ -1,9 +1,13 @@
-#include <X11/X.h>
-#include <X11/Xlib.h>
-#include <X11/XKBlib.h>
-#include <limits.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+#include <xcb/xkb.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/select.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <lua.h>
 
 #include "include/plugin_v1.h"
@@ -12,21 +16,48 @@
 
 #include "libls/alloc_utils.h"
 #include "libls/compdep.h"
+#include "libls/cstring_utils.h"
+#include "libls/evloop_utils.h"
+#include "libls/sig_utils.h"
 #include "libls/strarr.h"
 #include "libls/algo.h"
+#include "libls/vector.h"
+
+#include "libxhub/xhub.h"
 
 #include "rules_names.h"
 
-// If this plugin is used, the whole process gets killed if a connection to the display is lost,
-// because Xlib is terrible.
-//
-// See:
-// * https://tronche.com/gui/x/xlib/event-handling/protocol-errors/XSetIOErrorHandler.html
-// * https://tronche.com/gui/x/xlib/event-handling/protocol-errors/XSetErrorHandler.html
+typedef struct {
+    // As specified in the options; may be /XCB_XKB_ID_USE_CORE_KBD/.
+    xcb_xkb_device_spec_t spec;
+
+    // Whether the events have been selected for the device, and its state is known. If not, the
+    // device is retried whenever any keyboard changes.
+    bool avail;
+
+    // The actual device ID, as reported in the events.
+    uint8_t real_id;
+
+    // Whether /group/ has to be requeried (e.g. after the keyboard has been replaced).
+    bool state_dirty;
+    int group;
+
+    // Whether /groups/ has to be requeried.
+    bool groups_dirty;
+    LSStringArray groups;
+
+    // Whether anything has changed since the last call.
+    bool changed;
+} Device;
 
 typedef struct {
-    char *dpyname;
-    unsigned deviceid;
+    // If set, there is a single device, and it is reported in the legacy format.
+    bool legacy;
+    LS_VECTOR_OF(Device) devs;
+    XHubSub sub;
+    XHub *hub;
+    // Events taken from the hub.
+    XHubEvents events;
 } Priv;
 
 static
@@ -34,192 +65,546 @@ void
 destroy(LuastatusPluginData *pd)
 {
     Priv *p = pd->priv;
-    free(p->dpyname);
+    for (size_t i = 0; i < p->devs.size; ++i) {
+        ls_strarr_destroy(p->devs.data[i].groups);
+    }
+    LS_VECTOR_FREE(p->devs);
+    if (p->hub) {
+        xhub_unsubscribe(p->hub, &p->sub);
+    }
+    ls_wakeup_fd_close(&p->sub.wakeup);
+    LS_VECTOR_FREE(p->events);
     free(p);
 }
 
+static
+bool
+use_extension(LuastatusPluginData *pd, xcb_connection_t *conn)
+{
+    xcb_xkb_use_extension_reply_t *reply = xcb_xkb_use_extension_reply(
+        conn,
+        xcb_xkb_use_extension(conn, XCB_XKB_MAJOR_VERSION, XCB_XKB_MINOR_VERSION),
+        NULL);
+    if (!reply) {
+        LS_FATALF(pd, "xcb_xkb_use_extension() failed");
+        return false;
+    }
+    const bool supported = reply->supported;
+    free(reply);
+    if (!supported) {
+        LS_FATALF(pd, "server has an incompatible extension version");
+        return false;
+    }
+    return true;
+}
+
+static
+void
+add_device(Priv *p, xcb_xkb_device_spec_t spec)
+{
+    LS_VECTOR_PUSH(p->devs, ((Device) {
+        .spec = spec,
+        .avail = false,
+        .real_id = 0,
+        .state_dirty = true,
+        .group = 0,
+        .groups_dirty = true,
+        .groups = ls_strarr_new(),
+        .changed = false,
+    }));
+}
+
 static
 int
 init(LuastatusPluginData *pd, lua_State *L)
 {
     Priv *p = pd->priv = LS_XNEW(Priv, 1);
     *p = (Priv) {
-        .dpyname = NULL,
-        .deviceid = XkbUseCoreKbd,
+        .legacy = true,
+        .devs = LS_VECTOR_NEW(),
+        .sub = {
+            .userdata = pd->userdata,
+            .sayf = pd->sayf,
+            .wakeup = LS_WAKEUP_FD_NEW(),
+            // for /_XKB_RULES_NAMES/ changes
+            .kinds = XHUB_PROPERTY_NOTIFY,
+            .ext = &xcb_xkb_id,
+        },
+        .hub = NULL,
+        .events = LS_VECTOR_NEW(),
     };
+    char *dpyname = NULL;
 
     PU_MAYBE_VISIT_STR_FIELD(-1, "display", "'display'", s,
-        p->dpyname = ls_xstrdup(s);
+        dpyname = ls_xstrdup(s);
+    );
+
+    PU_MAYBE_VISIT_TABLE_FIELD(-1, "device_ids", "'device_ids'",
+        p->legacy = false;
+        PU_CHECK_TYPE(LS_LUA_KEY, "'device_ids' key", LUA_TNUMBER);
+        PU_VISIT_NUM(LS_LUA_VALUE, "'device_ids' element", n,
+            if (!ls_is_between_d(n, 0, 255)) {
+                LS_FATALF(pd, "'device_ids' element is invalid");
+                goto error;
+            }
+            add_device(p, n);
+        );
     );
 
     PU_MAYBE_VISIT_NUM_FIELD(-1, "device_id", "'device_id'", n,
-        if (!ls_is_between_d(n, 0, UINT_MAX)) {
+        if (!p->legacy) {
+            LS_FATALF(pd, "both 'device_id' and 'device_ids' were specified");
+            goto error;
+        }
+        if (!ls_is_between_d(n, 0, 255)) {
             LS_FATALF(pd, "'device_id' is invalid");
             goto error;
         }
-        p->deviceid = n;
+        add_device(p, n);
     );
-
-    static char dummy[1];
-    void **ptr = pd->map_get(pd->userdata, "flag:library_used:x11");
-    if (!*ptr) {
-        if (!XInitThreads()) {
-            LS_FATALF(pd, "XInitThreads failed");
+    if (!p->devs.size) {
+        if (!p->legacy) {
+            LS_FATALF(pd, "'device_ids' is empty");
             goto error;
         }
-        *ptr = dummy;
+        add_device(p, XCB_XKB_ID_USE_CORE_KBD);
+    }
+
+    if (ls_wakeup_fd_open(&p->sub.wakeup) < 0) {
+        LS_FATALF(pd, "ls_wakeup_fd_open: %s", ls_strerror_onstack(errno));
+        goto error;
+    }
+    if (!(p->hub = xhub_subscribe(&p->sub, pd->map_get, dpyname))) {
+        goto error;
+    }
+    if (!use_extension(pd, p->hub->conn)) {
+        goto error;
     }
 
+    free(dpyname);
     return LUASTATUS_OK;
 
 error:
+    free(dpyname);
     destroy(pd);
     return LUASTATUS_ERR;
 }
 
+// Splits /s/ by non-parenthesized /sep/ characters, calling /f(ud, segment, nsegment)/ for each
+// segment.
 static
-Display *
-open_dpy(LuastatusPluginData *pd, char *dpyname)
-{
-    XkbIgnoreExtension(False);
-    int event_out;
-    int error_out;
-    int reason_out;
-    int major_in_out = XkbMajorVersion;
-    int minor_in_out = XkbMinorVersion;
-    Display *dpy = XkbOpenDisplay(dpyname, &event_out, &error_out, &major_in_out, &minor_in_out,
-                                  &reason_out);
-    if (dpy && reason_out == XkbOD_Success) {
-        return dpy;
-    }
-    const char *msg;
-    switch (reason_out) {
-    case XkbOD_BadLibraryVersion:
-        msg = "bad XKB library version";
-        break;
-    case XkbOD_ConnectionRefused:
-        msg = "can't open display, connection refused";
-        break;
-    case XkbOD_BadServerVersion:
-        msg = "server has an incompatible extension version";
-        break;
-    case XkbOD_NonXkbServer:
-        msg = "extension is not present in the server";
-        break;
-    default:
-        msg = "unknown error";
-        break;
+void
+split_toplevel(const char *s, char sep, void (*f)(void *ud, const char *seg, size_t nseg), void *ud)
+{
+    int balance = 0;
+    size_t prev = 0;
+    const size_t ns = strlen(s);
+    for (size_t i = 0; i < ns; ++i) {
+        if (s[i] == '(') {
+            ++balance;
+        } else if (s[i] == ')') {
+            --balance;
+        } else if (s[i] == sep && balance == 0) {
+            f(ud, s + prev, i - prev);
+            prev = i + 1;
+        }
     }
-    LS_FATALF(pd, "XkbOpenDisplay failed: %s", msg);
-    return NULL;
+    f(ud, s + prev, ns - prev);
+}
+
+static
+void
+append_layout(void *ud, const char *seg, size_t nseg)
+{
+    ls_strarr_append(ud, seg, nseg);
 }
 
 static
 bool
-query_groups(Display *dpy, LSStringArray *groups)
+query_rules_groups(XHub *h, LSStringArray *groups)
 {
     RulesNames rn;
-    if (!rules_names_load(dpy, &rn)) {
+    if (!rules_names_load(h->conn, h->root, h->atoms[XHUB_ATOM__XKB_RULES_NAMES], &rn)) {
         return false;
     }
-
     ls_strarr_clear(groups);
     if (rn.layout) {
-        // split /rn.layout/ by non-parenthesized commas
-        int balance = 0;
-        size_t prev = 0;
-        const size_t nlayout = strlen(rn.layout);
-        for (size_t i = 0; i < nlayout; ++i) {
-            switch (rn.layout[i]) {
-            case '(': ++balance; break;
-            case ')': --balance; break;
-            case ',':
-                if (balance == 0) {
-                    ls_strarr_append(groups, rn.layout + prev, i - prev);
-                    prev = i + 1;
-                }
-                break;
-            }
+        split_toplevel(rn.layout, ',', append_layout, groups);
+    }
+    rules_names_destroy(&rn);
+    return true;
+}
+
+// The components of a symbols name (e.g. "pc+us+ru:2+inet(evdev)+group(alt_shift_toggle)") that
+// are not layouts.
+static const char *NON_LAYOUT_SYMBOLS[] = {
+    "pc", "inet", "group", "level3", "level5", "ctrl", "compose", "terminate", "altwin",
+    "capslock", "keypad", "eurosign", "kpdl", "nbsp", "shift", "lv3", "lv5", "srvr_ctrl", "caps",
+    "mod_led", "grp_led", "japan", "korean", "rupeesign", "parens", "numpad", "kr",
+};
+
+static
+void
+append_symbols_layout(void *ud, const char *seg, size_t nseg)
+{
+    LSStringArray *groups = ud;
+
+    // "name(variant):index"
+    size_t nname = 0;
+    while (nname < nseg && seg[nname] != '(' && seg[nname] != ':') {
+        ++nname;
+    }
+    for (size_t i = 0; i < LS_ARRAY_SIZE(NON_LAYOUT_SYMBOLS); ++i) {
+        const char *s = NON_LAYOUT_SYMBOLS[i];
+        if (strlen(s) == nname && memcmp(s, seg, nname) == 0) {
+            return;
         }
-        ls_strarr_append(groups, rn.layout + prev, nlayout - prev);
     }
+    const char *colon = memchr(seg, ':', nseg);
+    size_t index = ls_strarr_size(*groups);
+    if (colon) {
+        char *end;
+        const unsigned long n = strtoul(colon + 1, &end, 10);
+        if (end == seg + nseg && n >= 1 && n <= 4) {
+            index = n - 1;
+        }
+        nseg = colon - seg;
+    }
+    // Groups are numbered consecutively, so a gap can only mean a weird symbols name; fill it.
+    while (ls_strarr_size(*groups) < index) {
+        ls_strarr_append(groups, "", 0);
+    }
+    if (index == ls_strarr_size(*groups)) {
+        ls_strarr_append(groups, seg, nseg);
+    }
+}
 
-    rules_names_destroy(&rn);
+// Derives the layouts of the device /spec/ from the name of its symbols; this works for any
+// device, unlike /_XKB_RULES_NAMES/, which only describes the core keyboard.
+static
+bool
+query_symbols_groups(XHub *h, xcb_xkb_device_spec_t spec, LSStringArray *groups)
+{
+    xcb_xkb_get_names_reply_t *reply = xcb_xkb_get_names_reply(
+        h->conn, xcb_xkb_get_names(h->conn, spec, XCB_XKB_NAME_DETAIL_SYMBOLS), NULL);
+    if (!reply) {
+        return false;
+    }
+    xcb_xkb_get_names_value_list_t list;
+    xcb_xkb_get_names_value_list_unpack(
+        xcb_xkb_get_names_value_list(reply), reply->nTypes, reply->indicators,
+        reply->virtualMods, reply->groupNames, reply->nKeys, reply->nKeyAliases,
+        reply->nRadioGroups, reply->which, &list);
+    const xcb_atom_t atom = list.symbolsName;
+    free(reply);
+    if (atom == XCB_ATOM_NONE) {
+        return false;
+    }
+
+    xcb_get_atom_name_reply_t *name = xcb_get_atom_name_reply(
+        h->conn, xcb_get_atom_name(h->conn, atom), NULL);
+    if (!name) {
+        return false;
+    }
+    const size_t nsymbols = xcb_get_atom_name_name_length(name);
+    char *symbols = ls_xmalloc(nsymbols + 1, 1);
+    memcpy(symbols, xcb_get_atom_name_name(name), nsymbols);
+    symbols[nsymbols] = '\0';
+    free(name);
+
+    ls_strarr_clear(groups);
+    split_toplevel(symbols, '+', append_symbols_layout, groups);
+    free(symbols);
     return true;
 }
 
+static
+bool
+query_groups(XHub *h, Device *d)
+{
+    // For the core keyboard, stick to /_XKB_RULES_NAMES/, as it reports the layouts exactly as
+    // they were passed to setxkbmap.
+    if (d->spec == XCB_XKB_ID_USE_CORE_KBD) {
+        return query_rules_groups(h, &d->groups);
+    }
+    return query_symbols_groups(h, d->spec, &d->groups) || query_rules_groups(h, &d->groups);
+}
+
+// Selects the events and fetches the state of the devices that are not available yet, and fetches
+// the state of those with /state_dirty/ set. All the requests are sent at once.
 static
 void
-run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+refresh_states(LuastatusPluginData *pd)
 {
     Priv *p = pd->priv;
-    LSStringArray groups = ls_strarr_new();
-    Display *dpy = NULL;
+    xcb_connection_t *conn = p->hub->conn;
 
-    if (!(dpy = open_dpy(pd, p->dpyname))) {
-        goto error;
+    const xcb_xkb_select_events_details_t details = {
+        .affectNewKeyboard = XCB_XKB_NKN_DETAIL_KEYCODES | XCB_XKB_NKN_DETAIL_DEVICE_ID,
+        .newKeyboardDetails = XCB_XKB_NKN_DETAIL_KEYCODES | XCB_XKB_NKN_DETAIL_DEVICE_ID,
+        .affectState = XCB_XKB_STATE_PART_GROUP_STATE,
+        .stateDetails = XCB_XKB_STATE_PART_GROUP_STATE,
+        .affectNames = XCB_XKB_NAME_DETAIL_SYMBOLS | XCB_XKB_NAME_DETAIL_GROUP_NAMES,
+        .namesDetails = XCB_XKB_NAME_DETAIL_SYMBOLS | XCB_XKB_NAME_DETAIL_GROUP_NAMES,
+    };
+    const uint16_t which = XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY |
+                           XCB_XKB_EVENT_TYPE_STATE_NOTIFY |
+                           XCB_XKB_EVENT_TYPE_NAMES_NOTIFY;
+
+    xcb_void_cookie_t select_cookies[p->devs.size];
+    xcb_xkb_get_state_cookie_t state_cookies[p->devs.size];
+    for (size_t i = 0; i < p->devs.size; ++i) {
+        Device *d = &p->devs.data[i];
+        if (!d->avail) {
+            select_cookies[i] = xcb_xkb_select_events_aux_checked(
+                conn, d->spec, which, 0, 0, 0, 0, &details);
+        }
+        if (!d->avail || d->state_dirty) {
+            state_cookies[i] = xcb_xkb_get_state(conn, d->spec);
+        }
     }
 
-    if (!query_groups(dpy, &groups)) {
-        LS_FATALF(pd, "query_groups failed");
-        goto error;
+    for (size_t i = 0; i < p->devs.size; ++i) {
+        Device *d = &p->devs.data[i];
+        const bool was_avail = d->avail;
+        if (!d->avail) {
+            xcb_generic_error_t *err = xcb_request_check(conn, select_cookies[i]);
+            if (err) {
+                free(err);
+                xcb_discard_reply(conn, state_cookies[i].sequence);
+                continue;
+            }
+        } else if (!d->state_dirty) {
+            continue;
+        }
+
+        xcb_xkb_get_state_reply_t *state = xcb_xkb_get_state_reply(conn, state_cookies[i], NULL);
+        d->state_dirty = false;
+        if (!state) {
+            if (d->avail) {
+                LS_WARNF(pd, "device %u has gone", (unsigned) d->spec);
+                d->avail = false;
+                d->changed = true;
+            }
+            continue;
+        }
+        d->avail = true;
+        d->real_id = state->deviceID;
+        if (!was_avail || d->group != state->group) {
+            d->group = state->group;
+            d->changed = true;
+        }
+        if (!was_avail) {
+            d->groups_dirty = true;
+        }
+        free(state);
     }
-    while (1) {
-        // query current state
-        XkbStateRec state;
-        if (XkbGetState(dpy, p->deviceid, &state) != Success) {
-            LS_FATALF(pd, "XkbGetState failed");
-            goto error;
+}
+
+static
+void
+refresh_groups(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    for (size_t i = 0; i < p->devs.size; ++i) {
+        Device *d = &p->devs.data[i];
+        if (!d->avail || (!d->groups_dirty && (size_t) d->group < ls_strarr_size(d->groups))) {
+            continue;
+        }
+        if (!d->groups_dirty) {
+            LS_WARNF(pd, "group ID (%d) is too large, requerying", d->group);
+        }
+        if (!query_groups(p->hub, d)) {
+            LS_WARNF(pd, "cannot query the layouts of device %u", (unsigned) d->spec);
+            ls_strarr_clear(&d->groups);
+        } else if ((size_t) d->group >= ls_strarr_size(d->groups)) {
+            LS_WARNF(pd, "group ID is still too large");
         }
+        d->groups_dirty = false;
+        d->changed = true;
+    }
+}
 
-        // check if group is valid and possibly requery
-        int group = state.group;
-        if (group < 0) {
-            LS_WARNF(pd, "group ID is negative (%d)", group);
-        } else if ((size_t) group >= ls_strarr_size(groups)) {
-            LS_WARNF(pd, "group ID (%d) is too large, requerying", group);
-            if (!query_groups(dpy, &groups)) {
-                LS_FATALF(pd, "query_groups failed");
-                goto error;
+static
+Device *
+find_device(Priv *p, uint8_t real_id)
+{
+    for (size_t i = 0; i < p->devs.size; ++i) {
+        Device *d = &p->devs.data[i];
+        if (d->avail && d->real_id == real_id) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Returns /true/ if the devices that are not available should be retried.
+static
+bool
+handle_event(Priv *p, xcb_generic_event_t *evt)
+{
+    XHub *h = p->hub;
+    const uint8_t type = evt->response_type & ~0x80;
+
+    if (type == XCB_PROPERTY_NOTIFY) {
+        // setxkbmap updates the property after loading the new keymap, so the "new keyboard"
+        // notification may come before it.
+        xcb_property_notify_event_t *pne = (xcb_property_notify_event_t *) evt;
+        if (pne->window == h->root && pne->atom == h->atoms[XHUB_ATOM__XKB_RULES_NAMES]) {
+            for (size_t i = 0; i < p->devs.size; ++i) {
+                p->devs.data[i].groups_dirty = true;
+            }
+        }
+        return false;
+    }
+
+    // All the XKB events share a single response type, and are told apart by /xkbType/ (the second
+    // byte).
+    switch (((xcb_xkb_state_notify_event_t *) evt)->xkbType) {
+    case XCB_XKB_STATE_NOTIFY:
+        {
+            xcb_xkb_state_notify_event_t *ev = (xcb_xkb_state_notify_event_t *) evt;
+            Device *d = find_device(p, ev->deviceID);
+            if (d && d->group != ev->group) {
+                d->group = ev->group;
+                d->changed = true;
+            }
+        }
+        return false;
+    case XCB_XKB_NEW_KEYBOARD_NOTIFY:
+        {
+            xcb_xkb_new_keyboard_notify_event_t *ev = (xcb_xkb_new_keyboard_notify_event_t *) evt;
+            for (size_t i = 0; i < p->devs.size; ++i) {
+                Device *d = &p->devs.data[i];
+                if (d->avail && (d->real_id == ev->oldDeviceID || d->real_id == ev->deviceID)) {
+                    d->real_id = ev->deviceID;
+                    d->state_dirty = true;
+                    d->groups_dirty = true;
+                }
             }
-            if ((size_t) group >= ls_strarr_size(groups)) {
-                LS_WARNF(pd, "group ID is still too large");
+        }
+        return true;
+    case XCB_XKB_NAMES_NOTIFY:
+        {
+            xcb_xkb_names_notify_event_t *ev = (xcb_xkb_names_notify_event_t *) evt;
+            Device *d = find_device(p, ev->deviceID);
+            if (d) {
+                d->groups_dirty = true;
             }
         }
+        return false;
+    default:
+        return false;
+    }
+}
 
-        // make a call
-        lua_State *L = funcs.call_begin(pd->userdata); // L: -
-        lua_createtable(L, 0, 2); // L: table
-        lua_pushinteger(L, group); // L: table n
-        lua_setfield(L, -2, "id"); // L: table
-        if (group >= 0 && (size_t) group < ls_strarr_size(groups)) {
-            size_t nbuf;
-            const char *buf = ls_strarr_at(groups, group, &nbuf);
-            lua_pushlstring(L, buf, nbuf); // L: table group
-            lua_setfield(L, -2, "name"); // L: table
+static
+void
+push_device(lua_State *L, Device *d)
+{
+    lua_createtable(L, 0, 2); // L: table
+    lua_pushinteger(L, d->group); // L: table n
+    lua_setfield(L, -2, "id"); // L: table
+    if ((size_t) d->group < ls_strarr_size(d->groups)) {
+        size_t nbuf;
+        const char *buf = ls_strarr_at(d->groups, d->group, &nbuf);
+        lua_pushlstring(L, buf, nbuf); // L: table group
+        lua_setfield(L, -2, "name"); // L: table
+    }
+}
+
+static
+void
+report(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+    bool changed = false;
+    for (size_t i = 0; i < p->devs.size; ++i) {
+        if (p->devs.data[i].changed) {
+            changed = true;
+            p->devs.data[i].changed = false;
         }
-        funcs.call_end(pd->userdata);
+    }
+    if (!changed) {
+        return;
+    }
 
-        // wait for next event
-        if (XkbSelectEventDetails(dpy, p->deviceid, XkbStateNotify, XkbAllStateComponentsMask,
-                                  XkbGroupStateMask)
-            == False)
-        {
-            LS_FATALF(pd, "XkbSelectEventDetails failed");
-            goto error;
+    lua_State *L = funcs.call_begin(pd->userdata); // L: -
+    if (p->legacy) {
+        push_device(L, &p->devs.data[0]); // L: table
+    } else {
+        lua_createtable(L, p->devs.size, 0); // L: array
+        for (size_t i = 0; i < p->devs.size; ++i) {
+            Device *d = &p->devs.data[i];
+            if (d->avail) {
+                push_device(L, d); // L: array table
+            } else {
+                lua_pushboolean(L, false); // L: array false
+            }
+            lua_rawseti(L, -2, i + 1); // L: array
         }
-        XEvent event;
-        // XXX should we block all signals here to ensure /XNextEvent/ will not
-        // fail with /EINTR/? Apparently not: /XNextEvent/ is untimed, so there is
-        // no sense for it to use a multiplexing interface.
-        XNextEvent(dpy, &event);
     }
+    funcs.call_end(pd->userdata);
+}
 
-error:
-    if (dpy) {
-        XCloseDisplay(dpy);
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+
+    sigset_t allsigs;
+    ls_xsigfillset(&allsigs);
+
+    refresh_states(pd);
+    if (p->legacy && !p->devs.data[0].avail) {
+        LS_FATALF(pd, "cannot select events for the device or query its state");
+        return;
+    }
+    refresh_groups(pd);
+    for (size_t i = 0; i < p->devs.size; ++i) {
+        p->devs.data[i].changed = true;
+    }
+    report(pd, funcs);
+
+    const int fd = p->sub.wakeup.rfd;
+    fd_set fds;
+    FD_ZERO(&fds);
+    while (1) {
+        FD_SET(fd, &fds);
+        if (pselect(fd + 1, &fds, NULL, NULL, NULL, &allsigs) < 0) {
+            LS_FATALF(pd, "pselect: %s", ls_strerror_onstack(errno));
+            return;
+        }
+        ls_wakeup_fd_drain(&p->sub.wakeup);
+        const bool alive = xhub_take_events(p->hub, &p->sub, &p->events);
+
+        bool retry = false;
+        bool state_dirty = false;
+        for (size_t i = 0; i < p->events.size; ++i) {
+            if (handle_event(p, &p->events.data[i])) {
+                retry = true;
+            }
+        }
+        for (size_t i = 0; i < p->devs.size; ++i) {
+            Device *d = &p->devs.data[i];
+            if ((retry && !d->avail) || d->state_dirty) {
+                state_dirty = true;
+            }
+        }
+        // In the common case (a group switch), the events carry everything we need, and no
+        // requests are made.
+        if (state_dirty) {
+            refresh_states(pd);
+        }
+        refresh_groups(pd);
+        report(pd, funcs);
+
+        if (!alive) {
+            LS_FATALF(pd, "connection to the X server has been lost");
+            return;
+        }
     }
-    ls_strarr_destroy(groups);
 }
 
 LuastatusPluginIface luastatus_plugin_iface_v1 = {
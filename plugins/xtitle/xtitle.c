@@ -1,8 +1,5 @@
 #include <xcb/xcb.h>
 #include <xcb/xproto.h>
-#include <xcb/xcb_event.h>
-#include <xcb/xcb_icccm.h>
-#include <xcb/xcb_ewmh.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/select.h>
@@ -17,14 +14,43 @@
 
 #include "libls/alloc_utils.h"
 #include "libls/cstring_utils.h"
+#include "libls/evloop_utils.h"
 #include "libls/sig_utils.h"
+#include "libls/string_.h"
+#include "libls/vector.h"
+
+#include "libxhub/xhub.h"
+#include "libxhub/props.h"
 
 // some parts of this file (including the name) are proudly stolen from
 // xtitle (https://github.com/baskerville/xtitle).
 
+// The maximum number of windows whose titles are cached.
+enum { CACHE_MAX = 64 };
+
+// A cached title of a window. All the windows in the cache are watched, so that an entry is
+// invalidated as soon as the window's title changes. Thus, switching the focus between windows in
+// the cache takes only the round trip for /_NET_ACTIVE_WINDOW/.
+typedef struct {
+    xcb_window_t window;
+    // Whether /has_title/ and /title/ are up to date.
+    bool valid;
+    bool has_title;
+    LSString title;
+    uint64_t last_used;
+} CacheEntry;
+
 typedef struct {
-    char *dpyname;
     bool visible;
+    XHubSub sub;
+    XHub *hub;
+    // Events taken from the hub.
+    XHubEvents events;
+    LS_VECTOR_OF(CacheEntry) cache;
+    uint64_t clock;
+    // What has been passed to /cb/ the last time.
+    bool last_has_title;
+    LSString last_title;
 } Priv;
 
 static
@@ -32,7 +58,19 @@ void
 destroy(LuastatusPluginData *pd)
 {
     Priv *p = pd->priv;
-    free(p->dpyname);
+    for (size_t i = 0; i < p->cache.size; ++i) {
+        if (p->hub) {
+            xhub_watch(p->hub, p->cache.data[i].window, false);
+        }
+        LS_VECTOR_FREE(p->cache.data[i].title);
+    }
+    LS_VECTOR_FREE(p->cache);
+    LS_VECTOR_FREE(p->last_title);
+    if (p->hub) {
+        xhub_unsubscribe(p->hub, &p->sub);
+    }
+    ls_wakeup_fd_close(&p->sub.wakeup);
+    LS_VECTOR_FREE(p->events);
     free(p);
 }
 
@@ -42,176 +80,201 @@ init(LuastatusPluginData *pd, lua_State *L)
 {
     Priv *p = pd->priv = LS_XNEW(Priv, 1);
     *p = (Priv) {
-        .dpyname = NULL,
         .visible = false,
+        .sub = {
+            .userdata = pd->userdata,
+            .sayf = pd->sayf,
+            .wakeup = LS_WAKEUP_FD_NEW(),
+            .kinds = XHUB_PROPERTY_NOTIFY | XHUB_DESTROY_NOTIFY,
+            .ext = NULL,
+        },
+        .hub = NULL,
+        .events = LS_VECTOR_NEW(),
+        .cache = LS_VECTOR_NEW(),
+        .clock = 0,
+        .last_has_title = false,
+        .last_title = LS_VECTOR_NEW(),
     };
+    char *dpyname = NULL;
 
     PU_MAYBE_VISIT_STR_FIELD(-1, "display", "'display'", s,
-        p->dpyname = ls_xstrdup(s);
+        dpyname = ls_xstrdup(s);
     );
 
     PU_MAYBE_VISIT_BOOL_FIELD(-1, "visible", "'visible'", b,
         p->visible = b;
     );
 
+    if (ls_wakeup_fd_open(&p->sub.wakeup) < 0) {
+        LS_FATALF(pd, "ls_wakeup_fd_open: %s", ls_strerror_onstack(errno));
+        goto error;
+    }
+    if (!(p->hub = xhub_subscribe(&p->sub, pd->map_get, dpyname))) {
+        goto error;
+    }
+
+    free(dpyname);
     return LUASTATUS_OK;
 
 error:
+    free(dpyname);
     destroy(pd);
     return LUASTATUS_ERR;
 }
 
-typedef struct {
-    xcb_connection_t *conn;
-    xcb_ewmh_connection_t *ewmh;
-    bool ewmh_inited;
-    xcb_window_t root;
-    int screenp;
-    bool visible;
-} Data;
-
-static inline
-void
-watch(Data *d, xcb_window_t win, bool state)
+static
+bool
+get_active_window(XHub *h, xcb_window_t *win)
 {
-    if (win == XCB_NONE) {
-        return;
+    xcb_get_property_reply_t *reply = xhub_prop_reply(
+        h,
+        xhub_prop_request(h, h->root, h->atoms[XHUB_ATOM__NET_ACTIVE_WINDOW], XCB_ATOM_WINDOW),
+        XCB_ATOM_WINDOW,
+        32);
+    if (!reply) {
+        return false;
     }
-    uint32_t value = state ? XCB_EVENT_MASK_PROPERTY_CHANGE : XCB_EVENT_MASK_NO_EVENT;
-    xcb_change_window_attributes(d->conn, win, XCB_CW_EVENT_MASK, &value);
+    const bool ok = xcb_get_property_value_length(reply) == sizeof(xcb_window_t);
+    if (ok) {
+        *win = *(xcb_window_t *) xcb_get_property_value(reply);
+    }
+    free(reply);
+    return ok;
 }
 
-static inline
-bool
-get_active_window(Data *d, xcb_window_t *win)
+// Fetches the title of /e->window/ into /e/; this takes a single round trip.
+static
+void
+fetch_title(Priv *p, CacheEntry *e)
 {
-    return
-        xcb_ewmh_get_active_window_reply(
-            d->ewmh,
-            xcb_ewmh_get_active_window(d->ewmh, d->screenp),
-            win,
-            NULL
-        ) == 1;
+    XHubTitleCookies c;
+    xhub_title_request(p->hub, e->window, p->visible, &c);
+    LS_VECTOR_CLEAR(e->title);
+    e->has_title = xhub_title_reply(p->hub, &c, &e->title);
+    e->valid = true;
 }
 
 static
-bool
-push_window_title(Data *d, lua_State *L, xcb_window_t win)
+CacheEntry *
+cache_find(Priv *p, xcb_window_t win)
 {
-    if (win == XCB_NONE) {
-        return false;
-    }
-    xcb_ewmh_get_utf8_strings_reply_t ewmh_txt_prop;
-    xcb_icccm_get_text_property_reply_t icccm_txt_prop;
-    ewmh_txt_prop.strings = NULL;
-    icccm_txt_prop.name = NULL;
-
-    if (d->visible &&
-        xcb_ewmh_get_wm_visible_name_reply(
-            d->ewmh,
-            xcb_ewmh_get_wm_visible_name(d->ewmh, win),
-            &ewmh_txt_prop,
-            NULL
-        ) == 1 &&
-        ewmh_txt_prop.strings)
-    {
-        lua_pushlstring(L, ewmh_txt_prop.strings, ewmh_txt_prop.strings_len);
-        xcb_ewmh_get_utf8_strings_reply_wipe(&ewmh_txt_prop);
-        return true;
-    }
-
-    if (xcb_ewmh_get_wm_name_reply(
-            d->ewmh,
-            xcb_ewmh_get_wm_name(d->ewmh, win),
-            &ewmh_txt_prop,
-            NULL
-        ) == 1 &&
-        ewmh_txt_prop.strings)
-    {
-        lua_pushlstring(L, ewmh_txt_prop.strings, ewmh_txt_prop.strings_len);
-        xcb_ewmh_get_utf8_strings_reply_wipe(&ewmh_txt_prop);
-        return true;
-    }
-
-    if (xcb_icccm_get_wm_name_reply(
-            d->conn,
-            xcb_icccm_get_wm_name(d->conn, win),
-            &icccm_txt_prop,
-            NULL
-        ) == 1 &&
-        icccm_txt_prop.name)
-    {
-        lua_pushlstring(L, icccm_txt_prop.name, icccm_txt_prop.name_len);
-        xcb_icccm_get_text_property_reply_wipe(&icccm_txt_prop);
-        return true;
+    for (size_t i = 0; i < p->cache.size; ++i) {
+        if (p->cache.data[i].window == win) {
+            return &p->cache.data[i];
+        }
     }
-
-    return false;
+    return NULL;
 }
 
 static
 void
-push_arg(Data *d, lua_State *L, xcb_window_t win)
+cache_remove(Priv *p, CacheEntry *e)
 {
-    if (!push_window_title(d, L, win)) {
-        lua_pushnil(L);
-    }
+    xhub_watch(p->hub, e->window, false);
+    LS_VECTOR_FREE(e->title);
+    *e = p->cache.data[p->cache.size - 1];
+    --p->cache.size;
 }
 
-// updates /*win/ and /*last_win/ if the active window was changed
+// Returns the (possibly invalid) cache entry for /win/, creating it if needed. Evicts the least
+// recently used entry if the cache is full.
 static
-bool
-title_changed(Data *d, xcb_generic_event_t *evt, xcb_window_t *win, xcb_window_t *last_win)
+CacheEntry *
+cache_get(Priv *p, xcb_window_t win)
 {
-    if (XCB_EVENT_RESPONSE_TYPE(evt) != XCB_PROPERTY_NOTIFY) {
-        return false;
-    }
-    xcb_property_notify_event_t *pne = (xcb_property_notify_event_t *) evt;
-
-    if (pne->atom == d->ewmh->_NET_ACTIVE_WINDOW) {
-        watch(d, *last_win, false);
-        if (get_active_window(d, win)) {
-            watch(d, *win, true);
-            *last_win = *win;
-        } else {
-            *win = *last_win = XCB_NONE;
+    CacheEntry *e = cache_find(p, win);
+    if (!e) {
+        if (p->cache.size == CACHE_MAX) {
+            CacheEntry *lru = &p->cache.data[0];
+            for (size_t i = 1; i < p->cache.size; ++i) {
+                if (p->cache.data[i].last_used < lru->last_used) {
+                    lru = &p->cache.data[i];
+                }
+            }
+            cache_remove(p, lru);
         }
-        return true;
-    }
-
-    if (*win != XCB_NONE && pne->window == *win &&
-        ((d->visible && pne->atom == d->ewmh->_NET_WM_VISIBLE_NAME) ||
-         pne->atom == d->ewmh->_NET_WM_NAME ||
-         pne->atom == XCB_ATOM_WM_NAME))
-    {
-        return true;
+        // Start watching before fetching anything, so that no change is missed.
+        xhub_watch(p->hub, win, true);
+        LS_VECTOR_PUSH(p->cache, ((CacheEntry) {
+            .window = win,
+            .valid = false,
+            .has_title = false,
+            .title = LS_VECTOR_NEW(),
+        }));
+        e = &p->cache.data[p->cache.size - 1];
     }
-
-    return false;
+    e->last_used = ++p->clock;
+    return e;
 }
 
+// Invalidates the cache according to /evt/; returns /true/ if the active window may have changed.
 static
 bool
-has_xcb_error(LuastatusPluginData *pd, xcb_connection_t *conn, const char *what)
+handle_event(Priv *p, xcb_generic_event_t *evt)
 {
-    const int err = xcb_connection_has_error(conn);
-    if (err) {
-        LS_FATALF(pd, "%s: XCB error %d", what, err);
-        return true;
+    XHub *h = p->hub;
+    switch (evt->response_type & ~0x80) {
+    case XCB_PROPERTY_NOTIFY:
+        {
+            xcb_property_notify_event_t *pne = (xcb_property_notify_event_t *) evt;
+            if (pne->window == h->root) {
+                return pne->atom == h->atoms[XHUB_ATOM__NET_ACTIVE_WINDOW];
+            }
+            if (xhub_is_title_atom(h, pne->atom, p->visible)) {
+                CacheEntry *e = cache_find(p, pne->window);
+                if (e) {
+                    e->valid = false;
+                }
+            }
+        }
+        return false;
+    case XCB_DESTROY_NOTIFY:
+        {
+            // The window ID may be reused later.
+            xcb_destroy_notify_event_t *dne = (xcb_destroy_notify_event_t *) evt;
+            CacheEntry *e = cache_find(p, dne->window);
+            if (e) {
+                cache_remove(p, e);
+            }
+        }
+        return false;
+    default:
+        return false;
     }
-    return false;
 }
 
+// Makes a call if /force/ is true, or the title has changed since the last call.
 static
-xcb_screen_iterator_t
-find_nth_screen(xcb_connection_t *conn, int n)
+void
+report(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, xcb_window_t win, bool force)
 {
-    const xcb_setup_t *setup = xcb_get_setup(conn);
-    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(setup);
-    for (int i = 0; i < n; ++i) {
-        xcb_screen_next(&iter);
+    Priv *p = pd->priv;
+    CacheEntry *e = NULL;
+    if (win != XCB_NONE) {
+        e = cache_get(p, win);
+        if (!e->valid) {
+            fetch_title(p, e);
+        }
+    }
+    const bool has_title = e && e->has_title;
+    if (!force &&
+        has_title == p->last_has_title &&
+        (!has_title || ls_string_eq(e->title, p->last_title)))
+    {
+        return;
+    }
+    p->last_has_title = has_title;
+    if (has_title) {
+        ls_string_assign_b(&p->last_title, e->title.data, e->title.size);
     }
-    return iter;
+
+    lua_State *L = funcs.call_begin(pd->userdata);
+    if (has_title) {
+        lua_pushlstring(L, e->title.data, e->title.size);
+    } else {
+        lua_pushnil(L);
+    }
+    funcs.call_end(pd->userdata);
 }
 
 static
@@ -219,83 +282,51 @@ void
 run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
 {
     Priv *p = pd->priv;
-
-    Data d = {
-        .conn = NULL,
-        .ewmh = LS_XNEW(xcb_ewmh_connection_t, 1),
-        .ewmh_inited = false,
-        .visible = p->visible,
-    };
-
-    // connect
-    d.conn = xcb_connect(p->dpyname, &d.screenp);
-    if (has_xcb_error(pd, d.conn, "xcb_connect")) {
-        // /xcb_disconnect/ should be called even if /xcb_connection_has_error/ returned non-zero,
-        // so we should not set /d.conn/ to /NULL/ here.
-        goto error;
-    }
-
-    // iterate over screens to find our root window
-    d.root = find_nth_screen(d.conn, d.screenp).data->root;
-
-    // initialize ewmh
-    if (xcb_ewmh_init_atoms_replies(d.ewmh, xcb_ewmh_init_atoms(d.conn, d.ewmh), NULL) == 0) {
-        LS_FATALF(pd, "xcb_ewmh_init_atoms_replies() failed");
-        goto error;
-    }
-    d.ewmh_inited = true;
-
-    xcb_window_t win = XCB_NONE;
-    xcb_window_t last_win = XCB_NONE;
+    XHub *h = p->hub;
 
     // get initial active window; make a call on success.
-    if (get_active_window(&d, &win)) {
-        push_arg(&d, funcs.call_begin(pd->userdata), win);
-        funcs.call_end(pd->userdata);
+    xcb_window_t win = XCB_NONE;
+    if (get_active_window(h, &win)) {
+        report(pd, funcs, win, true);
     }
 
-    // set up initial watchers
-    watch(&d, d.root, true);
-    watch(&d, win, true);
-
-    // poll for changes
+    // poll for changes (the root window is always watched by the hub)
     sigset_t allsigs;
     ls_xsigfillset(&allsigs);
 
     fd_set fds;
     FD_ZERO(&fds);
 
-    const int fd = xcb_get_file_descriptor(d.conn);
-    xcb_flush(d.conn);
+    const int fd = p->sub.wakeup.rfd;
     while (1) {
         FD_SET(fd, &fds);
         const int nfds = pselect(fd + 1, &fds, NULL, NULL, NULL, &allsigs);
         if (nfds < 0) {
             LS_FATALF(pd, "pselect: %s", ls_strerror_onstack(errno));
-            goto error;
+            return;
         } else if (nfds > 0) {
-            xcb_generic_event_t *evt;
-            while ((evt = xcb_poll_for_event(d.conn))) {
-                if (title_changed(&d, evt, &win, &last_win)) {
-                    push_arg(&d, funcs.call_begin(pd->userdata), win);
-                    funcs.call_end(pd->userdata);
+            ls_wakeup_fd_drain(&p->sub.wakeup);
+            const bool alive = xhub_take_events(h, &p->sub, &p->events);
+            if (p->events.size) {
+                bool active_changed = false;
+                for (size_t i = 0; i < p->events.size; ++i) {
+                    if (handle_event(p, &p->events.data[i])) {
+                        active_changed = true;
+                    }
                 }
-                free(evt);
+                if (active_changed && !get_active_window(h, &win)) {
+                    win = XCB_NONE;
+                }
+                // Only the active window's title is of interest; the others are fetched lazily,
+                // when their window gets focused.
+                report(pd, funcs, win, false);
             }
-            if (has_xcb_error(pd, d.conn, "xcb_poll_for_event")) {
-                goto error;
+            if (!alive) {
+                LS_FATALF(pd, "connection to the X server has been lost");
+                return;
             }
         }
     }
-
-error:
-    if (d.ewmh_inited) {
-       xcb_ewmh_connection_wipe(d.ewmh);
-    }
-    if (d.conn) {
-        xcb_disconnect(d.conn);
-    }
-    free(d.ewmh);
 }
 
 LuastatusPluginIface luastatus_plugin_iface_v1 = {
@@ -0,0 +1,663 @@
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+
+#include "include/plugin_v1.h"
+#include "include/sayf_macros.h"
+#include "include/plugin_utils.h"
+
+#include "libls/alloc_utils.h"
+#include "libls/cstring_utils.h"
+#include "libls/evloop_utils.h"
+#include "libls/sig_utils.h"
+#include "libls/string_.h"
+#include "libls/vector.h"
+
+#include "libxhub/xhub.h"
+#include "libxhub/props.h"
+
+// The properties of a window that are to be (re)fetched.
+enum {
+    PROP_TITLE   = 1 << 0,
+    PROP_DESKTOP = 1 << 1,
+    PROP_CLASS   = 1 << 2,
+    PROP_ALL     = PROP_TITLE | PROP_DESKTOP | PROP_CLASS,
+};
+
+typedef struct {
+    xcb_window_t window;
+
+    // A bitmask of /PROP_*/ values: the properties that have changed since they were last fetched.
+    unsigned dirty;
+    // The properties that have been requested, but the replies have not been collected yet.
+    unsigned pending;
+    XHubTitleCookies title_cookies;
+    xcb_get_property_cookie_t desktop_cookie;
+    xcb_get_property_cookie_t class_cookie;
+
+    // Whether the window has not been reported yet.
+    bool is_new;
+    // Whether any of the properties has changed since the window was last reported.
+    bool changed;
+
+    bool has_title;
+    LSString title;
+
+    bool has_desktop;
+    uint32_t desktop;
+
+    bool has_class;
+    LSString instance;
+    LSString class_;
+} Win;
+
+typedef LS_VECTOR_OF(Win) WinVector;
+
+typedef struct {
+    bool visible;
+    XHubSub sub;
+    XHub *hub;
+    // Events taken from the hub.
+    XHubEvents events;
+
+    // The windows in the client list, sorted by /window/.
+    WinVector wins;
+    // The client list as reported by the window manager (that is, in the initial mapping order).
+    LS_VECTOR_OF(xcb_window_t) order;
+    // Windows removed since the last call.
+    LS_VECTOR_OF(xcb_window_t) removed;
+    // Scratch buffers.
+    LS_VECTOR_OF(xcb_window_t) sorted;
+    WinVector merged;
+    LSString tmp;
+
+    // Which of the root window's properties have changed since they were last fetched.
+    bool list_dirty;
+    bool desktop_dirty;
+    bool active_dirty;
+
+    // Whether /order/, /desktop/ or /active/ have changed since the last call.
+    bool order_changed;
+    bool desktop_changed;
+    bool active_changed;
+
+    bool has_desktop;
+    uint32_t desktop;
+
+    bool has_active;
+    xcb_window_t active;
+} Priv;
+
+static
+void
+win_destroy(Win *w)
+{
+    LS_VECTOR_FREE(w->title);
+    LS_VECTOR_FREE(w->instance);
+    LS_VECTOR_FREE(w->class_);
+}
+
+// Discards the replies to the requests of /w/ that have not been collected.
+static
+void
+win_discard_pending(XHub *h, Win *w)
+{
+    if (w->pending & PROP_TITLE) {
+        for (size_t i = w->title_cookies.first; i < XHUB_TITLE_NPROPS; ++i) {
+            xcb_discard_reply(h->conn, w->title_cookies.cookies[i].sequence);
+        }
+    }
+    if (w->pending & PROP_DESKTOP) {
+        xcb_discard_reply(h->conn, w->desktop_cookie.sequence);
+    }
+    if (w->pending & PROP_CLASS) {
+        xcb_discard_reply(h->conn, w->class_cookie.sequence);
+    }
+    w->pending = 0;
+}
+
+static
+void
+destroy(LuastatusPluginData *pd)
+{
+    Priv *p = pd->priv;
+    for (size_t i = 0; i < p->wins.size; ++i) {
+        Win *w = &p->wins.data[i];
+        if (p->hub) {
+            win_discard_pending(p->hub, w);
+            xhub_watch(p->hub, w->window, false);
+        }
+        win_destroy(w);
+    }
+    LS_VECTOR_FREE(p->wins);
+    LS_VECTOR_FREE(p->order);
+    LS_VECTOR_FREE(p->removed);
+    LS_VECTOR_FREE(p->sorted);
+    LS_VECTOR_FREE(p->merged);
+    LS_VECTOR_FREE(p->tmp);
+    if (p->hub) {
+        xhub_unsubscribe(p->hub, &p->sub);
+    }
+    ls_wakeup_fd_close(&p->sub.wakeup);
+    LS_VECTOR_FREE(p->events);
+    free(p);
+}
+
+static
+int
+init(LuastatusPluginData *pd, lua_State *L)
+{
+    Priv *p = pd->priv = LS_XNEW(Priv, 1);
+    *p = (Priv) {
+        .visible = false,
+        .sub = {
+            .userdata = pd->userdata,
+            .sayf = pd->sayf,
+            .wakeup = LS_WAKEUP_FD_NEW(),
+            .kinds = XHUB_PROPERTY_NOTIFY,
+            .ext = NULL,
+        },
+        .hub = NULL,
+        .events = LS_VECTOR_NEW(),
+        .wins = LS_VECTOR_NEW(),
+        .order = LS_VECTOR_NEW(),
+        .removed = LS_VECTOR_NEW(),
+        .sorted = LS_VECTOR_NEW(),
+        .merged = LS_VECTOR_NEW(),
+        .tmp = LS_VECTOR_NEW(),
+        .list_dirty = true,
+        .desktop_dirty = true,
+        .active_dirty = true,
+        .order_changed = false,
+        .desktop_changed = false,
+        .active_changed = false,
+        .has_desktop = false,
+        .has_active = false,
+    };
+    char *dpyname = NULL;
+
+    PU_MAYBE_VISIT_STR_FIELD(-1, "display", "'display'", s,
+        dpyname = ls_xstrdup(s);
+    );
+
+    PU_MAYBE_VISIT_BOOL_FIELD(-1, "visible", "'visible'", b,
+        p->visible = b;
+    );
+
+    if (ls_wakeup_fd_open(&p->sub.wakeup) < 0) {
+        LS_FATALF(pd, "ls_wakeup_fd_open: %s", ls_strerror_onstack(errno));
+        goto error;
+    }
+    if (!(p->hub = xhub_subscribe(&p->sub, pd->map_get, dpyname))) {
+        goto error;
+    }
+
+    free(dpyname);
+    return LUASTATUS_OK;
+
+error:
+    free(dpyname);
+    destroy(pd);
+    return LUASTATUS_ERR;
+}
+
+static
+int
+window_cmp(const void *a, const void *b)
+{
+    const xcb_window_t x = *(const xcb_window_t *) a;
+    const xcb_window_t y = *(const xcb_window_t *) b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// /Win/ starts with its /window/ field, so /window_cmp()/ can be used for /bsearch()/ing it.
+static
+Win *
+find_win(Priv *p, xcb_window_t win)
+{
+    return bsearch(&win, p->wins.data, p->wins.size, sizeof(Win), window_cmp);
+}
+
+static
+void
+request_props(Priv *p, Win *w)
+{
+    XHub *h = p->hub;
+    if (w->dirty & PROP_TITLE) {
+        xhub_title_request(h, w->window, p->visible, &w->title_cookies);
+    }
+    if (w->dirty & PROP_DESKTOP) {
+        w->desktop_cookie = xhub_prop_request(h, w->window, h->atoms[XHUB_ATOM__NET_WM_DESKTOP],
+                                              XCB_ATOM_CARDINAL);
+    }
+    if (w->dirty & PROP_CLASS) {
+        w->class_cookie = xhub_prop_request(h, w->window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING);
+    }
+    w->pending = w->dirty;
+    w->dirty = 0;
+}
+
+// Fetches a single 32-bit value; returns /false/ if there is no such property.
+static
+bool
+collect_card32(XHub *h, xcb_get_property_cookie_t cookie, xcb_atom_t type, uint32_t *out)
+{
+    xcb_get_property_reply_t *reply = xhub_prop_reply(h, cookie, type, 32);
+    if (!reply) {
+        return false;
+    }
+    const bool ok = xcb_get_property_value_length(reply) >= 4;
+    if (ok) {
+        memcpy(out, xcb_get_property_value(reply), 4);
+    }
+    free(reply);
+    return ok;
+}
+
+static
+bool
+update_str(LSString *s, bool *has, bool new_has, LSString *tmp)
+{
+    if (*has == new_has && (!new_has || ls_string_eq(*s, *tmp))) {
+        return false;
+    }
+    *has = new_has;
+    ls_string_swap(s, tmp);
+    return true;
+}
+
+static
+void
+collect_props(Priv *p, Win *w)
+{
+    XHub *h = p->hub;
+    bool changed = false;
+
+    if (w->pending & PROP_TITLE) {
+        LS_VECTOR_CLEAR(p->tmp);
+        const bool has = xhub_title_reply(h, &w->title_cookies, &p->tmp);
+        changed |= update_str(&w->title, &w->has_title, has, &p->tmp);
+    }
+
+    if (w->pending & PROP_DESKTOP) {
+        uint32_t desktop = 0;
+        const bool has = collect_card32(h, w->desktop_cookie, XCB_ATOM_CARDINAL, &desktop);
+        if (has != w->has_desktop || desktop != w->desktop) {
+            w->has_desktop = has;
+            w->desktop = desktop;
+            changed = true;
+        }
+    }
+
+    if (w->pending & PROP_CLASS) {
+        // "instance\0class\0"
+        bool has = false;
+        LS_VECTOR_CLEAR(p->tmp);
+        LSString class_ = LS_VECTOR_NEW();
+        xcb_get_property_reply_t *reply = xhub_prop_reply(h, w->class_cookie, XCB_ATOM_STRING, 8);
+        if (reply) {
+            const char *data = xcb_get_property_value(reply);
+            const size_t ndata = xcb_get_property_value_length(reply);
+            const char *nul = memchr(data, '\0', ndata);
+            if (nul) {
+                has = true;
+                ls_string_assign_b(&p->tmp, data, nul - data);
+                const char *cls = nul + 1;
+                const size_t ncls = ndata - (cls - data);
+                const char *end = memchr(cls, '\0', ncls);
+                ls_string_assign_b(&class_, cls, end ? (size_t) (end - cls) : ncls);
+            }
+            free(reply);
+        }
+        bool has_copy = w->has_class;
+        changed |= update_str(&w->instance, &has_copy, has, &p->tmp);
+        changed |= update_str(&w->class_, &w->has_class, has, &class_);
+        LS_VECTOR_FREE(class_);
+    }
+
+    w->pending = 0;
+    if (changed && !w->is_new) {
+        w->changed = true;
+    }
+}
+
+// Replaces /p->wins/ with the windows of /list/ (of /nlist/ elements), keeping the ones that are
+// already known, and creating (and starting watching) the new ones.
+static
+void
+diff_client_list(Priv *p, const xcb_window_t *list, size_t nlist)
+{
+    XHub *h = p->hub;
+
+    LS_VECTOR_CLEAR(p->sorted);
+    LS_VECTOR_ENSURE(p->sorted, nlist);
+    if (nlist) {
+        memcpy(p->sorted.data, list, sizeof(xcb_window_t) * nlist);
+    }
+    p->sorted.size = nlist;
+    qsort(p->sorted.data, nlist, sizeof(xcb_window_t), window_cmp);
+
+    LS_VECTOR_CLEAR(p->merged);
+    size_t i = 0;
+    size_t j = 0;
+    while (i < p->wins.size || j < p->sorted.size) {
+        if (j > 0 && j < p->sorted.size && p->sorted.data[j] == p->sorted.data[j - 1]) {
+            // a duplicate
+            ++j;
+            continue;
+        }
+        if (j == p->sorted.size ||
+            (i < p->wins.size && p->wins.data[i].window < p->sorted.data[j]))
+        {
+            // removed
+            Win *w = &p->wins.data[i++];
+            LS_VECTOR_PUSH(p->removed, w->window);
+            win_discard_pending(h, w);
+            xhub_watch(h, w->window, false);
+            win_destroy(w);
+
+        } else if (i == p->wins.size || p->sorted.data[j] < p->wins.data[i].window) {
+            // added; start watching it before requesting anything, so that no change is missed.
+            const xcb_window_t win = p->sorted.data[j++];
+            xhub_watch(h, win, true);
+            LS_VECTOR_PUSH(p->merged, ((Win) {
+                .window = win,
+                .dirty = PROP_ALL,
+                .pending = 0,
+                .is_new = true,
+                .changed = false,
+                .has_title = false,
+                .title = LS_VECTOR_NEW(),
+                .has_desktop = false,
+                .has_class = false,
+                .instance = LS_VECTOR_NEW(),
+                .class_ = LS_VECTOR_NEW(),
+            }));
+
+        } else {
+            // kept
+            LS_VECTOR_PUSH(p->merged, p->wins.data[i]);
+            ++i;
+            ++j;
+        }
+    }
+
+    WinVector t = p->wins;
+    p->wins = p->merged;
+    p->merged = t;
+
+    // /p->order/ := /list/
+    if (p->order.size != nlist ||
+        (nlist && memcmp(p->order.data, list, sizeof(xcb_window_t) * nlist) != 0))
+    {
+        LS_VECTOR_CLEAR(p->order);
+        LS_VECTOR_ENSURE(p->order, nlist);
+        if (nlist) {
+            memcpy(p->order.data, list, sizeof(xcb_window_t) * nlist);
+        }
+        p->order.size = nlist;
+        p->order_changed = true;
+    }
+}
+
+// Fetches everything that is dirty. In the common case (no new windows), this takes a single round
+// trip; if new windows appear in the client list, two.
+static
+void
+update(Priv *p)
+{
+    XHub *h = p->hub;
+
+    // Send all the requests for the root window and the known windows.
+    xcb_get_property_cookie_t list_cookie = {0};
+    xcb_get_property_cookie_t desktop_cookie = {0};
+    xcb_get_property_cookie_t active_cookie = {0};
+    if (p->list_dirty) {
+        list_cookie = xhub_prop_request(h, h->root, h->atoms[XHUB_ATOM__NET_CLIENT_LIST],
+                                        XCB_ATOM_WINDOW);
+    }
+    if (p->desktop_dirty) {
+        desktop_cookie = xhub_prop_request(h, h->root, h->atoms[XHUB_ATOM__NET_CURRENT_DESKTOP],
+                                           XCB_ATOM_CARDINAL);
+    }
+    if (p->active_dirty) {
+        active_cookie = xhub_prop_request(h, h->root, h->atoms[XHUB_ATOM__NET_ACTIVE_WINDOW],
+                                          XCB_ATOM_WINDOW);
+    }
+    for (size_t i = 0; i < p->wins.size; ++i) {
+        Win *w = &p->wins.data[i];
+        if (w->dirty) {
+            request_props(p, w);
+        }
+    }
+
+    // Collect the replies for the root window.
+    if (p->list_dirty) {
+        xcb_get_property_reply_t *reply = xhub_prop_reply(h, list_cookie, XCB_ATOM_WINDOW, 32);
+        if (reply) {
+            diff_client_list(p, xcb_get_property_value(reply),
+                             xcb_get_property_value_length(reply) / sizeof(xcb_window_t));
+            free(reply);
+        } else {
+            diff_client_list(p, NULL, 0);
+        }
+        p->list_dirty = false;
+    }
+    if (p->desktop_dirty) {
+        uint32_t desktop = 0;
+        const bool has = collect_card32(h, desktop_cookie, XCB_ATOM_CARDINAL, &desktop);
+        if (has != p->has_desktop || desktop != p->desktop) {
+            p->has_desktop = has;
+            p->desktop = desktop;
+            p->desktop_changed = true;
+        }
+        p->desktop_dirty = false;
+    }
+    if (p->active_dirty) {
+        uint32_t active = XCB_NONE;
+        const bool has = collect_card32(h, active_cookie, XCB_ATOM_WINDOW, &active) &&
+                         active != XCB_NONE;
+        if (has != p->has_active || active != p->active) {
+            p->has_active = has;
+            p->active = active;
+            p->active_changed = true;
+        }
+        p->active_dirty = false;
+    }
+
+    // Send the requests for the new windows, then collect all the replies.
+    for (size_t i = 0; i < p->wins.size; ++i) {
+        Win *w = &p->wins.data[i];
+        if (w->dirty) {
+            request_props(p, w);
+        }
+    }
+    for (size_t i = 0; i < p->wins.size; ++i) {
+        Win *w = &p->wins.data[i];
+        if (w->pending) {
+            collect_props(p, w);
+        }
+    }
+}
+
+static
+void
+handle_event(Priv *p, xcb_generic_event_t *evt)
+{
+    XHub *h = p->hub;
+    if ((evt->response_type & ~0x80) != XCB_PROPERTY_NOTIFY) {
+        return;
+    }
+    xcb_property_notify_event_t *pne = (xcb_property_notify_event_t *) evt;
+    const xcb_atom_t atom = pne->atom;
+
+    if (pne->window == h->root) {
+        if (atom == h->atoms[XHUB_ATOM__NET_CLIENT_LIST]) {
+            p->list_dirty = true;
+        } else if (atom == h->atoms[XHUB_ATOM__NET_CURRENT_DESKTOP]) {
+            p->desktop_dirty = true;
+        } else if (atom == h->atoms[XHUB_ATOM__NET_ACTIVE_WINDOW]) {
+            p->active_dirty = true;
+        }
+        return;
+    }
+
+    Win *w = find_win(p, pne->window);
+    if (!w) {
+        return;
+    }
+    if (xhub_is_title_atom(h, atom, p->visible)) {
+        w->dirty |= PROP_TITLE;
+    } else if (atom == h->atoms[XHUB_ATOM__NET_WM_DESKTOP]) {
+        w->dirty |= PROP_DESKTOP;
+    } else if (atom == XCB_ATOM_WM_CLASS) {
+        w->dirty |= PROP_CLASS;
+    }
+}
+
+static
+void
+push_win(lua_State *L, Win *w)
+{
+    lua_createtable(L, 0, 4); // L: table
+    if (w->has_title) {
+        lua_pushlstring(L, w->title.data, w->title.size); // L: table title
+        lua_setfield(L, -2, "title"); // L: table
+    }
+    if (w->has_desktop) {
+        // 0xFFFFFFFF means "all desktops".
+        lua_pushinteger(L, w->desktop == 0xFFFFFFFF ? -1 : (lua_Integer) w->desktop);
+        lua_setfield(L, -2, "desktop"); // L: table
+    }
+    if (w->has_class) {
+        lua_pushlstring(L, w->instance.data, w->instance.size); // L: table instance
+        lua_setfield(L, -2, "instance"); // L: table
+        lua_pushlstring(L, w->class_.data, w->class_.size); // L: table class
+        lua_setfield(L, -2, "class"); // L: table
+    }
+}
+
+// Makes a call with the changes since the last one, if there are any (or /force/ is true).
+static
+void
+report(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs, bool force)
+{
+    Priv *p = pd->priv;
+
+    size_t nadded = 0;
+    size_t nchanged = 0;
+    for (size_t i = 0; i < p->wins.size; ++i) {
+        nadded += p->wins.data[i].is_new;
+        nchanged += p->wins.data[i].changed;
+    }
+    if (!force && !nadded && !nchanged && !p->removed.size &&
+        !p->order_changed && !p->desktop_changed && !p->active_changed)
+    {
+        return;
+    }
+
+    lua_State *L = funcs.call_begin(pd->userdata);
+    lua_createtable(L, 0, 6); // L: table
+
+    lua_createtable(L, 0, nadded); // L: table added
+    lua_createtable(L, 0, nchanged); // L: table added changed
+    for (size_t i = 0; i < p->wins.size; ++i) {
+        Win *w = &p->wins.data[i];
+        if (w->is_new || w->changed) {
+            lua_pushinteger(L, w->window); // L: table added changed id
+            push_win(L, w); // L: table added changed id info
+            lua_settable(L, w->is_new ? -4 : -3); // L: table added changed
+            w->is_new = false;
+            w->changed = false;
+        }
+    }
+    lua_setfield(L, -3, "changed"); // L: table added
+    lua_setfield(L, -2, "added"); // L: table
+
+    lua_createtable(L, p->removed.size, 0); // L: table removed
+    for (size_t i = 0; i < p->removed.size; ++i) {
+        lua_pushinteger(L, p->removed.data[i]); // L: table removed id
+        lua_rawseti(L, -2, i + 1); // L: table removed
+    }
+    lua_setfield(L, -2, "removed"); // L: table
+    LS_VECTOR_CLEAR(p->removed);
+
+    if (force || p->order_changed) {
+        lua_createtable(L, p->order.size, 0); // L: table order
+        for (size_t i = 0; i < p->order.size; ++i) {
+            lua_pushinteger(L, p->order.data[i]); // L: table order id
+            lua_rawseti(L, -2, i + 1); // L: table order
+        }
+        lua_setfield(L, -2, "order"); // L: table
+        p->order_changed = false;
+    }
+
+    if (p->has_desktop) {
+        lua_pushinteger(L, p->desktop); // L: table desktop
+        lua_setfield(L, -2, "current_desktop"); // L: table
+    }
+    p->desktop_changed = false;
+
+    if (p->has_active) {
+        lua_pushinteger(L, p->active); // L: table active
+        lua_setfield(L, -2, "active"); // L: table
+    }
+    p->active_changed = false;
+
+    funcs.call_end(pd->userdata);
+}
+
+static
+void
+run(LuastatusPluginData *pd, LuastatusPluginRunFuncs funcs)
+{
+    Priv *p = pd->priv;
+    XHub *h = p->hub;
+
+    // the root window is always watched by the hub
+    update(p);
+    report(pd, funcs, true);
+
+    sigset_t allsigs;
+    ls_xsigfillset(&allsigs);
+
+    fd_set fds;
+    FD_ZERO(&fds);
+
+    const int fd = p->sub.wakeup.rfd;
+    while (1) {
+        FD_SET(fd, &fds);
+        const int nfds = pselect(fd + 1, &fds, NULL, NULL, NULL, &allsigs);
+        if (nfds < 0) {
+            LS_FATALF(pd, "pselect: %s", ls_strerror_onstack(errno));
+            return;
+        } else if (nfds > 0) {
+            ls_wakeup_fd_drain(&p->sub.wakeup);
+            const bool alive = xhub_take_events(h, &p->sub, &p->events);
+            if (p->events.size) {
+                for (size_t i = 0; i < p->events.size; ++i) {
+                    handle_event(p, &p->events.data[i]);
+                }
+                update(p);
+                report(pd, funcs, false);
+            }
+            if (!alive) {
+                LS_FATALF(pd, "connection to the X server has been lost");
+                return;
+            }
+        }
+    }
+}
+
+LuastatusPluginIface luastatus_plugin_iface_v1 = {
+    .init = init,
+    .run = run,
+    .destroy = destroy,
+};